@@ -39,6 +39,7 @@
 #include "inifile.h"
 #include "mtlib.h"
 #include "wu.h"
+#include "thread.h"
 
 typedef struct {
 	int frame1, frame2;
@@ -88,20 +89,20 @@ static void ani_widget_changed(anim_dd *dt)	// Widget changed so flag the layers
 
 
 
-static void set_layer_from_slot( int layer, int slot )		// Set layer x, y, opacity from slot
+static void set_layer_from_slot( layer_node *t, int slot )		// Set layer x, y, opacity from slot
 {
-	ani_slot *ani = layer_table[layer].image->ani_.pos + slot;
-	layer_table[layer].x = ani->x;
-	layer_table[layer].y = ani->y;
-	layer_table[layer].opacity = ani->opacity;
+	ani_slot *ani = t->image->ani_.pos + slot;
+	t->x = ani->x;
+	t->y = ani->y;
+	t->opacity = ani->opacity;
 }
 
-static void set_layer_inbetween( int layer, int i, int frame, int effect )		// Calculate in between value for layer from slot i & (i+1) at given frame
+static void set_layer_inbetween( layer_node *t, int i, int frame, int effect )		// Calculate in between value for layer from slot i & (i+1) at given frame
 {
 	MT_Coor c[4], co_res, lenz;
 	float p1, p2;
 	int f0, f1, f2, f3, ii[4] = {i-1, i, i+1, i+2}, j;
-	ani_slot *ani = layer_table[layer].image->ani_.pos;
+	ani_slot *ani = t->image->ani_.pos;
 
 
 	f1 = ani[i].frame;
@@ -124,10 +125,9 @@ static void set_layer_inbetween( int layer, int i, int frame, int effect )		// C
 	p1 = ( (float) (f2-frame) ) / ( (float) (f2-f1) );	// % of (i-1) slot
 	p2 = 1-p1;						// % of i slot
 
-	layer_table[layer].x = rint(p1 * ani[i].x + p2 * ani[i + 1].x);
-	layer_table[layer].y = rint(p1 * ani[i].y + p2 * ani[i + 1].y);
-	layer_table[layer].opacity = rint(p1 * ani[i].opacity +
-		p2 * ani[i + 1].opacity);
+	t->x = rint(p1 * ani[i].x + p2 * ani[i + 1].x);
+	t->y = rint(p1 * ani[i].y + p2 * ani[i + 1].y);
+	t->opacity = rint(p1 * ani[i].opacity + p2 * ani[i + 1].opacity);
 
 
 	if ( effect == 1 )		// Interpolated smooth in between - use p2 value
@@ -149,23 +149,74 @@ static void set_layer_inbetween( int layer, int i, int frame, int effect )		// C
 		}
 		co_res = MT_palin(p2, 0.35, c[0], c[1], c[2], c[3], lenz);
 
-		layer_table[layer].x = co_res.x;
-		layer_table[layer].y = co_res.y;
+		t->x = co_res.x;
+		t->y = co_res.y;
 	}
 }
 
-static void ani_set_frame_state(int frame)
+/* Visibility of layer at frame as set by cycle table, or -1 if not set */
+static int ani_cycle_vis(unsigned char *cp, int frame)
 {
-	int i, j, k, v, c, f, p;
-	ani_slot *ani;
 	ani_cycle *cc;
-	unsigned char *cp;
+	int i, j, c, f, p, v = -1; // Leave alone by default
+
+	/* !!! Table must be sorted by cycle # */
+	for (i = c = 0; i < MAX_CYC_ITEMS; i++ , c = j)
+	{
+		if (!(j = *cp++)) break; // Cycle # + 1
+		p = *cp++;
+		cc = ani_cycle_table + j - 1;
+		if (!(f = cc->frame0)) continue; // Paranoia
+		if (f > frame) continue; // Not yet active
+		/* Special case for enabling/disabling en-masse */
+		if (cc->frame1 == f)
+		{
+			if (j != c) v = !p; // Ignore entries after 1st
+		}
+		/* Inside a normal cycle */
+		else if (cc->frame1 >= frame)
+		{
+			if (j != c) v = 0; // Hide initially
+			v |= (frame - f) % cc->len == p; // Show if matched
+		}
+	}
+	return (v);
+}
+
+/* Last frame not past the given one, at which cycle table sets visibility */
+static int ani_cycle_last(unsigned char *cp, int frame)
+{
+	ani_cycle *cc;
+	int i, j, f, res = 0;
+
+	for (i = 0; i < MAX_CYC_ITEMS; i++ , cp += 2)
+	{
+		if (!(j = *cp)) break; // Cycle # + 1
+		cc = ani_cycle_table + j - 1;
+		if (!(f = cc->frame0) || (f > frame)) continue;
+		if (cc->frame1 < f) continue; // Never active
+		/* En-masse setting stays active, normal cycle ends */
+		f = (cc->frame1 == f) || (cc->frame1 >= frame) ? frame : cc->frame1;
+		if (res < f) res = f;
+	}
+	return (res);
+}
+
+/* Set up layer table "lt" for frame, as if all frames from frame0 on had been
+ * stepped through in order starting from its current state; depends on
+ * nothing else, so frames can be prepared independently */
+static void ani_frame_state(layer_node *lt, int frame, int frame0)
+{
+	layer_node *t;
+	ani_slot *ani;
+	int i, k, v;
 
 // !!! Maybe make background x/y settable here too?
 	for (k = 1; k <= layers_total; k++)
 	{
+		t = lt + k;
 		/* Set x, y, opacity for layer */
-		ani = layer_table[k].image->ani_.pos;
+		ani = t->image->ani_.pos;
 
 		/* Find first frame in position list that excedes or equals 'frame' */
 		for (i = 0; i < MAX_POS_SLOTS; i++)
@@ -182,42 +233,33 @@ static void ani_set_frame_state(int frame)
 		/* All position slots < 'frame'
 		 * Set layer pos/opac to last slot values */
 		else if ((i >= MAX_POS_SLOTS) || !ani[i].frame)
-			set_layer_from_slot(k, i - 1);
+			set_layer_from_slot(t, i - 1);
 		/* If closest frame = requested frame, set all values to this
 		 * ditto if i=0, i.e. no better matches exist */
 		else if ((ani[i].frame == frame) || !i)
-			set_layer_from_slot(k, i);
+			set_layer_from_slot(t, i);
 		/* i is currently pointing to slot that excedes 'frame',
 		 * so in between this and the previous slot */
-		else set_layer_inbetween(k, i - 1, frame, ani[i - 1].effect);
-
-		/* Set visibility for layer by processing cycle table */
-		/* !!! Table must be sorted by cycle # */
-		v = -1; // Leave alone by default
-		cp = layer_table[k].image->ani_.cycles;
-		for (i = c = 0; i < MAX_CYC_ITEMS; i++ , c = j)
-		{
-			if (!(j = *cp++)) break; // Cycle # + 1
-			p = *cp++;
-			cc = ani_cycle_table + j - 1;
-			if (!(f = cc->frame0)) continue; // Paranoia
-			if (f > frame) continue; // Not yet active
-			/* Special case for enabling/disabling en-masse */
-			if (cc->frame1 == f)
-			{
-				if (j != c) v = !p; // Ignore entries after 1st
-			}
-			/* Inside a normal cycle */
-			else if (cc->frame1 >= frame)
-			{
-				if (j != c) v = 0; // Hide initially
-				v |= (frame - f) % cc->len == p; // Show if matched
-			}
-		}
-		if (v >= 0) layer_table[k].visible = v;
+		else set_layer_inbetween(t, i - 1, frame, ani[i - 1].effect);
+
+		/* Set visibility for layer by processing cycle table: the last
+		 * frame in range which set it, decides it */
+		i = ani_cycle_last(t->image->ani_.cycles, frame);
+		if (i < frame0) continue;
+		v = ani_cycle_vis(t->image->ani_.cycles, i);
+		if (v >= 0) t->visible = v;
 	}
 }
 
+static void ani_set_frame_state(int frame)
+{
+	int k;
+
+	ani_frame_state(layer_table, frame, frame);
+	for (k = 1; k <= layers_total; k++)
+		if (layer_table[k].visible) layer_ready(k);
+}
+
 #define ANI_CYC_ROWLEN (MAX_CYC_ITEMS * 2 + 1)
 #define ANI_CYC_TEXT_MAX (128 + MAX_CYC_ITEMS * 10)
 
@@ -677,31 +719,145 @@ void ani_but_preview(void **awin)
 	run_create(apview_code, &tdata, sizeof(tdata));
 }
 
+/* Frames are rendered, and for separate files also encoded, on multiple
+ * threads at once; each thread gets its own layer table and frame buffer.
+ * For an animated file, frames are rendered in batches into a set of buffers,
+ * to be passed in order to the encoder */
+
+/* Memory limit for frame buffers */
+#define ANI_FRAMES_MEM (256 * 1024 * 1024)
+
+typedef struct {
+	ls_settings settings;
+	image_info *image;
+	layer_node *lt;		// Layer table for frame
+	unsigned char *rgb;	// Frame buffer
+	unsigned char *slots;	// Buffers for a batch, if any
+	volatile int *fail;	// Error code, shared by threads
+	int a, f0, alpha, l;
+	png_color pal[256];
+	char path[PATHBUF];
+} ani_frame_job;
+
+/* Render frame #idx of the job, and unless batched, save it; return error code
+ * (-1 no memory, 1 failed to save) */
+static int ani_make_frame(ani_frame_job *job, int idx)
+{
+	ls_settings *settings = &job->settings;
+	image_info *image = job->image;
+	png_color *trans;
+	unsigned char *rgb = job->rgb, *irgb;
+	int i, cols, npt, w = settings->width, h = settings->height;
+	int frame = job->f0 + idx;
+	size_t sz = (size_t)w * h;
+
+	if (job->slots) rgb = job->slots + sz * 4 * idx;
+	irgb = rgb + sz * 3;	// For indexed or alpha
+
+	memcpy(job->lt, layer_table, (layers_total + 1) * sizeof(layer_node));
+	ani_frame_state(job->lt, frame, job->a);		// Change layer positions
+	memset(rgb, 0, sz * 4);	// Init for RGBA compositing
+	render_frame_rgb(rgb, w, h, job->lt);	// Render layer
+	if (job->alpha)
+	{
+		collect_frame_alpha(irgb, w, h, job->lt);
+		mem_demultiply(rgb, irgb, sz, 3);
+	}
+	if (job->slots) return (0); // To be saved by caller
+
+	snprintf(job->path + job->l, PATHBUF - job->l, DIR_SEP_STR "%s%05d.%s",
+		ani_file_prefix, frame, file_formats[settings->ftype].ext);
+
+	if (settings->bpp == 1)	// Prepare palette
+	{
+		settings->img[CHN_IMAGE] = irgb;
+		settings->pal = job->pal;
+		cols = mem_cols_used_real(rgb, w, h, job->pal);
+					// Count & collect colours in image
+
+		if (cols > 256)		// If >256 use Wu to quantize
+		{
+			cols = 256;
+			if (wu_quant(rgb, w, h, cols, job->pal, NULL))
+				return (-1); // No memory
+			// Create new indexed image (cannot fail if no dither)
+			mem_dumb_dither(rgb, irgb, job->pal, w, h, cols, FALSE);
+		}
+		// Create new indexed image (cannot fail w/ exact palette)
+		else mem_convert_indexed(irgb, rgb, sz, cols, job->pal);
+
+		settings->xpm_trans = -1;	// Default is no transparency
+		if (image->trans >= 0)	// Background has transparency
+		{
+			trans = image->pal + image->trans;
+			npt = PNG_2_INT(*trans);
+			for (i = 0; i < cols; i++)
+			{	// Does it exist in the composite frame?
+				if (PNG_2_INT(job->pal[i]) != npt) continue;
+				// Transparency found so note it
+				settings->xpm_trans = i;
+				break;
+			}
+		}
+	}
+	else
+	{
+		settings->img[CHN_IMAGE] = rgb;
+		settings->img[CHN_ALPHA] = job->alpha ? irgb : NULL;
+	}
+
+	return (save_image(job->path, settings) < 0);
+}
+
+static void ani_frame_jobs(tcb *thread)
+{
+	ani_frame_job *job = thread->data;
+	int i, res, n = thread->nsteps, p0 = thread->progress;
+
+	for (i = 0; i < n; i++)
+	{
+		if (*job->fail) break;
+		if ((res = ani_make_frame(job, thread->step0 + i)))
+		{
+			*job->fail = res;
+			break;
+		}
+		if (job->slots) continue; // Progress is counted when saving
+		if (!thread_step(thread, p0 + i + 1, thread->tdata->total, 100))
+			continue;
+		thread->stop = TRUE; // Single-threaded build does not set it
+		break;
+	}
+	if (*job->fail) thread->stop = TRUE;
+}
+
 static void create_frames_ani()
 {
 	image_info *image;
-	ls_settings settings;
-	png_color pngpal[256], *trans;
-	unsigned char *layer_rgb, *irgb;
-	char output_path[PATHBUF], *command, *wild_path;
-	int a, b, k, i, tr, cols, layer_w, layer_h, npt, l = 0;
+	ani_frame_job job;
+	threaddata *tdata;
+	char *command;
+	void *anim = NULL;
+	size_t fsz;
+	int a, b, k, i, n, nt, nb = 0, tr, oa, layer_w, layer_h, fail = 0, l = 0;
 
 
 	layer_press_save();		// Save layers data file
 
+	memset(&job, 0, sizeof(job));
 	if (path_type(ani_output_path) == PT_REL)
 	{
 		command = strrchr(layers_filename, DIR_SEP);
 		if (command) l = command - layers_filename + 1;
 	}
-	wjstrcat(output_path, PATHBUF, layers_filename, l, ani_output_path, NULL);
-	l = strlen(output_path);
+	wjstrcat(job.path, PATHBUF, layers_filename, l, ani_output_path, NULL);
+	job.l = l = strlen(job.path);
 
 	if (!ani_output_path[0]); // Reusing layers file directory
 #ifdef WIN32
-	else if (mkdir(output_path))
+	else if (mkdir(job.path))
 #else
-	else if (mkdir(output_path, 0777))
+	else if (mkdir(job.path, 0777))
 #endif
 	{
 		if ( errno != EEXIST )
@@ -716,120 +872,136 @@ static void create_frames_ani()
 	a = ani_frame1 < ani_frame2 ? ani_frame1 : ani_frame2;
 	b = ani_frame1 < ani_frame2 ? ani_frame2 : ani_frame1;
 
-	image = layer_selected ? &layer_table[0].image->image_ : &mem_image;
+	job.image = image = layer_selected ? &layer_table[0].image->image_ :
+		&mem_image;
+	job.a = job.f0 = a;
 
 	layer_w = image->width;
 	layer_h = image->height;
-	layer_rgb = malloc(layer_w * layer_h * 4);	// Primary layer image for RGB version
-	if (!layer_rgb)
-	{
-		memory_errors(1);
-		return;
-	}
-	irgb = layer_rgb + layer_w * layer_h * 3;	// For indexed or alpha
+	fsz = (size_t)layer_w * layer_h * 4;	// RGB + indexed or alpha
 
 	/* Prepare settings */
-	init_ls_settings(&settings, NULL);
-	settings.mode = FS_COMPOSITE_SAVE;
-	settings.width = layer_w;
-	settings.height = layer_h;
-	settings.colors = 256;
-	settings.silent = TRUE;
-	settings.ftype = ani_format;
-	/* Indexed */
-	if (!(file_formats[ani_format].flags & FF_RGB))
+	init_ls_settings(&job.settings, NULL);
+	job.settings.mode = FS_COMPOSITE_SAVE;
+	job.settings.width = layer_w;
+	job.settings.height = layer_h;
+	job.settings.colors = 256;
+	job.settings.silent = TRUE;
+	job.settings.ftype = ani_format;
+	/* Animated file, from RGB frames */
+	if (can_save_anim(ani_format))
 	{
-		settings.img[CHN_IMAGE] = irgb;
-		settings.bpp = 1;
-		settings.pal = pngpal;
+		job.alpha = comp_need_alpha(ani_format);
+		job.settings.bpp = 3;
+		job.settings.gif_delay = ani_gif_delay;
+		/* Background transparency */
+		tr = image->trans;
+		job.settings.rgb_trans = tr < 0 ? -1 : PNG_2_INT(image->pal[tr]);
 	}
+	/* Indexed */
+	else if (!(file_formats[ani_format].flags & FF_RGB))
+		job.settings.bpp = 1;
 	/* RGB */
 	else
 	{
-		if (!comp_need_alpha(ani_format)) irgb = NULL;
-		settings.img[CHN_IMAGE] = layer_rgb;
-		settings.img[CHN_ALPHA] = irgb;
-		settings.bpp = 3;
+		job.alpha = comp_need_alpha(ani_format);
+		job.settings.bpp = 3;
 		/* Background transparency */
-		settings.xpm_trans = tr = image->trans;
-		settings.rgb_trans = tr < 0 ? -1 : PNG_2_INT(image->pal[tr]);
+		job.settings.xpm_trans = tr = image->trans;
+		job.settings.rgb_trans = tr < 0 ? -1 : PNG_2_INT(image->pal[tr]);
 	}
 
-	progress_init(_("Creating Animation Frames"), 1);
-	for ( k=a; k<=b; k++ )			// Create each frame and save it as a PNG or GIF image
+	/* Threads share no buffers, so how many fit decides how many run */
+	n = b - a + 1;
+	nt = ANI_FRAMES_MEM / fsz;
+	if (nt > n) nt = n;
+#ifdef HANDLE_JP2
+	/* JasPer has global state */
+	if ((ani_format == FT_JP2) || (ani_format == FT_J2K)) nt = 1;
+#endif
+	if (can_save_anim(ani_format))
 	{
-		if (progress_update(b == a ? 0.0 : (k - a) / (float)(b - a)))
-			break;
-
-		ani_set_frame_state(k);		// Change layer positions
-		memset(layer_rgb, 0, layer_w * layer_h * 4);	// Init for RGBA compositing
-		view_render_rgb( layer_rgb, 0, 0, layer_w, layer_h, 1 );	// Render layer
+		/* Twice as many buffers as threads, to have them all busy */
+		nb = helper_threads() * 2;
+		if (nb > nt) nb = nt;
+		if (nb < 1) nb = 1;
+		while (!(job.slots = malloc(fsz * nb)) && (nb >>= 1));
+		nt = nb;
+	}
+	tdata = talloc(MA_ALIGN_DEFAULT | MA_SKIP_ZEROSIZE, nt, &job, sizeof(job),
+		&job.fail, sizeof(int), NULL,
+		&job.lt, (layers_total + 1) * sizeof(layer_node),
+		&job.rgb, nb ? 0 : fsz, NULL);
+	if (!tdata || (nb && !job.slots))
+	{
+		free(tdata);
+		free(job.slots);
+		memory_errors(1);
+		return;
+	}
 
-		snprintf(output_path + l, PATHBUF - l, DIR_SEP_STR "%s%05d.%s",
-			ani_file_prefix, k, file_formats[ani_format].ext);
+	/* Have what frames need ready before threads start */
+	for (i = 1; i <= layers_total; i++) layer_ready(i);
+	/* Control transparency separately */
+	oa = overlay_alpha;
+	overlay_alpha = opaque_view;
 
-		if (settings.bpp == 1)	// Prepare palette
-		{
-			cols = mem_cols_used_real(layer_rgb, layer_w, layer_h, pngpal);
-						// Count & collect colours in image
+	progress_init(_("Creating Animation Frames"), 1);
 
-			if (cols > 256)		// If >256 use Wu to quantize
-			{
-				cols = 256;
-				if (wu_quant(layer_rgb, layer_w, layer_h, cols,
-					pngpal)) goto failure2; // No memory
-				// Create new indexed image (cannot fail if no dither)
-				mem_dumb_dither(layer_rgb, irgb, pngpal,
-					layer_w, layer_h, cols, FALSE);
-			}
-			// Create new indexed image (cannot fail w/ exact palette)
-			else mem_convert_indexed(irgb, layer_rgb, layer_w * layer_h,
-				cols, pngpal);
+	/* Separate files, all frames in one go */
+	if (!nb)
+	{
+		tdata->chunks = (n + tdata->count - 1) / tdata->count;
+		launch_threads(ani_frame_jobs, tdata, NULL, n);
+		fail = *job.fail;
+	}
 
-			settings.xpm_trans = -1;	// Default is no transparency
-			if (image->trans >= 0)	// Background has transparency
+	/* Animated file, from batches of frames rendered in parallel */
+	else
+	{
+		snprintf(job.path + l, PATHBUF - l, DIR_SEP_STR "%s.%s",
+			ani_file_prefix, file_formats[ani_format].ext);
+		if (!(anim = save_anim_start(job.path, &job.settings))) fail = 1;
+		tdata->silent = TRUE;
+		for (k = a; !fail && (k <= b); k += n)
+		{
+			n = b - k + 1;
+			if (n > nb) n = nb;
+			for (i = 0; i < tdata->count; i++)
+				((ani_frame_job *)tdata->threads[i]->data)->f0 = k;
+			tdata->chunks = (n + tdata->count - 1) / tdata->count;
+			launch_threads(ani_frame_jobs, tdata, NULL, n);
+			if ((fail = *job.fail)) break;
+
+			for (i = 0; i < n; i++)
 			{
-				trans = image->pal + image->trans;
-				npt = PNG_2_INT(*trans);
-				for (i = 0; i < cols; i++)
-				{	// Does it exist in the composite frame?
-					if (PNG_2_INT(pngpal[i]) != npt) continue;
-					// Transparency found so note it
-					settings.xpm_trans = i;
-					break;
-				}
+				if (progress_update(b == a ? 0.0 :
+					(k + i - a) / (float)(b - a))) break;
+				job.settings.img[CHN_IMAGE] = job.slots + fsz * i;
+				job.settings.img[CHN_ALPHA] = !job.alpha ? NULL :
+					job.slots + fsz * i + fsz / 4 * 3;
+				if (!save_anim_frame(anim, &job.settings)) continue;
+				fail = 1;
+				break;
 			}
+			if (i < n) break;
 		}
-		else if (irgb)
-		{
-			collect_alpha(irgb, layer_w, layer_h);
-			mem_demultiply(layer_rgb, irgb, layer_w * layer_h, 3);
-		}
-
-		if (save_image(output_path, &settings) < 0)
-		{
-			alert_box(_("Error"), _("Unable to save image"), NULL);
-			goto failure2;
-		}
-	}
 
-	/* all GIF files created OK so lets give them to gifsicle */
-	if (ani_format == FT_GIF)
-	{
-		wild_path = wjstrcat(NULL, 0, output_path, l,
-			DIR_SEP_STR, ani_file_prefix, "?????.gif", NULL);
-		snprintf(output_path + l, PATHBUF - l, DIR_SEP_STR "%s.gif",
-			ani_file_prefix);
-
-		if (!run_def_action(DA_GIF_CREATE, wild_path, output_path, ani_gif_delay) &&
-			!cmd_mode) /* Don't launch GUI from commandline */
-			run_def_action(DA_GIF_PLAY, output_path, NULL, 0);
-		free(wild_path);
+		/* Finish the animation, and show it if complete */
+		if (anim && save_anim_end(anim, &job.settings) && !fail)
+			fail = 1;
+		else if (!fail && (k > b) && !cmd_mode)
+			/* Don't launch GUI from commandline */
+			run_def_action(ani_format == FT_WEBP ? DA_WEBP_PLAY :
+				DA_GIF_PLAY, job.path, NULL, 0);
 	}
 
-failure2:
 	progress_end();
-	free( layer_rgb );
+	overlay_alpha = oa;
+	if (fail < 0) memory_errors(1);
+	else if (fail) alert_box(_("Error"), _("Unable to save image"), NULL);
+	free(tdata);
+	free(job.slots);
 }
 
 void pressed_remove_key_frames()
@@ -201,11 +201,17 @@ void update_xy_bar(int x, int y)
 
 static void update_undo_bar()
 {
-	char txt[32];
+	char txt[64];
+	int n;
 
 	if (status_on[STATUS_UNDOREDO])
 	{
-		sprintf(txt, "%i+%i", mem_undo_done, mem_undo_redo);
+		n = sprintf(txt, "%i+%i", mem_undo_done, mem_undo_redo);
+		/* Undo data moved out to disk, in all layers */
+		if (mem_undo_spill) n += sprintf(txt + n, " (%.1f MB on disk)",
+			mem_undo_spilled() / (1024.0 * 1024.0));
+		sprintf(txt + n, "  %.1f MB",
+			mem_undo_used() / (1024.0 * 1024.0));
 		cmd_setv(label_bar[STATUS_UNDOREDO], txt, LABEL_VALUE);
 	}
 }
@@ -1238,6 +1244,9 @@ void update_stuff(int flags)
 		(!mem_clipboard || (mem_clip_bpp > MEM_BPP)))
 		pressed_select(FALSE);
 
+	/* Image contents changed - mipmaps are out of date */
+	if ((flags & (CF_PIXEL | CF_DRAW)) == (CF_PIXEL | CF_DRAW))
+		mip_flush();
 	if (flags & CF_CAB)
 		flags |= mem_channel == CHN_IMAGE ? UPD_AB : UPD_GRAD;
 	if (flags & CF_GEOM)
@@ -1311,7 +1320,10 @@ void update_stuff(int flags)
 	if (flags & CF_CURSOR)
 		set_cursor(NULL);
 	if (flags & CF_DRAW)
+	{
+		ccache_flush();	// Something changed, maybe everything
 		if (drawing_canvas) cmd_repaint(drawing_canvas);
+	}
 	if (flags & CF_VDRAW)
 		if (view_showing && vw_drawing) cmd_repaint(vw_drawing);
 	if (flags & CF_PDRAW)
@@ -1549,7 +1561,8 @@ int do_a_load_x(char *fname, int undo, void *v)
 
 	set_image(FALSE);
 
-	if (ftype == FT_LAYERS1) mult = res = load_layers(real_fname);
+	if ((ftype == FT_LAYERS1) || (ftype == FT_LAYERS2))
+		mult = res = load_layers(real_fname);
 	else
 	{
 		if (script_cmds && v)
@@ -1777,6 +1790,7 @@ void init_ls_settings(ls_settings *settings, void **wdata)
 	settings->lbm_pack = lbm_pack;
 	settings->lbm_pbm = lbm_pbm;
 	settings->gif_delay = preserved_gif_delay;
+	settings->gif_small = gif_small;
 
 	/* Read in settings */
 	if (wdata)
@@ -1996,6 +2010,7 @@ static void fs_ok(fselector_dd *dt, void **wdata)
 		break;
 	case FS_LAYER_SAVE:
 		if (check_file(dt->filename)) break;
+		if (check_layers_all_saved(dt->filename)) break;
 		if (save_layers(dt->filename) != 1) break;
 		redo = 0;
 		break;
@@ -2219,8 +2234,7 @@ void file_selector_x(int action_type, void **xdata)
 		}
 		tdata.title = _("Export ASCII Art");
 		break;
-	case FS_LAYER_SAVE: /* !!! No selectable layer file format yet */
-		if (check_layers_all_saved()) return;
+	case FS_LAYER_SAVE: /* !!! Layer file format goes by extension */
 		tdata.title = _("Save Layer Files");
 		strncpy(tdata.filename, layers_filename, PATHBUF);
 		break;
@@ -2286,7 +2300,7 @@ void file_selector_x(int action_type, void **xdata)
 	/* Default filename */
 	if (!tdata.filename[0]) file_in_dir(tdata.filename,
 		inifile_get("last_dir", get_home_directory()),
-		action_type == FS_LAYER_SAVE ? "layers.txt" : "", PATHBUF);
+		action_type == FS_LAYER_SAVE ? "layers.mtpl" : "", PATHBUF);
 	if (!ext)
 	{
 		ext = strrchr(tdata.filename, '.');
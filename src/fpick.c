@@ -33,6 +33,7 @@
 #include "canvas.h"
 #include "mainwindow.h"
 #include "icons.h"
+#include "thread.h"
 
 #define FP_KEY "mtPaint.fpick"
 
@@ -41,7 +42,8 @@
 #define FPICK_ICON_DIR 2
 #define FPICK_ICON_HIDDEN 3
 #define FPICK_ICON_CASE 4
-#define FPICK_ICON_TOT 5
+#define FPICK_ICON_THUMBS 5
+#define FPICK_ICON_TOT 6
 
 #define FPICK_COMBO_ITEMS 16
 
@@ -59,6 +61,40 @@ enum {
 
 #define RELREF(X) ((char *)&X + X)
 
+/* Thumbnail grid labels need Pango to render */
+#if GTK_MAJOR_VERSION >= 2
+#define THUMB_LABELS
+#endif
+
+/* Persistent thumbnail cache, as per freedesktop.org Thumbnail Managing
+ * Standard, needs GChecksum which appeared in GLib 2.16 */
+#if (GTK_MAJOR_VERSION == 3) || (GTK2VERSION >= 14)
+#define THUMB_CACHE
+#endif
+
+#define THUMB_SIZE	128	/* Size of "normal" thumbnails in the spec */
+#define THUMB_LABEL_H	22
+#define THUMB_CELL_W	(THUMB_SIZE + 12)
+#define THUMB_CELL_H	(THUMB_SIZE + 8 + THUMB_LABEL_H)
+#define THUMB_MEM	(64 * 1024 * 1024) /* Keep no more than this in memory */
+#define THUMB_COST	256 /* Repaint cost for grid canvas */
+
+#define THUMB_BKG	0xFFFFFF
+#define THUMB_SEL	0xB8D0F0
+#define THUMB_TEXT	0x000000
+
+enum {
+	TR_NONE = 0,
+	TR_QUEUED,
+	TR_DONE
+};
+
+typedef struct {
+	unsigned char *rgb, *label;
+	short w, h, lw, lh; // Label width of -1 means rendering it failed
+	int state, stamp;
+} thumb_row;
+
 // ------ Main Data Structure ------
 
 typedef struct {
@@ -70,8 +106,14 @@ typedef struct {
 	int cnt, cntx, idx;
 	int fsort;		// Sort column/direction of list
 	int *fcols, *fmap;
+	int thumbs;		// Show thumbnail grid instead of list
+	int tcols, tcnt;	// Grid columns, thumbnail slots
+	int tscan, tstamp;	// Scan ID, paint counter
+	int tmem;		// Memory held by thumbnails and labels
+	guint ttimer;
+	thumb_row *trows;
 	char *cdir, **cpp, *cp[FPICK_COMBO_ITEMS + 1];
-	void **combo, **list;
+	void **combo, **list, **lbox, **gbox, **grid;
 	void **hbox, **entry;
 	void **ok, **cancel;
 	memx2 files;
@@ -143,6 +185,7 @@ static void fpick_sort(fpick_dd *dt)
 	/* Sort row map */
 	mdt = dt;
 	qsort(dt->fmap, dt->cntx, sizeof(dt->fmap[0]), cmp_rows);
+	if (dt->thumbs && dt->grid) cmd_repaint(dt->grid);
 }
 
 /* *** A WORD OF WARNING ***
@@ -274,6 +317,502 @@ static int cmp_rows(const void *f1, const void *f2)
 }
 
 
+/* Thumbnails are made in a background thread, which takes jobs from a shared
+ * queue, newest first, so the cells the user currently looks at get filled in
+ * before those he has scrolled past. A timer on the GUI side collects results,
+ * and when the thread cannot be created, does the jobs itself, one per tick.
+ * The disk cache is shared with other programs, so the thumbnails in it are
+ * stored as is; those in memory are composited over grid background */
+
+#define THUMB_JOBS 64	/* Max queued at once */
+#define THUMB_TICK 50	/* Interval to check for results, in ms */
+
+enum {
+	TJ_FREE = 0,
+	TJ_QUEUED,
+	TJ_BUSY,
+	TJ_DONE
+};
+
+typedef struct {
+	int state, scan, row, seq;
+	int w, h;
+	unsigned char *rgb;
+	char name[PATHBUF];
+} thumb_job;
+
+static thumb_job thumb_jobs[THUMB_JOBS];
+static int thumb_worker, thumb_seq, thumb_scans;
+static char thumb_dir[PATHBUF];
+
+DEF_MUTEX(thumb_lock);
+
+/* Prepare the cache directory, creating it if needed */
+static void thumb_dir_init()
+{
+#ifdef THUMB_CACHE
+	const char *dir;
+	char *s;
+
+	if (thumb_dir[0]) return;
+	dir = g_get_user_cache_dir();
+	wjstrcat(thumb_dir, PATHBUF, dir, strlen(dir), DIR_SEP_STR "thumbnails"
+		DIR_SEP_STR "normal" DIR_SEP_STR, NULL);
+	/* The spec wants the directories private */
+	for (s = thumb_dir; (s = strchr(s + 1, DIR_SEP)); )
+	{
+		*s = '\0';
+#ifdef WIN32
+		mkdir(thumb_dir);
+#else
+		mkdir(thumb_dir, 0700);
+#endif
+		*s = DIR_SEP;
+	}
+#endif
+}
+
+/* Make thumbnail for the job, from cache or from the file itself */
+static void thumb_make(thumb_job *job)
+{
+	struct stat buf;
+	unsigned char *src, *dest, *rgba = NULL;
+	int i, l, a, w, h, ft;
+#ifdef THUMB_CACHE
+	char *keys[7], *uri, *md5 = NULL, mtime[32], size[32];
+	char fnm[PATHBUF], tmp[PATHBUF];
+	int cached = FALSE;
+#endif
+
+	job->rgb = NULL;
+	if (stat(job->name, &buf) < 0) return;
+
+#ifdef THUMB_CACHE
+	uri = g_filename_to_uri(job->name, NULL, NULL);
+	if (uri && thumb_dir[0])
+	{
+		sprintf(mtime, "%lu", (unsigned long)buf.st_mtime);
+		sprintf(size, "%llu", (unsigned long long)buf.st_size);
+		keys[0] = "Thumb::URI";
+		keys[1] = uri;
+		keys[2] = "Thumb::MTime";
+		keys[3] = mtime;
+		keys[4] = NULL;
+		md5 = g_compute_checksum_for_string(G_CHECKSUM_MD5, uri, -1);
+		snprintf(fnm, PATHBUF, "%s%s.png", thumb_dir, md5);
+		cached = !!(rgba = load_thumb_png(fnm, keys, &w, &h));
+	}
+#endif
+	if (!rgba && ((ft = detect_image_format(job->name)) > FT_NONE))
+		rgba = load_thumbnail(job->name, ft, THUMB_SIZE, &w, &h);
+#ifdef THUMB_CACHE
+	/* Store the new thumbnail, unless it is of a thumbnail */
+	if (rgba && md5 && !cached &&
+		strncmp(job->name, thumb_dir, strlen(thumb_dir)))
+	{
+		keys[4] = "Thumb::Size";
+		keys[5] = size;
+		keys[6] = NULL;
+		/* Write to a temp file, then rename, so that no one sees
+		 * a partial file */
+		snprintf(tmp, PATHBUF, "%s.%d.tmp", fnm, (int)getpid());
+		if (save_thumb_png(tmp, keys, rgba, w, h)) remove(tmp);
+		else
+		{
+#ifndef WIN32
+			chmod(tmp, 0600);
+#endif
+			if (rename(tmp, fnm)) remove(tmp);
+		}
+	}
+	g_free(md5);
+	g_free(uri);
+#endif
+	if (!rgba) return;
+
+	/* Composite over background */
+	l = w * h;
+	if ((job->rgb = dest = malloc(l * 3)))
+	{
+		for (src = rgba , i = 0; i < l; i++ , src += 4 , dest += 3)
+		{
+			a = src[3];
+			dest[0] = (src[0] * a + INT_2_R(THUMB_BKG) * (255 - a) +
+				127) / 255;
+			dest[1] = (src[1] * a + INT_2_G(THUMB_BKG) * (255 - a) +
+				127) / 255;
+			dest[2] = (src[2] * a + INT_2_B(THUMB_BKG) * (255 - a) +
+				127) / 255;
+		}
+		job->w = w;
+		job->h = h;
+	}
+	free(rgba);
+}
+
+/* Pick the newest queued job; call with lock held */
+static thumb_job *thumb_next()
+{
+	thumb_job *job = NULL;
+	int i;
+
+	for (i = 0; i < THUMB_JOBS; i++)
+	{
+		if (thumb_jobs[i].state != TJ_QUEUED) continue;
+		if (!job || (thumb_jobs[i].seq > job->seq)) job = thumb_jobs + i;
+	}
+	return (job);
+}
+
+static void *thumb_work(void *data)
+{
+	thumb_job *job;
+
+	while (TRUE)
+	{
+		LOCK_BG_MUTEX(thumb_lock);
+		if ((job = thumb_next())) job->state = TJ_BUSY;
+		else thumb_worker = FALSE;
+		UNLOCK_BG_MUTEX(thumb_lock);
+		if (!job) break;
+
+		thumb_make(job);
+		LOCK_BG_MUTEX(thumb_lock);
+		/* Drop the result if the scan got cancelled meanwhile */
+		if (job->scan) job->state = TJ_DONE;
+		else
+		{
+			free(job->rgb);
+			job->rgb = NULL;
+			job->state = TJ_FREE;
+		}
+		UNLOCK_BG_MUTEX(thumb_lock);
+	}
+	return (NULL);
+}
+
+/* Launch background thread if not running, or do one job here if cannot */
+static void thumb_start()
+{
+	thumb_job *job;
+
+	if (thumb_worker) return;
+	thumb_worker = TRUE; // Worker may reset it right away
+	if (launch_bg_thread(thumb_work, NULL)) return;
+	thumb_worker = FALSE;
+	if (!(job = thumb_next())) return;
+	job->state = TJ_BUSY;
+	thumb_make(job);
+	job->state = TJ_DONE;
+}
+
+/* Free memory held by a grid cell */
+static void thumb_drop(fpick_dd *dt, thumb_row *tr)
+{
+	if (tr->rgb) dt->tmem -= tr->w * tr->h * 3;
+	if (tr->label) dt->tmem -= tr->lw * tr->lh;
+	free(tr->rgb);
+	free(tr->label);
+	tr->rgb = tr->label = NULL;
+	tr->lw = tr->lh = 0;
+	if (tr->state == TR_DONE) tr->state = TR_NONE;
+}
+
+/* Drop least recently shown thumbnails, to keep memory use in bounds */
+static void thumb_trim(fpick_dd *dt)
+{
+	thumb_row *tr;
+	int i, lo, cut;
+
+	while (dt->tmem > THUMB_MEM)
+	{
+		lo = dt->tstamp;
+		for (i = 0 , tr = dt->trows; i < dt->tcnt; i++ , tr++)
+			if ((tr->rgb || tr->label) && (tr->stamp < lo))
+				lo = tr->stamp;
+		/* Keep what is on screen */
+		if (lo >= dt->tstamp) break;
+		cut = lo + (dt->tstamp - lo + 1) / 2;
+		for (i = 0 , tr = dt->trows; i < dt->tcnt; i++ , tr++)
+			if (tr->stamp < cut) thumb_drop(dt, tr);
+	}
+}
+
+static gboolean fpick_thumb_timer(gpointer data)
+{
+	fpick_dd *dt = data;
+	thumb_job *job;
+	thumb_row *tr;
+	int i, n, busy = 0, done = 0;
+
+	thumb_start();
+	for (i = 0; i < THUMB_JOBS; i++)
+	{
+		job = thumb_jobs + i;
+		LOCK_BG_MUTEX(thumb_lock);
+		n = job->state;
+		UNLOCK_BG_MUTEX(thumb_lock);
+		if (job->scan != dt->tscan) continue;
+		if ((n == TJ_QUEUED) || (n == TJ_BUSY)) busy++;
+		if (n != TJ_DONE) continue;
+		/* Attach the result to its cell */
+		tr = dt->trows + job->row;
+		tr->state = TR_DONE;
+		if ((tr->rgb = job->rgb))
+		{
+			tr->w = job->w;
+			tr->h = job->h;
+			dt->tmem += job->w * job->h * 3;
+		}
+		job->rgb = NULL;
+		job->state = TJ_FREE;
+		done++;
+	}
+	if (done)
+	{
+		thumb_trim(dt);
+		cmd_repaint(dt->grid);
+	}
+	if (busy) return (TRUE);
+	dt->ttimer = 0;
+	return (FALSE);
+}
+
+/* Queue up a thumbnail to make */
+static void thumb_queue(fpick_dd *dt, int row)
+{
+	thumb_job *job, *old = NULL;
+	int i;
+
+	LOCK_BG_MUTEX(thumb_lock);
+	for (i = 0; i < THUMB_JOBS; i++)
+	{
+		job = thumb_jobs + i;
+		if (job->state == TJ_FREE) break;
+		/* Oldest request gets bumped if no free slot */
+		if ((job->state == TJ_QUEUED) && (job->scan == dt->tscan) &&
+			(!old || (job->seq < old->seq))) old = job;
+	}
+	if (i >= THUMB_JOBS)
+	{
+		/* The cell will ask again when shown */
+		if ((job = old)) dt->trows[job->row].state = TR_NONE;
+	}
+	if (job)
+	{
+		job->state = TJ_QUEUED;
+		job->scan = dt->tscan;
+		job->row = row;
+		job->seq = ++thumb_seq;
+		wjstrcat(job->name, PATHBUF, dt->txt_directory,
+			strlen(dt->txt_directory),
+			RELREF(dt->fcols[row * COL_MAX + COL_FILE]), NULL);
+		dt->trows[row].state = TR_QUEUED;
+	}
+	UNLOCK_BG_MUTEX(thumb_lock);
+
+	if (job && !dt->ttimer) dt->ttimer = threads_timeout_add(THUMB_TICK,
+		fpick_thumb_timer, dt);
+}
+
+/* Cancel the jobs and free the thumbnails */
+static void thumb_cancel(fpick_dd *dt)
+{
+	thumb_job *job;
+	int i;
+
+	if (dt->ttimer) g_source_remove(dt->ttimer);
+	dt->ttimer = 0;
+
+	LOCK_BG_MUTEX(thumb_lock);
+	for (i = 0; i < THUMB_JOBS; i++)
+	{
+		job = thumb_jobs + i;
+		if (job->scan != dt->tscan) continue;
+		job->scan = 0; // Tell worker to drop it
+		if (job->state == TJ_BUSY) continue;
+		free(job->rgb);
+		job->rgb = NULL;
+		job->state = TJ_FREE;
+	}
+	UNLOCK_BG_MUTEX(thumb_lock);
+
+	if (dt->trows) for (i = 0; i < dt->tcnt; i++)
+		thumb_drop(dt, dt->trows + i);
+	free(dt->trows);
+	dt->trows = NULL;
+	dt->tcnt = dt->tmem = 0;
+}
+
+/* Prepare thumbnail slots for a new list of files */
+static void thumbs_new(fpick_dd *dt)
+{
+	thumb_cancel(dt);
+	dt->tscan = ++thumb_scans;
+	if (dt->thumbs && (dt->trows = calloc(dt->cnt + 1, sizeof(thumb_row))))
+		dt->tcnt = dt->cnt;
+}
+
+/* Put a block of pixels into the grid, or fill it with colour if no source;
+ * single-channel source is text coverage, to paint with the colour */
+static void thumb_put(rgbcontext *ctx, int x, int y, int w, int h,
+	unsigned char *src, int bpp, int col)
+{
+	unsigned char *dest, *tmp = NULL;
+	int i, j, k, a, cw, rxy[4], rgb[3];
+
+	if (!clip(rxy, x, y, x + w, y + h, ctx->xy)) return;
+	rgb[0] = INT_2_R(col);
+	rgb[1] = INT_2_G(col);
+	rgb[2] = INT_2_B(col);
+	cw = ctx->xy[2] - ctx->xy[0];
+	for (i = rxy[1]; i < rxy[3]; i++)
+	{
+		dest = ctx->rgb + ((i - ctx->xy[1]) * cw + rxy[0] - ctx->xy[0]) * 3;
+		if (src) tmp = src + ((i - y) * w + rxy[0] - x) * bpp;
+		for (j = rxy[0]; j < rxy[2]; j++ , dest += 3)
+		{
+			if (!src)
+			{
+				dest[0] = rgb[0];
+				dest[1] = rgb[1];
+				dest[2] = rgb[2];
+			}
+			else if (bpp == 3)
+			{
+				dest[0] = *tmp++;
+				dest[1] = *tmp++;
+				dest[2] = *tmp++;
+			}
+			else
+			{
+				a = *tmp++;
+				for (k = 0; k < 3; k++) dest[k] = (rgb[k] * a +
+					dest[k] * (255 - a) + 127) / 255;
+			}
+		}
+	}
+}
+
+#ifdef THUMB_LABELS
+
+/* Render filename, keeping only the part which fits into the cell */
+static void thumb_label(fpick_dd *dt, thumb_row *tr, char *name)
+{
+	texteng_dd td = { name, "", 0, 0, 0, 0 };
+	unsigned char *src, *dest;
+	int i, j, w, h;
+
+	td.ctx.rgb = NULL;
+	cmd_setv(main_window_, &td, WINDOW_TEXTENG);
+	tr->lw = -1;
+	if (!td.ctx.rgb) return;
+	w = td.ctx.xy[2];
+	h = td.ctx.xy[3];
+	if (w > THUMB_CELL_W - 4) w = THUMB_CELL_W - 4;
+	if (h > THUMB_LABEL_H) h = THUMB_LABEL_H;
+	if ((tr->label = dest = malloc(w * h)))
+	{
+		/* White on black, so any channel is coverage */
+		for (i = 0; i < h; i++)
+		{
+			src = td.ctx.rgb + i * td.ctx.xy[2] * 3 + 1;
+			for (j = 0; j < w; j++ , src += 3) *dest++ = *src;
+		}
+		tr->lw = w;
+		tr->lh = h;
+		dt->tmem += w * h;
+	}
+	free(td.ctx.rgb);
+}
+
+#endif
+
+static void fpick_grid_cell(fpick_dd *dt, rgbcontext *ctx, int x, int y,
+	int row)
+{
+	thumb_row *tr = dt->trows + row;
+	char *nm = RELREF(dt->fcols[row * COL_MAX + COL_NAME]);
+	int tx = x + (THUMB_CELL_W - THUMB_SIZE) / 2, ty = y + 4;
+
+	tr->stamp = dt->tstamp;
+	if (row == dt->idx) thumb_put(ctx, x + 2, y + 2,
+		THUMB_CELL_W - 4, THUMB_CELL_H - 4, NULL, 0, THUMB_SEL);
+
+	if (nm[0] != 'F') /* Folder */
+	{
+		thumb_put(ctx, tx + 16, ty + 26, 40, 10, NULL, 0, 0xC8A040);
+		thumb_put(ctx, tx + 16, ty + 34, 96, 68, NULL, 0, 0xC8A040);
+		thumb_put(ctx, tx + 18, ty + 38, 92, 62, NULL, 0, 0xF0D070);
+	}
+	else if (tr->rgb) thumb_put(ctx, tx + (THUMB_SIZE - tr->w) / 2,
+		ty + (THUMB_SIZE - tr->h) / 2, tr->w, tr->h, tr->rgb, 3, 0);
+	else /* Blank page, till the thumbnail arrives or if there is none */
+	{
+		if (tr->state == TR_NONE) thumb_queue(dt, row);
+		thumb_put(ctx, tx + 32, ty + 24, 64, 80, NULL, 0, 0x909090);
+		thumb_put(ctx, tx + 33, ty + 25, 62, 78, NULL, 0, 0xFFFFFF);
+	}
+
+#ifdef THUMB_LABELS
+	if (!tr->label && !tr->lw) thumb_label(dt, tr, nm + 1);
+	if (tr->label) thumb_put(ctx, x + (THUMB_CELL_W - tr->lw) / 2,
+		y + THUMB_SIZE + 6, tr->lw, tr->lh, tr->label, 1, THUMB_TEXT);
+#endif
+}
+
+static int fpick_grid_paint(fpick_dd *dt, void **wdata, int what, void **where,
+	rgbcontext *ctx)
+{
+	int i, j, n, c0, c1, r0, r1;
+
+	thumb_put(ctx, ctx->xy[0], ctx->xy[1], ctx->xy[2] - ctx->xy[0],
+		ctx->xy[3] - ctx->xy[1], NULL, 0, THUMB_BKG);
+	if (!dt->trows) return (TRUE);
+
+	dt->tstamp++;
+	c0 = ctx->xy[0] / THUMB_CELL_W;
+	c1 = (ctx->xy[2] - 1) / THUMB_CELL_W;
+	if (c1 >= dt->tcols) c1 = dt->tcols - 1;
+	r0 = ctx->xy[1] / THUMB_CELL_H;
+	r1 = (ctx->xy[3] - 1) / THUMB_CELL_H;
+	for (i = r0; i <= r1; i++)
+	for (j = c0; j <= c1; j++)
+	{
+		if ((n = i * dt->tcols + j) >= dt->cntx) break;
+		fpick_grid_cell(dt, ctx, j * THUMB_CELL_W, i * THUMB_CELL_H,
+			dt->fmap[n]);
+	}
+	thumb_trim(dt);
+
+	return (TRUE); // now draw this
+}
+
+/* Set grid size to match the list */
+static void fpick_grid_reset(fpick_dd *dt)
+{
+	int wh[2];
+
+	if (!dt->thumbs || !dt->grid) return;
+	wh[0] = dt->tcols * THUMB_CELL_W;
+	wh[1] = ((dt->cntx + dt->tcols - 1) / dt->tcols) * THUMB_CELL_H;
+	cmd_setv(dt->grid, wh, CANVAS_SIZE);
+	cmd_repaint(dt->grid);
+}
+
+static void fpick_grid_configure(fpick_dd *dt, void **wdata, int what,
+	void **where)
+{
+	int n, wh[2];
+
+	cmd_peekv(where, wh, sizeof(wh), CANVAS_SIZE);
+	n = wh[0] / THUMB_CELL_W;
+	if (n < 1) n = 1;
+	if (n == dt->tcols) return;
+	dt->tcols = n;
+	fpick_grid_reset(dt);
+}
+
 /* Register directory in combo */
 static void fpick_directory_new(fpick_dd *dt, char *name)
 {
@@ -356,7 +895,9 @@ static void fpick_scan_drives(fpick_dd *dt)	// Scan drives, populate widgets
 	cmd_setv(dt->combo, "", ENTRY_VALUE); // Just clear it
 
 	scan_drives(dt, cdrive);
+	thumbs_new(dt);
 	cmd_reset(dt->list, dt);
+	fpick_grid_reset(dt);
 }
 
 #endif
@@ -560,8 +1101,10 @@ static int fpick_scan_directory(fpick_dd *dt, char *name, char *select)
 	g_free(parent);
 	closedir(dp);
 	filter_dir(dt, dt->txt_mask);
+	thumbs_new(dt);
 
 	cmd_reset(dt->list, dt);
+	fpick_grid_reset(dt);
 
 	return (res);
 }
@@ -609,6 +1152,21 @@ static void fpick_select(fpick_dd *dt, void **wdata, int what, void **where)
 
 	// File selected
 	if (txt_size[0]) cmd_setv(dt->entry, txt_name, PATH_VALUE);
+	if (dt->thumbs && dt->grid) cmd_repaint(dt->grid);
+}
+
+static int fpick_grid_click(fpick_dd *dt, void **wdata, int what, void **where,
+	mouse_ext *mouse)
+{
+	int n, x = mouse->x / THUMB_CELL_W;
+
+	if (mouse->button != 1) return (FALSE);
+	if ((mouse->x < 0) || (mouse->y < 0) || (x >= dt->tcols)) return (TRUE);
+	n = (mouse->y / THUMB_CELL_H) * dt->tcols + x;
+	if (n >= dt->cntx) return (TRUE);
+	if (mouse->count == 1) cmd_set(dt->list, dt->fmap[n]);
+	else if (mouse->count == 2) fpick_ok(dt);
+	return (TRUE);
 }
 
 /* Return 1 if changed directory, 0 if directory was the same, -1 if tried
@@ -811,6 +1369,7 @@ static int fpick_wildcard(fpick_dd *dt, int button)
 	{	/* Redisplay only files that match pattern */
 		filter_dir(dt, mask);
 		cmd_reset(dt->list, dt);
+		fpick_grid_reset(dt);
 	}
 
 	/* Don't let pattern pass as filename */
@@ -866,6 +1425,9 @@ static void fpick_destroy(fpick_dd *dt, void **wdata)
 
 	inifile_set_gboolean("fpick_case_insensitive", case_insensitive);
 	inifile_set_gboolean("fpick_show_hidden", dt->show_hidden );
+	inifile_set_gboolean("fpick_thumbnails", dt->thumbs);
+
+	thumb_cancel(dt);
 }
 
 static void fpick_iconbar_click(fpick_dd *dt, void **wdata, int what, void **where)
@@ -893,6 +1455,12 @@ static void fpick_iconbar_click(fpick_dd *dt, void **wdata, int what, void **whe
 	case FPICK_ICON_CASE:
 		cmd_setv(dt->list, (void *)dt->fsort, LISTC_SORT);
 		break;
+	case FPICK_ICON_THUMBS:
+		thumbs_new(dt);
+		cmd_showhide(dt->gbox, dt->thumbs);
+		cmd_showhide(dt->lbox, !dt->thumbs);
+		fpick_grid_reset(dt);
+		break;
 	}
 }
 
@@ -928,9 +1496,12 @@ static void *fpick_code[] = {
 		show_hidden),
 	TBTOGGLEv(_("Case Insensitive Sort"), XPM_ICON(case), FPICK_ICON_CASE,
 		case_insensitive),
+	TBTOGGLE(_("Show Thumbnails"), XPM_ICON(thumbs), FPICK_ICON_THUMBS,
+		thumbs),
 	WDONE, WDONE,
 	// ------- File List -------
 	XHBOXP,
+	REF(lbox), XVBOXr, IF(thumbs), HIDDEN,
 	XSCROLL(1, 2), // auto/always
 	WLIST,
 	NRFILECOLUMNDax(_("Name"), COL_NAME, 250, 0, "fpick_col1"),
@@ -943,6 +1514,13 @@ static void *fpick_code[] = {
 	UNLESS(entry_f), FOCUS,
 	CLEANUP(files.buf),
 	WDONE,
+	// ------- Thumbnail Grid -------
+	REF(gbox), XVBOXr, UNLESS(thumbs), HIDDEN,
+	XSCROLL(1, 2), // auto/always
+	REF(grid), CANVAS(THUMB_CELL_W, THUMB_CELL_H, THUMB_COST,
+		fpick_grid_paint),
+	EVENT(CHANGE, fpick_grid_configure), EVENT(MOUSE, fpick_grid_click),
+	WDONE, WDONE,
 	// ------- Extra widget section -------
 	REF(hbox), HBOXPr, WDONE,
 	// ------- Entry Box -------
@@ -978,6 +1556,9 @@ GtkWidget *fpick(GtkWidget **box, char *title, int flags, void **r)
 	case_insensitive = inifile_get_gboolean("fpick_case_insensitive", TRUE );
 
 	tdata.show_hidden = inifile_get_gboolean("fpick_show_hidden", FALSE );
+	tdata.thumbs = inifile_get_gboolean("fpick_thumbnails", FALSE);
+	tdata.tcols = 1;
+	thumb_dir_init();
 	tdata.allow_files = !(tdata.flags & FPICK_DIRS_ONLY);
 	tdata.allow_dirs = TRUE;
 
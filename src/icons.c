@@ -98,6 +98,7 @@
 #include "graphics/xpm_shuffle.xpm"
 #include "graphics/xpm_smudge.xpm"
 #include "graphics/xpm_text.xpm"
+#include "graphics/xpm_thumbs.xpm"
 #include "graphics/xpm_undo.xpm"
 #include "graphics/xpm_up.xpm"
 #include "graphics/xpm_cline.xpm"
@@ -80,6 +80,7 @@ DEF_XPM_ICON(select);
 DEF_XPM_ICON(shuffle);
 DEF_XPM_ICON(smudge);
 DEF_XPM_ICON(text);
+DEF_XPM_ICON(thumbs);
 DEF_XPM_ICON(undo);
 DEF_XPM_ICON(up);
 DEF_XPM_ICON(cline);
@@ -37,13 +37,13 @@
 #define HS_GRAPH_H 64
 
 typedef struct {
-	int indexed, clip, layers;
+	int indexed, clip, layers, table;
 	int norm;
 	int wh[3];
 	char *col_h, *col_d;
 	unsigned char *rgb_mem;
 	void **drawingarea;
-	char mem_d[128], clip_d[256], rgb_d[64], lr_d[128];
+	char mem_d[128], clip_d[256], rgb_d[64], lr_d[128], lc_d[64];
 	int rgb[256][3];	// Raw frequencies
 	int rgb_sorted[256][3];	// Sorted frequencies
 } info_dd;
@@ -193,7 +193,8 @@ static void hs_click_normalize(info_dd *dt, void **wdata, int what, void **where
 }
 
 /* Populate RGB tables */
-static void hs_populate_rgb(int hs_rgb[256][3], int hs_rgb_sorted[256][3])
+static void hs_populate_rgb(int hs_rgb[256][3], int hs_rgb_sorted[256][3],
+	col_stats *cs)
 {
 	int i, j, k, t;
 	unsigned char *im = mem_img[CHN_IMAGE];
@@ -202,7 +203,8 @@ static void hs_populate_rgb(int hs_rgb[256][3], int hs_rgb_sorted[256][3])
 
 	j = mem_width * mem_height;
 
-	if ( mem_img_bpp == 3 )
+	if (cs) memcpy(hs_rgb, cs->rgb, sizeof(cs->rgb)); // Already counted
+	else if ( mem_img_bpp == 3 )
 	{
 		for ( i=0; i<j; i++ )			// Populate table with RGB frequencies
 		{
@@ -256,7 +258,7 @@ static void hs_populate_rgb(int hs_rgb[256][3], int hs_rgb_sorted[256][3])
 #define WBbase info_dd
 static void *info_code[] = {
 	WINDOWm(_("Information")),
-	IF(indexed), DEFH(400),
+	IF(table), DEFH(400),
 	FTABLE(_("Memory"), 2, 3),
 	TLLABEL(_("Total memory for main + undo images"), 0, 0),
 		TLTEXTf(mem_d, 1, 0),
@@ -271,6 +273,7 @@ static void *info_code[] = {
 	IFx(layers, 1),
 		TLLABEL(_("Layers"), 0, 4), TLTEXTf(lr_d, 1, 4),
 		TLLABEL(_("Total layer memory usage"), 0, 5),
+		TLLABEL(_("Cached layer composites"), 0, 6), TLTEXTf(lc_d, 1, 6),
 	ENDIF(1),
 	WDONE,
 	BORDER(TABLE, 0),
@@ -280,13 +283,14 @@ static void *info_code[] = {
 	TLCHECK(_("Normalize"), norm, 0, 1), EVENT(CHANGE, hs_click_normalize),
 		TRIGGER,
 	WDONE,
-	IFx(indexed, 1),
-///	Big index table
+	IFx(table, 1),
+///	Big index (or colour) table
 		BORDER(SCROLL, 0),
 		XFRAMEp(col_h), VBOXbp(0, 4, 0), XSCROLL(1, 1), // auto/auto
 		BORDER(TABLE, 0),
 		TABLE(3, 256 + 3),
-		TLLABEL(_("Index"), 0, 0),
+		IF(indexed), TLLABEL(_("Index"), 0, 0),
+		UNLESS(indexed), TLLABEL(_("Colour"), 0, 0),
 		TLLABEL(_("Canvas pixels"), 1, 0),
 		TLLABEL("%", 2, 0),
 		BORDER(LABEL, 0),
@@ -305,6 +309,7 @@ static void *info_code[] = {
 void pressed_information()
 {
 	info_dd tdata;
+	col_stats *cs = NULL;
 	char txt[256];
 	int i, j, maxi, orphans;
 
@@ -335,7 +340,8 @@ void pressed_information()
 
 	if (mem_img_bpp == 3)	// RGB image so count different colours
 	{
-		i = mem_count_all_cols();
+		cs = mem_col_stats(CS_FREQ);
+		i = cs ? cs->cols : -1;
 		if (i < 0) // not enough memory
 		{
 			i = mem_cols_used(NULL);
@@ -349,13 +355,38 @@ void pressed_information()
 	{
 		snprintf(tdata.lr_d, sizeof(tdata.lr_d), "%d\n%1.1f MB",
 			layers_total, mem_used_layers() / (double)(1024 * 1024));
+		snprintf(tdata.lc_d, sizeof(tdata.lc_d), "%1.1f / %d MB",
+			lcache_used() / (double)(1024 * 1024), lcache_mb);
 	}
 
-	hs_populate_rgb(tdata.rgb, tdata.rgb_sorted);
+	hs_populate_rgb(tdata.rgb, tdata.rgb_sorted, cs);
 	tdata.wh[0] = HS_GRAPH_W;
 	tdata.wh[1] = HS_GRAPH_H * mem_img_bpp;
 	tdata.wh[2] = tdata.wh[0] * tdata.wh[1] * 3;
 
+	if (cs && cs->nfreq) // List the most frequent colours
+	{
+		memx2 mem;
+
+		memset(&mem, 0, sizeof(mem));
+		j = mem_width * mem_height;
+		for (i = 0; i < cs->nfreq; i++)
+		{
+			int rgb = cs->freq[i].rgb;
+
+			snprintf(txt, sizeof(txt), "#%02X%02X%02X\t%d\t%1.1f%s",
+				INT_2_R(rgb), INT_2_G(rgb), INT_2_B(rgb),
+				cs->freq[i].cnt, (100.0 * cs->freq[i].cnt) / j,
+				i < cs->nfreq - 1 ? "\n" : "");
+			addstr(&mem, txt, 1);
+		}
+		tdata.col_d = mem.buf;
+
+		snprintf(tdata.col_h = txt, sizeof(txt),
+			_("Most frequent colours - %i of %i"), cs->nfreq, cs->cols);
+		tdata.table = TRUE;
+	}
+
 	if (mem_img_bpp == 1)
 	{
 		memx2 mem;
@@ -381,6 +412,7 @@ void pressed_information()
 		for (j = i = 0; i < mem_cols; i++) if (mem_histogram[i]) j++;
 		snprintf(tdata.col_h = txt, sizeof(txt),
 			_("Colour index totals - %i of %i used"), j, mem_cols);
+		tdata.table = TRUE;
 	}
 
 	run_create(info_code, &tdata, sizeof(tdata));
@@ -34,6 +34,7 @@
 #include "viewer.h"
 #include "channels.h"
 #include "icons.h"
+#include "thread.h"
 
 
 int	layers_total,		// Layers currently being used
@@ -126,6 +127,7 @@ static void layers_update_titlebar()		// Update filename in titlebar
 
 void layers_notify_changed()			// Layers have just changed - update vars as needed
 {
+	lcache_flush(); // Cached composites may be wrong now
 	if ( layers_changed != 1 )
 	{
 		layers_changed = 1;
@@ -157,6 +159,7 @@ void layer_copy_to_main( int l )		// Copy info from layer to main image
 {
 	layer_image *lp = layer_table[l].image;
 
+	layer_ready(l);
 	if (!layer_overlay)
 	{
 		lp->state_.iover = mem_state.iover;
@@ -177,6 +180,8 @@ void shift_layer(int val)
 	/* Update source layer */
 	if ((blend_src == SRC_LAYER + layer_selected) || (blend_src == SRC_LAYER + lv))
 		blend_src ^= (SRC_LAYER + layer_selected) ^ (SRC_LAYER + lv);
+	/* Background gets used even when hidden */
+	if (!layer_selected) layer_ready(lv);
 
 	layer_copy_from_main(layer_selected);
 	temp = layer_table[layer_selected];
@@ -280,6 +285,7 @@ void layer_delete(int item)
 	int i;
 
 	mem_free_image(&lp->image_, FREE_ALL);
+	free(lp->packed);
 	free(lp);
 
 	// If deleted item is not at the end shuffle rest down
@@ -356,9 +362,18 @@ void layer_press_centre()
 	repaint_layers();
 }
 
+/* Which layers format the filename asks for */
+static int layers_format(char *file_name)
+{
+	char *ext = strrchr(file_name, '.');
+
+	return (ext && !strcasecmp(ext + 1, file_formats[FT_LAYERS2].ext) ?
+		FT_LAYERS2 : FT_LAYERS1);
+}
+
 /* Return 1 if some layers are modified, 2 if some are nameless, 3 if both,
- * 0 if neither */
-static int layers_changed_tot()
+ * 0 if neither; nameless layers don't count if layers file holds them */
+static int layers_changed_tot(int named)
 {
 	image_info *image;
 	int j, k;
@@ -367,7 +382,7 @@ static int layers_changed_tot()
 	{
 		image = k == layer_selected ? &mem_image :
 			&layer_table[k].image->image_;
-		j |= !!image->changed + !image->filename * 2;
+		j |= !!image->changed + (named && !image->filename) * 2;
 	}
 
 	return (j);
@@ -375,7 +390,8 @@ static int layers_changed_tot()
 
 int check_layers_for_changes()		// 1=STOP, 2=IGNORE, -10=NOT CHANGED
 {
-	if (!(layers_changed_tot() + layers_changed)) return (-10);
+	if (!(layers_changed_tot(layers_format(layers_filename) != FT_LAYERS2) +
+		layers_changed)) return (-10);
 	return (alert_box(_("Warning"),
 		_("One or more of the layers contains changes that have not been saved.  Do you really want to lose these changes?"),
 		_("Cancel Operation"), _("Lose Changes"), NULL));
@@ -404,6 +420,7 @@ static void layers_free_all()
 	for (t = layer_table + layers_total; t != layer_table; t--)
 	{
 		mem_free_image(&t->image->image_, FREE_ALL);
+		free(t->image->packed);
 		free(t->image);
 	}
 	memset(layer_table + 1, 0, sizeof(layer_node) * MAX_LAYERS);
@@ -430,6 +447,418 @@ int read_file_num(FILE *fp, char *txt)
 	return i;
 }
 
+/* Single-file layers format: text header, then chunks each starting with
+ * 4-char tag and 32-bit length; all numbers are 32-bit little-endian.
+ * "LTOC" chunk has layer count, record size, and offset of "LANI" chunk,
+ * followed by per-layer records; each record points to its "LIMG" chunk
+ * holding the layer image; "LANI" chunk is the animation data in text form,
+ * and extends to end of file */
+
+#define LAYERS_HEADER2 LAYERS_HEADER "\n2\n"
+#define LCHUNK_HDR 8
+#define LTOC_HDR 16
+
+enum {
+	LR_OFS = 0,
+	LR_OFS_HI,
+	LR_LEN,
+	LR_ULEN,
+	LR_W,
+	LR_H,
+	LR_BPP,
+	LR_CMASK,
+	LR_X,
+	LR_Y,
+	LR_OPAC,
+	LR_VIS,
+	LR_TRANS,
+
+	LR_NVALS
+};
+#define LR_SIZE (LR_NVALS * 4 + LAYER_NAMELEN)
+
+#define GET32(buf) (((unsigned)(buf)[3] << 24) + ((buf)[2] << 16) + \
+	((buf)[1] << 8) + (buf)[0])
+#define PUT32(buf, v) (buf)[0] = (v) & 0xFF; (buf)[1] = ((v) >> 8) & 0xFF; \
+	(buf)[2] = ((v) >> 16) & 0xFF; (buf)[3] = ((v) >> 24) & 0xFF;
+
+typedef struct {
+	layer_image *lim;
+	ls_settings settings;
+	png_color pal[256];
+	unsigned char *buf;
+	size_t len, ulen;
+	int res;	// 0 = to do, 1 = done, 2 = packed already, -1 = failed
+} lpack_job;
+
+typedef struct {
+	lpack_job *jobs;
+	int pack;
+} lpack_data;
+
+static void lpack_init(lpack_job *job, layer_image *lim, int pack)
+{
+	image_info *image = &lim->image_;
+	ls_settings *s = &job->settings;
+
+	memset(job, 0, sizeof(lpack_job));
+	job->lim = lim;
+	s->pal = job->pal;
+	s->xpm_trans = s->rgb_trans = -1;
+	if (lim->packed)
+	{
+		job->buf = lim->packed;
+		job->len = lim->plen;
+		job->ulen = lim->ulen;
+		job->res = pack ? 2 : 0;
+	}
+	else if (!pack) job->res = -1; // Nothing to unpack
+	if (!pack)
+	{
+		s->mode = FS_LAYER_LOAD;
+		return;
+	}
+	s->mode = FS_LAYER_SAVE;
+	memcpy(s->img, image->img, sizeof(chanlist));
+	s->width = image->width;
+	s->height = image->height;
+	s->bpp = image->bpp;
+	mem_pal_copy(job->pal, image->pal);
+	s->colors = image->cols;
+	s->xpm_trans = image->trans;
+	s->png_compression = png_compression;
+}
+
+static void lpack_one(lpack_job *job, int pack)
+{
+	if (pack) job->res = (job->buf = pack_layer(&job->settings,
+		&job->len, &job->ulen)) ? 1 : -1;
+	else job->res = unpack_layer(job->buf, job->len, job->ulen,
+		&job->settings) == 1 ? 1 : -1;
+}
+
+/* Layers differ in size, so they go one by one */
+static void lpack_jobs(tcb *thread)
+{
+	lpack_data *ld = thread->data;
+	lpack_job *job = ld->jobs + thread->step0;
+	int i;
+
+	for (i = thread->nsteps; i > 0; i-- , job++)
+		if (!job->res) lpack_one(job, ld->pack);
+}
+
+static void layers_pack_run(lpack_job *jobs, int n, int pack)
+{
+	lpack_data ld = { jobs, pack };
+	threaddata *tdata;
+	int i;
+
+	tdata = talloc(MA_ALIGN_DEFAULT, n, &ld, sizeof(ld), NULL, NULL);
+	if (!tdata) /* Do it here then */
+	{
+		for (i = 0; i < n; i++)
+			if (!jobs[i].res) lpack_one(jobs + i, pack);
+		return;
+	}
+	tdata->chunks = (n + tdata->count - 1) / tdata->count;
+	tdata->silent = TRUE;
+	launch_threads(lpack_jobs, tdata, NULL, n);
+	free(tdata);
+}
+
+/* Replace layer's placeholder by unpacked image, or by empty one on failure;
+ * the packed image is dropped either way */
+static int lpack_done(lpack_job *job)
+{
+	layer_image *lim = job->lim;
+	image_info *image = &lim->image_;
+	ls_settings *s = &job->settings;
+	int w = image->width, h = image->height, bpp = image->bpp;
+	int res = (job->res > 0) && (s->width == w) && (s->height == h) &&
+		(s->bpp == bpp);
+
+	free(lim->packed);
+	lim->packed = NULL;
+	mem_free_chanlist(image->img);
+	memset(image->img, 0, sizeof(chanlist));
+	if (res)
+	{
+		memcpy(image->img, s->img, sizeof(chanlist));
+		mem_pal_copy(image->pal, s->pal);
+		image->cols = s->colors;
+		image->trans = s->xpm_trans;
+	}
+	else
+	{
+		mem_free_chanlist(s->img);
+		if (!mem_alloc_image(0, image, w, h, bpp, CMASK_IMAGE, NULL))
+			mem_alloc_image(0, image, 8, 8, bpp, CMASK_IMAGE, NULL);
+	}
+	update_undo(image);
+	init_istate(&lim->state_, image);
+	return (res);
+}
+
+void layer_ready(int l)
+{
+	lpack_job job;
+
+	if ((l < 0) || (l > layers_total) || !layer_table[l].image->packed)
+		return;
+	lpack_init(&job, layer_table[l].image, FALSE);
+	lpack_one(&job, FALSE);
+	if (!lpack_done(&job)) alert_box(_("Error"), _("Layer failed to load"),
+		NULL);
+}
+
+/* Seek to 64-bit offset, if the system can */
+static int layers_seek(FILE *fp, unsigned int lo, unsigned int hi)
+{
+	long ofs = (long)lo;
+
+	if (hi)
+	{
+		if (sizeof(long) <= 4) return (FALSE);
+		ofs += (long)hi << 16 << 16;
+	}
+	return ((ofs >= 0) && !fseek(fp, ofs, SEEK_SET));
+}
+
+static int load_layers2(FILE *fp, char *file_name)
+{
+	lpack_job *jobs;
+	layer_node *t;
+	layer_image *lim;
+	image_info *image;
+	unsigned char hdr[LCHUNK_HDR], *toc, *r;
+	unsigned int v[LR_NVALS], ani_lo, ani_hi;
+	char tin[300];
+	size_t l;
+	int i, j, n, rl, lfail;
+
+	/* Read in table of contents */
+	if ((fread(hdr, 1, LCHUNK_HDR, fp) != LCHUNK_HDR) ||
+		memcmp(hdr, "LTOC", 4)) return (-1);
+	l = GET32(hdr + 4);
+	if ((l < LTOC_HDR) || (l > LTOC_HDR + (MAX_LAYERS + 1) * 4096))
+		return (-1);
+	if (!(toc = malloc(l))) return (FILE_MEM_ERROR);
+	n = rl = 0;
+	if (fread(toc, 1, l, fp) == l)
+	{
+		n = GET32(toc);
+		rl = GET32(toc + 4);
+	}
+	ani_lo = GET32(toc + 8);
+	ani_hi = GET32(toc + 12);
+	/* Validate it all before dropping current layers */
+	if ((n < 1) || (n > MAX_LAYERS + 1) || (rl < LR_SIZE) || (rl > 4096) ||
+		(LTOC_HDR + n * rl > l)) n = 0;
+	for (i = 0; i < n; i++)
+	{
+		r = toc + LTOC_HDR + i * rl;
+		for (j = 0; j < LR_NVALS; j++) v[j] = GET32(r + j * 4);
+		if ((v[LR_W] < 1) || (v[LR_W] > MAX_WIDTH) ||
+			(v[LR_H] < 1) || (v[LR_H] > MAX_HEIGHT) ||
+			((v[LR_BPP] != 1) && (v[LR_BPP] != 3)) ||
+			!(v[LR_CMASK] & CMASK_IMAGE) ||
+			(v[LR_CMASK] & ~CMASK_ALL)) n = 0;
+	}
+	jobs = n ? calloc(n, sizeof(lpack_job)) : NULL;
+	if (!jobs)
+	{
+		free(toc);
+		return (n ? FILE_MEM_ERROR : -1);
+	}
+
+	/* !!! Can use lock field instead, but this is the original way */
+	cmd_sensitive(GET_WINDOW(layers_box_), FALSE);
+
+	if (layers_total) layers_free_all();	// Remove all current layers if any
+	for (i = 0; i < n; i++)
+	{
+		r = toc + LTOC_HDR + i * rl;
+		for (j = 0; j < LR_NVALS; j++) v[j] = GET32(r + j * 4);
+
+		/* Create the layer, with no image in it yet */
+		t = layer_table + i;
+		if (!i)
+		{
+			mem_new(v[LR_W], v[LR_H], v[LR_BPP], 0);
+			layer_copy_from_main(0);
+		}
+		else
+		{
+			if (!(lim = alloc_layer(v[LR_W], v[LR_H], v[LR_BPP], 0,
+				NULL))) break;
+			layer_clear_slot(i, FALSE);
+			t->image = lim;
+			layers_total = i;
+		}
+		lim = t->image;
+		lim->state_.xbm_hot_x = lim->state_.xbm_hot_y = -1;
+		lim->state_.channel = CHN_IMAGE;
+		image = &lim->image_;
+		image->trans = (int)v[LR_TRANS] < 0 ? -1 :
+			v[LR_TRANS] > 255 ? 255 : v[LR_TRANS];
+		image->cols = 256;
+		mem_pal_copy(image->pal, mem_pal_def);
+
+		memcpy(t->name, r + LR_NVALS * 4, LAYER_NAMELEN);
+		t->name[LAYER_NAMELEN - 1] = '\0';
+		t->visible = !!v[LR_VIS];
+		t->x = (int)v[LR_X];
+		t->y = (int)v[LR_Y];
+		t->opacity = v[LR_OPAC] < 1 ? 1 : v[LR_OPAC] > 100 ? 100 :
+			v[LR_OPAC];
+
+		/* Read in packed image */
+		if (!layers_seek(fp, v[LR_OFS], v[LR_OFS_HI]) ||
+			(fread(hdr, 1, LCHUNK_HDR, fp) != LCHUNK_HDR) ||
+			memcmp(hdr, "LIMG", 4) ||
+			(GET32(hdr + 4) != v[LR_LEN]) ||
+			!(lim->packed = malloc(v[LR_LEN])) ||
+			(fread(lim->packed, 1, v[LR_LEN], fp) != v[LR_LEN]))
+		{
+			free(lim->packed);
+			lim->packed = NULL;
+		}
+		lim->plen = v[LR_LEN];
+		lim->ulen = v[LR_ULEN];
+
+		/* Hidden layers stay packed till needed, with placeholder */
+		if (i && !t->visible && lim->packed &&
+			mem_alloc_image(AI_NOINIT, image, v[LR_W], v[LR_H],
+			v[LR_BPP], v[LR_CMASK], NULL))
+		{
+			update_undo(image);
+			init_istate(&lim->state_, image);
+			jobs[i].res = 2; // Not now
+		}
+		else lpack_init(jobs + i, lim, FALSE);
+	}
+	free(toc);
+	lfail = n - i; // Out of memory for layer structures
+	n = i;
+
+	/* Unpack the visible ones */
+	layers_pack_run(jobs, n, FALSE);
+	for (i = 0; i < n; i++)
+		if (jobs[i].res != 2) lfail += !lpack_done(jobs + i);
+	free(jobs);
+	layer_copy_to_main(0); // Update everything
+
+	/* Read in animation data */
+	if (layers_seek(fp, ani_lo, ani_hi) &&
+		(fread(hdr, 1, LCHUNK_HDR, fp) == LCHUNK_HDR) &&
+		!memcmp(hdr, "LANI", 4)) ani_read_file(fp);
+	else ani_init();
+
+	layer_refresh_list(layers_total);
+	cmd_sensitive(GET_WINDOW(layers_box_), TRUE);
+	layer_update_filename(file_name);
+
+	if (lfail) /* There were failures */
+	{
+		snprintf(tin, 300, __("%d layers failed to load"), lfail);
+		alert_box(_("Error"), tin, NULL);
+	}
+
+	return (1);
+}
+
+static int save_layers2(char *file_name)
+{
+	lpack_job *jobs;
+	layer_image *lim;
+	layer_node *t;
+	unsigned char hdr[LCHUNK_HDR], *toc, *r;
+	unsigned int v[LR_NVALS];
+	size_t ofs;
+	int i, j, n = layers_total + 1, res = FALSE;
+	int tl = LTOC_HDR + n * LR_SIZE;
+	FILE *fp = NULL;
+
+	jobs = calloc(n, sizeof(lpack_job));
+	toc = calloc(1, tl);
+	if (!jobs || !toc) goto fail;
+
+	/* Pack the layers that aren't packed already */
+	for (i = 0; i < n; i++)
+		lpack_init(jobs + i, layer_table[i].image, TRUE);
+	layers_pack_run(jobs, n, TRUE);
+
+	/* Prepare table of contents */
+	PUT32(toc, n);
+	PUT32(toc + 4, LR_SIZE);
+	ofs = strlen(LAYERS_HEADER2) + LCHUNK_HDR + tl;
+	for (i = 0; i < n; i++)
+	{
+		if (jobs[i].res < 0) goto fail;
+		t = layer_table + i;
+		lim = t->image;
+		v[LR_OFS] = ofs;
+		v[LR_OFS_HI] = ofs >> 16 >> 16;
+		v[LR_LEN] = jobs[i].len;
+		v[LR_ULEN] = jobs[i].ulen;
+		v[LR_W] = lim->image_.width;
+		v[LR_H] = lim->image_.height;
+		v[LR_BPP] = lim->image_.bpp;
+		v[LR_CMASK] = cmask_from(lim->image_.img);
+		v[LR_X] = t->x;
+		v[LR_Y] = t->y;
+		v[LR_OPAC] = t->opacity;
+		v[LR_VIS] = t->visible;
+		v[LR_TRANS] = lim->image_.trans;
+		r = toc + LTOC_HDR + i * LR_SIZE;
+		for (j = 0; j < LR_NVALS; j++)
+		{
+			PUT32(r + j * 4, v[j]);
+		}
+		strncpy((char *)r + LR_NVALS * 4, t->name, LAYER_NAMELEN);
+		ofs += LCHUNK_HDR + jobs[i].len;
+	}
+	PUT32(toc + 8, ofs);
+	PUT32(toc + 12, ofs >> 16 >> 16);
+
+	/* Write it all out */
+	if (!(fp = fopen(file_name, "wb"))) goto fail;
+	fputs(LAYERS_HEADER2, fp);
+	memcpy(hdr, "LTOC", 4);
+	PUT32(hdr + 4, tl);
+	fwrite(hdr, 1, LCHUNK_HDR, fp);
+	fwrite(toc, 1, tl, fp);
+	memcpy(hdr, "LIMG", 4);
+	for (i = 0; i < n; i++)
+	{
+		PUT32(hdr + 4, jobs[i].len);
+		fwrite(hdr, 1, LCHUNK_HDR, fp);
+		fwrite(jobs[i].buf, 1, jobs[i].len, fp);
+	}
+	/* Animation data goes till the end */
+	memcpy(hdr, "LANI", 4);
+	PUT32(hdr + 4, 0);
+	fwrite(hdr, 1, LCHUNK_HDR, fp);
+	ani_write_file(fp);
+	res = !ferror(fp);
+	res &= !fclose(fp);
+	if (!res) goto fail;
+
+	/* Layers' images are saved now */
+	for (i = 0; i < n; i++)
+	{
+		if (i == layer_selected) notify_unchanged(NULL);
+		else layer_table[i].image->image_.changed = 0;
+	}
+
+fail:	if (jobs) for (i = 0; i < n; i++)
+		if (jobs[i].res == 1) free(jobs[i].buf);
+	free(jobs);
+	free(toc);
+	return (res);
+}
+
 int load_layers( char *file_name )
 {
 	layer_node *t;
@@ -443,7 +872,7 @@ int load_layers( char *file_name )
 	if (c) lplen = c - file_name + 1;
 
 		// Try to save text file, return -1 if failure
-	if ((fp = fopen(file_name, "r")) == NULL) goto fail;
+	if ((fp = fopen(file_name, "rb")) == NULL) goto fail;
 
 	if (!fgets(tin, 32, fp)) goto fail2;
 
@@ -453,7 +882,13 @@ int load_layers( char *file_name )
 	i = read_file_num(fp, tin);
 	if ( i==-987654321 ) goto fail2;
 //	layer_file_version = i;
-	if ( i>LAYERS_VERSION ) goto fail2;		// Version number must be compatible
+	if ( i>LAYERS_VERSION2 ) goto fail2;		// Version number must be compatible
+	if (i == LAYERS_VERSION2)
+	{
+		i = load_layers2(fp, file_name);
+		fclose(fp);
+		return (i);
+	}
 
 	i = read_file_num(fp, tin);
 	if ( i==-987654321 ) goto fail2;
@@ -471,7 +906,8 @@ int load_layers( char *file_name )
 		wjstrcat(load_name, PATHBUF, file_name, lplen, tin, NULL);
 		k = 1;
 		j = detect_image_format(load_name);
-		if ((j > 0) && (j != FT_NONE) && (j != FT_LAYERS1))
+		if ((j > 0) && (j != FT_NONE) && (j != FT_LAYERS1) &&
+			(j != FT_LAYERS2))
 			k = load_image(load_name, FS_LAYER_LOAD, j) != 1;
 
 		if (k) /* Failure - skip this layer */
@@ -663,7 +1099,7 @@ int load_to_layers(char *file_name, int ftype, int ani_mode)
 	cmd_sensitive(GET_WINDOW(layers_box_), TRUE);
 
 	/* Name change so that layers file would not overwrite the source */
-	strcpy(tail, ".txt");
+	strcpy(tail, ".mtpl");
 	layer_update_filename(buf);
 
 	free(buf);
@@ -784,6 +1220,12 @@ int save_layers( char *file_name )
 
 	layer_copy_from_main(layer_selected);
 
+	if (layers_format(file_name) == FT_LAYERS2)
+	{
+		if (!save_layers2(file_name)) goto fail;
+		goto done;
+	}
+
 	c = strrchr(file_name, DIR_SEP);
 	if (c) l = c - file_name + 1;
 
@@ -805,7 +1247,7 @@ int save_layers( char *file_name )
 	ani_write_file(fp);			// Write animation data
 
 	fclose(fp);
-	layer_update_filename( file_name );
+done:	layer_update_filename( file_name );
 	register_file( file_name );		// Recently used file list / last directory
 
 	return 1;		// Success
@@ -820,9 +1262,11 @@ fail:
 }
 
 
-int check_layers_all_saved()
+int check_layers_all_saved(char *file_name)
 {
-	if (layers_changed_tot() < 2) return (0);
+	/* Single-file format needs no separate image files */
+	if (layers_format(file_name) == FT_LAYERS2) return (0);
+	if (layers_changed_tot(TRUE) < 2) return (0);
 	alert_box(_("Warning"), _("One or more of the image layers has not been saved.  You must save each image individually before saving the layers text file in order to load this composite image in the future."), NULL);
 	return (1);
 }
@@ -830,7 +1274,8 @@ int check_layers_all_saved()
 void layer_press_save()
 {
 	if (!layers_filename[0]) file_selector(FS_LAYER_SAVE);
-	else if (!check_layers_all_saved()) save_layers(layers_filename);
+	else if (!check_layers_all_saved(layers_filename))
+		save_layers(layers_filename);
 }
 
 void layer_press_remove_all()
@@ -854,7 +1299,8 @@ static void layer_tog_visible(layers_dd *dt, void **wdata, int what,
 	/* !!! Column is self-reading */
 	if (dt->lock) return;
 	layers_notify_changed();
-	repaint_layer((int)xdata); // !!! row passed in there
+	layer_ready((int)xdata); // !!! row passed in there
+	repaint_layer((int)xdata);
 }
 
 static void layer_inputs_changed(layers_dd *dt, void **wdata, int what,
@@ -20,6 +20,7 @@
 #define MAX_LAYERS 100
 #define LAYERS_HEADER "# mtPaint layers"
 #define LAYERS_VERSION 1
+#define LAYERS_VERSION2 2	/* Single-file binary format */
 
 #define LAYER_NAMELEN 35
 
@@ -29,6 +30,8 @@ typedef struct {
 	image_info image_;
 	image_state state_;
 	ani_info ani_;
+	unsigned char *packed;	// Image not yet unpacked from layers file
+	size_t plen, ulen;	// Its packed & unpacked sizes
 } layer_image;
 
 typedef struct {
@@ -72,10 +75,14 @@ int load_to_layers(char *file_name, int ftype, int ani_mode);
 void layers_notify_changed();
 void layer_copy_from_main( int l );	// Copy info from main image to layer
 void layer_copy_to_main( int l );	// Copy info from layer to main image
+void layer_ready(int l);		// Unpack layer image if still packed
+//	Render RGB & composite alpha with given layer table (in viewer.c)
+void render_frame_rgb(unsigned char *rgb, int w, int h, layer_node *lt);
+void collect_frame_alpha(unsigned char *alpha, int pw, int ph, layer_node *lt);
 void layer_refresh_list();
 void layer_press_remove_all();
 int check_layers_for_changes();
-int check_layers_all_saved();
+int check_layers_all_saved(char *file_name);
 void move_layer_relative(int l, int change_x, int change_y);	// Move a layer & update window labels
 void layer_new(int w, int h, int bpp, int cols, png_color *pal, int cmask);
 //	*Silently* add layer, return success
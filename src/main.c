@@ -33,6 +33,7 @@
 #include "prefs.h"
 #include "csel.h"
 #include "spawn.h"
+#include "simd.h"
 
 static int compare_names(const void *s1, const void *s2)
 {
@@ -358,6 +359,8 @@ int main( int argc, char *argv[] )
 	char *env;
 	glob_t globdata;
 	int file_arg_start = argc, new_empty = TRUE, get_screenshot = FALSE;
+	int bench = FALSE, batch = FALSE, jobs = 0, script_at = 2, res = 0;
+	char *pattern = NULL;
 	int i, j, l, nf, nw, nl, w0, pass, fmode, dosort = FALSE;
 
 	if (argc > 1)
@@ -377,6 +380,8 @@ int main( int argc, char *argv[] )
 				"  --flist         Read a list of files\n"
 				"  --sort          Sort files passed as arguments\n"
 				"  --cmd           Commandline scripting mode, no GUI\n"
+				"  --batch         Run script on many files in parallel, no GUI\n"
+				"  --bench         Time image scaling, palette search, compositing and saving, no GUI\n"
 				"  -s              Grab screenshot\n"
 				"  -v              Start in viewer mode\n"
 				"  --              End of options\n\n"
@@ -388,6 +393,26 @@ int main( int argc, char *argv[] )
 			cmd_mode = TRUE;
 			script_cmds = argv + 2;
 		}
+		if (!strcmp(argv[1], "--batch"))
+		{
+			cmd_mode = batch = TRUE;
+			/* Batch options and file lists go before the script */
+			for (i = 2; i < argc - 1; i++)
+			{
+				if (!strcmp(argv[i], "-j"))
+					sscanf(argv[++i], "%d", &jobs);
+				else if (!strcmp(argv[i], "-o")) pattern = argv[++i];
+				else if (!strcmp(argv[i], "--flist") ||
+					!strcmp(argv[i], "-w")) i++;
+				else if (strcmp(argv[i], "--sort")) break;
+			}
+			script_cmds = argv + (script_at = i);
+		}
+		if (!strcmp(argv[1], "--bench"))
+		{
+			cmd_mode = bench = TRUE;
+			script_cmds = argv + 2;
+		}
 	}
 
 	putenv( "G_BROKEN_FILENAMES=1" );	// Needed to read non ASCII filenames in GTK+2
@@ -492,7 +517,12 @@ int main( int argc, char *argv[] )
 			fmode |= 2;	// Files only, no wildcards
 			continue;
 		}
-		else if (cmd_mode) continue;	// One more script command
+		else if (cmd_mode && (i >= script_at)) continue; // Script command
+		else if (batch && (!strcmp(arg, "-j") || !strcmp(arg, "-o")))
+		{
+			i++;
+			continue;
+		}
 		else if (!strcmp(arg, "-g"))	// Loading GIF animation frames
 		{
 			if (++i >= argc) continue;
@@ -585,6 +615,9 @@ int main( int argc, char *argv[] )
 	layers_init();
 	init_cols();
 
+	if (bench) return (mem_scale_bench() | mem_nearest_bench() |
+		simd_bench() | save_bench());
+
 	if ( get_screenshot )
 	{
 		if (load_image(NULL, FS_PNG_LOAD, FT_PIXMAP) == 1)
@@ -600,7 +633,8 @@ int main( int argc, char *argv[] )
 	}
 	else
 	{
-		if ((files_passed > 0) && !do_a_load(file_args[0], FALSE))
+		if (!batch && (files_passed > 0) &&
+			!do_a_load(file_args[0], FALSE))
 			new_empty = FALSE;
 	}
 
@@ -611,7 +645,10 @@ int main( int argc, char *argv[] )
 
 	update_menus();
 
-	if (cmd_mode) // Console
+	if (batch) // Console, many files
+		res = spawn_batch(script_cmds, file_args, files_passed, jobs,
+			pattern);
+	else if (cmd_mode) // Console
 		run_script(script_cmds);
 	else // GUI
 	{
@@ -632,5 +669,5 @@ int main( int argc, char *argv[] )
 	}
 	spawn_quit();
 
-	return (cmd_mode && user_break);
+	return (batch ? res : cmd_mode && user_break);
 }
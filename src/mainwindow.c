@@ -43,6 +43,7 @@
 #include "font.h"
 #include "icons.h"
 #include "thread.h"
+#include "simd.h"
 
 
 typedef struct {
@@ -83,6 +84,7 @@ static inilist ini_bool[] = {
 	{ "tgaDefdir",		&tga_defdir,		FALSE },
 	{ "tgaRLE",		&tga_RLE,		FALSE },
 	{ "lbmPBM",		&lbm_pbm,		FALSE },
+	{ "gifSmall",		&gif_small,		FALSE },
 	{ "disableTransparency", &opaque_view,		FALSE },
 	{ "smudgeOpacity",	&smudge_mode,		FALSE },
 	{ "showMenuIcons",	&show_menu_icons,	FALSE },
@@ -157,8 +159,11 @@ static inilist ini_int[] = {
 	{ "gridMin",		&mem_grid_min,		8   },
 	{ "undoMBlimit",	&mem_undo_limit,	0   },
 	{ "undoCommon",		&mem_undo_common,	25  },
+	{ "undoSpillMB",	&mem_undo_spill,	0   },
+	{ "blurEngine",		&blur_engine,		BLUR_DOUBLE },
 	{ "maxThreads",		&maxthreads,		0   },
 	{ "kpixThreads",	&kpix_threads,		256 },
+	{ "layerCacheMB",	&lcache_mb,		64  },
 	{ "backgroundGrey",	&mem_background,	180 },
 	{ "pixelNudge",		&mem_nudge,		8   },
 	{ "recentFiles",	&recent_files,		10  },
@@ -1930,6 +1935,48 @@ void setup_row(renderstate *r, int x0, int width, int zoom, int scale, int mw,
 	*r = rr;
 }
 
+#define VROW 256 /* Pixels per batch for vector code */
+
+/* Transparent pixels without replication - prepare a batch of colours and
+ * opacities, then let vector code do the blending */
+static void render_row_v(renderstate *rr, unsigned char *dest,
+	unsigned char *src, unsigned char *alpha, int ds, int da, int bpp, int xpm)
+{
+	unsigned char buf[VROW * 3], op[VROW * 3], *s;
+	png_color *pal = rr->pal;
+	int i, k, l, n, cnt = rr->width + 1, opac = rr->opac;
+
+	for (; cnt > 0; cnt -= l , dest += l * 3)
+	{
+		l = cnt > VROW ? VROW : cnt;
+		s = (bpp == 3) && (ds == 3) ? src : buf; // Use in place if can
+		for (i = n = 0; i < l; i++ , n += 3 , src += ds , alpha += da)
+		{
+			if (bpp == 1) /* Alpha is only on/off for indexed */
+			{
+				k = !*alpha || (*src == xpm) ? 0 : opac;
+				buf[n + 0] = pal[*src].red;
+				buf[n + 1] = pal[*src].green;
+				buf[n + 2] = pal[*src].blue;
+			}
+			else
+			{
+				k = opac * *alpha;
+				k = (k + (k >> 8) + 1) >> 8;
+				if (MEM_2_INT(src, 0) == xpm) k = 0;
+				if (s == buf)
+				{
+					buf[n + 0] = src[0];
+					buf[n + 1] = src[1];
+					buf[n + 2] = src[2];
+				}
+			}
+			op[n] = op[n + 1] = op[n + 2] = k;
+		}
+		blend_bytes(dest, s, op, n);
+	}
+}
+
 void render_row(renderstate *r, unsigned char *rgb, chanlist base_img,
 	int x, int y, chanlist xtra_img)
 {
@@ -1984,6 +2031,11 @@ void render_row(renderstate *r, unsigned char *rgb, chanlist base_img,
 		}
 	}
 
+	/* Transparent at 1:1 or zoomed out */
+	else if (alpha_blend && (rr.scale == 1))
+		render_row_v(&rr, dest, src, alpha, w_bpp == 1 ? rr.zoom : ds,
+			da, w_bpp, w_xpm);
+
 	/* Indexed transparent */
 	else if (w_bpp == 1)
 	{
@@ -2029,6 +2081,10 @@ rr2_s:
 		}
 	}
 
+	/* RGB fully opaque, unscaled */
+	else if (!alpha_blend && (rr.scale == 1) && (ds == 3))
+		memcpy(dest, src, (rr.width + 1) * 3);
+
 	/* RGB fully opaque */
 	else if (!alpha_blend)
 	{
@@ -2131,6 +2187,39 @@ void overlay_row(renderstate *r, unsigned char *rgb, chanlist base_img,
 	opM = (k * opM) / j;
 	if (!(opA + opS + opM)) return;
 
+	/* No replication - do batches of channel values with vector code */
+	if (rr.scale == 1)
+	{
+		unsigned char buf[3][VROW * 3], *src[3] = { buf[0], buf[1], buf[2] };
+		unsigned char *cp[3], cinv[3], crgb[3 * 3];
+		int l, n, c, nc = 0, op[3], cnt = rr.width + 1;
+
+		for (c = CHN_ALPHA; c <= CHN_MASK; c++)
+		{
+			k = c == CHN_ALPHA ? opA : c == CHN_SEL ? opS : opM;
+			if (!k) continue;
+			op[nc] = k;
+			cp[nc] = c == CHN_ALPHA ? alpha : c == CHN_SEL ? sel : mask;
+			cinv[nc] = channel_inv[c];
+			memcpy(crgb + nc * 3, channel_rgb[c], 3);
+			nc++;
+		}
+		for (dest = rgb; cnt > 0; cnt -= l , dest += l * 3)
+		{
+			l = cnt > VROW ? VROW : cnt;
+			for (c = 0; c < nc; c++)
+			{
+				unsigned char *tmp = cp[c], *bp = buf[c];
+
+				for (i = n = 0; i < l; i++ , n += 3 , tmp += rr.zoom)
+					bp[n] = bp[n + 1] = bp[n + 2] = *tmp ^ cinv[c];
+				cp[c] = tmp;
+			}
+			overlay_bytes(dest, src, op, crgb, nc, l * 3);
+		}
+		return;
+	}
+
 	dest = rgb;
 	ii = rr.dx;
 	for (i = dw = 0; ; ii += rr.scale , dw += rr.zoom)
@@ -2221,6 +2310,297 @@ op_s:
 	}
 }
 
+/// MIPMAPS
+
+/* Zoomed-out views of big RGB images are rendered from a pyramid of 2x
+ * downscaled copies, built when first needed and then updated tile by tile,
+ * as parts of the image get changed */
+
+#define MIP_LEVELS 3	/* Down to 1:8 */
+#define MIP_TILE 64	/* Tile size at any level */
+#define MIP_MIN (1024 * 1024) /* Smaller images are fast enough as is */
+#define MIP_SLOTS (MAX_LAYERS + 1)
+
+typedef struct {
+	chanlist key;		// Image channels it is built from
+	int w, h;		// Image geometry
+	int nlev;		// Levels allocated
+	int ready;		// Levels up to date
+	chanlist img[MIP_LEVELS];	// Levels 1:2, 1:4, 1:8
+	unsigned char *dirty[MIP_LEVELS]; // Tile flags: need updating
+} mipmap;
+
+static mipmap mips[MIP_SLOTS];
+
+#define MIP_W(M,L) (((M)->w + (1 << (L)) - 1) >> (L))
+#define MIP_H(M,L) (((M)->h + (1 << (L)) - 1) >> (L))
+#define MIP_TW(M,L) ((MIP_W(M, L) + MIP_TILE - 1) / MIP_TILE)
+#define MIP_TH(M,L) ((MIP_H(M, L) + MIP_TILE - 1) / MIP_TILE)
+
+static void mip_free(mipmap *m)
+{
+	int i;
+
+	for (i = 0; i < m->nlev; i++)
+	{
+		mem_free_chanlist(m->img[i]);
+		free(m->dirty[i]);
+	}
+	memset(m, 0, sizeof(mipmap));
+}
+
+static mipmap *mip_find(chanlist img, int w, int h)
+{
+	mipmap *m;
+
+	for (m = mips; m < mips + MIP_SLOTS; m++)
+		if (m->key[CHN_IMAGE] && (m->w == w) && (m->h == h) &&
+			!memcmp(m->key, img, sizeof(chanlist))) return (m);
+	return (NULL);
+}
+
+/* Level which can be used for this zoom factor */
+static int mip_zoom_level(int zoom)
+{
+	int l;
+
+	for (l = 0; (l < MIP_LEVELS) && (zoom > 1) && !(zoom & 1); l++)
+		zoom >>= 1;
+	return (l);
+}
+
+static int mip_usable(image_info *image, int xpm)
+{
+	/* Averaging would break exact colour transparency */
+	return ((image->bpp == 3) && (xpm < 0) &&
+		((size_t)image->width * image->height >= MIP_MIN));
+}
+
+/* Downscale one tile of a level from the one above */
+static void mip_tile(mipmap *m, int l, int tx, int ty)
+{
+	unsigned char **src = l ? m->img[l - 1] : m->key, **dest = m->img[l];
+	unsigned char *s0, *s1, *sa0, *sa1, *d;
+	int sw = MIP_W(m, l), sh = MIP_H(m, l), dw = MIP_W(m, l + 1);
+	int x, y, x0, x1, y1, cc, dx, a0, a1, a2, a3, sa, k;
+
+	x0 = tx * MIP_TILE;
+	x1 = x0 + MIP_TILE;
+	if (x1 > dw) x1 = dw;
+	y1 = (ty + 1) * MIP_TILE;
+	if (y1 > MIP_H(m, l + 1)) y1 = MIP_H(m, l + 1);
+	for (y = ty * MIP_TILE; y < y1; y++)
+	{
+		k = y * 2 + 1 < sh ? sw : 0; // Bottom row is doubled
+		for (cc = CHN_ALPHA; cc < NUM_CHANNELS; cc++)
+		{
+			if (!src[cc]) continue;
+			s0 = src[cc] + y * 2 * sw;
+			s1 = s0 + k;
+			d = dest[cc] + y * dw;
+			for (x = x0; x < x1; x++)
+			{
+				dx = x * 2 + 1 < sw; // Right column is doubled
+				d[x] = (s0[x * 2] + s0[x * 2 + dx] +
+					s1[x * 2] + s1[x * 2 + dx] + 2) >> 2;
+			}
+		}
+
+		s0 = src[CHN_IMAGE] + y * 2 * sw * 3;
+		s1 = s0 + k * 3;
+		d = dest[CHN_IMAGE] + (y * dw + x0) * 3;
+		if (!src[CHN_ALPHA]) /* Plain average */
+		{
+			for (x = x0; x < x1; x++ , d += 3)
+			{
+				dx = (x * 2 + 1 < sw) * 3;
+				for (cc = x * 6; cc < x * 6 + 3; cc++)
+					*d++ = (s0[cc] + s0[cc + dx] +
+						s1[cc] + s1[cc + dx] + 2) >> 2;
+				d -= 3;
+			}
+			continue;
+		}
+		/* Alpha-weighted average, so that invisible pixels don't
+		 * bleed into visible ones */
+		sa0 = src[CHN_ALPHA] + y * 2 * sw;
+		sa1 = sa0 + k;
+		for (x = x0; x < x1; x++ , d += 3)
+		{
+			dx = x * 2 + 1 < sw;
+			a0 = sa0[x * 2]; a1 = sa0[x * 2 + dx];
+			a2 = sa1[x * 2]; a3 = sa1[x * 2 + dx];
+			if (!(sa = a0 + a1 + a2 + a3)) a0 = a1 = a2 = a3 = sa = 1;
+			dx *= 3;
+			for (cc = x * 6; cc < x * 6 + 3; cc++) *d++ =
+				(s0[cc] * a0 + s0[cc + dx] * a1 + s1[cc] * a2 +
+				s1[cc + dx] * a3 + (sa >> 1)) / sa;
+			d -= 3;
+		}
+	}
+}
+
+typedef struct {
+	mipmap *m;
+	int l;
+} mip_state;
+
+static void do_mip_rows(tcb *thread)
+{
+	mip_state *ms = thread->data;
+	mipmap *m = ms->m;
+	unsigned char *dirty;
+	int i, j, l = ms->l, tw = MIP_TW(m, l + 1);
+
+	for (i = thread->step0; i < thread->step0 + thread->nsteps; i++)
+	{
+		dirty = m->dirty[l] + i * tw;
+		for (j = 0; j < tw; j++)
+		{
+			if (!dirty[j]) continue;
+			mip_tile(m, l, j, i);
+			dirty[j] = 0;
+		}
+	}
+	thread_done(thread);
+}
+
+/* Bring the levels needed for the zoom factor up to date */
+static void mip_update(image_info *image, int zoom)
+{
+	mip_state ms;
+	threaddata *tdata;
+	mipmap *m;
+	size_t sz;
+	int i, l, lev = mip_zoom_level(zoom);
+
+	if (!lev || !mip_usable(image, -1)) return;
+	if (!(m = mip_find(image->img, image->width, image->height)))
+	{
+		/* Take a free slot, or the last one if none */
+		for (m = mips; m < mips + MIP_SLOTS - 1; m++)
+			if (!m->key[CHN_IMAGE]) break;
+		mip_free(m);
+		memcpy(m->key, image->img, sizeof(chanlist));
+		m->w = image->width;
+		m->h = image->height;
+	}
+	if (m->ready >= lev) return;
+
+	/* Allocate new levels */
+	for (l = m->nlev; l < lev; l++)
+	{
+		i = MIP_TW(m, l + 1) * MIP_TH(m, l + 1);
+		if (!(m->dirty[l] = malloc(i))) break;
+		memset(m->dirty[l], 1, i);
+		m->nlev++;
+		sz = (size_t)MIP_W(m, l + 1) * MIP_H(m, l + 1);
+		for (i = 0; i < NUM_CHANNELS; i++)
+		{
+			if (!image->img[i]) continue;
+			if (!(m->img[l][i] = malloc(i == CHN_IMAGE ? sz * 3 : sz)))
+				break;
+		}
+		if (i < NUM_CHANNELS) break;
+	}
+
+	/* Update changed tiles, level by level */
+	ms.m = m;
+	for (i = 0; (i < lev) && (l >= lev); i++)
+	{
+		ms.l = i;
+		tdata = talloc(MA_ALIGN_DEFAULT, image_threads(MIP_W(m, i + 1),
+			MIP_H(m, i + 1)), &ms, sizeof(ms), NULL, NULL);
+		if (!tdata) break;
+		tdata->silent = TRUE;
+		launch_threads(do_mip_rows, tdata, NULL, MIP_TH(m, i + 1));
+		free(tdata);
+	}
+	if (i < lev) mip_free(m); // Out of memory
+	else m->ready = lev;
+}
+
+/* Prepare mipmaps for rendering layers lr0 to lr1 */
+void mip_prepare(int zoom, int lr0, int lr1, int view)
+{
+	layer_node *t;
+	int l;
+
+	if (!mip_zoom_level(zoom)) return;
+	for (l = lr0; l <= lr1; l++)
+	{
+		t = (view ? layer_table : layer_table_p) + l;
+		if (!t->visible && (view || (l != layer_selected))) continue;
+		mip_update(l == layer_selected ? &mem_image :
+			&t->image->image_, zoom);
+	}
+}
+
+/* Get the mipmap level to render image at this zoom, adjusting zoom factor
+ * and row length to it; return 0 if none */
+int mip_get(image_info *image, int xpm, int *zoom, int *mw, chanlist res)
+{
+	mipmap *m;
+	int l = mip_zoom_level(*zoom);
+
+	if (!l || !mip_usable(image, xpm) ||
+		!(m = mip_find(image->img, image->width, image->height)) ||
+		(m->ready < l)) return (0);
+	memcpy(res, m->img[l - 1], sizeof(chanlist));
+	*zoom >>= l;
+	*mw = MIP_W(m, l);
+	return (l);
+}
+
+/* Mark image area as changed; whole image if w is 0, all images if NULL */
+void mip_dirty(image_info *image, int x, int y, int w, int h)
+{
+	mipmap *m;
+	int i, j, l, x1, y1, tw, ts;
+
+	for (m = mips; m < mips + MIP_SLOTS; m++)
+	{
+		if (!m->key[CHN_IMAGE] || (image &&
+			memcmp(m->key, image->img, sizeof(chanlist)))) continue;
+		m->ready = 0;
+		for (l = 0; l < m->nlev; l++)
+		{
+			tw = MIP_TW(m, l + 1);
+			if (!w)
+			{
+				memset(m->dirty[l], 1, tw * MIP_TH(m, l + 1));
+				continue;
+			}
+			ts = MIP_TILE << (l + 1); // Tile size in image pixels
+			x1 = (x + w - 1) / ts;
+			if (x1 >= tw) x1 = tw - 1;
+			y1 = (y + h - 1) / ts;
+			if (y1 >= MIP_TH(m, l + 1)) y1 = MIP_TH(m, l + 1) - 1;
+			for (j = y < 0 ? 0 : y / ts; j <= y1; j++)
+				for (i = x < 0 ? 0 : x / ts; i <= x1; i++)
+					m->dirty[l][j * tw + i] = 1;
+		}
+	}
+}
+
+/* Forget mipmaps of images no longer there, and mark the rest as changed */
+void mip_flush()
+{
+	mipmap *m;
+	int l;
+
+	for (m = mips; m < mips + MIP_SLOTS; m++)
+	{
+		if (!m->key[CHN_IMAGE]) continue;
+		for (l = 0; l <= layers_total; l++)
+			if (!memcmp(m->key, l == layer_selected ? mem_img :
+				layer_table[l].image->image_.img,
+				sizeof(chanlist))) break;
+		if (l > layers_total) mip_free(m);
+	}
+	mip_dirty(NULL, 0, 0, 0, 0);
+}
+
 typedef struct {
 	int rgb_s;		// For when need RGB with 1bpp channel
 	int mask_s;		// For most everything
@@ -2453,7 +2833,7 @@ typedef struct {
 	main_render_state r;
 	paste_render_state p;
 	render_mem_req m;
-	int tflag, xflag, gflag, pflag, lr;
+	int tflag, xflag, gflag, pflag, lr, lc;
 	int pw;
 	int cxy[4];
 	unsigned char *rgb, *irgb;
@@ -2520,8 +2900,10 @@ static void main_render(u_render_state *u, int py, int ph)
 	main_render_state r = u->r;
 	grad_render_state grstate;
 	renderstate rs;
-	unsigned char *rgb, **tlist = r.tlist, *overlay = u->m.overlay;
-	int j, jj, j0, l, pw2, pw;
+	chanlist mimg;
+	unsigned char *rgb, **tlist = r.tlist, **img = mem_img;
+	unsigned char *overlay = u->m.overlay;
+	int j, jj, j0, l, pw2, pw, zoom = r.zoom, mw = mem_width, lev = 0;
 
 	/* ****** Init phase ****** */
 
@@ -2550,9 +2932,13 @@ static void main_render(u_render_state *u, int py, int ph)
 	/* Paste preview */
 	if (u->pflag) init_paste_render(&u->m, &u->p, &r);
 
+	/* Use mipmap if only the image itself is shown */
+	if (!(u->tflag | u->xflag | u->gflag | u->pflag) && !overlay &&
+		(lev = mip_get(&mem_image, r.xpm, &zoom, &mw, mimg))) img = mimg;
+
 	/* Start rendering */
 	pw2 = r.rxy[2] - r.rxy[0];
-	setup_row(&rs, r.rxy[0], pw2, r.zoom, r.scale, mem_width, r.xpm, r.lop,
+	setup_row(&rs, r.rxy[0], pw2, zoom, r.scale, mw, r.xpm, r.lop,
 		u->gflag && grstate.rgb ? 3 : mem_img_bpp, mem_pal);
 	rs.cmask = (hide_image ? CMASK_IMAGE : 0) |
 		(channel_dis[CHN_ALPHA] ? CMASK_ALPHA : 0) |
@@ -2621,8 +3007,8 @@ static void main_render(u_render_state *u, int py, int ph)
 			memcpy(rgb, rgb - pw, pw2);
 			continue;
 		}
-		render_row(&rs, rgb, mem_img, r.dx, j, tlist);
-		if (!overlay) overlay_row(&rs, rgb, mem_img, r.dx, j, tlist);
+		render_row(&rs, rgb, img, r.dx >> lev, j >> lev, tlist);
+		if (!overlay) overlay_row(&rs, rgb, img, r.dx >> lev, j >> lev, tlist);
 		else overlay_preview(&rs, rgb, overlay, csel_preview, csel_preview_a);
 	}
 }
@@ -3050,6 +3436,275 @@ void prepare_line_clip(int *lxy, int *vxy, int scale)
 		lxy[i] = floor_div(vxy[i] - margin_main_xy[i & 1] - (i >> 1), scale);
 }
 
+/// LAYER COMPOSITES CACHE
+
+/* With layers shown, the layers below the current one are kept composited
+ * together, and the layers above it too, in screen-space tiles at current
+ * zoom; so repainting the canvas while editing a layer only needs to copy the
+ * one, render the layer, and blend the other, however many layers there are.
+ * The layers above are rendered over black and over white; from these two,
+ * both their colour and their opacity per channel can be had */
+
+#define LC_TILE 128	/* Tile size in screen pixels */
+#define LC_HASH 256	/* Hash table size, power of 2 */
+
+typedef struct lc_tile {
+	struct lc_tile *next;	// Hash chain
+	int x, y;		// Position in tiles
+	unsigned int stamp;	// Last use
+	unsigned char below[LC_TILE * LC_TILE * 3]; // Composite over backdrop
+	unsigned char above0[LC_TILE * LC_TILE * 3]; // Composite over black
+	unsigned char above1[LC_TILE * LC_TILE * 3]; // Composite over white
+} lc_tile;
+
+/* What the composites depend on, besides pixels */
+typedef struct {
+	int zoom, scale, lr, lrs, bkg, ovl;
+	struct {
+		unsigned char *img, *alpha;
+		int x, y, opacity, visible, w, h, bpp, trans;
+	} l[MAX_LAYERS + 1];
+} lc_keys;
+
+int lcache_mb;	// Memory limit for tiles, in megabytes
+
+static lc_tile *lc_hash[LC_HASH];
+static lc_keys lc_key;
+static unsigned int lc_stamp;
+static int lc_count;
+
+#define LC_HASHV(X,Y) (((X) * 31 + (Y) * 1021) & (LC_HASH - 1))
+
+static lc_tile *lcache_find(int x, int y)
+{
+	lc_tile *t;
+
+	for (t = lc_hash[LC_HASHV(x, y)]; t; t = t->next)
+		if ((t->x == x) && (t->y == y)) break;
+	return (t);
+}
+
+/* Remove tiles in the rectangle (in tiles), or the one tile, or all */
+static void lcache_drop(int *txy, lc_tile *tile)
+{
+	lc_tile *t, **tp;
+	int i;
+
+	for (i = 0; i < LC_HASH; i++)
+	{
+		tp = lc_hash + i;
+		while ((t = *tp))
+		{
+			if (tile ? t != tile : txy && ((t->x < txy[0]) ||
+				(t->x > txy[2]) || (t->y < txy[1]) ||
+				(t->y > txy[3])))
+			{
+				tp = &t->next;
+				continue;
+			}
+			*tp = t->next;
+			free(t);
+			lc_count--;
+		}
+	}
+}
+
+/* Forget all tiles */
+void lcache_flush()
+{
+	lcache_drop(NULL, NULL);
+	memset(&lc_key, 0, sizeof(lc_key));
+}
+
+/* Forget tiles under changed area of some other layer than current */
+void lcache_dirty(int x, int y, int w, int h)
+{
+	int txy[4], zoom = lc_key.zoom, scale = lc_key.scale;
+
+	if (!lc_count) return;
+	txy[0] = floor_div(floor_div(x * scale, zoom), LC_TILE);
+	txy[1] = floor_div(floor_div(y * scale, zoom), LC_TILE);
+	txy[2] = floor_div(floor_div((x + w) * scale - 1, zoom), LC_TILE);
+	txy[3] = floor_div(floor_div((y + h) * scale - 1, zoom), LC_TILE);
+	lcache_drop(txy, NULL);
+}
+
+size_t lcache_used()
+{
+	return (lc_count * sizeof(lc_tile));
+}
+
+static void lcache_keys(lc_keys *key, int zoom, int scale)
+{
+	layer_node *t = layer_table_p;
+	image_info *image;
+	int i;
+
+	memset(key, 0, sizeof(lc_keys));
+	key->zoom = zoom;
+	key->scale = scale;
+	key->lr = layer_selected;
+	key->lrs = layers_total;
+	key->bkg = mem_background;
+	key->ovl = overlay_alpha;
+	for (i = 0; i <= layers_total; i++ , t++)
+	{
+		key->l[i].x = t->x;
+		key->l[i].y = t->y;
+		if (i == layer_selected) continue; // Only position matters
+		image = &t->image->image_;
+		key->l[i].img = image->img[CHN_IMAGE];
+		key->l[i].alpha = image->img[CHN_ALPHA];
+		key->l[i].opacity = t->opacity;
+		key->l[i].visible = t->visible;
+		key->l[i].w = image->width;
+		key->l[i].h = image->height;
+		key->l[i].bpp = image->bpp;
+		key->l[i].trans = image->trans;
+	}
+}
+
+/* Have composites for the canvas area all in cache; return FALSE if cannot */
+static int lcache_prepare(int *cxy, int zoom, int scale)
+{
+	static lc_keys key;
+	lc_tile *t, *old;
+	unsigned char *buf, *src;
+	size_t sz, max = ((size_t)lcache_mb << 20) / sizeof(lc_tile);
+	int txy[4], bxy[4] = { INT_MAX, INT_MAX, INT_MIN, INT_MIN };
+	int x, y, i, j, n, w, h, res = FALSE;
+
+	lcache_keys(&key, zoom, scale);
+	if (memcmp(&key, &lc_key, sizeof(key)))
+	{
+		lcache_drop(NULL, NULL);
+		lc_key = key;
+	}
+
+	txy[0] = floor_div(cxy[0], LC_TILE);
+	txy[1] = floor_div(cxy[1], LC_TILE);
+	txy[2] = floor_div(cxy[2] - 1, LC_TILE);
+	txy[3] = floor_div(cxy[3] - 1, LC_TILE);
+	if ((size_t)(txy[2] - txy[0] + 1) * (txy[3] - txy[1] + 1) > max)
+		return (FALSE); // Not enough room
+
+	/* Find which tiles are missing */
+	lc_stamp++;
+	for (n = 0 , y = txy[1]; y <= txy[3]; y++)
+	for (x = txy[0]; x <= txy[2]; x++)
+	{
+		if ((t = lcache_find(x, y)))
+		{
+			t->stamp = lc_stamp;
+			continue;
+		}
+		n++;
+		if (bxy[0] > x) bxy[0] = x;
+		if (bxy[1] > y) bxy[1] = y;
+		if (bxy[2] < x) bxy[2] = x;
+		if (bxy[3] < y) bxy[3] = y;
+	}
+	if (!n) return (TRUE);
+
+	/* Evict the oldest tiles not needed now */
+	while (lc_count + n > max)
+	{
+		old = NULL;
+		for (i = 0; i < LC_HASH; i++)
+			for (t = lc_hash[i]; t; t = t->next)
+				if ((t->stamp != lc_stamp) && (!old ||
+					(lc_stamp - t->stamp > lc_stamp - old->stamp)))
+					old = t;
+		if (!old) break; // Paranoia
+		lcache_drop(NULL, old);
+	}
+
+	/* Render the area with missing tiles */
+	w = (bxy[2] - bxy[0] + 1) * LC_TILE;
+	h = (bxy[3] - bxy[1] + 1) * LC_TILE;
+	sz = (size_t)w * h * 3;
+	if (!(buf = malloc(sz * 3))) return (FALSE);
+	bxy[0] *= LC_TILE;
+	bxy[1] *= LC_TILE;
+	bxy[2] = bxy[0] + w;
+	bxy[3] = bxy[1] + h;
+	memset(buf, mem_background, sz);
+	memset(buf + sz, 0, sz);
+	memset(buf + sz * 2, 255, sz);
+	if (layer_selected) render_layers_mt(buf, bxy, w * 3, zoom, scale,
+		0, layer_selected - 1, FALSE);
+	if (layer_selected < layers_total)
+	{
+		render_layers_mt(buf + sz, bxy, w * 3, zoom, scale,
+			layer_selected + 1, layers_total, FALSE);
+		render_layers_mt(buf + sz * 2, bxy, w * 3, zoom, scale,
+			layer_selected + 1, layers_total, FALSE);
+	}
+
+	/* Store the tiles */
+	for (y = txy[1]; y <= txy[3]; y++)
+	for (x = txy[0]; x <= txy[2]; x++)
+	{
+		if (lcache_find(x, y)) continue;
+		if (!(t = malloc(sizeof(lc_tile)))) goto fail;
+		t->x = x;
+		t->y = y;
+		t->stamp = lc_stamp;
+		t->next = lc_hash[i = LC_HASHV(x, y)];
+		lc_hash[i] = t;
+		lc_count++;
+		src = buf + ((y * LC_TILE - bxy[1]) * w + x * LC_TILE - bxy[0]) * 3;
+		for (j = 0; j < LC_TILE * LC_TILE * 3; j += LC_TILE * 3)
+		{
+			memcpy(t->below + j, src, LC_TILE * 3);
+			memcpy(t->above0 + j, src + sz, LC_TILE * 3);
+			memcpy(t->above1 + j, src + sz * 2, LC_TILE * 3);
+			src += w * 3;
+		}
+	}
+	res = TRUE;
+fail:	free(buf);
+	return (res);
+}
+
+/* Copy composite of layers below into canvas area, or blend the one of layers
+ * above over it */
+static void lcache_put(unsigned char *rgb, int *cxy, int pw, int above)
+{
+	lc_tile *t;
+	unsigned char *dest, *s0, *s1;
+	int x, y, i, j, k, l, bxy[4];
+
+	if (above ? layer_selected >= layers_total : !layer_selected) return;
+	for (y = floor_div(cxy[1], LC_TILE); y * LC_TILE < cxy[3]; y++)
+	for (x = floor_div(cxy[0], LC_TILE); x * LC_TILE < cxy[2]; x++)
+	{
+		t = lcache_find(x, y);
+		clip(bxy, x * LC_TILE, y * LC_TILE, (x + 1) * LC_TILE,
+			(y + 1) * LC_TILE, cxy);
+		l = (bxy[2] - bxy[0]) * 3;
+		i = ((bxy[1] - y * LC_TILE) * LC_TILE + bxy[0] - x * LC_TILE) * 3;
+		dest = rgb + (bxy[1] - cxy[1]) * pw + (bxy[0] - cxy[0]) * 3;
+		for (j = bxy[1]; j < bxy[3]; j++ , i += LC_TILE * 3 , dest += pw)
+		{
+			if (!above)
+			{
+				memcpy(dest, t->below + i, l);
+				continue;
+			}
+			/* Over black, colour is premultiplied by opacity; over
+			 * white, the difference is what shows through */
+			s0 = t->above0 + i;
+			s1 = t->above1 + i;
+			for (k = 0; k < l; k++)
+			{
+				int v = (s1[k] - s0[k]) * dest[k];
+				dest[k] = s0[k] + ((v + (v >> 8) + 1) >> 8);
+			}
+		}
+	}
+}
+
 static void canvas_render(u_render_state *u, int py, int ph)
 {
 	int cxy[4], rxy[4], pw = u->pw;
@@ -3061,7 +3716,8 @@ static void canvas_render(u_render_state *u, int py, int ph)
 		copy4(cxy, u->cxy);
 		rgb = u->rgb + (py - cxy[1]) * pw;
 		cxy[3] = (cxy[1] = py) + ph;
-		render_layers(rgb, cxy, pw, u->r.zoom, u->r.scale,
+		if (u->lc) lcache_put(rgb, cxy, pw, FALSE);
+		else render_layers(rgb, cxy, pw, u->r.zoom, u->r.scale,
 			0, layer_selected - 1, FALSE);
 	}
 
@@ -3070,7 +3726,9 @@ static void canvas_render(u_render_state *u, int py, int ph)
 		main_render(u, rxy[1], rxy[3] - rxy[1]);
 
 	/* Render overlying layers */
-	if (u->lr) render_layers(rgb, cxy, pw, u->r.zoom, u->r.scale,
+	if (!u->lr);
+	else if (u->lc) lcache_put(rgb, cxy, pw, TRUE);
+	else render_layers(rgb, cxy, pw, u->r.zoom, u->r.scale,
 		layer_selected + 1, layers_total, FALSE);
 }
 
@@ -3094,13 +3752,248 @@ static void do_canvas_render(tcb *thread)
 
 int kpix_threads;	// Min kpixels per render thread
 
+/// CANVAS CACHE
+
+/* Rendered image is kept in screen-space tiles for a few last used zoom
+ * factors, so that scrolling, zooming back and forth, and repainting under
+ * marquee and such need not redo the compositing; tiles are dropped when
+ * the image area under them changes */
+
+#define CC_TILE 128	/* Tile size in screen pixels */
+#define CC_ZOOMS 3	/* Zoom factors to keep */
+#define CC_HASH 1024	/* Hash table size, power of 2 */
+#define CC_MAX (96 * 1024 * 1024) /* Memory limit for tiles */
+
+typedef struct cc_tile {
+	struct cc_tile *next;	// Hash chain
+	int x, y, z;		// Position in tiles, zoom slot
+	unsigned int stamp;	// Last use
+	unsigned char rgb[CC_TILE * CC_TILE * 3];
+} cc_tile;
+
+static cc_tile *cc_hash[CC_HASH];
+static struct {
+	int zoom, scale;
+	unsigned int stamp;
+} cc_zooms[CC_ZOOMS];
+static unsigned int cc_stamp;
+static int cc_count, cc_filling;
+
+#define CC_HASHV(X,Y,Z) (((X) * 31 + (Y) * 1021 + (Z)) & (CC_HASH - 1))
+
+static cc_tile *ccache_find(int x, int y, int z)
+{
+	cc_tile *t;
+
+	for (t = cc_hash[CC_HASHV(x, y, z)]; t; t = t->next)
+		if ((t->x == x) && (t->y == y) && (t->z == z)) break;
+	return (t);
+}
+
+/* Remove tiles which satisfy the condition */
+#define CC_DROP(COND) \
+	for (i = 0; i < CC_HASH; i++) \
+	{ \
+		cc_tile **tp = cc_hash + i; \
+		while ((t = *tp)) \
+		{ \
+			if (!(COND)) { tp = &t->next; continue; } \
+			*tp = t->next; \
+			free(t); \
+			cc_count--; \
+		} \
+	}
+
+/* Get a new tile, evicting the oldest one if at limit */
+static cc_tile *ccache_new(int x, int y, int z)
+{
+	cc_tile *t, *old = NULL;
+	unsigned int s = 0;
+	int i;
+
+	if ((t = ccache_find(x, y, z))) return (t);
+	if (cc_count >= CC_MAX / sizeof(cc_tile))
+	{
+		for (i = 0; i < CC_HASH; i++)
+			for (t = cc_hash[i]; t; t = t->next)
+				if (!old || (cc_stamp - t->stamp > s))
+					s = cc_stamp - (old = t)->stamp;
+		CC_DROP(t == old);
+	}
+	if (!(t = malloc(sizeof(cc_tile)))) return (NULL);
+	t->x = x;
+	t->y = y;
+	t->z = z;
+	t->next = cc_hash[i = CC_HASHV(x, y, z)];
+	cc_hash[i] = t;
+	cc_count++;
+	return (t);
+}
+
+/* Get the slot for zoom factor, reusing the oldest one if needed */
+static int ccache_zoom(int zoom, int scale)
+{
+	cc_tile *t;
+	int i, z = 0;
+
+	for (i = 0; i < CC_ZOOMS; i++)
+	{
+		if ((cc_zooms[i].zoom == zoom) && (cc_zooms[i].scale == scale))
+			break;
+		if (cc_stamp - cc_zooms[i].stamp > cc_stamp - cc_zooms[z].stamp)
+			z = i;
+	}
+	if (i >= CC_ZOOMS) /* Drop the oldest one */
+	{
+		CC_DROP(t->z == z);
+		cc_zooms[i = z].zoom = zoom;
+		cc_zooms[i].scale = scale;
+	}
+	cc_zooms[i].stamp = ++cc_stamp;
+	return (i);
+}
+
+/* Forget all tiles */
+void ccache_flush()
+{
+	cc_tile *t;
+	int i;
+
+	CC_DROP(TRUE);
+	memset(cc_zooms, 0, sizeof(cc_zooms));
+	lcache_flush();
+}
+
+/* Forget tiles under changed image area */
+static void ccache_dirty(int x, int y, int w, int h)
+{
+	cc_tile *t;
+	int i, z, zoom, scale, txy[CC_ZOOMS][4];
+
+	if (!cc_count) return;
+	for (z = 0; z < CC_ZOOMS; z++)
+	{
+		if (!(zoom = cc_zooms[z].zoom)) continue;
+		scale = cc_zooms[z].scale;
+		txy[z][0] = floor_div(floor_div(x * scale, zoom), CC_TILE);
+		txy[z][1] = floor_div(floor_div(y * scale, zoom), CC_TILE);
+		txy[z][2] = floor_div(floor_div((x + w) * scale - 1, zoom), CC_TILE);
+		txy[z][3] = floor_div(floor_div((y + h) * scale - 1, zoom), CC_TILE);
+	}
+	CC_DROP((t->x >= txy[t->z][0]) && (t->x <= txy[t->z][2]) &&
+		(t->y >= txy[t->z][1]) && (t->y <= txy[t->z][3]));
+}
+
+/* Cache is only for the image, not for previews of things being done */
+static int ccache_usable(u_render_state *u)
+{
+	return (!(u->tflag | u->xflag | u->gflag | u->pflag) &&
+		!u->m.overlay_s && !(bkg_flag && bkg_rgb));
+}
+
+static int paint_canvas(void *dt, void **wdata, int what, void **where,
+	rgbcontext *ctx);
+
+/* Fill canvas area from cache, rendering the missing tiles; return FALSE
+ * if failed to */
+static int ccache_paint(rgbcontext *ctx, int zoom, int scale)
+{
+	rgbcontext tc;
+	cc_tile *t;
+	unsigned char *src, *dest;
+	int cnv[4] = { 0, 0 }, cxy[4], rxy[4];
+	int bxy[4] = { INT_MAX, INT_MAX, INT_MIN, INT_MIN };
+	int i, j, x, y, w, h, z, l, tw;
+
+	xy_origin(rxy, ctx->xy, margin_main_x, margin_main_y);
+	canvas_size(cnv + 2, cnv + 3);
+	if (!clip(cxy, rxy[0], rxy[1], rxy[2], rxy[3], cnv)) return (TRUE);
+	z = ccache_zoom(zoom, scale);
+
+	/* Find which tiles are missing */
+	rxy[0] = cxy[0] / CC_TILE;
+	rxy[1] = cxy[1] / CC_TILE;
+	rxy[2] = (cxy[2] - 1) / CC_TILE;
+	rxy[3] = (cxy[3] - 1) / CC_TILE;
+	for (y = rxy[1]; y <= rxy[3]; y++)
+	for (x = rxy[0]; x <= rxy[2]; x++)
+	{
+		if (ccache_find(x, y, z)) continue;
+		if (bxy[0] > x) bxy[0] = x;
+		if (bxy[1] > y) bxy[1] = y;
+		if (bxy[2] < x) bxy[2] = x;
+		if (bxy[3] < y) bxy[3] = y;
+	}
+
+	if (bxy[0] <= bxy[2])
+	{
+		/* Render a margin around big areas, for scrolling into */
+		i = (bxy[2] > bxy[0]) && (bxy[3] > bxy[1]);
+		clip(tc.xy, (bxy[0] - i) * CC_TILE, (bxy[1] - i) * CC_TILE,
+			(bxy[2] + 1 + i) * CC_TILE, (bxy[3] + 1 + i) * CC_TILE,
+			cnv);
+		bxy[0] = tc.xy[0] / CC_TILE;
+		bxy[1] = tc.xy[1] / CC_TILE;
+		bxy[2] = (tc.xy[2] - 1) / CC_TILE + 1;
+		bxy[3] = (tc.xy[3] - 1) / CC_TILE + 1;
+		w = tc.xy[2] - tc.xy[0];
+		h = tc.xy[3] - tc.xy[1];
+		for (i = 0; i < 4; i++) tc.xy[i] += margin_main_xy[i & 1];
+		if (!(tc.rgb = malloc((size_t)w * h * 3))) return (FALSE);
+
+		cc_filling = TRUE;
+		paint_canvas(NULL, NULL, 0, NULL, &tc);
+		cc_filling = FALSE;
+
+		/* Store the tiles */
+		for (y = bxy[1]; y < bxy[3]; y++)
+		for (x = bxy[0]; x < bxy[2]; x++)
+		{
+			if (!(t = ccache_new(x, y, z))) continue;
+			i = x * CC_TILE + margin_main_x - tc.xy[0];
+			j = y * CC_TILE + margin_main_y - tc.xy[1];
+			l = (w - i < CC_TILE ? w - i : CC_TILE) * 3;
+			h = tc.xy[3] - tc.xy[1] - j;
+			if (h > CC_TILE) h = CC_TILE;
+			src = tc.rgb + (j * w + i) * 3;
+			for (dest = t->rgb; h-- > 0; dest += CC_TILE * 3 , src += w * 3)
+				memcpy(dest, src, l);
+		}
+		free(tc.rgb);
+	}
+
+	/* Check that all tiles are there - can fail only if out of memory */
+	for (y = rxy[1]; y <= rxy[3]; y++)
+	for (x = rxy[0]; x <= rxy[2]; x++)
+		if (!ccache_find(x, y, z)) return (FALSE);
+
+	/* Copy to the canvas */
+	tw = (ctx->xy[2] - ctx->xy[0]) * 3;
+	for (y = rxy[1]; y <= rxy[3]; y++)
+	for (x = rxy[0]; x <= rxy[2]; x++)
+	{
+		t = ccache_find(x, y, z);
+		t->stamp = cc_stamp;
+		clip(bxy, x * CC_TILE, y * CC_TILE, (x + 1) * CC_TILE,
+			(y + 1) * CC_TILE, cxy);
+		l = (bxy[2] - bxy[0]) * 3;
+		src = t->rgb + ((bxy[1] - y * CC_TILE) * CC_TILE +
+			bxy[0] - x * CC_TILE) * 3;
+		dest = ctx->rgb + (bxy[1] + margin_main_y - ctx->xy[1]) * tw +
+			(bxy[0] + margin_main_x - ctx->xy[0]) * 3;
+		for (h = bxy[3] - bxy[1]; h-- > 0; src += CC_TILE * 3 , dest += tw)
+			memcpy(dest, src, l);
+	}
+	return (TRUE);
+}
+
 static int paint_canvas(void *dt, void **wdata, int what, void **where,
 	rgbcontext *ctx)
 {
 	u_render_state u;
 	unsigned char *irgb, *rgb = ctx->rgb;
 	int rect[4], vxy[4];
-	int i, px, py, pw, ph, zoom = 1, scale = 1, paste_f = FALSE;
+	int i, px, py, pw, ph, zoom = 1, scale = 1, paste_f = FALSE, cached = FALSE;
 
 	pw = ctx->xy[2] - (px = ctx->xy[0]);
 	ph = ctx->xy[3] - (py = ctx->xy[1]);
@@ -3124,6 +4017,10 @@ static int paint_canvas(void *dt, void **wdata, int what, void **where,
 
 	u.lr = layers_total && show_layers_main;
 
+	/* Update mipmaps before render threads need them */
+	if (zoom > 1) mip_prepare(zoom, u.lr ? 0 : layer_selected,
+		u.lr ? layers_total : layer_selected, FALSE);
+
 	/* Set up image for renderer */
 	if (irgb)
 	{
@@ -3132,7 +4029,12 @@ static int paint_canvas(void *dt, void **wdata, int what, void **where,
 		paste_f = u.pflag;
 	}
 
-	if (bkg_flag && bkg_rgb) async_bk = render_bkg(ctx); /* Tracing image */
+	/* Take the image from cache if possible */
+	if (!cc_filling && ccache_usable(&u))
+		cached = ccache_paint(ctx, zoom, scale);
+
+	if (cached); /* Already done */
+	else if (bkg_flag && bkg_rgb) async_bk = render_bkg(ctx); /* Tracing image */
 	else if (!u.lr) /* Render default background if no layers shown */
 	{
 		if (irgb && ((mem_xpm_trans >= 0) ||
@@ -3141,7 +4043,11 @@ static int paint_canvas(void *dt, void **wdata, int what, void **where,
 				rect[2] - rect[0], rect[3] - rect[1], pw * 3);
 	}
 
-	while (irgb || u.lr)
+	/* Take composites of other layers from cache if possible */
+	if (!cached && u.lr && !(bkg_flag && bkg_rgb) && lcache_mb)
+		u.lc = lcache_prepare(u.cxy, zoom, scale);
+
+	while (!cached && (irgb || u.lr))
 	{
 #ifdef U_THREADS
 		int nt, nt2, pww = 0, wh = 0;
@@ -3221,6 +4127,13 @@ static int paint_canvas(void *dt, void **wdata, int what, void **where,
 		break;
 	}
 
+	/* Only the image is wanted for cache */
+	if (cc_filling)
+	{
+		async_bk = FALSE;
+		return (TRUE);
+	}
+
 	/* No grid at all */
 	if (!mem_show_grid || (scale < mem_grid_min));
 	/* No paste - single area */
@@ -3298,16 +4211,18 @@ void main_update_area(int x, int y, int w, int h)
 {
 	int zoom, scale, rxy[4];
 
+	/* Cached render of the area is no longer valid */
+	ccache_dirty(x, y, w, h);
+
 	if (can_zoom < 1.0)
 	{
 		zoom = rint(1.0 / can_zoom);
-		w += x;
-		h += y;
-		x = floor_div(x + zoom - 1, zoom);
-		y = floor_div(y + zoom - 1, zoom);
-		w = (w - x * zoom + zoom - 1) / zoom;
-		h = (h - y * zoom + zoom - 1) / zoom;
-		if ((w <= 0) || (h <= 0)) return;
+		/* With mipmaps, any pixel can be visible, not only every Nth */
+		w = floor_div(x + w - 1, zoom) + 1;
+		h = floor_div(y + h - 1, zoom) + 1;
+		x = floor_div(x, zoom);
+		y = floor_div(y, zoom);
+		if (((w -= x) <= 0) || ((h -= y) <= 0)) return;
 	}
 	else
 	{
@@ -3596,7 +4511,8 @@ static void parse_drag(main_dd *dt, void **wdata, int what, void **where,
 		reseparate(fname);
 #endif
 		j = detect_image_format(fname);
-		if ((j > 0) && (j != FT_NONE) && (j != FT_LAYERS1))
+		if ((j > 0) && (j != FT_NONE) && (j != FT_LAYERS1) &&
+			(j != FT_LAYERS2))
 		{
 			if (!nlayer || layer_add(0, 0, 1, 0, mem_pal_def, 0))
 				nlayer = load_image(fname, FS_LAYER_LOAD, j) == 1;
@@ -313,6 +313,7 @@ extern char mem_clip_file[];
 extern void *scriptbar_code[];		// Set up scriptable items for tools toolbar
 
 int kpix_threads;			// Min kpixels per render thread
+int lcache_mb;				// Max MB for cached layer composites
 
 /* With 2 cores and uniform layers stack, no noticeable difference between
  * 1, 4 and 8 strips per thread; time jitter of about 10% is common, and spikes
@@ -357,6 +358,23 @@ void setup_row(renderstate *r, int x0, int width, int zoom, int scale, int mw,
 void render_row(renderstate *r, unsigned char *rgb, chanlist base_img,
 	int x, int y, chanlist xtra_img);
 
+//	Prepare mipmaps for rendering layers at this zoom
+void mip_prepare(int zoom, int lr0, int lr1, int view);
+//	Get mipmap channels for image, adjusting zoom & row length; 0 if none
+int mip_get(image_info *image, int xpm, int *zoom, int *mw, chanlist res);
+//	Mark image area as changed; whole image if w = 0, all images if NULL
+void mip_dirty(image_info *image, int x, int y, int w, int h);
+//	Forget mipmaps of deleted images, mark all others as changed
+void mip_flush();
+//	Forget all cached canvas tiles, and layer composites
+void ccache_flush();
+//	Forget all cached layer composites
+void lcache_flush();
+//	Forget layer composites under changed area of a not current layer
+void lcache_dirty(int x, int y, int w, int h);
+//	Memory used by cached layer composites
+size_t lcache_used();
+
 void stop_line();
 void change_to_tool(int icon);
 
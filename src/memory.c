@@ -17,6 +17,8 @@
 	along with mtPaint in the file COPYING.
 */
 
+#include <zlib.h>
+
 #include "global.h"
 #undef _
 #define _(X) X
@@ -37,6 +39,8 @@
 #include "viewer.h"
 #include "csel.h"
 #include "thread.h"
+#include "spawn.h"
+#include "simd.h"
 
 
 grad_info gradient[NUM_CHANNELS];	// Per-channel gradients
@@ -88,6 +92,7 @@ int quan_sqrt;	// "Diameter based weighting" - use sqrt of pixel count
 /// IMAGE
 
 int mem_undo_depth = DEF_UNDO;		// Current undo depth
+static unsigned int undo_gen;		// Counts changes to undo state
 image_info mem_image;			// Current image
 image_info mem_clip;			// Current clipboard
 image_state mem_state;			// Current edit settings
@@ -112,9 +117,14 @@ transform_state mem_bcsp[2];
 #define UF_SIZED 0x04
 #define UF_ORIG  0x08 /* Unmodified state */
 #define UF_ACCUM 0x10 /* Cumulative */
+#define UF_PACKED  0x20 /* Channels compressed */
+#define UF_PACKING 0x40 /* Queued for compression */
+#define UF_NOPACK  0x80 /* Not worth compressing */
+#define UF_SPILLED 0x100 /* Packed channels moved to disk */
 
 int mem_undo_limit;		// Max MB memory allocation limit
 int mem_undo_common;		// Percent of undo space in common arena
+int mem_undo_spill;		// Max MB disk space for undo
 int mem_undo_opacity;		// Use previous image for opacity calculations?
 
 int mem_undo_fail;		// Undo space shortfall
@@ -759,6 +769,43 @@ void mem_file_modified(char *fname)
 	}
 }
 
+/* Running total of sized frames' memory, in the undo stack it was counted for;
+ * kept up to date as frames get sized, packed, spilled or freed */
+static undo_item **undo_used_at;
+static size_t undo_used;
+
+/* Set frame's size, updating the running total if the frame is counted */
+static void undo_set_size(undo_item **items, undo_item *undo, size_t size)
+{
+	if (items == undo_used_at) undo_used += size -
+		(undo->flags & UF_SIZED ? undo->size : 0);
+	undo->size = size;
+	undo->flags |= UF_SIZED;
+}
+
+/* Mark frame's size as no longer valid */
+static void undo_unsize(undo_item **items, undo_item *undo)
+{
+	if (!undo || !(undo->flags & UF_SIZED)) return;
+	if (items == undo_used_at) undo_used -= undo->size;
+	undo->flags &= ~UF_SIZED;
+}
+
+/* Size of a frame holding unpacked, untiled channels */
+static size_t undo_flat_size(undo_item *undo)
+{
+	size_t k = (size_t)undo->width * undo->height, l = 0;
+	int j, bpp = undo->bpp;
+
+	for (j = 0; j < NUM_CHANNELS; j++ , bpp = 1)
+	{
+		if (undo->img[j] && (undo->img[j] != MEM_NONE))
+			l += k * bpp + 32;
+	}
+	if (undo->pal_) l += SIZEOF_PALETTE + 32;
+	return (l);
+}
+
 /* Create new undo stack of a given depth, and put default frame onto it */
 int init_undo(undo_stack *ustack, int depth)
 {
@@ -784,6 +831,7 @@ void update_undo(image_info *image)
 	if (!undo->pal_) undo->pal_ = malloc(SIZEOF_PALETTE);
 	mem_pal_copy(undo->pal_, image->pal);
 
+	undo_unsize(image->undo_.items, undo);
 	memcpy(undo->img, image->img, sizeof(chanlist));
 	undo->dataptr = NULL;
 	undo->cols = image->cols;
@@ -805,12 +853,19 @@ void mem_free_chanlist(chanlist img)
 	}
 }
 
+static void undo_pack_drop(undo_item *undo);
+static void undo_pack_restack(undo_item **items, undo_item **nitems);
+static void undo_spill_drop(undo_item *undo);
+static int undo_unpack(undo_item *undo);
+
 static size_t undo_free_x(undo_item **undo_)
 {
 	undo_item *undo = *undo_;
 	size_t j;
 
 	if (!undo) return (0);
+	undo_pack_drop(undo);
+	undo_spill_drop(undo);
 	j = undo->size;
 	undo_free_data(undo);
 	free(undo->pal_);
@@ -861,6 +916,8 @@ static int resize_undo(undo_stack *ustack, int depth)
 		for (i = 0; i < udepth; i++)
 			undo_free_x(ustack->items + i);
 	}
+	undo_pack_restack(ustack->items, nstack.items);
+	if (ustack->items == undo_used_at) undo_used_at = NULL;
 	free(ustack->items);
 	*ustack = nstack;
 	return (TRUE);
@@ -888,6 +945,7 @@ void mem_free_image(image_info *image, int mode)
 {
 	int i, j = image->undo_.max, p = image->undo_.pointer;
 
+	undo_gen++;
 	/* Delete current image (don't rely on undo frame being up to date) */
 	if (mode & FREE_IMAGE)
 	{
@@ -905,6 +963,8 @@ void mem_free_image(image_info *image, int mode)
 	memset(image->undo_.items[p]->img, 0, sizeof(chanlist)); // Already freed
 	for (i = 0; i < j; i++) undo_free_x(image->undo_.items + i);
 
+	if (image->undo_.items == undo_used_at) undo_used_at = NULL;
+
 	/* Delete undo stack if finalizing */
 	if (mode & FREE_UNDO)
 	{
@@ -1066,6 +1126,8 @@ unsigned char *mem_undo_previous(int channel)
 	unsigned char *res;
 
 	undo = mem_undo_im_[(mem_undo_pointer ? mem_undo_pointer : mem_undo_max) - 1];
+	/* Tiled frames aren't usable anyway, so needn't be unpacked */
+	if (undo && !(undo->flags & UF_TILED) && !undo_unpack(undo)) undo = NULL;
 	if (!undo || !(res = undo->img[channel]) || (res == MEM_NONE) ||
 		(undo->flags & UF_TILED))
 		res = mem_img[channel];	// No usable undo so use current
@@ -1081,7 +1143,9 @@ static size_t lose_oldest(undo_stack *ustack)	// Lose the oldest undo image
 	else return (0);
 /* !!! mem_try_malloc() may call this on an unsized undo stack - but it
  * !!! doesn't need valid sizes anyway - WJ */
-	return (undo_free_x(ustack->items + (ustack->pointer + idx) % ustack->max));
+	idx = (ustack->pointer + idx) % ustack->max;
+	undo_unsize(ustack->items, ustack->items[idx]);
+	return (undo_free_x(ustack->items + idx));
 }
 
 /* Convert tile bitmap row into a set of spans (skip/copy), terminated by
@@ -1391,241 +1455,980 @@ static void mem_undo_tile(undo_item *undo)
 	}
 
 	if (undo->pal_) msize += SIZEOF_PALETTE + 32;
-	undo->size = msize;
-	undo->flags |= UF_SIZED;
+	undo_set_size(mem_undo_im_, undo, msize);
 }
 
-/* Compress last undo frame */
-void mem_undo_prepare()
+/* Undo frames which are done with tiling get their channels compressed, in a
+ * background thread when possible; the data is decompressed again before the
+ * frame is swapped in. Packed channels are split into independently deflated
+ * blocks, so that unpacking can be done by several threads at once */
+
+#define UNDO_PACK_BLOCK (1024 * 1024) /* Unpacked size of a block */
+#define UNDO_PACK_MIN   (256 * 1024) /* Smaller frames aren't worth the effort */
+#define UNDO_PACK_JOBS  8 /* How many frames can be queued at once */
+
+typedef struct {
+	size_t len;		// Unpacked length
+	size_t size;		// Packed length, with this header
+	int nblk;		// Number of blocks
+	unsigned int blen[1];	// Packed lengths of blocks
+} undo_pack;
+
+/* Size of packed channel header; packed blocks follow it */
+#define PACK_HDR(N) (offsetof(undo_pack, blen) + sizeof(unsigned int) * (N))
+
+/* Packing job states */
+enum {
+	PJ_FREE = 0,
+	PJ_QUEUED,
+	PJ_BUSY,
+	PJ_DONE,
+	PJ_FAIL
+};
+
+typedef struct {
+	undo_item *undo;		// Frame being packed
+	undo_item **items;		// Undo stack it is in
+	unsigned char *src[NUM_CHANNELS]; // Its unpacked channels
+	size_t len[NUM_CHANNELS];	// Lengths of these
+	undo_pack *res[NUM_CHANNELS];	// Packed channels
+	volatile int state, stop;
+} pack_job;
+
+static pack_job pack_jobs[UNDO_PACK_JOBS];
+static volatile int pack_worker;
+static int pack_timer;
+
+DEF_MUTEX(pack_lock);
+
+/* Calculate length of tiled channel data */
+static size_t undo_tiled_len(undo_item *undo, int bpp)
 {
-	undo_item *undo;
+	int spans[(MAX_WIDTH + TILE_SIZE - 1) / TILE_SIZE + 3];
+	unsigned char *tmap = undo->tileptr;
+	size_t l = 0;
+	int i, h, nw = ((undo->width + TILE_SIZE - 1) / TILE_SIZE + 7) >> 3;
 
-	if (!mem_undo_done) return;
-	undo = mem_undo_im_[(mem_undo_pointer ? mem_undo_pointer : mem_undo_max) - 1];
+	for (i = 0; i < undo->height; i += TILE_SIZE , tmap += nw)
+	{
+		h = undo->height - i;
+		if (h > TILE_SIZE) h = TILE_SIZE;
+		l += (size_t)mem_undo_spans(spans, tmap, undo->width, bpp) * h;
+	}
+	return (l);
+}
 
-	/* Already processed? */
-	if (undo->flags & (UF_TILED | UF_FLAT)) return;
+/* Size of frame's tilemap */
+static size_t undo_tilemap_size(undo_item *undo)
+{
+	return ((size_t)(((undo->width + TILE_SIZE - 1) / TILE_SIZE + 7) >> 3) *
+		((undo->height + TILE_SIZE - 1) / TILE_SIZE));
+}
 
-	/* Cull palette if unchanged */
-	if (undo->pal_ && !memcmp(undo->pal_, mem_pal, SIZEOF_PALETTE))
+/* Compress a channel; return NULL if failed or cancelled */
+static undo_pack *undo_pack_chan(z_stream *zs, unsigned char *src, size_t len,
+	volatile int *stop)
+{
+	undo_pack *res, *tmp;
+	unsigned char *dest;
+	size_t l, n, sz, bound;
+	int i, nblk = (len + UNDO_PACK_BLOCK - 1) / UNDO_PACK_BLOCK;
+
+	bound = deflateBound(zs, UNDO_PACK_BLOCK);
+	n = PACK_HDR(nblk);
+	sz = n + bound;
+	if (!(res = malloc(sz))) return (NULL);
+	res->len = len;
+	res->nblk = nblk;
+	for (i = 0; i < nblk; i++ , src += l , len -= l)
+	{
+		if (*stop) goto fail;
+		l = len > UNDO_PACK_BLOCK ? UNDO_PACK_BLOCK : len;
+		if (n + bound > sz) /* Extend the buffer */
+		{
+			sz = (n + bound) * 2;
+			if (!(tmp = realloc(res, sz))) goto fail;
+			res = tmp;
+		}
+		dest = (unsigned char *)res + n;
+		deflateReset(zs);
+		zs->next_in = src;
+		zs->avail_in = l;
+		zs->next_out = dest;
+		zs->avail_out = bound;
+		if (deflate(zs, Z_FINISH) != Z_STREAM_END) goto fail;
+		/* Store the block as is if it failed to compress */
+		if ((res->blen[i] = bound - zs->avail_out) >= l)
+			memcpy(dest, src, res->blen[i] = l);
+		n += res->blen[i];
+	}
+	/* Release the unused space */
+	if ((tmp = realloc(res, n))) res = tmp;
+	res->size = n;
+	return (res);
+
+fail:	free(res);
+	return (NULL);
+}
+
+/* Compress frame's channels, if it gains enough */
+static int undo_pack_run(pack_job *job)
+{
+	z_stream zs;
+	size_t l = 0, n = 0;
+	int i, res = TRUE;
+
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit(&zs, Z_BEST_SPEED) != Z_OK) return (FALSE);
+	for (i = 0; res && (i < NUM_CHANNELS); i++)
 	{
-		/* Free new block, reuse old */
-		free(mem_undo_im_[mem_undo_pointer]->pal_);
-		mem_undo_im_[mem_undo_pointer]->pal_ = undo->pal_;
-		undo->pal_ = NULL;
+		if (!job->src[i]) continue;
+		res = !!(job->res[i] = undo_pack_chan(&zs, job->src[i],
+			job->len[i], &job->stop));
+		if (res) l += job->len[i] , n += job->res[i]->size;
 	}
-	/* Tile image */
-	mem_undo_tile(undo);
+	deflateEnd(&zs);
+
+	/* Leave data alone if packing didn't free at least 1/8 of it */
+	if (res && (n > l - (l >> 3))) res = FALSE;
+	if (!res) for (i = 0; i < NUM_CHANNELS; i++)
+	{
+		free(job->res[i]);
+		job->res[i] = NULL;
+	}
+	return (res);
 }
 
-static size_t mem_undo_size(undo_stack *ustack)
+static void *undo_pack_worker(void *data)
 {
-	undo_item *undo;
-	size_t k, l, total = 0;
-	int i, j, bpp, umax = ustack->max;
+	pack_job *job;
+	int i;
 
-	for (i = 0; i < umax; i++)
+	while (TRUE)
 	{
-		/* Anything there? */
-		if (!(undo = ustack->items[i])) continue;
-		/* Not empty and not yet scanned */
-		if (undo->width && !(undo->flags & UF_SIZED))
+		LOCK_BG_MUTEX(pack_lock);
+		for (job = NULL , i = 0; i < UNDO_PACK_JOBS; i++)
 		{
-			k = (size_t)undo->width * undo->height;
-			bpp = undo->bpp;
-			for (j = l = 0; j < NUM_CHANNELS; j++)
-			{
-				if (undo->img[j] && (undo->img[j] != MEM_NONE))
-					l += k * bpp + 32;
-				bpp = 1;
-			}
-			if (undo->pal_) l += SIZEOF_PALETTE + 32;
-			undo->size = l;
-			undo->flags |= UF_SIZED;
+			if (pack_jobs[i].state != PJ_QUEUED) continue;
+			(job = pack_jobs + i)->state = PJ_BUSY;
+			break;
 		}
-		total += undo->size;
-	}
+		if (!job) pack_worker = FALSE;
+		UNLOCK_BG_MUTEX(pack_lock);
+		if (!job) break;
 
-	return (total);
+		i = undo_pack_run(job);
+		LOCK_BG_MUTEX(pack_lock);
+		job->state = i ? PJ_DONE : PJ_FAIL;
+		UNLOCK_BG_MUTEX(pack_lock);
+	}
+	return (NULL);
 }
 
-/* Add up sizes of all layers other than current */
-static size_t mem_undo_lsize()
+/* Attach results of a finished job to its frame */
+static void undo_pack_commit(pack_job *job)
 {
-	undo_stack *ustack;
-	size_t total = 0;
-	int l;
+	undo_item *undo = job->undo;
+	size_t sz = 0;
+	int i;
 
-	for (l = 0; l <= layers_total; l++)
+	undo->flags &= ~UF_PACKING;
+	if (job->state == PJ_DONE)
 	{
-		if (l == layer_selected) continue;
-		ustack = &layer_table[l].image->image_.undo_;
-// !!! This relies on layer_table items already processed by update_undo()
-		if (!ustack->size) ustack->size = mem_undo_size(ustack);
-		total += ustack->size;
+		for (i = 0; i < NUM_CHANNELS; i++)
+		{
+			if (!job->res[i]) continue;
+			free(undo->img[i]);
+			undo->img[i] = (void *)job->res[i];
+			sz += job->res[i]->size + 32;
+		}
+		if (undo->pal_) sz += SIZEOF_PALETTE + 32;
+		undo->tileptr = NULL; // Packed along with the first channel
+		undo_set_size(job->items, undo, sz);
+		undo->flags |= UF_PACKED;
 	}
+	/* Do not retry what failed by itself */
+	else if (!job->stop) undo->flags |= UF_NOPACK;
+	memset(job, 0, sizeof(pack_job));
+}
 
-	return (total);
+/* Remove frame from packing queue, cancelling the job if in progress */
+static void undo_pack_drop(undo_item *undo)
+{
+	pack_job *job = pack_jobs;
+	int i;
+
+	if (!(undo->flags & UF_PACKING)) return;
+	while (job->undo != undo) job++;
+
+	LOCK_BG_MUTEX(pack_lock);
+	job->stop = TRUE;
+	if (job->state == PJ_QUEUED) job->state = PJ_FAIL;
+	UNLOCK_BG_MUTEX(pack_lock);
+	while (job->state == PJ_BUSY) thread_yield();
+
+	for (i = 0; i < NUM_CHANNELS; i++) free(job->res[i]);
+	memset(job, 0, sizeof(pack_job));
+	undo->flags &= ~UF_PACKING;
 }
 
-/* Free requested amount of undo space */
-static int mem_undo_space(size_t mem_req)
+/* Point jobs from an undo stack to its resized copy */
+static void undo_pack_restack(undo_item **items, undo_item **nitems)
 {
-	undo_stack *heap[MAX_LAYERS + 2], *wp, *hp;
-	size_t mem_lim, mem_max = (size_t)mem_undo_limit * (1024 * 1024);
-	int i, l, l2, h, csz = mem_undo_common * layers_total;
-	
-	/* Layer mem limit including common area */
-	mem_lim = mem_max * (csz * 0.01 + 1) / (layers_total + 1);
+	int i;
 
-	/* Fail if hopeless */
-	if (mem_req > mem_lim) return (mem_req - mem_lim);
+	for (i = 0; i < UNDO_PACK_JOBS; i++)
+		if (pack_jobs[i].items == items) pack_jobs[i].items = nitems;
+}
 
-	/* Layer mem limit exceeded - drop oldest */
-	mem_req += mem_undo_size(&mem_image.undo_);
-	while (mem_req > mem_lim)
+/* Put frame into packing queue; return FALSE if the queue is full */
+static int undo_pack_add(undo_item *undo)
+{
+	pack_job *job;
+	size_t l, sz, tsz = 0, total = 0;
+	int i, bpp;
+
+	if (!(undo->flags & (UF_TILED | UF_FLAT)) ||
+		(undo->flags & (UF_PACKED | UF_PACKING | UF_NOPACK))) return (TRUE);
+	for (job = pack_jobs; job->state != PJ_FREE; job++)
+		if (job == pack_jobs + UNDO_PACK_JOBS - 1) return (FALSE);
+
+	/* Tilemap goes with the first channel */
+	if (undo->flags & UF_TILED) tsz = undo_tilemap_size(undo);
+	sz = (size_t)undo->width * undo->height;
+	for (i = 0 , bpp = undo->bpp; i < NUM_CHANNELS; i++ , bpp = 1)
 	{
-		if (!mem_undo_done) return (mem_req - mem_lim);
-		mem_req -= lose_oldest(&mem_image.undo_);
+		if (!undo->img[i] || (undo->img[i] == MEM_NONE)) continue;
+		l = undo->flags & UF_TILED ? undo_tiled_len(undo, bpp) + tsz :
+			sz * bpp;
+		tsz = 0;
+		job->src[i] = undo->img[i];
+		total += job->len[i] = l;
+	}
+	if (total < UNDO_PACK_MIN)
+	{
+		memset(job, 0, sizeof(pack_job));
+		undo->flags |= UF_NOPACK;
+		return (TRUE);
 	}
-	/* All done if no common area */
-	if (!csz) return (0);
 
-	mem_req += mem_undo_lsize();
-	if (mem_req <= mem_max) return (0); // No need to trim other layers yet
-	mem_lim -= mem_max * (mem_undo_common * 0.01); // Reserved space per layer
+	job->undo = undo;
+	job->items = mem_undo_im_;
+	undo->flags |= UF_PACKING;
+	LOCK_BG_MUTEX(pack_lock);
+	job->state = PJ_QUEUED;
+	UNLOCK_BG_MUTEX(pack_lock);
+	return (TRUE);
+}
 
-	/* Build heap of undo stacks */
-	for (i = h = 0; i <= layers_total; i++)
+/* Queue up current image's frames, newest or oldest first */
+static void undo_pack_queue(int oldest)
+{
+	int i, n;
+
+	if (oldest) /* Farthest from current position go first */
 	{
-		// Skip current layer
-		if (i == layer_selected) continue;
-		wp = &layer_table[i].image->image_.undo_;
-		// Skip layers without extra frames
-		if (!(wp->done + wp->redo)) continue;
-		// Skip layers under the memory limit
-		if (wp->size <= mem_lim) continue;
-		// Put undo stack onto heap
-		for (l = ++h; l > 1; l = l2)
+		n = mem_undo_done > mem_undo_redo ? mem_undo_done : mem_undo_redo;
+		for (i = n; i > 0; i--)
 		{
-			l2 = l >> 1;
-			if ((hp = heap[l2])->size >= wp->size) break;
-			heap[l] = hp;
+			if ((i <= mem_undo_redo) && !undo_pack_add(mem_undo_im_[
+				(mem_undo_pointer + i) % mem_undo_max])) return;
+			if ((i <= mem_undo_done) && !undo_pack_add(mem_undo_im_[
+				(mem_undo_pointer - i + mem_undo_max) %
+				mem_undo_max])) return;
 		}
-		heap[l] = wp;
+		return;
 	}
+	n = mem_undo_done;
+	for (i = 1; i <= n; i++) if (!undo_pack_add(
+		mem_undo_im_[(mem_undo_pointer - i + mem_undo_max) %
+		mem_undo_max])) return;
+	n = mem_undo_redo;
+	for (i = 1; i <= n; i++) if (!undo_pack_add(
+		mem_undo_im_[(mem_undo_pointer + i) % mem_undo_max])) return;
+}
 
-	/* Drop frames of greediest layers */
-	while (h > 0)
+#define PACK_QUEUE  1 /* Queue up current image's frames */
+#define PACK_WAIT   2 /* Wait till all jobs are done */
+#define PACK_OLDEST 4 /* Queue oldest frames first */
+
+static gboolean undo_pack_timer_call(gpointer data);
+
+/* Commit finished jobs, and start new ones if requested; return how many
+ * frames changed */
+static int undo_pack_sync(int mode)
+{
+	pack_job *job;
+	int i, n, busy, done, res = 0;
+
+	while (TRUE)
 	{
-		size_t mem_nx = h > 1 ? heap[2]->size : 0;
-		if ((h > 2) && (heap[3]->size > mem_nx)) mem_nx = heap[3]->size;
-		/* Drop frames */
-		wp = heap[1];
-		while (TRUE)
+		busy = done = 0;
+		for (i = 0; i < UNDO_PACK_JOBS; i++)
 		{
-			size_t res = lose_oldest(wp);
-			wp->size -= res; // Maintain undo stack size
-			mem_req -= res;
-			if (mem_req <= mem_max) return (0);
-			if (!(wp->done + wp->redo) || (wp->size <= mem_lim))
-				wp = heap[h--];
-			else if (wp->size >= mem_nx) continue;
-			break;
+			job = pack_jobs + i;
+			LOCK_BG_MUTEX(pack_lock);
+			n = job->state;
+			UNLOCK_BG_MUTEX(pack_lock);
+			if ((n == PJ_QUEUED) || (n == PJ_BUSY)) busy++;
+			else if (n != PJ_FREE) undo_pack_commit(job) , done++;
 		}
-		/* Reheap layer */
-		mem_nx = wp->size;
-		for (l = 1; (l2 = l + l) <= h; l = l2)
+		/* Packed sizes of inactive layers need recalculating */
+		res += done;
+		if (done) for (i = 0; i <= layers_total; i++)
+			if (i != layer_selected)
+				layer_table[i].image->image_.undo_.size = 0;
+
+		if (mode & PACK_QUEUE)
 		{
-			if ((l2 < h) && (heap[l2]->size < heap[l2 + 1]->size)) l2++;
-			if (mem_nx >= (hp = heap[l2])->size) break;
-			heap[l] = hp;
+			mode ^= PACK_QUEUE;
+			undo_pack_queue(mode & PACK_OLDEST);
+			if (!pack_worker) for (i = 0; i < UNDO_PACK_JOBS; i++)
+			{
+				job = pack_jobs + i;
+				if (job->state != PJ_QUEUED) continue;
+				/* Launch background thread if possible */
+				pack_worker = TRUE; // Worker may reset it right away
+				if (launch_bg_thread(undo_pack_worker, NULL)) break;
+				pack_worker = FALSE;
+				/* Do the packing here and now if not */
+				job->state = undo_pack_run(job) ? PJ_DONE : PJ_FAIL;
+			}
+			/* Commit results when ready, in GUI mode */
+			if (pack_worker && !pack_timer && !cmd_mode)
+				pack_timer = threads_timeout_add(250,
+					undo_pack_timer_call, NULL);
+			continue;
 		}
-		heap[l] = wp;
+		if (!busy || !(mode & PACK_WAIT)) break;
+		thread_yield();
 	}
+	return (res);
+}
 
-	return (0);
+static gboolean undo_pack_timer_call(gpointer data)
+{
+	int i;
+
+	if (undo_pack_sync(0)) update_stuff(CF_MENU); // Memory use changed
+	for (i = 0; i < UNDO_PACK_JOBS; i++)
+		if (pack_jobs[i].state != PJ_FREE) return (TRUE);
+	pack_timer = 0;
+	return (FALSE);
 }
 
-/* Try to allocate a memory block, releasing undo frames if needed */
-void *mem_try_malloc(size_t size)
+typedef struct {
+	undo_pack *pk;
+	unsigned char *dest;
+	size_t *ofs;
+	int fail;
+} unpack_data;
+
+static void undo_unpack_blocks(tcb *thread)
 {
-	void *ptr;
+	unpack_data *ud = thread->data;
+	undo_pack *pk = ud->pk;
+	unsigned char *src, *dest;
+	uLongf dl;
+	size_t l;
+	int i, n = thread->step0 + thread->nsteps;
 
-	while (!((ptr = malloc(size))))
+	for (i = thread->step0; i < n; i++)
 	{
-// !!! Hardcoded to work with mem_image for now
-		if (!mem_undo_done) return (NULL);
-		lose_oldest(&mem_image.undo_);
+		l = pk->len - (size_t)i * UNDO_PACK_BLOCK;
+		if (l > UNDO_PACK_BLOCK) l = UNDO_PACK_BLOCK;
+		src = (unsigned char *)pk + ud->ofs[i];
+		dest = ud->dest + (size_t)i * UNDO_PACK_BLOCK;
+		if (pk->blen[i] == l) memcpy(dest, src, l); // Stored as is
+		else if ((dl = l) , (uncompress(dest, &dl, src, pk->blen[i])
+			!= Z_OK) || (dl != l)) ud->fail = TRUE;
 	}
-	return (ptr);
+	thread_done(thread);
 }
 
-int undo_next_core(int mode, int new_width, int new_height, int new_bpp, int cmask)
+/* Decompress a channel */
+static int undo_unpack_chan(unsigned char *dest, undo_pack *pk)
 {
-	png_color *newpal;
-	undo_item *undo;
-	unsigned char *img;
-	void *tempfiles = mem_tempfiles;
-	chanlist holder, frame;
-	size_t mem_req, mem_lim, wh;
-	int i, j, k, need_frame;
+	unpack_data ud;
+	threaddata *tdata;
+	size_t l;
+	int i, res;
+
+	ud.pk = pk;
+	ud.dest = dest;
+	ud.fail = FALSE;
+	tdata = talloc(MA_ALIGN_DEFAULT, pk->nblk, &ud, sizeof(ud),
+		&ud.ofs, pk->nblk * sizeof(size_t),
+		NULL,
+		NULL);
+	if (!tdata) return (FALSE);
+	l = PACK_HDR(pk->nblk);
+	for (i = 0; i < pk->nblk; i++)
+	{
+		ud.ofs[i] = l;
+		l += pk->blen[i];
+	}
+	tdata->silent = TRUE;
+	launch_threads(undo_unpack_blocks, tdata, NULL, pk->nblk);
+	for (i = res = 0; i < tdata->count; i++)
+		res |= ((unpack_data *)tdata->threads[i]->data)->fail;
+	free(tdata);
+	return (!res);
+}
 
+/* Packed frames which do not fit into memory limit can be moved out into
+ * a scratch file, to be read back in when needed */
 
-	if (pen_down && (mode & UC_PENDOWN)) return (0);
-	pen_down = mode & UC_PENDOWN ? 1 : 0;
+typedef struct {
+	off_t ofs;
+	size_t size;
+} spill_ext;
 
-	/* Fill undo frame */
-	update_undo(&mem_image);
+static spill_ext *spill_holes;
+static int spill_nholes, spill_maxholes, spill_failed;
+static off_t spill_end, spill_fsize;
+static size_t spill_used;
 
-	/* Postpone change notify if nothing will be done without new frame */
-	need_frame = mode & (UC_CREATE | UC_NOCOPY | UC_GETMEM);
-	if (!need_frame) notify_changed();
+/* Allocate space in scratch file */
+static off_t spill_alloc(size_t size)
+{
+	spill_ext *h = spill_holes;
+	off_t res;
+	int i;
 
-	/* Release redo data */
-	if (mem_undo_redo)
+	/* First fit */
+	for (i = 0; i < spill_nholes; i++ , h++)
 	{
-		k = mem_undo_pointer;
-		for (i = 0; i < mem_undo_redo; i++)
-		{
-			k = (k + 1) % mem_undo_max;
-			undo_free_x(mem_undo_im_ + k);
-		}
-		mem_undo_redo = 0;
+		if (h->size < size) continue;
+		res = h->ofs;
+		h->ofs += size;
+		if (!(h->size -= size))
+			memmove(h, h + 1, (--spill_nholes - i) * sizeof(spill_ext));
+		return (res);
 	}
+	/* Extend the file */
+	res = spill_end;
+	spill_end += size;
+	return (res);
+}
 
-	/* Let cumulative updates stack */
-	if (mode & UC_ACCUM)
+/* Release space in scratch file */
+static void spill_free(off_t ofs, size_t size)
+{
+	spill_ext *h, *tmp;
+	int i, n;
+
+	for (i = 0; (i < spill_nholes) && (spill_holes[i].ofs < ofs); i++);
+	h = spill_holes + i;
+	/* Merge with previous hole */
+	if (i && (h[-1].ofs + h[-1].size == ofs))
 	{
-		int i = (mem_undo_pointer ? mem_undo_pointer : mem_undo_max) - 1;
-		if (mem_undo_done && (mem_undo_im_[i]->flags & UF_ACCUM))
-			return (0);
-		mem_undo_im_[mem_undo_pointer]->flags |= UF_ACCUM;
+		(--h)->size += size;
+		/* And with next one */
+		if ((i < spill_nholes) && (h->ofs + h->size == h[1].ofs))
+		{
+			h->size += h[1].size;
+			memmove(h + 1, h + 2, (--spill_nholes - i) * sizeof(spill_ext));
+		}
 	}
-
-	/* Compress last undo frame */
-	mem_undo_prepare();
-
-	/* Calculate memory requirements */
-	mem_req = SIZEOF_PALETTE + 32;
-	wh = (size_t)new_width * new_height;
-	if (!(mode & UC_DELETE))
+	/* Merge with next hole */
+	else if ((i < spill_nholes) && (ofs + size == h->ofs))
+		h->ofs = ofs , h->size += size;
+	else /* Add a new hole */
 	{
-		for (i = j = 0; i < NUM_CHANNELS; i++)
+		if (spill_nholes >= spill_maxholes)
 		{
-			if ((cmask & (1 << i)) && (mem_img[i] ||
-				(mode & (UC_CREATE | UC_RESET)))) j++;
+			n = spill_maxholes * 2 + 16;
+			tmp = realloc(spill_holes, n * sizeof(spill_ext));
+			if (!tmp) return; // The space just gets lost
+			spill_holes = tmp;
+			spill_maxholes = n;
+			h = spill_holes + i;
 		}
-		if (cmask & CMASK_IMAGE) j += new_bpp - 1;
-		mem_req += (wh + 32) * j;
-// !!! Must be after update_undo() to get used memory right
-		if ((mem_undo_fail = mem_undo_space(mem_req))) return (2);
+		memmove(h + 1, h, (spill_nholes++ - i) * sizeof(spill_ext));
+		h->ofs = ofs;
+		h->size = size;
 	}
-	if (mode & UC_GETMEM) return (0); // Enough memory was freed
+	/* Cut off the free tail */
+	h = spill_holes + spill_nholes - 1;
+	if (h->ofs + h->size == spill_end) spill_end = h->ofs , spill_nholes--;
+}
 
-	/* Ensure a new frame */
-	undo = newchunk(&undo_items);
-	if (!undo) return (1);
+static int spill_io(int fd, off_t ofs, void *buf, size_t len, int write_)
+{
+	ssize_t l;
+
+	if (lseek(fd, ofs, SEEK_SET) != ofs) return (FALSE);
+	while (len)
+	{
+		l = write_ ? write(fd, buf, len) : read(fd, buf, len);
+		if (l <= 0) return (FALSE);
+		buf = (char *)buf + l;
+		len -= l;
+	}
+	return (TRUE);
+}
+
+/* Write out a packed frame; return the amount of memory freed */
+static size_t undo_spill(undo_item **items, undo_item *undo)
+{
+	spill_ext *rec[NUM_CHANNELS];
+	undo_pack *pk;
+	size_t l = 0, sz = 0;
+	int i, fd;
+
+	if ((undo->flags & (UF_PACKED | UF_SPILLED)) != UF_PACKED) return (0);
+	for (i = 0; i < NUM_CHANNELS; i++)
+		if (undo->img[i] && (undo->img[i] != MEM_NONE))
+			l += ((undo_pack *)undo->img[i])->size;
+	if (spill_used + l > (size_t)mem_undo_spill * (1024 * 1024)) return (0);
+	if ((fd = get_scratch_fd()) < 0) return (spill_failed = TRUE , 0);
+
+	memset(rec, 0, sizeof(rec));
+	for (i = 0; i < NUM_CHANNELS; i++)
+	{
+		if (!undo->img[i] || (undo->img[i] == MEM_NONE)) continue;
+		pk = (void *)undo->img[i];
+		if (!(rec[i] = malloc(sizeof(spill_ext)))) break;
+		rec[i]->ofs = spill_alloc(rec[i]->size = pk->size);
+		if (spill_end > spill_fsize) spill_fsize = spill_end;
+		if (spill_io(fd, rec[i]->ofs, pk, pk->size, TRUE)) continue;
+		spill_failed = TRUE; // Disk full, most likely
+		break;
+	}
+	if (i < NUM_CHANNELS) /* Failed - release what was done */
+	{
+		for (; i >= 0; i--)
+		{
+			if (!rec[i]) continue;
+			spill_free(rec[i]->ofs, rec[i]->size);
+			free(rec[i]);
+		}
+		return (0);
+	}
+
+	for (i = 0; i < NUM_CHANNELS; i++)
+	{
+		if (!rec[i]) continue;
+		free(undo->img[i]);
+		undo->img[i] = (void *)rec[i];
+		sz += sizeof(spill_ext) + 32;
+	}
+	spill_used += l;
+	if (undo->pal_) sz += SIZEOF_PALETTE + 32;
+	l = undo->size - sz;
+	undo_set_size(items, undo, sz);
+	undo->flags |= UF_SPILLED;
+	return (l);
+}
+
+/* Release frame's space in scratch file */
+static void undo_spill_drop(undo_item *undo)
+{
+	spill_ext *rec;
+	int i;
+
+	if (!(undo->flags & UF_SPILLED)) return;
+	for (i = 0; i < NUM_CHANNELS; i++)
+	{
+		if (!undo->img[i] || (undo->img[i] == MEM_NONE)) continue;
+		rec = (void *)undo->img[i];
+		spill_free(rec->ofs, rec->size);
+		spill_used -= rec->size;
+	}
+	undo->flags &= ~UF_SPILLED;
+	/* Give the freed tail of scratch file back to the filesystem */
+	if ((spill_end < spill_fsize) &&
+		!ftruncate(get_scratch_fd(), spill_end)) spill_fsize = spill_end;
+}
+
+/* Read a frame back into memory; return FALSE if failed */
+static int undo_unspill(undo_item *undo)
+{
+	chanlist tmp;
+	spill_ext *rec;
+	size_t sz = 0;
+	int i, fd;
+
+	if (!(undo->flags & UF_SPILLED)) return (TRUE);
+	fd = get_scratch_fd();
+	memset(tmp, 0, sizeof(chanlist));
+	for (i = 0; i < NUM_CHANNELS; i++)
+	{
+		if (!undo->img[i] || (undo->img[i] == MEM_NONE)) continue;
+		rec = (void *)undo->img[i];
+		if ((tmp[i] = malloc(rec->size)) &&
+			spill_io(fd, rec->ofs, tmp[i], rec->size, FALSE)) continue;
+		while (i >= 0) free(tmp[i--]);
+		return (FALSE);
+	}
+
+	undo_spill_drop(undo);
+	for (i = 0; i < NUM_CHANNELS; i++)
+	{
+		if (!tmp[i]) continue;
+		sz += ((undo_pack *)tmp[i])->size + 32;
+		free(undo->img[i]);
+		undo->img[i] = tmp[i];
+	}
+	if (undo->pal_) sz += SIZEOF_PALETTE + 32;
+	undo_set_size(mem_undo_im_, undo, sz);
+	return (TRUE);
+}
+
+/* Spill out the oldest frame still in memory; return the memory freed */
+static size_t undo_spill_oldest(undo_stack *ustack)
+{
+	undo_item **items = ustack->items;
+	size_t res;
+	int k, m = ustack->max;
+
+	if (!mem_undo_spill || spill_failed) return (0);
+	k = ustack->done > ustack->redo ? ustack->done : ustack->redo;
+	for (; k > 0; k--)
+	{
+		if ((k <= ustack->redo) && (res = undo_spill(items,
+			items[(ustack->pointer + k) % m]))) return (res);
+		if ((k <= ustack->done) && (res = undo_spill(items,
+			items[(ustack->pointer - k + m) % m]))) return (res);
+	}
+	return (0);
+}
+
+/* Return the number of bytes kept on disk, for all layers */
+size_t mem_undo_spilled()
+{
+	return (spill_used);
+}
+
+/* Restore frame's channels to uncompressed state; return FALSE if failed */
+static int undo_unpack(undo_item *undo)
+{
+	chanlist tmp;
+	undo_pack *pk;
+	size_t sz = 0;
+	int i, tm = FALSE;
+
+	undo_pack_drop(undo);
+	if (!undo_unspill(undo)) return (FALSE);
+	if (!(undo->flags & UF_PACKED)) return (TRUE);
+
+	memset(tmp, 0, sizeof(chanlist));
+	for (i = 0; i < NUM_CHANNELS; i++)
+	{
+		if (!undo->img[i] || (undo->img[i] == MEM_NONE)) continue;
+		pk = (void *)undo->img[i];
+		if ((tmp[i] = malloc(pk->len)) && undo_unpack_chan(tmp[i], pk))
+			continue;
+		while (i >= 0) free(tmp[i--]);
+		return (FALSE);
+	}
+
+	for (i = 0; i < NUM_CHANNELS; i++)
+	{
+		if (!tmp[i]) continue;
+		pk = (void *)undo->img[i];
+		sz += pk->len + 32;
+		/* Tilemap is at the end of the first channel */
+		if ((undo->flags & UF_TILED) && !tm++) undo->tileptr =
+			tmp[i] + pk->len - undo_tilemap_size(undo);
+		free(pk);
+		undo->img[i] = tmp[i];
+	}
+	if (undo->pal_) sz += SIZEOF_PALETTE + 32;
+	undo_set_size(mem_undo_im_, undo, sz);
+	undo->flags &= ~UF_PACKED;
+	return (TRUE);
+}
+
+/* Compress last undo frame */
+void mem_undo_prepare()
+{
+	undo_item *undo;
+
+	if (!mem_undo_done) return;
+	undo = mem_undo_im_[(mem_undo_pointer ? mem_undo_pointer : mem_undo_max) - 1];
+
+	/* Already processed? */
+	if (undo->flags & (UF_TILED | UF_FLAT)) return;
+
+	/* Cull palette if unchanged */
+	if (undo->pal_ && !memcmp(undo->pal_, mem_pal, SIZEOF_PALETTE))
+	{
+		/* Free new block, reuse old */
+		free(mem_undo_im_[mem_undo_pointer]->pal_);
+		mem_undo_im_[mem_undo_pointer]->pal_ = undo->pal_;
+		undo->pal_ = NULL;
+	}
+	/* Tile image */
+	mem_undo_tile(undo);
+	/* Compress older frames */
+	undo_pack_sync(PACK_QUEUE);
+}
+
+static size_t mem_undo_size(undo_stack *ustack)
+{
+	undo_item *undo;
+	size_t total = 0;
+	int i, umax = ustack->max;
+
+	for (i = 0; i < umax; i++)
+	{
+		/* Anything there? */
+		if (!(undo = ustack->items[i])) continue;
+		/* Not empty and not yet scanned */
+		if (undo->width && !(undo->flags & UF_SIZED))
+			undo_set_size(ustack->items, undo, undo_flat_size(undo));
+		total += undo->size;
+	}
+
+	return (total);
+}
+
+/* Add up sizes of all layers other than current */
+static size_t mem_undo_lsize()
+{
+	undo_stack *ustack;
+	size_t total = 0;
+	int l;
+
+	for (l = 0; l <= layers_total; l++)
+	{
+		if (l == layer_selected) continue;
+		ustack = &layer_table[l].image->image_.undo_;
+// !!! This relies on layer_table items already processed by update_undo()
+		if (!ustack->size) ustack->size = mem_undo_size(ustack);
+		total += ustack->size;
+	}
+
+	return (total);
+}
+
+/* Put undo stacks larger than given size, and having frames to lose, onto
+ * a heap with the largest on top; return heap size */
+static int undo_heap(undo_stack **heap, size_t mem_lim, int current)
+{
+	undo_stack *wp, *hp;
+	int i, l, l2, h;
+
+	for (i = h = 0; i <= layers_total; i++)
+	{
+		if (i != layer_selected) wp = &layer_table[i].image->image_.undo_;
+		// Skip current layer unless requested
+		else if (!current) continue;
+		else
+		{
+			wp = &mem_image.undo_;
+			wp->size = mem_undo_size(wp);
+		}
+		// Skip layers without extra frames
+		if (!(wp->done + wp->redo)) continue;
+		// Skip layers under the memory limit
+		if (wp->size <= mem_lim) continue;
+		// Put undo stack onto heap
+		for (l = ++h; l > 1; l = l2)
+		{
+			l2 = l >> 1;
+			if ((hp = heap[l2])->size >= wp->size) break;
+			heap[l] = hp;
+		}
+		heap[l] = wp;
+	}
+	return (h);
+}
+
+/* Put undo stack back onto top of heap, and sift it down */
+static void undo_reheap(undo_stack **heap, int h, undo_stack *wp)
+{
+	undo_stack *hp;
+	size_t mem_nx = wp->size;
+	int l, l2;
+
+	for (l = 1; (l2 = l + l) <= h; l = l2)
+	{
+		if ((l2 < h) && (heap[l2]->size < heap[l2 + 1]->size)) l2++;
+		if (mem_nx >= (hp = heap[l2])->size) break;
+		heap[l] = hp;
+	}
+	heap[l] = wp;
+}
+
+/* Move oldest frames of greediest layers to disk, till total size of undo
+ * stacks fits into mem_max; return the total left */
+static size_t undo_spill_layers(size_t mem_req, size_t mem_max)
+{
+	undo_stack *heap[MAX_LAYERS + 2], *wp;
+	size_t res, mem_nx;
+	int h;
+
+	h = undo_heap(heap, 0, TRUE);
+	while ((h > 0) && (mem_req > mem_max))
+	{
+		if (!mem_undo_spill || spill_failed) break;
+		mem_nx = h > 1 ? heap[2]->size : 0;
+		if ((h > 2) && (heap[3]->size > mem_nx)) mem_nx = heap[3]->size;
+		wp = heap[1];
+		while ((res = undo_spill_oldest(wp)))
+		{
+			wp->size -= res; // Maintain undo stack size
+			mem_req -= res;
+			if ((mem_req <= mem_max) || (wp->size < mem_nx)) break;
+		}
+		/* Nothing more to spill from this layer */
+		if (!res) wp = heap[h--];
+		undo_reheap(heap, h, wp);
+	}
+	return (mem_req);
+}
+
+/* Free requested amount of undo space */
+static int mem_undo_space(size_t mem_req)
+{
+	undo_stack *heap[MAX_LAYERS + 2], *wp;
+	size_t mem_lim, mem_max = (size_t)mem_undo_limit * (1024 * 1024);
+	int h, csz = mem_undo_common * layers_total;
+	
+	/* Layer mem limit including common area */
+	mem_lim = mem_max * (csz * 0.01 + 1) / (layers_total + 1);
+
+	/* Fail if hopeless */
+	if (mem_req > mem_lim) return (mem_req - mem_lim);
+
+	/* Layer mem limit exceeded - try compressing frames first, oldest
+	 * ones first, as many batches as it takes */
+	while ((mem_req + mem_undo_size(&mem_image.undo_) > mem_lim) &&
+		undo_pack_sync(PACK_QUEUE | PACK_OLDEST | PACK_WAIT));
+	/* Then move oldest to disk, or drop them */
+	mem_req += mem_undo_size(&mem_image.undo_);
+	while (mem_req > mem_lim)
+	{
+		size_t res;
+
+		if (!mem_undo_done) return (mem_req - mem_lim);
+		if (!(res = undo_spill_oldest(&mem_image.undo_)))
+			res = lose_oldest(&mem_image.undo_);
+		mem_req -= res;
+	}
+	/* All done if no common area, and nothing can go to disk */
+	if (!csz && (!mem_undo_spill || spill_failed)) return (0);
+
+	mem_req += mem_undo_lsize();
+	if (mem_req <= mem_max) return (0); // No need to trim other layers yet
+	/* Move frames to disk from whichever layers hold the most */
+	mem_req = undo_spill_layers(mem_req, mem_max);
+	if ((mem_req <= mem_max) || !csz) return (0);
+	mem_lim -= mem_max * (mem_undo_common * 0.01); // Reserved space per layer
+
+	/* Build heap of undo stacks */
+	h = undo_heap(heap, mem_lim, FALSE);
+
+	/* Drop frames of greediest layers */
+	while (h > 0)
+	{
+		size_t mem_nx = h > 1 ? heap[2]->size : 0;
+		if ((h > 2) && (heap[3]->size > mem_nx)) mem_nx = heap[3]->size;
+		/* Drop frames */
+		wp = heap[1];
+		while (TRUE)
+		{
+			size_t res = undo_spill_oldest(wp);
+			if (!res) res = lose_oldest(wp);
+			wp->size -= res; // Maintain undo stack size
+			mem_req -= res;
+			if (mem_req <= mem_max) return (0);
+			if (!(wp->done + wp->redo) || (wp->size <= mem_lim))
+				wp = heap[h--];
+			else if (wp->size >= mem_nx) continue;
+			break;
+		}
+		/* Reheap layer */
+		undo_reheap(heap, h, wp);
+	}
+
+	return (0);
+}
+
+/* Try to allocate a memory block, releasing undo frames if needed */
+void *mem_try_malloc(size_t size)
+{
+	void *ptr;
+
+	while (!((ptr = malloc(size))))
+	{
+// !!! Hardcoded to work with mem_image for now
+		if (!mem_undo_done) return (NULL);
+		lose_oldest(&mem_image.undo_);
+	}
+	return (ptr);
+}
+
+int undo_next_core(int mode, int new_width, int new_height, int new_bpp, int cmask)
+{
+	png_color *newpal;
+	undo_item *undo;
+	unsigned char *img;
+	void *tempfiles = mem_tempfiles;
+	chanlist holder, frame;
+	size_t mem_req, mem_lim, wh;
+	int i, j, k, need_frame;
+
+
+	if (pen_down && (mode & UC_PENDOWN)) return (0);
+	pen_down = mode & UC_PENDOWN ? 1 : 0;
+	undo_gen++;
+
+	/* Fill undo frame */
+	update_undo(&mem_image);
+
+	/* Postpone change notify if nothing will be done without new frame */
+	need_frame = mode & (UC_CREATE | UC_NOCOPY | UC_GETMEM);
+	if (!need_frame) notify_changed();
+
+	/* Release redo data */
+	if (mem_undo_redo)
+	{
+		k = mem_undo_pointer;
+		for (i = 0; i < mem_undo_redo; i++)
+		{
+			k = (k + 1) % mem_undo_max;
+			undo_unsize(mem_undo_im_, mem_undo_im_[k]);
+			undo_free_x(mem_undo_im_ + k);
+		}
+		mem_undo_redo = 0;
+	}
+
+	/* Let cumulative updates stack */
+	if (mode & UC_ACCUM)
+	{
+		int i = (mem_undo_pointer ? mem_undo_pointer : mem_undo_max) - 1;
+		if (mem_undo_done && (mem_undo_im_[i]->flags & UF_ACCUM))
+			return (0);
+		mem_undo_im_[mem_undo_pointer]->flags |= UF_ACCUM;
+	}
+
+	/* Compress last undo frame */
+	mem_undo_prepare();
+
+	/* Calculate memory requirements */
+	mem_req = SIZEOF_PALETTE + 32;
+	wh = (size_t)new_width * new_height;
+	if (!(mode & UC_DELETE))
+	{
+		for (i = j = 0; i < NUM_CHANNELS; i++)
+		{
+			if ((cmask & (1 << i)) && (mem_img[i] ||
+				(mode & (UC_CREATE | UC_RESET)))) j++;
+		}
+		if (cmask & CMASK_IMAGE) j += new_bpp - 1;
+		mem_req += (wh + 32) * j;
+// !!! Must be after update_undo() to get used memory right
+		if ((mem_undo_fail = mem_undo_space(mem_req))) return (2);
+	}
+	if (mode & UC_GETMEM) return (0); // Enough memory was freed
+
+	/* Ensure a new frame */
+	undo = newchunk(&undo_items);
+	if (!undo) return (1);
 	freechunk(&undo_items, undo); // It'll be waiting in the freelist
 
 	/* Prepare outgoing frame */
@@ -1671,7 +2474,10 @@ int undo_next_core(int mode, int new_width, int new_height, int new_bpp, int cma
 	/* Next undo step */
 	mem_undo_pointer = (mem_undo_pointer + 1) % mem_undo_max;
 	if (mem_undo_done >= mem_undo_max - 1)
+	{
+		undo_unsize(mem_undo_im_, mem_undo_im_[mem_undo_pointer]);
 		undo_free_x(mem_undo_im_ + mem_undo_pointer);
+	}
 	else mem_undo_done++;
 	mem_undo_im_[mem_undo_pointer] = newchunk(&undo_items); // Cannot fail
 
@@ -1817,6 +2623,7 @@ static void mem_undo_swap(undo_item *prev, int redo)
 			}
 		}
 		/* !!! If more flags need preserving, add them to mask */
+		undo_unsize(mem_undo_im_, prev);
 		prev->flags = (prev->flags & UF_ACCUM) | UF_FLAT;
 	}
 
@@ -1835,6 +2642,8 @@ static void mem_undo_swap(undo_item *prev, int redo)
 	prev->cols = mem_cols;
 	prev->trans = mem_xpm_trans;
 	if (!mem_changed) prev->flags |= UF_ORIG;
+	if (!(prev->flags & UF_TILED))
+		undo_set_size(mem_undo_im_, prev, undo_flat_size(prev));
 
 	mem_width = tmp.width;
 	mem_height = tmp.height;
@@ -1860,7 +2669,14 @@ void mem_do_undo(int redo)
 		/* Swap data */
 		curr = mem_undo_im_[mem_undo_pointer];
 		prev = mem_undo_im_[i];
+		if (!undo_unpack(prev))
+		{
+			memory_errors(1);
+			pen_down = 0;
+			return;
+		}
 		mem_undo_swap(prev, redo);
+		undo_gen++;
 
 		/* Swap frames */
 		mem_undo_im_[mem_undo_pointer] = prev;
@@ -1871,6 +2687,9 @@ void mem_do_undo(int redo)
 
 		/* Update current */
 		update_undo(&mem_image);
+
+		/* Compress the frame just swapped out */
+		undo_pack_sync(PACK_QUEUE);
 	}
 	pen_down = 0;
 }
@@ -1878,10 +2697,35 @@ void mem_do_undo(int redo)
 /* Return the number of bytes used in image + undo */
 size_t mem_used()
 {
+	undo_pack_sync(0);
 	update_undo(&mem_image);
 	return mem_undo_size(&mem_image.undo_);
 }
 
+/* Return the same as mem_used(), from the running total of frame sizes, for
+ * displaying after every change */
+size_t mem_undo_used()
+{
+	undo_item *undo;
+	size_t total;
+	int i;
+
+	if (undo_used_at != mem_undo_im_) /* Count anew */
+	{
+		undo_used_at = mem_undo_im_;
+		for (undo_used = i = 0; i < mem_undo_max; i++)
+			if ((undo = mem_undo_im_[i]) && (undo->flags & UF_SIZED))
+				undo_used += undo->size;
+	}
+	update_undo(&mem_image);
+	total = undo_used + undo_flat_size(mem_undo_im_[mem_undo_pointer]);
+	/* Last frame until it gets tiled */
+	if (mem_undo_done && !((undo = mem_undo_im_[(mem_undo_pointer ?
+		mem_undo_pointer : mem_undo_max) - 1])->flags & UF_SIZED))
+		total += undo_flat_size(undo);
+	return (total);
+}
+
 /* Return the number of bytes used in image + undo in all layers */
 size_t mem_used_layers()
 {
@@ -2676,7 +3520,7 @@ int mem_convert_indexed(unsigned char *dest, unsigned char *src, int cnt,
 
 #define HISTSIZE (64 * 64 * 64)
 int maxminquan(unsigned char *inbuf, int width, int height, int quant_to,
-	png_color *userpal)
+	png_color *userpal, col_stats *cs)
 {
 	int i, j, k, ii, r, g, b, dr, dg, db, l = width * height, *hist;
 
@@ -2684,8 +3528,14 @@ int maxminquan(unsigned char *inbuf, int width, int height, int quant_to,
 	hist = calloc(1, HISTSIZE * sizeof(int));
 	if (!hist) return (-1);
 
-	/* Fill histogram */
-	for (i = 0; i < l; i++)
+	/* Fill histogram, from colour table if there is one */
+	if (cs && cs->tab) for (i = 0; i < cs->cols; i++)
+	{
+		j = cs->tab[i].rgb;
+		hist[((INT_2_R(j) & 0xFC) << 10) + ((INT_2_G(j) & 0xFC) << 4) +
+			(INT_2_B(j) >> 2)] += cs->tab[i].cnt;
+	}
+	else for (i = 0; i < l; i++)
 	{
 		++hist[((inbuf[0] & 0xFC) << 10) + ((inbuf[1] & 0xFC) << 4) +
 			(inbuf[2] >> 2)];
@@ -2802,32 +3652,107 @@ static void find_nn(pnnbin *bins, int idx)
 	bin1->nn = nn;
 }
 
+/* Histogram gets built in threads' own copies, and summed up afterwards; sums
+ * are of integers, so come out exact regardless of how image is split */
+
+typedef struct {
+	unsigned char *inbuf;
+	pnnbin *bins, *hist;
+	int width;
+} pnn_info;
+
+static void pnn_hist(tcb *thread)
+{
+	pnn_info *pi = thread->data;
+	unsigned char *src = pi->inbuf + thread->step0 * pi->width * 3;
+	pnnbin *tb;
+	int i, j, k = thread->nsteps * pi->width;
+
+	for (i = 0; i < k; i++ , src += 3)
+	{
+// !!! Can throw gamma correction in here, but what to do about perceptual
+// !!! nonuniformity then?
+		j = ((src[0] & 0xF8) << 7) + ((src[1] & 0xF8) << 2) +
+			(src[2] >> 3);
+		tb = pi->hist + j;
+		tb->rc += src[0]; tb->gc += src[1]; tb->bc += src[2];
+		tb->cnt++;
+	}
+	thread_done(thread);
+}
+
+/* Work per bin diminishes from first to last, so it goes in chunks */
+static void pnn_nn(tcb *thread)
+{
+	pnn_info *pi = thread->data;
+	int i, n = thread->nsteps, p0 = thread->progress;
+
+	for (i = 0; i < n; i++)
+	{
+		find_nn(pi->bins, thread->step0 + i);
+		if (!thread_step(thread, p0 + i + 1, thread->tdata->total, 50))
+			continue;
+		thread->stop = TRUE; // Single-threaded build does not set it
+		break;
+	}
+}
+
 int pnnquan(unsigned char *inbuf, int width, int height, int quant_to,
-	png_color *userpal)
+	png_color *userpal, col_stats *cs)
 {
 	unsigned short heap[32769];
+	threaddata *tdata;
+	pnn_info pi;
 	pnnbin *bins, *tb, *nb;
 	double d, err, n1, n2;
-	int i, j, k, l, l2, h, b1, maxbins, extbins, res = 1;
+	int i, j, k, l, l2, h, b1, r, g, b, maxbins, extbins, res = 1;
 
 
 	heap[0] = 0; // Empty
-	bins = calloc(32768, sizeof(pnnbin));
-	if (!bins) return (-1);
+	memset(&pi, 0, sizeof(pi));
+	tdata = talloc(MA_ALIGN_DOUBLE, image_threads(width, height), &pi,
+		sizeof(pi), NULL, &pi.hist, 32768 * sizeof(pnnbin), NULL);
+	if (!tdata) return (-1);
+	bins = ((pnn_info *)tdata->threads[0]->data)->hist;
+	for (i = 0; i < tdata->count; i++)
+	{
+		pnn_info *ti = tdata->threads[i]->data;
+		ti->inbuf = inbuf;
+		ti->width = width;
+		ti->bins = bins;
+	}
 
 	progress_init(_("Quantize Pass 1"), 1);
 
-	/* Build histogram */
-	k = width * height;
-	for (i = 0; i < k; i++ , inbuf += 3)
+	/* Build histogram, from colour table if there is one */
+	if (cs && cs->tab) for (i = 0; i < cs->cols; i++)
 	{
-// !!! Can throw gamma correction in here, but what to do about perceptual
-// !!! nonuniformity then?
-		j = ((inbuf[0] & 0xF8) << 7) + ((inbuf[1] & 0xF8) << 2) +
-			(inbuf[2] >> 3);
-		tb = bins + j;
-		tb->rc += inbuf[0]; tb->gc += inbuf[1]; tb->bc += inbuf[2];
-		tb->cnt++;
+		j = cs->tab[i].rgb;
+		k = cs->tab[i].cnt;
+		r = INT_2_R(j);
+		g = INT_2_G(j);
+		b = INT_2_B(j);
+		tb = bins + ((r & 0xF8) << 7) + ((g & 0xF8) << 2) + (b >> 3);
+		tb->rc += r * (double)k;
+		tb->gc += g * (double)k;
+		tb->bc += b * (double)k;
+		tb->cnt += k;
+	}
+	else
+	{
+		tdata->silent = TRUE;
+		launch_threads(pnn_hist, tdata, NULL, height);
+	}
+	for (k = 1; !(cs && cs->tab) && (k < tdata->count); k++)
+	{
+		nb = ((pnn_info *)tdata->threads[k]->data)->hist;
+		for (i = 0; i < 32768; i++)
+		{
+			if (!nb[i].cnt) continue;
+			tb = bins + i;
+			tb->rc += nb[i].rc; tb->gc += nb[i].gc; tb->bc += nb[i].bc;
+			tb->cnt += nb[i].cnt;
+		}
 	}
 
 	/* Cluster nonempty bins at one end of array */
@@ -2847,16 +3772,18 @@ int pnnquan(unsigned char *inbuf, int width, int height, int quant_to,
 		bins[i].fw = i + 1;
 		bins[i + 1].bk = i;
 	}
-// !!! Already zeroed out by calloc()
+// !!! Already zeroed out by talloc()
 //	bins[0].bk = bins[i].fw = 0;
 
-	/* Initialize nearest neighbors and build heap of them */
+	/* Initialize nearest neighbors */
+	tdata->silent = FALSE;
+	tdata->chunks = 16;
+	launch_threads(pnn_nn, tdata, NULL, maxbins);
+	if (tdata->threads[0]->stop) goto quit;
+
+	/* Build heap of them */
 	for (i = 0; i < maxbins; i++)
 	{
-		if (((i * 50) % maxbins >= maxbins - 50))
-			if (progress_update((float)i / maxbins)) goto quit;
-
-		find_nn(bins, i);
 		/* Push slot on heap */
 		err = bins[i].err;
 		for (l = ++heap[0]; l > 1; l = l2)
@@ -2937,7 +3864,7 @@ int pnnquan(unsigned char *inbuf, int width, int height, int quant_to,
 	res = 0;
 
 quit:	progress_end();
-	free(bins);
+	free(tdata);
 	return (res);
 }
 
@@ -2982,28 +3909,115 @@ static const distance_func distance_3d[NUM_DISTANCES] = {
 /* Dithering works with 6-bit colours, because hardware VGA palette is 6-bit,
  * and any kind of dithering is imprecise by definition anyway - WJ */
 
+/* Palette gets put into a k-d tree, with up to 8 colours in a leaf; a leaf
+ * gets measured all at once by vector code, and a subtree gets skipped if
+ * the splitting plane is further away than the nearest colour found yet.
+ * Distance to the plane is never more than any of the 3 measures, and ties
+ * get resolved to lowest index, so results are exactly those of a plain
+ * scan through the palette */
+
+#define KD_LEAF   8
+#define KD_NODES 64 /* Enough for 256 colours */
+
 typedef struct {
 	double xyz256[768], gamma[256 * 2], lin[256 * 2];
 	int cspace, cdist, ncols;
-	guint32 xcmap[64 * 64 * 2 + 128 * 2]; /* Cache bitmap */
+	/* K-d tree: splits and their axes, or -1 for leaves, then leaves'
+	 * colours, as X coords, Y coords and Z coords */
+	double kdsplit[KD_NODES], kdleaf[KD_NODES][KD_LEAF * 3];
+	short kdaxis[KD_NODES], kdidx[KD_NODES][KD_LEAF];
+	guint32 xcmap[64 * 64 * 2 + 128 * 2]; /* Palette scratchpad */
 	guint32 lcmap[64 * 64 * 2]; /* Extension bitmap */
-	unsigned char cmap[64 * 64 * 64 + 128 * 64]; /* Index cache */
+	/* Index cache; holds index+1, so that 0 means "not there yet". Threads
+	 * racing to fill the same slot will all write the same value there */
+	unsigned short cmap[64 * 64 * 64 + 128 * 64];
 } ctable;
 
 static ctable *ctp;
 
-/* !!! Beware of GCC misoptimizing this! The two functions below is the result
- * of much trial and error, and hopefully not VERY brittle; but still, after any
- * modification to them, compare the performance to what it was before - WJ */
+static void kd_build(short *ord, int n, int node)
+{
+	double *xyz = ctp->xyz256, d, dmax = -1.0;
+	int i, j, k, l, axis = 0;
 
-static int find_nearest(int col[3], int n)
+	if (n <= KD_LEAF) /* Leaf, with colours in index order */
+	{
+		for (i = 1; i < n; i++)
+		{
+			for (k = ord[i] , j = i; (j > 0) && (ord[j - 1] > k); j--)
+				ord[j] = ord[j - 1];
+			ord[j] = k;
+		}
+		ctp->kdaxis[node] = -1;
+		for (i = 0; i < KD_LEAF; i++)
+		{
+			/* Padding never gets chosen */
+			ctp->kdidx[node][i] = i < n ? ord[i] : 0x7FFF;
+			for (j = 0; j < 3; j++) ctp->kdleaf[node][j * KD_LEAF + i] =
+				i < n ? xyz[ord[i] * 3 + j] : 1e100;
+		}
+		return;
+	}
+
+	/* Split along the longest side, at median */
+	for (j = 0; j < 3; j++)
+	{
+		double lo = xyz[ord[0] * 3 + j], hi = lo;
+		for (i = 1; i < n; i++)
+		{
+			d = xyz[ord[i] * 3 + j];
+			if (d < lo) lo = d;
+			if (d > hi) hi = d;
+		}
+		if (hi - lo > dmax) dmax = hi - lo , axis = j;
+	}
+	for (i = 1; i < n; i++)
+	{
+		d = xyz[(k = ord[i]) * 3 + axis];
+		for (j = i; (j > 0) && (xyz[ord[j - 1] * 3 + axis] > d); j--)
+			ord[j] = ord[j - 1];
+		ord[j] = k;
+	}
+	l = n >> 1;
+	ctp->kdaxis[node] = axis;
+	ctp->kdsplit[node] = xyz[ord[l] * 3 + axis];
+	kd_build(ord, l, node * 2);
+	kd_build(ord + l, n - l, node * 2 + 1);
+}
+
+static void kd_search(double *v, int node, double *d, int *j)
 {
-	/* !!! Stack misalignment is a very real issue here */
-	unsigned char tmp_[4 * sizeof(double)];
-	double *tmp = ALIGNED(tmp_, sizeof(double));
+	double diff, td[KD_LEAF];
+	int i, k;
 
-	
-	/* Prepare colour coords */
+	while ((k = ctp->kdaxis[node]) >= 0)
+	{
+		diff = v[k] - ctp->kdsplit[node];
+		node = node * 2 + (diff >= 0.0);
+		kd_search(v, node, d, j); // Nearer side
+		if (fabs(diff) > *d) return; // Further side is too far
+		node ^= 1;
+	}
+	distance_doubles(td, v, ctp->kdleaf[node], KD_LEAF, ctp->cdist);
+	for (i = 0; i < KD_LEAF; i++)
+	{
+		k = ctp->kdidx[node][i];
+		if ((td[i] < *d) || ((td[i] == *d) && (k < *j)))
+			*d = td[i] , *j = k;
+	}
+}
+
+static void palette_tree()
+{
+	short ord[256];
+	int i;
+
+	for (i = 0; i < ctp->ncols; i++) ord[i] = i;
+	kd_build(ord, ctp->ncols, 1);
+}
+
+static void nearest_coords(double *tmp, int col[3], int n)
+{
 	switch (ctp->cspace)
 	{
 	default:
@@ -3022,25 +4036,27 @@ static int find_nearest(int col[3], int n)
 			ctp->gamma[n + col[2]]);
 		break;
 	}
+}
 
-	/* Find nearest colour */
-	{
-		const distance_func dist = distance_3d[ctp->cdist];
-		double d = 1000000000.0, td, *xyz = ctp->xyz256;
-		int i, j, l = ctp->ncols;
+/* !!! Beware of GCC misoptimizing this! The two functions below is the result
+ * of much trial and error, and hopefully not VERY brittle; but still, after any
+ * modification to them, compare the performance to what it was before - WJ */
 
-		for (i = j = 0; i < l; i++)
-		{
-			td = dist(tmp, xyz + i * 3);
-			if (td < d) j = i , d = td;
-		}
-		return (j);
-	}
+static int find_nearest(int col[3], int n)
+{
+	/* !!! Stack misalignment is a very real issue here */
+	unsigned char tmp_[4 * sizeof(double)];
+	double *tmp = ALIGNED(tmp_, sizeof(double)), d = 1000000000.0;
+	int j = 0;
+
+	nearest_coords(tmp, col, n);
+	kd_search(tmp, 1, &d, &j);
+	return (j);
 }
 
 static int lookup_srgb(double *srgb)
 {
-	int k, n = 0, col[3];
+	int k, v, n = 0, col[3];
 
 	/* Convert to 8-bit RGB coords */
 	col[0] = UNGAMMA256(srgb[0]);
@@ -3055,122 +4071,60 @@ static int lookup_srgb(double *srgb)
 	else n = 256; /* Use posterized values for 6-bit part */
 
 	/* Use colour cache if possible */
-	if (!(ctp->xcmap[k >> 5] & (1U << (k & 31))))
-	{
-		ctp->xcmap[k >> 5] |= 1U << (k & 31);
-		ctp->cmap[k] = find_nearest(col, n);
-	}
+	if (!(v = ctp->cmap[k])) ctp->cmap[k] = v = find_nearest(col, n) + 1;
 
-	return (ctp->cmap[k]);
+	return (v - 1);
 }
 
-// !!! No support for transparency yet !!!
-/* Damping functions roughly resemble old GIMP's behaviour, but may need some
- * tuning because linear sRGB is just too different from normal RGB */
-int mem_dither(unsigned char *old, int ncols, short *dither, int cspace,
-	int dist, int limit, int selc, int serpent, int rgb8b, double emult)
-{
-	int i, j, k, l, kk, j0, j1, dj, rlen, col0, col1, progress;
-	unsigned char *ddata, *src, *dest;
-	double *row0, *row1, *row2, *tmp;
-	double err, intd, extd, *gamma6, *lin6;
-	double tc0[3], tc1[3], color0[3], color1[3];
-	double fdiv = 0, gamut[6] = {1, 1, 1, 0, 0, 0};
-
-	/* Allocate working space */
-	rlen = (mem_width + 4) * 3 * sizeof(double);
-	ddata = multialloc(MA_ALIGN_DOUBLE,
-		&row0, rlen,
-		&row1, rlen,
-		&row2, rlen,
-		&ctp, sizeof(ctable),
-		NULL);
-	if (!ddata) return (1);
+/* Error diffusion goes in a wavefront: a row is taken by whichever thread is
+ * free, and each pixel waits till the row above is done with 2 pixels to each
+ * side of it. This gives exactly the same sums in the same order as doing it
+ * all in one thread; but it cannot work with serpentine scan */
 
-	if ((progress = mem_width * mem_height > 1000000))
-		progress_init(_("Converting to Indexed Palette"), 0);
+#define DITH_STEP 32 /* Pixels done between progress reports to next row */
 
-	/* Preprocess palette to find whether to extend precision and where */
-	for (i = 0; i < ncols; i++)
-	{
-		j = ((mem_pal[i].red & 0xFC) << 10) +
-			((mem_pal[i].green & 0xFC) << 4) +
-			(mem_pal[i].blue >> 2);
-		if (!(l = ctp->cmap[j]))
-		{
-			ctp->cmap[j] = l = i + 1;
-			ctp->xcmap[l * 4 + 2] = j;
-		}
-		k = ((mem_pal[i].red & 3) << 4) +
-			((mem_pal[i].green & 3) << 2) +
-			(mem_pal[i].blue & 3);
-		ctp->xcmap[l * 4 + (k & 1)] |= 1U << (k >> 1);
-	}
-	memset(ctp->cmap, 0, 64 * 64 * 64);
-	for (k = 0 , i = 4; i < 256 * 4; i += 4)
-	{
-		guint32 v = ctp->xcmap[i] | ctp->xcmap[i + 1];
-		/* Are 2+ colors there somewhere? */
-		if (!((v & (v - 1)) | (ctp->xcmap[i] & ctp->xcmap[i + 1])))
-			continue;
-		rgb8b = TRUE; /* Force 8-bit precision */
-		j = ctp->xcmap[i + 2];
-		ctp->lcmap[j >> 5] |= 1U << (j & 31);
-		ctp->cmap[j] = k++;
-	}
-	memset(ctp->xcmap, 0, 257 * 4 * sizeof(guint32));
+typedef struct {
+	unsigned char *old;
+	short *dither;
+	double *rows;	// Error rows, in a ring
+	int *done;	// How many pixels each row is done with
+	int *next;	// Next row to process
+	double *gamma6;
+	double gamut[6], fdiv, emult;
+	int nrows, limit, selc, serpent, progress;
+} ditherd;
+
+static void dither_rows(tcb *thread)
+{
+	ditherd *dd = thread->data;
+	unsigned char *src, *dest;
+	short *dither = dd->dither;
+	double *row0, *row1, *row2, *gamma6 = dd->gamma6, *gamut = dd->gamut;
+	double err, intd, extd, fdiv = dd->fdiv, emult = dd->emult;
+	double tc0[3], tc1[3], color0[3], color1[3];
+	int i, j, k, l, kk, j0, j1, dj, x, col0, col1, seen, need, nr = 0;
+	int limit = dd->limit, selc = dd->selc, rlen = (mem_width + 4) * 3;
+	int *done = dd->done;
 
-	/* Prepare tables */
-	for (i = 0; i < 256; i++)
-	{
-		j = (i & 0xFC) + (i >> 6);
-		ctp->gamma[i] = gamma256[i];
-		ctp->gamma[i + 256] = gamma256[j];
-		ctp->lin[i] = i * (1.0 / 255.0);
-		ctp->lin[i + 256] = j * (1.0 / 255.0);
-	}
-	/* Keep all 8 bits of input or posterize to 6 bits? */
-	i = rgb8b ? 0 : 256;
-	gamma6 = ctp->gamma + i; lin6 = ctp->lin + i;
-	tmp = ctp->xyz256;
-	for (i = 0; i < ncols; i++ , tmp += 3)
+	while ((i = thread_xadd(dd->next, 1)) < mem_height)
 	{
-		/* Update gamut limits */
-		tmp[0] = gamma6[mem_pal[i].red];
-		tmp[1] = gamma6[mem_pal[i].green];
-		tmp[2] = gamma6[mem_pal[i].blue];
-		for (j = 0; j < 3; j++)
-		{
-			if (tmp[j] < gamut[j]) gamut[j] = tmp[j];
-			if (tmp[j] > gamut[j + 3]) gamut[j + 3] = tmp[j];
-		}
-		/* Store colour coords */
-		switch (cspace)
+		src = dd->old + i * mem_width * 3;
+		dest = mem_img[CHN_IMAGE] + i * mem_width;
+		row0 = dd->rows + (i % dd->nrows) * rlen;
+		row1 = dd->rows + ((i + 1) % dd->nrows) * rlen;
+		row2 = dd->rows + ((i + 2) % dd->nrows) * rlen;
+		if (dither)
 		{
-		default:
-		case CSPACE_RGB:
-			tmp[0] = lin6[mem_pal[i].red];
-			tmp[1] = lin6[mem_pal[i].green];
-			tmp[2] = lin6[mem_pal[i].blue];
-			break;
-		case CSPACE_SRGB:
-			break; /* Done already */
-		case CSPACE_LXN:
-			rgb2LXN(tmp, tmp[0], tmp[1], tmp[2]);
-			break;
+			/* Wait till the ring slot is free */
+			k = i + 2 - dd->nrows;
+			while ((k >= 0) && (thread_xadd(done + k, 0) < mem_width))
+			{
+				if (thread->stop) goto stop;
+				thread_yield();
+			}
+			memset(row2, 0, rlen * sizeof(double));
 		}
-	}
-	ctp->cspace = cspace; ctp->cdist = dist; ctp->ncols = ncols;
-	serpent = serpent ? 0 : 2;
-	if (dither) fdiv = 1.0 / *dither++;
-
-	/* Process image */
-	for (i = 0; i < mem_height; i++)
-	{
-		src = old + i * mem_width * 3;
-		dest = mem_img[CHN_IMAGE] + i * mem_width;
-		memset(row2, 0, rlen);
-		if (serpent ^= 1)
+		if (!dd->serpent || !(i & 1))
 		{
 			j0 = 0; j1 = mem_width * 3; dj = 1;
 		}
@@ -3179,8 +4133,18 @@ int mem_dither(unsigned char *old, int ncols, short *dither, int cspace,
 			j0 = (mem_width - 1) * 3; j1 = -3; dj = -1;
 			dest += mem_width - 1;
 		}
-		for (j = j0; j != j1; j += dj * 3)
+		seen = i ? 0 : mem_width;
+		for (j = j0 , x = 0; j != j1; j += dj * 3 , x++)
 		{
+			/* Wait for the row above to get ahead */
+			need = x + 5 < mem_width ? x + 5 : mem_width;
+			while (dither && (seen < need))
+			{
+				if ((seen = thread_xadd(done + i - 1, 0)) >= need)
+					break;
+				if (thread->stop) goto stop;
+				thread_yield();
+			}
 			for (k = 0; k < 3; k++)
 			{
 				/* Posterize to 6 bits as natural for palette */
@@ -3269,22 +4233,238 @@ int mem_dither(unsigned char *old, int ncols, short *dither, int cspace,
 			color1[2] *= fdiv;
 			for (k = 0; k < 5; k++)
 			{
-				kk = j + (k - 2) * dj * 3 + 6;
-				for (l = 0; l < 3; l++ , kk++)
-				{
-					row0[kk] += color1[l] * dither[k];
-					row1[kk] += color1[l] * dither[k + 5];
-					row2[kk] += color1[l] * dither[k + 10];
-				}
+				kk = j + (k - 2) * dj * 3 + 6;
+				for (l = 0; l < 3; l++ , kk++)
+				{
+					row0[kk] += color1[l] * dither[k];
+					row1[kk] += color1[l] * dither[k + 5];
+					row2[kk] += color1[l] * dither[k + 10];
+				}
+			}
+			/* Let the row below go on */
+			if (!((x + 1) & (DITH_STEP - 1)))
+				thread_xadd(done + i, DITH_STEP);
+		}
+		if (dither) thread_xadd(done + i, mem_width - (x & ~(DITH_STEP - 1)));
+		if (dd->progress && thread_step(thread, ++nr, mem_height, 10))
+			break;
+	}
+stop:	thread_done(thread);
+}
+
+// !!! No support for transparency yet !!!
+/* Damping functions roughly resemble old GIMP's behaviour, but may need some
+ * tuning because linear sRGB is just too different from normal RGB */
+int mem_dither(unsigned char *old, int ncols, short *dither, int cspace,
+	int dist, int limit, int selc, int serpent, int rgb8b, double emult)
+{
+	threaddata *tdata;
+	ditherd dd;
+	int i, j, k, l, nt;
+	double *tmp, *gamma6, *lin6;
+
+	/* Allocate working space */
+	memset(&dd, 0, sizeof(dd));
+	/* Serpentine diffusion has each row wait for the entire previous one */
+	nt = dither && serpent ? 1 : image_threads(mem_width, mem_height);
+	dd.nrows = dither ? (nt < 1 ? 1 : nt) + 3 : 1;
+	tdata = talloc(MA_ALIGN_DOUBLE, nt, &dd, sizeof(dd),
+		&dd.rows, dd.nrows * (mem_width + 4) * 3 * sizeof(double),
+		&dd.done, mem_height * sizeof(int),
+		&dd.next, sizeof(int),
+		&ctp, sizeof(ctable),
+		NULL,
+		NULL);
+	if (!tdata) return (1);
+
+	/* Preprocess palette to find whether to extend precision and where */
+	for (i = 0; i < ncols; i++)
+	{
+		j = ((mem_pal[i].red & 0xFC) << 10) +
+			((mem_pal[i].green & 0xFC) << 4) +
+			(mem_pal[i].blue >> 2);
+		if (!(l = ctp->cmap[j]))
+		{
+			ctp->cmap[j] = l = i + 1;
+			ctp->xcmap[l * 4 + 2] = j;
+		}
+		k = ((mem_pal[i].red & 3) << 4) +
+			((mem_pal[i].green & 3) << 2) +
+			(mem_pal[i].blue & 3);
+		ctp->xcmap[l * 4 + (k & 1)] |= 1U << (k >> 1);
+	}
+	memset(ctp->cmap, 0, 64 * 64 * 64 * sizeof(ctp->cmap[0]));
+	for (k = 0 , i = 4; i < 256 * 4; i += 4)
+	{
+		guint32 v = ctp->xcmap[i] | ctp->xcmap[i + 1];
+		/* Are 2+ colors there somewhere? */
+		if (!((v & (v - 1)) | (ctp->xcmap[i] & ctp->xcmap[i + 1])))
+			continue;
+		rgb8b = TRUE; /* Force 8-bit precision */
+		j = ctp->xcmap[i + 2];
+		ctp->lcmap[j >> 5] |= 1U << (j & 31);
+		ctp->cmap[j] = k++;
+	}
+
+	/* Prepare tables */
+	for (i = 0; i < 256; i++)
+	{
+		j = (i & 0xFC) + (i >> 6);
+		ctp->gamma[i] = gamma256[i];
+		ctp->gamma[i + 256] = gamma256[j];
+		ctp->lin[i] = i * (1.0 / 255.0);
+		ctp->lin[i + 256] = j * (1.0 / 255.0);
+	}
+	/* Keep all 8 bits of input or posterize to 6 bits? */
+	i = rgb8b ? 0 : 256;
+	gamma6 = ctp->gamma + i; lin6 = ctp->lin + i;
+	dd.gamut[0] = dd.gamut[1] = dd.gamut[2] = 1;
+	tmp = ctp->xyz256;
+	for (i = 0; i < ncols; i++ , tmp += 3)
+	{
+		/* Update gamut limits */
+		tmp[0] = gamma6[mem_pal[i].red];
+		tmp[1] = gamma6[mem_pal[i].green];
+		tmp[2] = gamma6[mem_pal[i].blue];
+		for (j = 0; j < 3; j++)
+		{
+			if (tmp[j] < dd.gamut[j]) dd.gamut[j] = tmp[j];
+			if (tmp[j] > dd.gamut[j + 3]) dd.gamut[j + 3] = tmp[j];
+		}
+		/* Store colour coords */
+		switch (cspace)
+		{
+		default:
+		case CSPACE_RGB:
+			tmp[0] = lin6[mem_pal[i].red];
+			tmp[1] = lin6[mem_pal[i].green];
+			tmp[2] = lin6[mem_pal[i].blue];
+			break;
+		case CSPACE_SRGB:
+			break; /* Done already */
+		case CSPACE_LXN:
+			rgb2LXN(tmp, tmp[0], tmp[1], tmp[2]);
+			break;
+		}
+	}
+	ctp->cspace = cspace; ctp->cdist = dist; ctp->ncols = ncols;
+	palette_tree();
+	if (dither) dd.fdiv = 1.0 / *dither++;
+
+	/* Process image */
+	dd.old = old;
+	dd.dither = dither;
+	dd.gamma6 = gamma6;
+	dd.emult = emult;
+	dd.limit = limit;
+	dd.selc = selc;
+	dd.serpent = serpent;
+	dd.progress = mem_width * mem_height > 1000000;
+	tdata->silent = !dd.progress;
+	for (i = 0; i < tdata->count; i++)
+		memcpy(tdata->threads[i]->data, &dd, sizeof(dd));
+	if (dd.progress) progress_init(_("Converting to Indexed Palette"), 0);
+	launch_threads(dither_rows, tdata, NULL, mem_height);
+	if (dd.progress) progress_end();
+
+	free(tdata);
+	return (0);
+}
+
+/* Plain scan through the palette, kept only as reference for benchmark */
+static int nearest_scan(double *tmp)
+{
+	const distance_func dist = distance_3d[ctp->cdist];
+	double d = 1000000000.0, td, *xyz = ctp->xyz256;
+	int i, j, l = ctp->ncols;
+
+	for (i = j = 0; i < l; i++)
+	{
+		td = dist(tmp, xyz + i * 3);
+		if (td < d) j = i , d = td;
+	}
+	return (j);
+}
+
+#define NBENCH_COLS 1000000
+
+/* Map random colours to random 256-colour palette, by tree search and by
+ * plain scan, and compare the speed and results */
+int mem_nearest_bench()
+{
+	static char *spaces[NUM_CSPACES] = { "RGB", "sRGB", "LXN" };
+	static char *dists[NUM_DISTANCES] = { "Linf", "L1", "L2" };
+	char buf[64];
+	GTimer *timer;
+	double d, t0, t1, *v;
+	unsigned int seed;
+	unsigned char *r0, *r1;
+	int i, j, n, cs, ds, col[3];
+
+	ctp = calloc(1, sizeof(ctable));
+	v = malloc(NBENCH_COLS * 3 * sizeof(double));
+	r0 = malloc(NBENCH_COLS * 2);
+	r1 = r0 + NBENCH_COLS;
+	if (!ctp || !v || !r0)
+	{
+		free(ctp); free(v); free(r0);
+		ctp = NULL;
+		printf("Not enough memory for benchmark\n");
+		return (1);
+	}
+	for (i = 0; i < 256; i++)
+	{
+		ctp->gamma[i] = gamma256[i];
+		ctp->lin[i] = i * (1.0 / 255.0);
+	}
+
+	printf("Mapping %d colours to 256-colour palette, vector level %d\n",
+		NBENCH_COLS, simd_level());
+	printf("%-28s%12s%12s%8s%10s\n", "Test", "Old, col/s", "New, col/s",
+		"Gain", "Differ");
+	timer = g_timer_new();
+	for (cs = 0; cs < NUM_CSPACES; cs++)
+	for (ds = 0; ds < NUM_DISTANCES; ds++)
+	{
+		ctp->cspace = cs;
+		ctp->cdist = ds;
+		ctp->ncols = 256;
+		seed = 1;
+		for (i = 0; i < 256 + NBENCH_COLS; i++)
+		{
+			for (j = 0; j < 3; j++)
+			{
+				seed = seed * 1103515245 + 12345;
+				col[j] = (seed >> 16) & 0xFF;
 			}
+			nearest_coords(i < 256 ? ctp->xyz256 + i * 3 :
+				v + (i - 256) * 3, col, 0);
+		}
+
+		g_timer_start(timer);
+		for (i = 0; i < NBENCH_COLS; i++) r0[i] = nearest_scan(v + i * 3);
+		t0 = g_timer_elapsed(timer, NULL);
+
+		g_timer_start(timer);
+		palette_tree();
+		for (i = 0; i < NBENCH_COLS; i++)
+		{
+			d = 1000000000.0;
+			j = 0;
+			kd_search(v + i * 3, 1, &d, &j);
+			r1[i] = j;
 		}
-		tmp = row0; row0 = row1; row1 = row2; row2 = tmp;
-		if (progress && (i * 10) % mem_height >= mem_height - 10)
-			progress_update((float)(i + 1) / mem_height);
+		t1 = g_timer_elapsed(timer, NULL);
+
+		for (i = n = 0; i < NBENCH_COLS; i++) n += r0[i] != r1[i];
+		snprintf(buf, sizeof(buf), "%s %s", spaces[cs], dists[ds]);
+		printf("%-28s%12.0f%12.0f%7.2fx%10d\n", buf, NBENCH_COLS / t0,
+			NBENCH_COLS / t1, t0 / t1, n);
 	}
+	g_timer_destroy(timer);
 
-	if (progress) progress_end();
-	free(ddata);
+	free(ctp); free(v); free(r0);
+	ctp = NULL;
 	return (0);
 }
 
@@ -5266,60 +6446,35 @@ static void mem_clear_img(chanlist img, int w, int h, int bpp)
 		if (img[k]) memset(img[k], 0, l);
 }
 
-void mem_rotate_free_real(chanlist old_img, chanlist new_img, int ow, int oh,
-	int nw, int nh, int bpp, double angle, int mode, int gcor, int dis_a,
-	int silent)
-{
-	unsigned char *src, *dest, *alpha, A_rgb[3];
+typedef struct {
+	unsigned char **old_img, **new_img;
+	int ow, oh, nw, nh, bpp, mode, gcor, dis_a, progress;
+	double s1, s2, c1, c2, x00, y00;
+	double sca, csa, Y00, Y0h, Yw0, Ywh, X00, Xwh;
+	unsigned char A_rgb[3];
+} rotd;
+
+static void rotate_filter(tcb *thread)
+{
+	rotd *rd = thread->data;
+	unsigned char **old_img = rd->old_img, **new_img = rd->new_img;
+	unsigned char *src, *dest, *alpha, *A_rgb = rd->A_rgb;
 	unsigned char *pix1, *pix2, *pix3, *pix4;
-	int nx, ny, ox, oy, cc;
-	double rangle = (M_PI / 180.0) * angle;	// Radians
-	double s1, s2, c1, c2;			// Trig values
-	double cx0, cy0, cx1, cy1;
-	double x00, y00, x0y, y0y;		// Quick look up values
+	int ow = rd->ow, oh = rd->oh, nw = rd->nw, bpp = rd->bpp;
+	int mode = rd->mode, gcor = rd->gcor, dis_a = rd->dis_a;
+	int nx, ny, ox, oy, cc, ii, cnt;
+	double s1 = rd->s1, s2 = rd->s2, c1 = rd->c1, c2 = rd->c2;
+	double x00 = rd->x00, y00 = rd->y00, x0y, y0y;
 	double fox, foy, k1, k2, k3, k4;	// Pixel weights
 	double aa1, aa2, aa3, aa4, aa;
 	double rr, gg, bb;
-	double tw, th, ta, ca, sa, sca, csa, Y00, Y0h, Yw0, Ywh, X00, Xwh;
-
-	c2 = cos(rangle);
-	s2 = sin(rangle);
-	c1 = -s2;
-	s1 = c2;
-
-	/* Centerpoints, including half-pixel offsets */
-	cx0 = (ow - 1) / 2.0;
-	cy0 = (oh - 1) / 2.0;
-	cx1 = (nw - 1) / 2.0;
-	cy1 = (nh - 1) / 2.0;
-
-	x00 = cx0 - cx1 * s1 - cy1 * s2;
-	y00 = cy0 - cx1 * c1 - cy1 * c2;
-	A_rgb[0] = mem_col_A24.red;
-	A_rgb[1] = mem_col_A24.green;
-	A_rgb[2] = mem_col_A24.blue;
-
-	/* Prepare clipping rectangle */
-	tw = 0.5 * (ow + (mode ? 1 : 0));
-	th = 0.5 * (oh + (mode ? 1 : 0));
-	ta = M_PI * (angle / 180.0 - floor(angle / 180.0));
-	ca = cos(ta); sa = sin(ta);
-	sca = ca ? sa / ca : 0.0;
-	csa = sa ? ca / sa : 0.0;
-	Y00 = cy1 - th * ca - tw * sa;
-	Y0h = cy1 + th * ca - tw * sa;
-	Yw0 = cy1 - th * ca + tw * sa;
-	Ywh = cy1 + th * ca + tw * sa;
-	X00 = cx1 - tw * ca + th * sa;
-	Xwh = cx1 + tw * ca - th * sa;
-
-	mem_clear_img(new_img, nw, nh, bpp); /* Clear the channels */
+	double sca = rd->sca, csa = rd->csa, Y00 = rd->Y00, Y0h = rd->Y0h;
+	double Yw0 = rd->Yw0, Ywh = rd->Ywh, X00 = rd->X00, Xwh = rd->Xwh;
 
-	for (ny = 0; ny < nh; ny++)
+	cnt = thread->nsteps;
+	for (ny = thread->step0 , ii = 0; ii < cnt; ny++ , ii++)
 	{
 		int xl, xm;
-		if (!silent && ((ny * 10) % nh >= nh - 10))
-			progress_update((float)ny / nh);
 
 		/* Clip this row */
 		if (ny < Y0h) xl = ceil(X00 + (Y00 - ny) * sca);
@@ -5476,7 +6631,81 @@ void mem_rotate_free_real(chanlist old_img, chanlist new_img, int ow, int oh,
 				*dest++ = rint(aa1 + aa2 + aa3 + aa4);
 			}
 		}
+		if (rd->progress && thread_step(thread, ii + 1, cnt, 10)) break;
+	}
+	thread_done(thread);
+}
+
+void mem_rotate_free_real(chanlist old_img, chanlist new_img, int ow, int oh,
+	int nw, int nh, int bpp, double angle, int mode, int gcor, int dis_a,
+	int silent)
+{
+	rotd rd;
+	threaddata *tdata;
+	double rangle = (M_PI / 180.0) * angle;	// Radians
+	double s1, s2, c1, c2;			// Trig values
+	double cx0, cy0, cx1, cy1;
+	double tw, th, ta, ca, sa;
+
+	c2 = cos(rangle);
+	s2 = sin(rangle);
+	c1 = -s2;
+	s1 = c2;
+
+	/* Centerpoints, including half-pixel offsets */
+	cx0 = (ow - 1) / 2.0;
+	cy0 = (oh - 1) / 2.0;
+	cx1 = (nw - 1) / 2.0;
+	cy1 = (nh - 1) / 2.0;
+
+	rd.old_img = old_img;
+	rd.new_img = new_img;
+	rd.ow = ow;
+	rd.oh = oh;
+	rd.nw = nw;
+	rd.nh = nh;
+	rd.bpp = bpp;
+	rd.mode = mode;
+	rd.gcor = gcor;
+	rd.dis_a = dis_a;
+	rd.progress = !silent;
+	rd.s1 = s1;
+	rd.s2 = s2;
+	rd.c1 = c1;
+	rd.c2 = c2;
+	rd.x00 = cx0 - cx1 * s1 - cy1 * s2;
+	rd.y00 = cy0 - cx1 * c1 - cy1 * c2;
+	rd.A_rgb[0] = mem_col_A24.red;
+	rd.A_rgb[1] = mem_col_A24.green;
+	rd.A_rgb[2] = mem_col_A24.blue;
+
+	/* Prepare clipping rectangle */
+	tw = 0.5 * (ow + (mode ? 1 : 0));
+	th = 0.5 * (oh + (mode ? 1 : 0));
+	ta = M_PI * (angle / 180.0 - floor(angle / 180.0));
+	ca = cos(ta); sa = sin(ta);
+	rd.sca = ca ? sa / ca : 0.0;
+	rd.csa = sa ? ca / sa : 0.0;
+	rd.Y00 = cy1 - th * ca - tw * sa;
+	rd.Y0h = cy1 + th * ca - tw * sa;
+	rd.Yw0 = cy1 - th * ca + tw * sa;
+	rd.Ywh = cy1 + th * ca + tw * sa;
+	rd.X00 = cx1 - tw * ca + th * sa;
+	rd.Xwh = cx1 + tw * ca - th * sa;
+
+	mem_clear_img(new_img, nw, nh, bpp); /* Clear the channels */
+
+	/* Rows are independent, so go in bands */
+	tdata = talloc(MA_ALIGN_DEFAULT, image_threads(nw, nh),
+		&rd, sizeof(rd), NULL, NULL);
+	if (!tdata)
+	{
+		if (!silent) memory_errors(1);
+		return;
 	}
+	tdata->silent = silent;
+	launch_threads(rotate_filter, tdata, NULL, nh);
+	free(tdata);
 }
 
 #define PIX_ADD (127.0 / 128.0) /* Include all _visibly_ altered pixels */
@@ -5581,11 +6810,6 @@ int mem_image_rot( int dir )					// Rotate image 90 degrees
 ///	Code for scaling contributed by Dmitry Groshev, January 2006
 ///	Multicore support added by Dmitry Groshev, November 2010
 
-typedef struct {
-	float *k;
-	int idx;
-} fstep;
-
 static double Cubic(double x, double A)
 {
 	if (x < -1.5) return (0.0);
@@ -5754,13 +6978,33 @@ static fstep *make_filter(int l0, int l1, int type, int sharp, int bound)
 	return (res);
 }
 
+/* Resampling works in floats: each source row gets converted, filtered
+ * horizontally, and kept in a ring buffer while vertical filter taps still
+ * need it; vertical pass then sums the rows up across pixels, and horizontal
+ * one runs across channels of each pixel. RGB pixel is 4 floats, with the
+ * last one unused; RGBA pixel is 8 floats, as RGBA gets scaled as colour and
+ * colour multiplied by alpha, then alpha itself */
+
+#define SCALE_RING_MEM (8 * 1024 * 1024) /* Preferred ring size per thread */
+#define SCALE_BLOCK 2048 /* Floats to sum up at once, to stay in L1 cache */
+
 typedef struct {
-	int tmask, gcor, progress;
+	unsigned char *src, *alpha;	// Source channel, and alpha for RGBA
+	float *buf;			// Horizontally scaled rows
+	int nch, lo, next;		// Rows from lo to next-1 are loaded
+} scale_ring;
+
+typedef struct {
+	int tmask, gcor, progress, ref;
 	int ow, oh, nw, nh, bpp;
+	int ring, rlen;
 	unsigned char **src, **dest;
 	double *rgb;
+	float *buf, *row, *acc, *tmp;
+	float **rows;
 	fstep *hfilter, *vfilter;
 	threaddata *tdata; // For simplicity
+	float ftab[256];
 } scale_context;
 
 static void clear_scale(scale_context *ctx)
@@ -5772,28 +7016,312 @@ static void clear_scale(scale_context *ctx)
 
 static int prepare_scale(scale_context *ctx, int type, int sharp, int bound)
 {
+	fstep *tmpy;
+	int i, l, sz, nch = ctx->tmask ? 7 : 3, nc = nch + 1, maxh = 1;
+
 	ctx->hfilter = ctx->vfilter = NULL;
 	ctx->tdata = NULL;
 
-	/* We don't use threading for NN */
-	if (!type || (ctx->bpp == 1)) return (TRUE);
+	/* We don't use threading for NN */
+	if (!type || (ctx->bpp == 1)) return (TRUE);
+
+	if ((ctx->hfilter = make_filter(ctx->ow, ctx->nw, type, sharp, bound)) &&
+		(ctx->vfilter = make_filter(ctx->oh, ctx->nh, type, sharp, bound)))
+	{
+		l = ctx->ow - ctx->hfilter[0].idx * 2;
+		/* Ring holds all rows the widest vertical step needs, if fits;
+		 * extra channels get a ring each */
+		for (i = CHN_IMAGE + 1; i < NUM_CHANNELS; i++)
+			nc += ctx->dest[i] && !(ctx->tmask & CMASK_FOR(i));
+		for (tmpy = ctx->vfilter; tmpy[1].k; tmpy++)
+		{
+			i = tmpy[1].k - tmpy->k;
+			if (maxh < i) maxh = i;
+		}
+		i = SCALE_RING_MEM / (ctx->nw * nc * sizeof(float));
+		ctx->ring = maxh < i ? maxh : i < 4 ? 4 : i;
+		ctx->rlen = l * (nch + 1);
+		sz = ctx->ref ? 0 : ctx->ring * sizeof(float *) + (ctx->rlen +
+			ctx->ow * 3 + 8 + ctx->nw * (nc * ctx->ring + 8)) *
+			sizeof(float);
+		for (i = 0; i < 256; i++) ctx->ftab[i] = gamma256[i];
+		if ((ctx->tdata = talloc(MA_ALIGN_DOUBLE,
+			image_threads(ctx->nw, ctx->nh), ctx, sizeof(*ctx),
+			NULL,
+			// !!! No space for RGBAS for now
+			&ctx->rgb, ctx->ref ? l * nch * sizeof(double) : 0,
+			&ctx->buf, sz,
+			NULL)))
+		{
+			ctx->tdata->silent = !ctx->progress;
+			return (TRUE);
+		}
+	}
+
+	clear_scale(ctx);
+	return (FALSE);
+}
+
+static void tile_extend_f(float *temp, int w, int l)
+{
+	memcpy(temp - l, temp + w - l, l * sizeof(*temp));
+	memcpy(temp + w, temp, l * sizeof(*temp));
+}
+
+/* Get source row y, converted and scaled horizontally */
+static float *scale_ring_row(scale_context *ctx, scale_ring *r, int y)
+{
+	unsigned char *img;
+	float *tab = ctx->ftab, *res, *row, *tmp = ctx->tmp;
+	int i, n = ctx->ring, w = ctx->ow, nch = r->nch, l = nch + (nch > 1);
+	int ll = -ctx->hfilter[0].idx * l;
+
+	res = r->buf + ((y % n + n) % n) * ctx->nw * l;
+	/* Rows from lo to next-1, but no more than ring size, are valid */
+	if ((y >= r->lo) && (y < r->next) && (y >= r->next - n)) return (res);
+	if (y != r->next) r->lo = y;
+	r->next = y + 1;
+
+	/* Only simple tiling isn't built into filter */
+	y = (y + ctx->oh) % ctx->oh;
+	row = ctx->row + ll;
+	if (nch == 1) float_bytes(row, r->src + y * w, w);
+	else
+	{
+		img = r->src + y * w * 3;
+		if (ctx->gcor) for (i = 0; i < w * 3; i++) tmp[i] = tab[img[i]];
+		else float_bytes(tmp, img, w * 3);
+		expand_floats(row, tmp, nch == 7 ? r->alpha + y * w : NULL, w);
+	}
+	if (ll) tile_extend_f(row, w * l, ll);
+	filter_floats(res, row, ctx->hfilter, l);
+	return (res);
+}
+
+/* Store a run of summed up pixels */
+static void scale_store(scale_context *ctx, int nch, unsigned char *dest,
+	unsigned char *dsta, float *tp, int w)
+{
+	float *sp;
+	double mult;
+	int j, k, l = nch + (nch > 1);
+
+	if (!ctx->gcor || (nch == 1))
+	{
+		store_floats(dest, dsta, tp, w, l);
+		return;
+	}
+	for (k = 0; k < w; k++ , tp += l)
+	{
+		sp = tp;
+		mult = 1.0;
+		if (nch == 7)
+		{
+			j = (int)rint(tp[7]);
+			*dsta = j < 0 ? 0 : j > 0xFF ? 0xFF : j;
+			if (*dsta++) sp += 4 , mult /= tp[7];
+		}
+		/* Reverse gamma correction */
+		*dest++ = UNGAMMA256X(sp[0] * mult);
+		*dest++ = UNGAMMA256X(sp[1] * mult);
+		*dest++ = UNGAMMA256X(sp[2] * mult);
+	}
+}
+
+static void scale_line(scale_context *ctx, scale_ring *r, fstep *tmpy, int i,
+	unsigned char *dest, unsigned char *dsta)
+{
+	float **rows = ctx->rows, *tp = ctx->acc;
+	int j, k, n, x, y = tmpy->idx, h = tmpy[1].k - tmpy->k;
+	int nch = r->nch, l = nch + (nch > 1), w = ctx->nw, bw = SCALE_BLOCK / l;
+
+	dest += i * w * (nch == 1 ? 1 : 3);
+	if (nch == 7) dsta += i * w;
+
+	/* With all the rows in the ring, sum them up and store the results
+	 * a block of columns at a time, so that the sums stay in L1 cache */
+	if (h <= ctx->ring)
+	{
+		for (k = 0; k < h; k++)
+			rows[k] = scale_ring_row(ctx, r, y + k);
+		for (x = 0; x < w; x += bw)
+		{
+			if (bw > w - x) bw = w - x;
+			memset(tp, 0, bw * l * sizeof(float));
+			sum_floats(tp, rows, tmpy->k, h, bw * l);
+			scale_store(ctx, nch, dest, dsta, tp, bw);
+			for (k = 0; k < h; k++) rows[k] += bw * l;
+			dest += bw * (nch == 1 ? 1 : 3);
+			if (nch == 7) dsta += bw;
+		}
+		return;
+	}
+
+	/* Otherwise, sum up whole rows, in batches the ring can hold */
+	memset(tp, 0, w * l * sizeof(float));
+	for (j = 0; j < h; j += n)
+	{
+		n = h - j;
+		if (n > ctx->ring) n = ctx->ring;
+		for (k = 0; k < n; k++)
+			rows[k] = scale_ring_row(ctx, r, y + j + k);
+		sum_floats(tp, rows, tmpy->k + j, n, w * l);
+	}
+	scale_store(ctx, nch, dest, dsta, tp, w);
+}
+
+static void do_scale(tcb *thread)
+{
+	scale_context ctx = *(scale_context *)thread->data;
+	scale_ring r[NUM_CHANNELS];
+	fstep *tmpy;
+	float *tmp;
+	int i, ii, cc, cnt = thread->nsteps;
+
+
+	/* Carve up the thread's buffer */
+	ctx.rows = (void *)ctx.buf;
+	ctx.row = tmp = (float *)(ctx.rows + ctx.ring);
+	ctx.tmp = tmp += ctx.rlen;
+	ctx.acc = tmp += ctx.ow * 3 + 8;
+	tmp += ctx.nw * 8;
+	memset(r, 0, sizeof(r));
+	for (cc = CHN_IMAGE; cc < NUM_CHANNELS; cc++)
+	{
+		if (!ctx.dest[cc] || (cc && (ctx.tmask & CMASK_FOR(cc))))
+			continue;
+		r[cc].src = ctx.src[cc];
+		r[cc].alpha = ctx.src[CHN_ALPHA];
+		r[cc].nch = cc ? 1 : ctx.tmask ? 7 : 3;
+		r[cc].buf = tmp;
+		tmp += ctx.nw * (r[cc].nch + !cc) * ctx.ring;
+	}
+
+	/* For each destination line */
+	for (i = thread->step0 , ii = 0; ii < cnt; i++ , ii++)
+	{
+		tmpy = ctx.vfilter + i;
+		if (ctx.dest[CHN_IMAGE]) // Chanlist may contain, e.g., only mask
+			scale_line(&ctx, r + CHN_IMAGE, tmpy, i,
+				ctx.dest[CHN_IMAGE], ctx.dest[CHN_ALPHA]);
+
+		for (cc = CHN_IMAGE + 1; cc < NUM_CHANNELS; cc++)
+		{
+			if (ctx.dest[cc] && !(ctx.tmask & CMASK_FOR(cc)))
+				scale_line(&ctx, r + cc, tmpy, i,
+					ctx.dest[cc], NULL);
+		}
+
+		if (ctx.progress && thread_step(thread, ii + 1, cnt, 10)) break;
+	}
+	thread_done(thread);
+}
+
+static void do_scale_nn(chanlist old_img, chanlist neo_img, int img_bpp,
+	int type, int ow, int oh, int nw, int nh, int gcor, int progress)
+{
+	char *src, *dest;
+	int i, j, oi, oj, cc, bpp;
+	double scalex, scaley, deltax, deltay;
+
+
+	scalex = (double)ow / (double)nw;
+	scaley = (double)oh / (double)nh;
+	deltax = 0.5 * scalex - 0.5;
+	deltay = 0.5 * scaley - 0.5;
+
+	for (j = 0; j < nh; j++)
+	{
+		for (cc = 0 , bpp = img_bpp; cc < NUM_CHANNELS; cc++ , bpp = 1)
+		{
+			if (!neo_img[cc]) continue;
+			dest = neo_img[cc] + nw * j * bpp;
+			WJ_ROUND(oj, scaley * j + deltay);
+			src = old_img[cc] + ow * oj * bpp;
+			for (i = 0; i < nw; i++)
+			{
+				WJ_ROUND(oi, scalex * i + deltax);
+				oi *= bpp;
+				*dest++ = src[oi];
+				if (bpp == 1) continue;
+				*dest++ = src[oi + 1];
+				*dest++ = src[oi + 2];
+			}
+		}
+		if (progress && ((j * 10) % nh >= nh - 10))
+			progress_update((float)(j + 1) / nh);
+	}
+}
+
+
+int mem_image_scale_real(chanlist old_img, int ow, int oh, int bpp,
+	chanlist new_img, int nw, int nh, int type, int gcor, int sharp)
+{
+	scale_context ctx;
+
+	ctx.tmask = CMASK_NONE;
+	ctx.gcor = gcor;
+	ctx.progress = ctx.ref = FALSE;
+	ctx.ow = ow;
+	ctx.oh = oh;
+	ctx.nw = nw;
+	ctx.nh = nh;
+	ctx.bpp = bpp;
+	ctx.src = old_img;
+	ctx.dest = new_img;
+
+	if (!prepare_scale(&ctx, type, sharp, BOUND_MIRROR))
+		return (1);	// Not enough memory
+
+	if (type && (bpp == 3))
+		launch_threads(do_scale, ctx.tdata, NULL, nh);
+	else do_scale_nn(old_img, new_img, bpp, type, ow, oh, nw, nh, gcor, FALSE);
+
+	clear_scale(&ctx);
+	return (0);
+}
+
+int mem_image_scale(int nw, int nh, int type, int gcor, int sharp, int bound)	// Scale image
+{
+	scale_context ctx;
+	chanlist old_img;
+	int res;
+
+	memcpy(old_img, mem_img, sizeof(chanlist));
+	nw = nw < 1 ? 1 : nw > MAX_WIDTH ? MAX_WIDTH : nw;
+	nh = nh < 1 ? 1 : nh > MAX_HEIGHT ? MAX_HEIGHT : nh;
+
+	ctx.tmask = mem_img[CHN_ALPHA] && !channel_dis[CHN_ALPHA] ? CMASK_RGBA : CMASK_NONE;
+	ctx.gcor = gcor;
+	ctx.progress = TRUE;
+	ctx.ref = FALSE;
+	ctx.ow = mem_width;
+	ctx.oh = mem_height;
+	ctx.nw = nw;
+	ctx.nh = nh;
+	ctx.bpp = mem_img_bpp;
+	ctx.src = old_img;
+	ctx.dest = mem_img;
 
-	if ((ctx->hfilter = make_filter(ctx->ow, ctx->nw, type, sharp, bound)) &&
-		(ctx->vfilter = make_filter(ctx->oh, ctx->nh, type, sharp, bound)))
+	if (!prepare_scale(&ctx, type, sharp, bound))
+		return (1);	// Not enough memory
+
+	if (!(res = undo_next_core(UC_NOCOPY, nw, nh, mem_img_bpp, CMASK_ALL)))
 	{
-		int l = (ctx->ow - ctx->hfilter[0].idx * 2) * sizeof(double);
-		if ((ctx->tdata = talloc(MA_ALIGN_DOUBLE,
-			image_threads(ctx->nw, ctx->nh), ctx, sizeof(*ctx),
-			NULL,
-			// !!! No space for RGBAS for now
-			&ctx->rgb, l * (ctx->tmask ? 7 : 3),
-			NULL))) return (TRUE);
+		progress_init(_("Scaling Image"), 0);
+		if (type && (mem_img_bpp == 3))
+			launch_threads(do_scale, ctx.tdata, NULL, mem_height);
+		else do_scale_nn(old_img, mem_img, mem_img_bpp, type,
+			ctx.ow, ctx.oh, nw, nh, gcor, TRUE);
+		progress_end();
 	}
 
-	clear_scale(ctx);
-	return (FALSE);
+	clear_scale(&ctx);
+	return (res);
 }
 
+/* The old double-precision scaler, kept only as reference for benchmark */
+
 static void tile_extend(double *temp, int w, int l)
 {
 	memcpy(temp - l, temp + w - l, l * sizeof(*temp));
@@ -5994,13 +7522,12 @@ static void scale_rgba(fstep *tmpy, fstep *hfilter, double *work_area,
 	}
 }
 
-static void do_scale(tcb *thread)
+static void do_scale_ref(tcb *thread)
 {
 	scale_context ctx = *(scale_context *)thread->data;
 	fstep *tmpy;
 	int i, ii, cc, cnt = thread->nsteps;
 
-
 	/* For each destination line */
 	for (i = thread->step0 , ii = 0; ii < cnt; i++ , ii++)
 	{
@@ -6021,198 +7548,241 @@ static void do_scale(tcb *thread)
 					1, FALSE, ctx.ow, ctx.oh, ctx.nw, i,
 					ctx.src[cc], ctx.dest[cc]);
 		}
-
-		if (ctx.progress && thread_step(thread, ii + 1, cnt, 10)) break;
 	}
 	thread_done(thread);
 }
 
-static void do_scale_nn(chanlist old_img, chanlist neo_img, int img_bpp,
-	int type, int ow, int oh, int nw, int nh, int gcor, int progress)
-{
-	char *src, *dest;
-	int i, j, oi, oj, cc, bpp;
-	double scalex, scaley, deltax, deltay;
-
-
-	scalex = (double)ow / (double)nw;
-	scaley = (double)oh / (double)nh;
-	deltax = 0.5 * scalex - 0.5;
-	deltay = 0.5 * scaley - 0.5;
-
-	for (j = 0; j < nh; j++)
-	{
-		for (cc = 0 , bpp = img_bpp; cc < NUM_CHANNELS; cc++ , bpp = 1)
-		{
-			if (!neo_img[cc]) continue;
-			dest = neo_img[cc] + nw * j * bpp;
-			WJ_ROUND(oj, scaley * j + deltay);
-			src = old_img[cc] + ow * oj * bpp;
-			for (i = 0; i < nw; i++)
-			{
-				WJ_ROUND(oi, scalex * i + deltax);
-				oi *= bpp;
-				*dest++ = src[oi];
-				if (bpp == 1) continue;
-				*dest++ = src[oi + 1];
-				*dest++ = src[oi + 2];
-			}
-		}
-		if (progress && ((j * 10) % nh >= nh - 10))
-			progress_update((float)(j + 1) / nh);
-	}
-}
-
+#define BENCH_W 7680 /* 8K UHD */
+#define BENCH_H 4320
 
-int mem_image_scale_real(chanlist old_img, int ow, int oh, int bpp,
-	chanlist new_img, int nw, int nh, int type, int gcor, int sharp)
+/* Run the scaling code, or the reference one, and return the time it took */
+static double bench_scale(chanlist old_img, chanlist new_img, int nw, int nh,
+	int type, int gcor, int sharp, int bound, int ref)
 {
 	scale_context ctx;
+	GTimer *timer;
+	double res = -1.0;
 
-	ctx.tmask = CMASK_NONE;
+	ctx.tmask = CMASK_RGBA;
 	ctx.gcor = gcor;
 	ctx.progress = FALSE;
-	ctx.ow = ow;
-	ctx.oh = oh;
+	ctx.ref = ref;
+	ctx.ow = BENCH_W;
+	ctx.oh = BENCH_H;
 	ctx.nw = nw;
 	ctx.nh = nh;
-	ctx.bpp = bpp;
+	ctx.bpp = 3;
 	ctx.src = old_img;
 	ctx.dest = new_img;
 
-	if (!prepare_scale(&ctx, type, sharp, BOUND_MIRROR))
-		return (1);	// Not enough memory
+	timer = g_timer_new();
+	if (prepare_scale(&ctx, type, sharp, bound))
+	{
+		launch_threads(ref ? do_scale_ref : do_scale, ctx.tdata,
+			NULL, nh);
+		res = g_timer_elapsed(timer, NULL);
+		clear_scale(&ctx);
+	}
+	g_timer_destroy(timer);
+	return (res);
+}
 
-	if (type && (bpp == 3))
-		launch_threads(do_scale, ctx.tdata, NULL, nh);
-	else do_scale_nn(old_img, new_img, bpp, type, ow, oh, nw, nh, gcor, FALSE);
+int mem_scale_bench()
+{
+	static const struct {
+		char *name;
+		int type, sharp, gcor, bound, nw, nh;
+	} tests[] = {
+		{ "Area mapping 1/2", 1, TRUE, FALSE, BOUND_MIRROR, 3840, 2160 },
+		{ "Bicubic 1/2", 2, FALSE, FALSE, BOUND_MIRROR, 3840, 2160 },
+		{ "Bicubic 1/2 gamma", 2, FALSE, TRUE, BOUND_MIRROR, 3840, 2160 },
+		{ "Bicubic sharper 1/3 sharp", 5, TRUE, FALSE, BOUND_VOID, 2560, 1440 },
+		{ "Bicubic 5/4 tile", 2, FALSE, FALSE, BOUND_TILE, 9600, 5400 },
+		{ "Blackman-Harris 1/2", 6, FALSE, FALSE, BOUND_MIRROR, 3840, 2160 },
+		{ "Blackman-Harris 5/4 gamma", 6, FALSE, TRUE, BOUND_MIRROR, 9600, 5400 },
+		{ NULL }
+	};
+	chanlist src, dest, ref;
+	unsigned char *img, *mem, *memn, *memr;
+	double t0, t1, tr = 0.0, tn = 0.0;
+	unsigned int seed = 1;
+	int i, j, l, d, n, dmax;
+	int sz = BENCH_W * BENCH_H, nsz = 9600 * 5400;
+
+	mem = malloc(sz * 4);
+	memn = malloc(nsz * 4);
+	memr = malloc(nsz * 4);
+	if (!mem || !memn || !memr)
+	{
+		free(mem); free(memn); free(memr);
+		printf("Not enough memory for benchmark\n");
+		return (1);
+	}
+	memset(src, 0, sizeof(chanlist));
+	memset(dest, 0, sizeof(chanlist));
+	memset(ref, 0, sizeof(chanlist));
+	src[CHN_IMAGE] = mem;
+	src[CHN_ALPHA] = mem + sz * 3;
+
+	/* Hard edges, gradients, noise, and several levels of alpha */
+	img = mem;
+	for (i = 0; i < BENCH_H; i++)
+	for (j = 0; j < BENCH_W; j++ , img += 3)
+	{
+		seed = seed * 1103515245 + 12345;
+		n = (seed >> 16) & 0x1F;
+		img[0] = ((i >> 5) ^ (j >> 5)) & 1 ? 0xFF : 0;
+		d = ((i + j) * 0xE0) / (BENCH_W + BENCH_H) + n;
+		img[1] = d;
+		img[2] = n * 8;
+		src[CHN_ALPHA][i * BENCH_W + j] = ((i / 89 + j / 97) % 3) * 0x7F;
+	}
+
+	printf("Scaling %dx%d RGBA image, %d threads, vector level %d\n",
+		BENCH_W, BENCH_H, image_threads(BENCH_W, BENCH_H), simd_level());
+	printf("%-28s%10s%10s%8s%10s%6s\n", "Test", "Old, s", "New, s",
+		"Gain", "Differ", "Max");
+	for (i = 0; tests[i].name; i++)
+	{
+		l = tests[i].nw * tests[i].nh;
+		dest[CHN_IMAGE] = memn;
+		dest[CHN_ALPHA] = memn + l * 3;
+		ref[CHN_IMAGE] = memr;
+		ref[CHN_ALPHA] = memr + l * 3;
+		t0 = bench_scale(src, ref, tests[i].nw, tests[i].nh,
+			tests[i].type, tests[i].gcor, tests[i].sharp,
+			tests[i].bound, TRUE);
+		t1 = bench_scale(src, dest, tests[i].nw, tests[i].nh,
+			tests[i].type, tests[i].gcor, tests[i].sharp,
+			tests[i].bound, FALSE);
+		if ((t0 < 0) || (t1 < 0))
+		{
+			printf("%-28sNot enough memory\n", tests[i].name);
+			continue;
+		}
+		tr += t0; tn += t1;
+		for (j = n = dmax = 0; j < l * 4; j++)
+		{
+			d = abs(memn[j] - memr[j]);
+			n += !!d;
+			if (dmax < d) dmax = d;
+		}
+		printf("%-28s%10.3f%10.3f%7.2fx%10d%6d\n", tests[i].name,
+			t0, t1, t0 / t1, n, dmax);
+	}
+	if (tn > 0.0) printf("%-28s%10.3f%10.3f%7.2fx\n", "Total", tr, tn,
+		tr / tn);
 
+	free(mem); free(memn); free(memr);
 	return (0);
 }
 
-int mem_image_scale(int nw, int nh, int type, int gcor, int sharp, int bound)	// Scale image
-{
-	scale_context ctx;
-	chanlist old_img;
-	int res;
 
-	memcpy(old_img, mem_img, sizeof(chanlist));
-	nw = nw < 1 ? 1 : nw > MAX_WIDTH ? MAX_WIDTH : nw;
-	nh = nh < 1 ? 1 : nh > MAX_HEIGHT ? MAX_HEIGHT : nh;
 
-	ctx.tmask = mem_img[CHN_ALPHA] && !channel_dis[CHN_ALPHA] ? CMASK_RGBA : CMASK_NONE;
-	ctx.gcor = gcor;
-	ctx.progress = TRUE;
-	ctx.ow = mem_width;
-	ctx.oh = mem_height;
-	ctx.nw = nw;
-	ctx.nh = nh;
-	ctx.bpp = mem_img_bpp;
-	ctx.src = old_img;
-	ctx.dest = mem_img;
+typedef struct {
+	unsigned char *src, *dest, pad[3];
+	int type, bpp, ow, oh, w, sstep;
+} isod;
 
-	if (!prepare_scale(&ctx, type, sharp, bound))
-		return (1);	// Not enough memory
+/* Every pixel comes from one place in the old image, or is background; bands
+ * going bottom up and right to left can also work in place */
+static void isometrics_rows(tcb *thread)
+{
+	isod *id = thread->data;
+	unsigned char *src, *dest;
+	int i, ii, j, x, y, cnt, bpp = id->bpp, ow = id->ow, oh = id->oh;
+	int w = id->w, type = id->type, s0 = (ow - 1) >> 1, odd = ow & 1;
 
-	if (!(res = undo_next_core(UC_NOCOPY, nw, nh, mem_img_bpp, CMASK_ALL)))
+	cnt = thread->nsteps;
+	for (i = thread->step0 + cnt - 1 , ii = 0; ii < cnt; i-- , ii++)
 	{
-		progress_init(_("Scaling Image"), 0);
-		if (type && (mem_img_bpp == 3))
-			launch_threads(do_scale, ctx.tdata, NULL, mem_height);
-		else do_scale_nn(old_img, mem_img, mem_img_bpp, type,
-			ctx.ow, ctx.oh, nw, nh, gcor, TRUE);
-		progress_end();
+		dest = id->dest + (i * w + w) * bpp;
+		for (j = w - 1; j >= 0; j--)
+		{
+			dest -= bpp;
+			if (type < 2)	// Left/Right side down
+			{
+				x = j;
+				y = i - (type ? j >> 1 : s0 - ((j + odd) >> 1));
+			}
+			else		// Top/Bottom side right
+			{
+				x = j - (type == 3 ? i : oh - 1 - i);
+				y = i;
+			}
+			src = (x < 0) || (x >= ow) || (y < 0) || (y >= oh) ?
+				id->pad : id->src + y * id->sstep + x * bpp;
+			dest[0] = src[0];
+			if (bpp == 1) continue;
+			dest[1] = src[1];
+			dest[2] = src[2];
+		}
 	}
-
-	clear_scale(&ctx);
-	return (res);
+	thread_done(thread);
 }
 
-
-
 int mem_isometrics(int type)
 {
-	unsigned char *wrk, *src, *dest, *fill;
-	int i, j, k, l, cc, step, bpp, ow = mem_width, oh = mem_height;
+	isod id;
+	threaddata *tdata;
+	int i, cc, nt = 1, ow = mem_width, oh = mem_height;
 
 	if ( type<2 )
 	{
 		if ( (oh + (ow-1)/2) > MAX_HEIGHT ) return -5;
-		i = mem_image_resize(ow, oh + (ow-1)/2, 0, 0, 0);
+		nt = image_threads(ow, oh + (ow-1)/2);
 	}
 	if ( type>1 )
 	{
 		if ( (ow+oh-1) > MAX_WIDTH ) return -5;
-		i = mem_image_resize(ow + oh - 1, oh, 0, 0, 0);
+		nt = image_threads(ow + oh - 1, oh);
 	}
+	tdata = talloc(MA_ALIGN_DEFAULT, nt, &id, sizeof(id), NULL, NULL);
+	if (!tdata) return (1);
+	nt = tdata->count;
+
+	if ( type<2 ) i = mem_image_resize(ow, oh + (ow-1)/2, 0, 0, 0);
+	else i = mem_image_resize(ow + oh - 1, oh, 0, 0, 0);
 
-	if (i) return (i);
+	if (i)
+	{
+		free(tdata);
+		return (i);
+	}
 
+	id.type = type;
+	id.ow = ow;
+	id.oh = oh;
+	id.w = mem_width;
 	for (cc = 0; cc < NUM_CHANNELS; cc++)
 	{
 		if (!mem_img[cc]) continue;
-		bpp = BPP(cc);
-		if ( type < 2 )		// Left/Right side down
-		{
-			fill = mem_img[cc] + (mem_height - 1) * ow * bpp;
-			step = ow * bpp;
-			if (type) step = -step;
-			else fill += (2 - (ow & 1)) * bpp;
-			for (i = mem_height - 1; i >= 0; i--)
-			{
-				k = i + i + 2;
-				if (k > ow) k = ow;
-				l = k;
-				j = 0;
-				dest = mem_img[cc] + i * ow * bpp;
-				src = dest - step;
-				if (!type)
-				{
-					j = ow - k;
-					dest += j * bpp;
-					src += (j - ow * ((ow - j - 1) >> 1)) * bpp;
-					j = j ? 0 : ow & 1;
-					k += j;
-					if (j) src += step;
-				}
-				for (; j < k; j++)
-				{
-					if (!(j & 1)) src += step;
-					*dest++ = *src++;
-					if (bpp == 1) continue;
-					*dest++ = *src++;
-					*dest++ = *src++;
-				}
-				if (l < ow)
-				{
-					if (!type) dest = mem_img[cc] + i * ow * bpp;
-					memcpy(dest, fill, (ow - l) * bpp);
-				}
-			}
-		}
-		else			// Top/Bottom side right
+		id.bpp = BPP(cc);
+		id.dest = mem_img[cc];
+
+		/* Remember background, if there is any */
+		memset(id.pad, 0, sizeof(id.pad));
+		i = type < 2 ? (mem_height > oh ? oh * mem_width : -1) :
+			oh > 1 ? ow : -1;
+		if (i >= 0) memcpy(id.pad, id.dest + i * id.bpp, id.bpp);
+
+		/* Read the old image from undo, or failing that, from the
+		 * new one in place, with one thread */
+		id.src = mem_undo_previous(cc);
+		id.sstep = ow * id.bpp;
+		tdata->count = nt;
+		if (id.src == id.dest)
 		{
-			step = mem_width * bpp;
-			fill = mem_img[cc] + ow * bpp;
-			k = (oh - 1) * mem_width * bpp;
-			if (type == 2)
-			{
-				fill += k;
-				step = -step;
-			}
-			wrk = fill + step - 1;
-			k = ow * bpp;
-			for (i = 1; i < oh; i++)
-			{
-				src = wrk;
-				dest = wrk + i * bpp;
-				for (j = 0; j < k; j++)
-					*dest-- = *src--;
-				memcpy(src + 1, fill, i * bpp);
-				wrk += step;
-			}
+			id.sstep = mem_width * id.bpp;
+			tdata->count = 1;
 		}
+
+		for (i = 0; i < nt; i++)
+			memcpy(tdata->threads[i]->data, &id, sizeof(id));
+		tdata->silent = TRUE;
+		launch_threads(isometrics_rows, tdata, NULL, mem_height);
 	}
+	free(tdata);
 
 	return 0;
 }
@@ -7498,72 +9068,269 @@ void process_img(int start, int step, int cnt, unsigned char *mask,
 				nrgb[1] ^= (nrgb[1] ^ img0[1]) & (ops >> 8);
 				nrgb[2] ^= (nrgb[2] ^ img0[2]) & (ops >> 16);
 			}
-
-			imgr[0] = nrgb[0];
-			imgr[1] = nrgb[1];
-			imgr[2] = nrgb[2];
+
+			imgr[0] = nrgb[0];
+			imgr[1] = nrgb[1];
+			imgr[2] = nrgb[2];
+		}
+	}	
+}
+
+/* !!! This assumes dest area lies entirely within src, its bpp matches src's
+ * current channel bpp, and it has alpha channel only if src has it too */
+void copy_area(image_info *dest, image_info *src, int x, int y)
+{
+	int w = dest->width, h = dest->height, bpp = dest->bpp, ww = src->width;
+	int i, ofs, delta, len;
+
+	/* Current channel */
+	ofs = (y * ww + x) * bpp;
+	delta = 0;
+	len = w * bpp;
+	for (i = 0; i < h; i++)
+	{
+		memcpy(dest->img[CHN_IMAGE] + delta, src->img[mem_channel] + ofs, len);
+		ofs += ww * bpp;
+		delta += len;
+	}
+
+	/* Alpha channel */
+	if (!dest->img[CHN_ALPHA]) return;
+	ofs = y * ww + x;
+	delta = 0;
+	for (i = 0; i < h; i++)
+	{
+		memcpy(dest->img[CHN_ALPHA] + delta, src->img[CHN_ALPHA] + ofs, w);
+		ofs += ww;
+		delta += w;
+	}
+}
+
+/* Colour statistics are collected in bands of rows on multiple threads, each
+ * thread setting bits for colours present in its own bitset; then the bitsets
+ * are merged, and if wanted, pixels are counted in a table indexed by rank of
+ * colour's bit in the merged bitset - which is exact and compact however many
+ * colours there are. For main image, the result is kept till undo state
+ * changes */
+
+#define CS_WORDS 0x80000 /* 32-bit words in a bitset of 24-bit colours */
+#define CS_PRIVATE 0x10000 /* Max colours to count separately by each thread */
+
+typedef struct {
+	unsigned char *img;
+	guint32 *bits;		// Bitset of colours present
+	unsigned int *rank;	// Bits set before each word
+	int *cnt;		// Pixel counts by colour rank
+	int *rgb;		// Channel value frequencies
+	int w, shared;
+} cstat_info;
+
+static void cstat_scan(tcb *thread)
+{
+	cstat_info *ci = thread->data;
+	unsigned char *im = ci->img + thread->step0 * ci->w * 3;
+	guint32 *bits = ci->bits;
+	int (*rgb)[3] = (void *)ci->rgb;
+	int i, c, n = thread->nsteps * ci->w;
+
+	for (i = 0; i < n; i++ , im += 3)
+	{
+		c = im[0] + (im[1] << 8) + (im[2] << 16);
+		bits[c >> 5] |= 1U << (c & 31);
+		rgb[im[0]][0]++;
+		rgb[im[1]][1]++;
+		rgb[im[2]][2]++;
+	}
+}
+
+static void cstat_count(tcb *thread)
+{
+	cstat_info *ci = thread->data;
+	unsigned char *im = ci->img + thread->step0 * ci->w * 3;
+	guint32 *bits = ci->bits;
+	unsigned int *rank = ci->rank;
+	int *cnt = ci->cnt;
+	int i, j, c, n = thread->nsteps * ci->w;
+
+	for (i = 0; i < n; i++ , im += 3)
+	{
+		c = im[0] + (im[1] << 8) + (im[2] << 16);
+		j = c >> 5;
+		j = rank[j] + bitcount(bits[j] & ((1U << (c & 31)) - 1));
+		/* Too many colours for a table per thread */
+		if (ci->shared) thread_xadd(cnt + j, 1);
+		else cnt[j]++;
+	}
+}
+
+/* Put colour into min-heap of most frequent ones, if it belongs there */
+static void cstat_top(col_freq *heap, int *n, int rgb, int cnt)
+{
+	int i, j, k = *n;
+
+	if (k < COL_STATS_TOP) i = (*n)++; // Add to bottom
+	else if (cnt <= heap[0].cnt) return; // Not frequent enough
+	else /* Replace top (least frequent), and sift it down */
+	{
+		for (i = 0; (j = i * 2 + 1) < k; i = j)
+		{
+			j += (j + 1 < k) && (heap[j + 1].cnt < heap[j].cnt);
+			if (heap[j].cnt >= cnt) break;
+			heap[i] = heap[j];
+		}
+		heap[i].rgb = rgb;
+		heap[i].cnt = cnt;
+		return;
+	}
+	/* Sift up */
+	for (; i && (heap[j = (i - 1) >> 1].cnt > cnt); i = j)
+		heap[i] = heap[j];
+	heap[i].rgb = rgb;
+	heap[i].cnt = cnt;
+}
+
+static int cmp_freq(const void *f1, const void *f2)
+{
+	const col_freq *a = f1, *b = f2;
+	return (a->cnt != b->cnt ? b->cnt - a->cnt : a->rgb - b->rgb);
+}
+
+int mem_get_col_stats(col_stats *cs, unsigned char *img, int w, int h, int freq)
+{
+	cstat_info ci;
+	threaddata *tdata, *tdata2 = NULL;
+	guint32 *bits, v;
+	int i, j, k, n, nt, *cnt;
+
+
+	memset(cs, 0, sizeof(col_stats));
+	memset(&ci, 0, sizeof(ci));
+	ci.img = img;
+	ci.w = w;
+
+	/* Merging bitsets isn't free, so no thread for less than 2 pixels/word */
+	nt = image_threads(w, h);
+	i = ((size_t)w * h) / (CS_WORDS * 2);
+	if (nt > i) nt = i;
+
+	/* Fill bitsets & channel frequencies */
+	tdata = talloc(MA_ALIGN_DEFAULT, nt, &ci, sizeof(ci),
+		NULL,
+		&ci.bits, CS_WORDS * sizeof(guint32),
+		&ci.rgb, 256 * 3 * sizeof(int),
+		NULL);
+	if (!tdata) return (FALSE); // Not enough memory
+	tdata->silent = TRUE;
+	launch_threads(cstat_scan, tdata, NULL, h);
+
+	/* Merge them and count the colours */
+	bits = ((cstat_info *)tdata->threads[0]->data)->bits;
+	for (i = 0; i < tdata->count; i++)
+	{
+		cstat_info *ct = tdata->threads[i]->data;
+		int *rgb = ct->rgb;
+
+		for (j = 0; j < 256 * 3; j++) ((int *)cs->rgb)[j] += rgb[j];
+		if (!i) continue;
+		for (j = 0; j < CS_WORDS; j++) bits[j] |= ct->bits[j];
+	}
+	for (i = n = 0; i < CS_WORDS; i++) n += bitcount(bits[i]);
+	cs->cols = n;
+
+	while (freq)
+	{
+		/* Count pixels of each colour */
+		ci.bits = bits;
+		ci.shared = n > CS_PRIVATE;
+		tdata2 = talloc(MA_ALIGN_DEFAULT | MA_SKIP_ZEROSIZE,
+			image_threads(w, h), &ci, sizeof(ci),
+			&ci.rank, CS_WORDS * sizeof(int),
+			&ci.cnt, ci.shared ? n * sizeof(int) : 0,
+			NULL,
+			&ci.cnt, ci.shared ? 0 : n * sizeof(int),
+			NULL);
+		if (!tdata2) break; // Leave it at the count
+		/* Full table is nice to have, but not essential */
+		cs->tab = malloc(n * sizeof(col_freq));
+		for (i = k = 0; i < CS_WORDS; i++)
+		{
+			ci.rank[i] = k;
+			k += bitcount(bits[i]);
+		}
+		tdata2->silent = TRUE;
+		launch_threads(cstat_count, tdata2, NULL, h);
+		cnt = ((cstat_info *)tdata2->threads[0]->data)->cnt;
+		if (!ci.shared) for (i = 1; i < tdata2->count; i++)
+		{
+			int *c2 = ((cstat_info *)tdata2->threads[i]->data)->cnt;
+			for (j = 0; j < n; j++) cnt[j] += c2[j];
+		}
+
+		/* Pick the most frequent colours */
+		for (i = k = 0; i < CS_WORDS; i++)
+		{
+			for (v = bits[i]; v; v &= v - 1 , k++)
+			{
+				j = (i << 5) + nlog2(v & -v);
+				j = RGB_2_INT(j & 0xFF, (j >> 8) & 0xFF, j >> 16);
+				cstat_top(cs->freq, &cs->nfreq, j, cnt[k]);
+				if (!cs->tab) continue;
+				cs->tab[k].rgb = j;
+				cs->tab[k].cnt = cnt[k];
+			}
 		}
-	}	
+		qsort(cs->freq, cs->nfreq, sizeof(col_freq), cmp_freq);
+		break;
+	}
+
+	free(tdata2);
+	free(tdata);
+	return (TRUE);
 }
 
-/* !!! This assumes dest area lies entirely within src, its bpp matches src's
- * current channel bpp, and it has alpha channel only if src has it too */
-void copy_area(image_info *dest, image_info *src, int x, int y)
+col_stats *mem_col_stats(int flags)
 {
-	int w = dest->width, h = dest->height, bpp = dest->bpp, ww = src->width;
-	int i, ofs, delta, len;
+	static col_stats cs;
+	static unsigned char *img;
+	static unsigned int gen;
+	static int w, h, valid;
 
-	/* Current channel */
-	ofs = (y * ww + x) * bpp;
-	delta = 0;
-	len = w * bpp;
-	for (i = 0; i < h; i++)
-	{
-		memcpy(dest->img[CHN_IMAGE] + delta, src->img[mem_channel] + ofs, len);
-		ofs += ww * bpp;
-		delta += len;
-	}
+	if (mem_img_bpp != 3) return (NULL);
+	/* Use the cached result if image is the same and unchanged */
+	if (valid && !pen_down && (gen == undo_gen) &&
+		(img == mem_img[CHN_IMAGE]) && (w == mem_width) &&
+		(h == mem_height) && (cs.nfreq || !(flags & CS_FREQ)))
+		return (&cs);
+	if (flags & CS_CACHED) return (NULL);
 
-	/* Alpha channel */
-	if (!dest->img[CHN_ALPHA]) return;
-	ofs = y * ww + x;
-	delta = 0;
-	for (i = 0; i < h; i++)
-	{
-		memcpy(dest->img[CHN_ALPHA] + delta, src->img[CHN_ALPHA] + ofs, w);
-		ofs += ww;
-		delta += w;
-	}
+	free(cs.tab);
+	valid = mem_get_col_stats(&cs, mem_img[CHN_IMAGE], mem_width,
+		mem_height, flags & CS_FREQ);
+	/* Image being drawn on is changing even without new undo frames */
+	valid &= !pen_down;
+	img = mem_img[CHN_IMAGE];
+	w = mem_width;
+	h = mem_height;
+	gen = undo_gen;
+	return (valid || cs.cols ? &cs : NULL);
 }
 
+#undef CS_WORDS
+#undef CS_PRIVATE
+
 int mem_count_all_cols()				// Count all colours - Using main image
 {
-	return mem_count_all_cols_real(mem_img[CHN_IMAGE], mem_width, mem_height);
+	col_stats *cs = mem_col_stats(0);
+	return (cs ? cs->cols : -1);
 }
 
 int mem_count_all_cols_real(unsigned char *im, int w, int h)	// Count all colours - very memory greedy
 {
-	guint32 *tab;
-	int i, j, k, ix;
-
-	j = 0x80000;
-	tab = calloc(j, sizeof(guint32));	// HUGE colour cube
-	if (!tab) return -1;			// Not enough memory Mr Greedy ;-)
-
-	k = w * h;
-	for (i = 0; i < k; i++)			// Scan each pixel
-	{
-		ix = (im[0] >> 5) + (im[1] << 3) + (im[2] << 11);
-		tab[ix] |= 1U << (im[0] & 31);
-		im += 3;
-	}
-
-	// Count each colour
-	for (i = k = 0; i < j; i++) k += bitcount(tab[i]);
+	col_stats cs;
 
-	free(tab);
-
-	return k;
+	if (!mem_get_col_stats(&cs, im, w, h, FALSE))
+		return -1;			// Not enough memory Mr Greedy ;-)
+	return (cs.cols);
 }
 
 int mem_cols_used(png_color *pal)	// Count and collect colours used in main RGB image
@@ -7619,30 +9386,29 @@ static inline double dist(int n1, int n2)
 	return (sqrt(n1 * n1 + n2 * n2));
 }
 
-void do_effect(int type, int param)
+typedef struct {
+	int type, param;
+	unsigned char *src;	// Source image
+	unsigned char *mask;	// Mask and output row, per thread
+} effectd;
+
+static void effect_filter(tcb *thread)
 {
-	unsigned char *src, *dest, *tmp, *mask, *buf;
-	int i, j, uninit_(k), k1, k2, bpp, ll, dxp1, dxm1, dyp1, dym1;
-	int op, md, ms;
+	effectd *ed = thread->data;
+	unsigned char *src, *dest, *tmp, *mask = ed->mask, *buf;
+	int i, ii, cnt, j, uninit_(k), k1, k2, bpp, ll, dxp1, dxm1, dyp1, dym1;
+	int op, md, ms, type = ed->type, param = ed->param;
 	double blur = (double)param / 200.0;
 
 	bpp = MEM_BPP;
 	ll = mem_width * bpp;
 	ms = bpp == 3 ? 1 : 4;
-
-	src = mem_undo_previous(mem_channel);
-	mask = malloc(mem_width * (bpp + 1));
-	if (!mask)
-	{
-		memory_errors(1);
-		return;
-	}
 	buf = mask + mem_width;
 
-	progress_init(_("Applying Effect"), 1);
-
-	for (i = 0; i < mem_height; i++)
+	cnt = thread->nsteps;
+	for (i = thread->step0 , ii = 0; ii < cnt; i++ , ii++)
 	{
+		src = ed->src + i * ll;
 		row_protected(0, i, mem_width, tmp = mask);
 		dyp1 = i < mem_height - 1 ? ll : -ll;
 		dym1 = i ? -ll : ll;
@@ -7763,11 +9529,32 @@ void do_effect(int type, int param)
 		dest = mem_img[mem_channel] + i * ll;
 		process_img(0, 1, mem_width, mask, dest, dest, buf,
 			NULL, bpp, BLENDF_SET | BLENDF_INVM);
-		if ((i * 10) % mem_height >= mem_height - 10)
-			if (progress_update((float)(i + 1) / mem_height)) break;
+		if (thread_step(thread, ii + 1, cnt, 10)) break;
 	}
-	free(mask);
-	progress_end();
+	thread_done(thread);
+}
+
+void do_effect(int type, int param)
+{
+	effectd ed;
+	threaddata *tdata;
+
+	ed.type = type;
+	ed.param = param;
+	ed.src = mem_undo_previous(mem_channel);
+	tdata = talloc(MA_ALIGN_DEFAULT,
+		image_threads(mem_width, mem_height),
+		&ed, sizeof(ed),
+		NULL,
+		&ed.mask, mem_width * (MEM_BPP + 1),
+		NULL);
+	if (!tdata)
+	{
+		memory_errors(1);
+		return;
+	}
+	launch_threads(effect_filter, tdata, _("Applying Effect"), mem_height);
+	free(tdata);
 }
 
 /* Apply vertical filter */
@@ -7815,6 +9602,413 @@ static void vert_gauss(unsigned char *chan, int w, int h, int y, double *temp,
 	}
 }
 
+/* Faster blur engines: single precision, or 16-bit fixed point with 32-bit
+ * integer sums. Kernels up to FG_BOXLEN long are convolved as in the double
+ * path; longer ones are approximated by 3 successive box filters, of two
+ * nearby odd widths chosen to match the gaussian's variance (Kovesi's take
+ * on extended box), so that cost does not depend on radius. Each thread goes
+ * through its rows in order, keeping in ring buffers the rows it will need
+ * again, so vertical box passes are running sums too. Inner loops are the
+ * row kernels from simd.c.
+ *
+ * Versus the double path, on 8-bit values: convolution results are off by
+ * 1 at most - float ones in a few values per million, fixed-point ones in a
+ * few per 10000. Box passes leave most values within 1 level too, but near
+ * sharp edges can be off by up to 2% of step height (more with gamma
+ * correction, in dark tones), as 3 boxes are not quite a gaussian */
+
+#define FG_BOXLEN 16	/* Longest kernel to convolve with */
+#define FG_NONE (-0x40000000)	/* No rows in ring */
+
+typedef struct {
+	unsigned char *img, *alpha;	// Source channels
+	void *shared, *buf;		// Shared and per-thread memory
+	size_t ssize, tsize;		// Their sizes
+	float *kX, *kY;			// Kernels, for convolution
+	int *ikX, *ikY;			// Same in 16-bit fixed point
+	int *idx;			// Mirror boundary indices, horizontal
+	void *zero;			// A row of zeroes
+	void *ring[3];			// Source rows, and rows after 1st & 2nd box
+	void *sum[3];			// Running sums for vertical boxes
+	void *row;			// Vertically filtered row
+	void *hbuf[2];			// Horizontal pass buffers
+	int w, h, nch, fixed;
+	int lenX, lenY;			// Kernel lengths, or 0 if using boxes
+	int boxX[3], boxY[3];		// Box radii
+	int rows[3];			// Ring sizes
+	int next[4];			// Next row for each ring and output
+	int margin;			// Extra pixels on each side, horizontally
+	float ftab[256];		// Source values as floats
+	unsigned short stab[256];	// Same in 16 bits
+	double scale[7];		// Output multipliers
+} gaussfast;
+
+static int fg_mirror(int v, int n)
+{
+	int n2 = n > 1 ? n + n - 2 : 1;
+
+	v = abs(v) % n2;
+	return (v < n ? v : n2 - v);
+}
+
+/* Pick radii for 3 boxes, for a gaussian of given mtPaint radius */
+static void fg_boxes(int *r, double radius)
+{
+	double s2, wi;
+	int i, m, wl;
+
+	/* Same sigma as the kernel init_gauss() makes */
+	s2 = (radius + 1.0) * (radius + 1.0) / (2.0 * log(255.0));
+	wi = sqrt(4.0 * s2 + 1.0);
+	wl = wi;
+	if (!(wl & 1)) wl--;
+	m = rint((12.0 * s2 - 3 * wl * wl - 12 * wl - 9) / (-4.0 * wl - 4.0));
+	for (i = 0; i < 3; i++) r[i] = (i < m ? wl - 1 : wl + 1) >> 1;
+}
+
+static void *fg_chunk(void *base, size_t *ofs, size_t n)
+{
+	void *res = base ? (char *)base + *ofs : NULL;
+	*ofs += (n + 7) & ~7;
+	return (res);
+}
+
+/* Lay out engine's memory; without memory yet, only count its size */
+static void fg_layout(gaussfast *gf)
+{
+	size_t ss = 0, ts = 0, rl = gf->w * gf->nch;
+	int i, es = gf->fixed ? 2 : 4;
+
+	gf->kX = fg_chunk(gf->shared, &ss, gf->lenX * sizeof(float));
+	gf->kY = fg_chunk(gf->shared, &ss, gf->lenY * sizeof(float));
+	gf->ikX = fg_chunk(gf->shared, &ss, gf->lenX * sizeof(int));
+	gf->ikY = fg_chunk(gf->shared, &ss, gf->lenY * sizeof(int));
+	gf->idx = fg_chunk(gf->shared, &ss, gf->margin * 2 * sizeof(int));
+	gf->zero = fg_chunk(gf->shared, &ss, rl * 4);
+	for (i = 0; i < 3; i++)
+		gf->ring[i] = fg_chunk(gf->buf, &ts, gf->rows[i] * rl * es);
+	for (i = 0; i < (gf->lenY ? 1 : 3); i++)
+		gf->sum[i] = fg_chunk(gf->buf, &ts, rl * 4);
+	gf->row = fg_chunk(gf->buf, &ts, rl * 4);
+	for (i = 0; i < 2; i++) gf->hbuf[i] = fg_chunk(gf->buf, &ts,
+		(gf->w + gf->margin * 2) * gf->nch * 4);
+	gf->ssize = ss;
+	gf->tsize = ts;
+}
+
+/* Set up engine for at most nch channels: 1, 3, or 7 for coupled RGBA */
+static int fg_init(gaussfast *gf, double radiusX, double radiusY, int nch,
+	int fixed)
+{
+	int i;
+
+	memset(gf, 0, sizeof(gaussfast));
+	gf->w = mem_width;
+	gf->h = mem_height;
+	gf->nch = nch;
+	gf->fixed = fixed;
+	gf->lenX = ceil(radiusX) + 2;
+	gf->lenY = ceil(radiusY) + 2;
+	gf->margin = gf->lenX - 1;
+	if (gf->lenX > FG_BOXLEN)
+	{
+		fg_boxes(gf->boxX, radiusX);
+		gf->margin = gf->boxX[0] + gf->boxX[1] + gf->boxX[2];
+		gf->lenX = 0;
+	}
+	if (gf->lenY > FG_BOXLEN) fg_boxes(gf->boxY, radiusY) , gf->lenY = 0;
+	if (gf->lenY) gf->rows[0] = gf->lenY * 2 - 1;
+	else for (i = 0; i < 3; i++) gf->rows[i] = gf->boxY[i] * 2 + 2;
+	fg_layout(gf);
+	/* Must fit in talloc() */
+	return ((gf->ssize < INT_MAX / 2) && (gf->tsize < INT_MAX / 2));
+}
+
+static void fg_kernel(float *kf, int *ki, double *gauss, int len)
+{
+	int i, l = 65536;
+
+	for (i = len - 1; i > 0; i--)
+	{
+		kf[i] = gauss[i];
+		l -= (ki[i] = rint(gauss[i] * 65536.0)) * 2;
+	}
+	kf[0] = gauss[0];
+	ki[0] = l; // Is even, so can be halved exactly
+}
+
+/* Fill shared parts, from double kernels */
+static void fg_fill(gaussfast *gf, double *gaussX, double *gaussY)
+{
+	int i, m = gf->margin;
+
+	fg_layout(gf);
+	if (gf->lenX) fg_kernel(gf->kX, gf->ikX, gaussX, gf->lenX);
+	if (gf->lenY) fg_kernel(gf->kY, gf->ikY, gaussY, gf->lenY);
+	for (i = 0; i < m; i++)
+	{
+		gf->idx[i] = fg_mirror(i - m, gf->w);
+		gf->idx[m + i] = fg_mirror(gf->w + i, gf->w);
+	}
+}
+
+/* Prepare a thread's copy for a run */
+static void fg_start(gaussfast *gf, int nch, unsigned char *img,
+	unsigned char *alpha, int gcor)
+{
+	double s = gcor ? 1.0 / 65535.0 : 1.0 / 257.0;
+	int i;
+
+	gf->nch = nch;
+	gf->img = img;
+	gf->alpha = alpha;
+	fg_layout(gf);
+	for (i = 0; i < 4; i++) gf->next[i] = FG_NONE;
+
+	for (i = 0; i < 256; i++)
+	{
+		gf->ftab[i] = gcor ? gamma256[i] : i;
+		gf->stab[i] = gcor ? (int)rint(gamma256[i] * 65535.0) : i * 257;
+	}
+	/* Scale 16-bit values back to what double path has */
+	for (i = 0; i < 7; i++) gf->scale[i] = !gf->fixed ? 1.0 :
+		i < 3 ? s : i < 6 ? s * 255.0 : 1.0 / 257.0;
+}
+
+static void *fg_slot(gaussfast *gf, int s, int v)
+{
+	int n = gf->rows[s];
+
+	return ((char *)gf->ring[s] + ((v % n + n) % n) *
+		(gf->w * gf->nch * (gf->fixed ? 2 : 4)));
+}
+
+/* Convert source row v, mirrored at edges, into the ring */
+static void *fg_load(gaussfast *gf, int v)
+{
+	unsigned char *src, *alf;
+	void *res = fg_slot(gf, 0, v);
+	int i, a, y = fg_mirror(v, gf->h), w = gf->w;
+
+	if ((v < gf->next[0]) && (v >= gf->next[0] - gf->rows[0]))
+		return (res); // Have it already
+	gf->next[0] = v + 1;
+
+	if (gf->nch < 7)
+	{
+		int l = w * gf->nch;
+
+		src = gf->img + y * l;
+		if (gf->fixed)
+		{
+			unsigned short *dest = res;
+			for (i = 0; i < l; i++) dest[i] = gf->stab[src[i]];
+		}
+		else
+		{
+			float *dest = res;
+			for (i = 0; i < l; i++) dest[i] = gf->ftab[src[i]];
+		}
+		return (res);
+	}
+
+	/* RGB, RGB premultiplied by alpha, and alpha */
+	src = gf->img + y * w * 3;
+	alf = gf->alpha + y * w;
+	if (gf->fixed)
+	{
+		unsigned short *dest = res;
+		for (i = 0; i < w; i++ , src += 3 , dest += 7)
+		{
+			a = alf[i];
+			dest[3] = ((dest[0] = gf->stab[src[0]]) * a + 127) / 255;
+			dest[4] = ((dest[1] = gf->stab[src[1]]) * a + 127) / 255;
+			dest[5] = ((dest[2] = gf->stab[src[2]]) * a + 127) / 255;
+			dest[6] = a * 257;
+		}
+	}
+	else
+	{
+		float *dest = res;
+		for (i = 0; i < w; i++ , src += 3 , dest += 7)
+		{
+			a = alf[i];
+			dest[3] = (dest[0] = gf->ftab[src[0]]) * a;
+			dest[4] = (dest[1] = gf->ftab[src[1]]) * a;
+			dest[5] = (dest[2] = gf->ftab[src[2]]) * a;
+			dest[6] = a;
+		}
+	}
+	return (res);
+}
+
+/* Make row v after s vertical boxes, as part of an ascending sequence */
+static void *fg_box(gaussfast *gf, int s, int v)
+{
+	void *add, *sub = gf->zero, *res = s < 3 ? fg_slot(gf, s, v) : gf->row;
+	int t, r = gf->boxY[s - 1], rl = gf->w * gf->nch;
+	float mult = 1.0f / (r + r + 1);
+
+	if (v == gf->next[s]) /* Slide the window */
+	{
+		t = v + r;
+		sub = fg_slot(gf, s - 1, v - r - 1);
+	}
+	else /* Start anew */
+	{
+		t = v - r;
+		memset(gf->sum[s - 1], 0, rl * 4);
+	}
+	for (; t <= v + r; t++)
+	{
+		add = s > 1 ? fg_box(gf, s - 1, t) : fg_load(gf, t);
+		if (gf->fixed) box_shorts(res, gf->sum[s - 1], add, sub, mult, rl);
+		else box_floats(res, gf->sum[s - 1], add, sub, mult, rl);
+	}
+	gf->next[s] = v + 1;
+	return (res);
+}
+
+/* Convolve vertically, for row y */
+static void fg_vconv(gaussfast *gf, int y)
+{
+	int k, l = gf->lenY, rl = gf->w * gf->nch;
+	void *c;
+
+	for (k = y - l + 1; k < y + l; k++) fg_load(gf, k);
+	c = fg_slot(gf, 0, y);
+	if (gf->fixed)
+	{
+		unsigned short *dest = gf->row;
+		unsigned int *acc = gf->sum[0];
+
+		memset(acc, 0, rl * sizeof(*acc));
+		madd_shorts(acc, c, c, gf->ikY[0] >> 1, rl);
+		for (k = 1; k < l; k++) madd_shorts(acc, fg_slot(gf, 0, y - k),
+			fg_slot(gf, 0, y + k), gf->ikY[k], rl);
+		for (k = 0; k < rl; k++) dest[k] = (acc[k] + 0x8000) >> 16;
+	}
+	else
+	{
+		memset(gf->row, 0, rl * sizeof(float));
+		madd_floats(gf->row, c, c, gf->kY[0] * 0.5f, rl);
+		for (k = 1; k < l; k++) madd_floats(gf->row, fg_slot(gf, 0, y - k),
+			fg_slot(gf, 0, y + k), gf->kY[k], rl);
+	}
+}
+
+/* One horizontal box pass; src has r more pixels on each side than dest */
+static void fg_hbox(gaussfast *gf, void *dest, void *src, int n, int r)
+{
+	int c, x, nch = gf->nch, r2 = (r + r) * nch;
+	float mult = 1.0f / (r + r + 1);
+
+	for (c = 0; c < nch; c++)
+	{
+		if (gf->fixed)
+		{
+			unsigned short *s = (unsigned short *)src + c;
+			unsigned short *d = (unsigned short *)dest + c;
+			int sum = 0;
+
+			for (x = 0; x <= r2; x += nch) sum += s[x];
+			for (x = 0; x < n; x++ , s += nch , d += nch)
+			{
+				if (x) sum += s[r2] - s[-nch];
+				*d = (int)((float)sum * mult + 0.5f);
+			}
+		}
+		else
+		{
+			float *s = (float *)src + c, *d = (float *)dest + c;
+			float sum = 0.0f;
+
+			for (x = 0; x <= r2; x += nch) sum += s[x];
+			for (x = 0; x < n; x++ , s += nch , d += nch)
+			{
+				if (x) sum += s[r2] - s[-nch];
+				*d = sum * mult;
+			}
+		}
+	}
+}
+
+/* Filter the row horizontally, and store it as doubles */
+static void fg_hor(gaussfast *gf, double *dest)
+{
+	char *src = gf->row, *buf = gf->hbuf[0];
+	int c, i, k, m = gf->margin, nch = gf->nch, rl = gf->w * nch;
+	int l = nch * (gf->fixed ? 2 : 4);
+
+	/* Extend with mirrored pixels */
+	memcpy(buf + m * l, src, rl * (gf->fixed ? 2 : 4));
+	for (i = 0; i < m; i++)
+	{
+		memcpy(buf + i * l, src + gf->idx[i] * l, l);
+		memcpy(buf + (m + gf->w + i) * l, src + gf->idx[m + i] * l, l);
+	}
+
+	if (gf->lenX) /* Convolve */
+	{
+		int len = gf->lenX;
+
+		if (gf->fixed)
+		{
+			unsigned short *p = (unsigned short *)buf + m * nch;
+			unsigned int *acc = gf->hbuf[1];
+
+			memset(acc, 0, rl * sizeof(*acc));
+			madd_shorts(acc, p, p, gf->ikX[0] >> 1, rl);
+			for (k = 1; k < len; k++) madd_shorts(acc,
+				p - k * nch, p + k * nch, gf->ikX[k], rl);
+			for (c = 0; c < nch; c++)
+			{
+				double d = gf->scale[c] * (1.0 / 65536.0);
+				for (i = c; i < rl; i += nch) dest[i] = acc[i] * d;
+			}
+		}
+		else
+		{
+			float *p = (float *)buf + m * nch, *acc = gf->hbuf[1];
+
+			memset(acc, 0, rl * sizeof(*acc));
+			madd_floats(acc, p, p, gf->kX[0] * 0.5f, rl);
+			for (k = 1; k < len; k++) madd_floats(acc,
+				p - k * nch, p + k * nch, gf->kX[k], rl);
+			for (i = 0; i < rl; i++) dest[i] = acc[i];
+		}
+		return;
+	}
+
+	/* Run 3 boxes, ping-ponging between buffers */
+	for (i = 0; i < 3; i++)
+	{
+		m -= gf->boxX[i];
+		fg_hbox(gf, gf->hbuf[~i & 1], gf->hbuf[i & 1], gf->w + m * 2,
+			gf->boxX[i]);
+	}
+	if (gf->fixed)
+	{
+		unsigned short *s = gf->hbuf[1];
+		for (c = 0; c < nch; c++)
+		for (i = c; i < rl; i += nch) dest[i] = s[i] * gf->scale[c];
+	}
+	else
+	{
+		float *s = gf->hbuf[1];
+		/* Running sums can drift a hair below zero */
+		for (i = 0; i < rl; i++) dest[i] = s[i] < 0.0f ? 0.0 : s[i];
+	}
+}
+
+/* Blur row y, in same scale as double path; rows must come in order */
+static void fg_blur_row(gaussfast *gf, int y, double *dest)
+{
+	if (gf->lenY) fg_vconv(gf, y);
+	else fg_box(gf, 3, y);
+	fg_hor(gf, dest);
+}
+
 typedef struct {
 	double *gaussX, *gaussY, *temp;
 	unsigned char *mask;
@@ -7824,6 +10018,9 @@ typedef struct {
 	// For unsharp mask
 	int threshold;
 	double amount;
+	// For faster engines
+	int fast;
+	gaussfast fg[2];
 } gaussd;
 
 /* Extend horizontal array, using precomputed indices */
@@ -7941,15 +10138,21 @@ static void gauss_filter(tcb *thread)
 	wid = mem_width * bpp;
 	chan = mem_undo_previous(channel);
 	temp = gd->temp + (lenX - 1) * bpp;
+	if (gd->fast) fg_start(gd->fg, bpp, chan, NULL, gcor);
 	for (i = thread->step0 , ii = 0; ii < cnt; i++ , ii++)
 	{
-		vert_gauss(chan, wid, mem_height, i, temp, gd->gaussY, gd->lenY, gcor);
-		gauss_extend(gd, temp, mem_width, bpp);
+		if (gd->fast) fg_blur_row(gd->fg, i, gd->temp);
+		else
+		{
+			vert_gauss(chan, wid, mem_height, i, temp, gd->gaussY,
+				gd->lenY, gcor);
+			gauss_extend(gd, temp, mem_width, bpp);
+		}
 		row_protected(0, i, mem_width, mask);
 		dest = mem_img[channel] + i * wid;
 		if (bpp == 3) /* Run 3-bpp horizontal filter */
 		{
-			hor_gauss3(temp, mem_width, gaussX, lenX, mask);
+			if (!gd->fast) hor_gauss3(temp, mem_width, gaussX, lenX, mask);
 			pack_row3(dest, gd->temp, mem_width, gcor, mask);
 		}
 		else /* Run 1-bpp horizontal filter - no gamma here */
@@ -7959,10 +10162,12 @@ static void gauss_filter(tcb *thread)
 			for (j = 0; j < mem_width; j++)
 			{
 				if (mask[j] == 255) continue;
-				sum = temp[j] * gaussX[0];
-				for (k = 1; k < lenX; k++)
+				if (gd->fast) sum = gd->temp[j];
+				else
 				{
-					sum += (temp[j - k] + temp[j + k]) * gaussX[k];
+					sum = temp[j] * gaussX[0];
+					for (k = 1; k < lenX; k++) sum +=
+						(temp[j - k] + temp[j + k]) * gaussX[k];
 				}
 				k0 = rint(sum);
 				k0 = k0 * 255 + (dest[j] - k0) * mask[j];
@@ -7994,8 +10199,46 @@ static void gauss_filter_rgba(tcb *thread)
 	/* Set up the main row buffer and process the image */
 	tmpa = temp + mem_width * 3 + (lenX - 1) * (3 + 3);
 	atmp = tmpa + mem_width * 3 + (lenX - 1) * (3 + 1);
+	if (gd->fast) fg_start(gd->fg, 7, chan, alpha, gcor);
 	for (i = thread->step0 , ii = 0; ii < cnt; i++ , ii++)
 	{
+		if (gd->fast) /* Blur all 7 values at once */
+		{
+			double a, c0, c1, c2, *tmp7 = gd->temp;
+			int j, k, kk;
+
+			fg_blur_row(gd->fg, i, tmp7);
+			row_protected(0, i, mem_width, mask);
+			dest = mem_img[CHN_IMAGE] + i * mem_width * 3;
+			dsta = mem_img[CHN_ALPHA] + i * mem_width;
+			/* Results go in place, 3 values where were 7 */
+			for (j = 0; j < mem_width; j++ , tmp7 += 7)
+			{
+				if (mask[j] == 255) continue;
+
+				k = rint(a = tmp7[6]);
+				src = tmp7;
+				mult = 1.0;
+				if (k)
+				{
+					src = tmp7 + 3;
+					mult /= a;
+				}
+				c0 = src[0] * mult;
+				c1 = src[1] * mult;
+				c2 = src[2] * mult;
+				kk = mask[j];
+				k = k * 255 + (dsta[j] - k) * kk;
+				if (k) mask[j] = (255 * kk * dsta[j]) / k;
+				dsta[j] = (k + (k >> 8) + 1) >> 8;
+				gd->temp[j * 3] = c0;
+				gd->temp[j * 3 + 1] = c1;
+				gd->temp[j * 3 + 2] = c2;
+			}
+			pack_row3(dest, gd->temp, mem_width, gcor, mask);
+			if (thread_step(thread, ii + 1, cnt, 10)) break;
+			continue;
+		}
 		/* Apply vertical filter */
 		{
 			unsigned char *srcc, *src0, *src1;
@@ -8180,15 +10423,35 @@ static threaddata *init_gauss(gaussd *gd, double radiusX, double radiusY, int mo
 	l = 2 * (lenX - 1);
 	w = mem_width + l;
 
+	/* Set up faster engine if wanted; fall back to double if too big */
+	memset(gd->fg, 0, sizeof(gd->fg));
+	gd->fast = blur_engine != BLUR_DOUBLE;
+	if (gd->fast)
+	{
+		int fixed = blur_engine == BLUR_FIXED;
+
+		if (mode == 1) gd->fast = fg_init(gd->fg, radiusX, radiusY,
+			7, fixed);
+		else if (mode == 2) gd->fast = fg_init(gd->fg, radiusX, radiusX,
+			bpp, fixed) && fg_init(gd->fg + 1, radiusY, radiusY,
+			bpp, fixed);
+		else gd->fast = fg_init(gd->fg, radiusX, radiusY, bpp, fixed);
+		if (!gd->fast) memset(gd->fg, 0, sizeof(gd->fg));
+	}
+
 	tdata = talloc(MA_ALIGN_DOUBLE,
 		image_threads(mem_width, mem_height),
 		gd, sizeof(gaussd),
 		&gd->gaussX, lenX * sizeof(double),
 		&gd->gaussY, lenY * sizeof(double),
 		&gd->idx, l * sizeof(int),
+		&gd->fg[0].shared, (int)gd->fg[0].ssize,
+		&gd->fg[1].shared, (int)gd->fg[1].ssize,
 		NULL, 
 		&gd->temp, i * w * sizeof(double),
 		&gd->mask, mem_width,
+		&gd->fg[0].buf, (int)gd->fg[0].tsize,
+		&gd->fg[1].buf, (int)gd->fg[1].tsize,
 		NULL);
 	if (!tdata) return (NULL);
 
@@ -8225,6 +10488,17 @@ static threaddata *init_gauss(gaussd *gd, double radiusX, double radiusY, int mo
 
 		}
 	}
+
+	/* Faster engines take their kernels from above */
+	if (gd->fast)
+	{
+		if (mode != 2) fg_fill(gd->fg, gd->gaussX, gd->gaussY);
+		else
+		{
+			fg_fill(gd->fg, gd->gaussX, gd->gaussX);
+			fg_fill(gd->fg + 1, gd->gaussY, gd->gaussY);
+		}
+	}
 	return (tdata);
 }
 
@@ -8293,17 +10567,23 @@ static void unsharp_filter(tcb *thread)
 	wid = mem_width * bpp;
 	chan = mem_undo_previous(channel);
 	temp = gd->temp + (lenX - 1) * bpp;
+	if (gd->fast) fg_start(gd->fg, bpp, chan, NULL, gcor);
 	for (i = thread->step0 , ii = 0; ii < cnt; i++ , ii++)
 	{
-		vert_gauss(chan, wid, mem_height, i, temp, gd->gaussY, gd->lenY, gcor);
-		gauss_extend(gd, temp, mem_width, bpp);
+		if (gd->fast) fg_blur_row(gd->fg, i, gt);
+		else
+		{
+			vert_gauss(chan, wid, mem_height, i, temp, gd->gaussY,
+				gd->lenY, gcor);
+			gauss_extend(gd, temp, mem_width, bpp);
+		}
 		row_protected(0, i, mem_width, mask);
 		dest = mem_img[channel] + i * wid;
 		if (bpp == 3) /* Run 3-bpp horizontal filter */
 		{
 			int j, jj, k, k1, k2;
 
-			hor_gauss3(temp, mem_width, gaussX, lenX, mask);
+			if (!gd->fast) hor_gauss3(temp, mem_width, gaussX, lenX, mask);
 			/* Threshold to mask */
 			if (threshold) for (j = jj = 0; jj < mem_width; jj++ , j += 3)
 			{
@@ -8349,10 +10629,12 @@ static void unsharp_filter(tcb *thread)
 			for (j = 0; j < mem_width; j++)
 			{
 				if (mask[j] == 255) continue;
-				sum = temp[j] * gaussX[0];
-				for (k = 1; k < lenX; k++)
+				if (gd->fast) sum = gt[j];
+				else
 				{
-					sum += (temp[j - k] + temp[j + k]) * gaussX[k];
+					sum = temp[j] * gaussX[0];
+					for (k = 1; k < lenX; k++) sum +=
+						(temp[j - k] + temp[j + k]) * gaussX[k];
 				}
 				k = rint(sum);
 				/* Threshold */
@@ -8434,12 +10716,25 @@ static void dog_filter(tcb *thread)
 	chan = mem_undo_previous(channel);
 	tmp1 = gd->temp + (lenW - 1) * bpp;
 	tmp2 = tmp1 + wid + (lenW - 1) * bpp * 2;
+	if (gd->fast)
+	{
+		fg_start(gd->fg + 0, bpp, chan, NULL, gcor);
+		fg_start(gd->fg + 1, bpp, chan, NULL, gcor);
+	}
 	for (i = thread->step0 , ii = 0; ii < cnt; i++ , ii++)
 	{
-		vert_gauss(chan, wid, mem_height, i, tmp1, gaussW, lenW, gcor);
-		vert_gauss(chan, wid, mem_height, i, tmp2, gaussN, lenN, gcor);
-		gauss_extend(gd, tmp1, mem_width, bpp);
-		gauss_extend(gd, tmp2, mem_width, bpp);
+		if (gd->fast)
+		{
+			fg_blur_row(gd->fg + 0, i, tmp1);
+			fg_blur_row(gd->fg + 1, i, tmp2);
+		}
+		else
+		{
+			vert_gauss(chan, wid, mem_height, i, tmp1, gaussW, lenW, gcor);
+			vert_gauss(chan, wid, mem_height, i, tmp2, gaussN, lenN, gcor);
+			gauss_extend(gd, tmp1, mem_width, bpp);
+			gauss_extend(gd, tmp2, mem_width, bpp);
+		}
 		dest = mem_img[channel] + i * wid;
 		if (bpp == 3) /* Run 3-bpp horizontal filter */
 		{
@@ -8449,6 +10744,13 @@ static void dog_filter(tcb *thread)
 			{
 				int x1, x2, x3, x4;
 
+				if (gd->fast)
+				{
+					sum = tmp1[j] - tmp2[j];
+					sum1 = tmp1[j + 1] - tmp2[j + 1];
+					sum2 = tmp1[j + 2] - tmp2[j + 2];
+					goto pack;
+				}
 				sum = tmp1[j] * gaussW[0] - tmp2[j] * gaussN[0];
 				sum1 = tmp1[j + 1] * gaussW[0] - tmp2[j + 1] * gaussN[0];
 				sum2 = tmp1[j + 2] * gaussW[0] - tmp2[j + 2] * gaussN[0];
@@ -8470,7 +10772,7 @@ static void dog_filter(tcb *thread)
 					sum1 -= (tmp2[x3 + 1] + tmp2[x4 + 1]) * gv;
 					sum2 -= (tmp2[x3 + 2] + tmp2[x4 + 2]) * gv;
 				}
-				if (gcor)
+pack:				if (gcor)
 				{
 #if 1 /* Reverse gamma - but does it make sense? */
 					k = UNGAMMA256X(sum);
@@ -8506,6 +10808,12 @@ static void dog_filter(tcb *thread)
 
 			for (j = 0; j < mem_width; j++)
 			{
+				if (gd->fast)
+				{
+					k = rint(tmp1[j] - tmp2[j]);
+					dest[j] = k < 0 ? 0 : k;
+					continue;
+				}
 				sum = tmp1[j] * gaussW[0] - tmp2[j] * gaussN[0];
 				for (k = 1; k < lenW; k++)
 				{
@@ -8583,9 +10891,14 @@ typedef struct {
 	int *avg;	// Sum of pixel values (for average)
 	int *dis;	// Sum of pixel values squared (for variance)
 	unsigned char *min;	// Offset to minimum-variance square
+	unsigned char *mask;	// Mask row
+	unsigned char *timg;	// Rows of filtered pixels
+	unsigned char *src;	// Source image
 	double r2i;	// 1/r^2 to multiply things with
-	int w, r;	// Row width & filter radius
+	int x0, w, r;	// Leftmost column, row width & filter radius
+	int bx, bw;	// Leftmost column & width of band to store
 	int gcor;	// Gamma correction toggle
+	int detail;	// Detail preservation toggle
 	int l, rl;	// Row array lengths
 } kuwahara_info;
 
@@ -8595,10 +10908,25 @@ static void kuwahara_row(unsigned char *src, int base, int add, kuwahara_info *i
 {
 	double rs0 = 0.0, rs1 = 0.0, rs2 = 0.0;
 	int avg[3] = { 0, 0, 0 }, dis[3] = { 0, 0, 0 };
-	int i, w, r = info->r, gc = info->gcor, *idx = info->idx;
+	int i, w, x0 = info->x0, r = info->r, gc = info->gcor, *idx = info->idx;
+
+	w = x0 + info->w + r++;
+	/* Gamma sums are run from row start regardless, for them to round the
+	 * same way wherever the band begins; integer ones are exact anyway */
+	if (gc) for (i = -r; i < x0 - r; i++)
+	{
+		unsigned char *tvv = src + idx[i];
 
-	w = info->w + r++;
-	for (i = -r; i < w; i++)
+		rs0 += Fgamma256[tvv[0]];
+		rs1 += Fgamma256[tvv[1]];
+		rs2 += Fgamma256[tvv[2]];
+		if (i < 0) continue;
+		tvv = src + idx[i - r];
+		rs0 -= Fgamma256[tvv[0]];
+		rs1 -= Fgamma256[tvv[1]];
+		rs2 -= Fgamma256[tvv[2]];
+	}
+	for (i = x0 - r; i < w; i++)
 	{
 		unsigned char *tvv;
 		int tv, i3, *iavg, *idis;
@@ -8616,7 +10944,15 @@ static void kuwahara_row(unsigned char *src, int base, int add, kuwahara_info *i
 			rs1 += Fgamma256[tvv[1]];
 			rs2 += Fgamma256[tvv[2]];
 		}
-		if (i < 0) continue;
+		if (i < x0)
+		{
+			if (!gc || (i < 0)) continue;
+			tvv = src + idx[i - r];
+			rs0 -= Fgamma256[tvv[0]];
+			rs1 -= Fgamma256[tvv[1]];
+			rs2 -= Fgamma256[tvv[2]];
+			continue;
+		}
 
 		tvv = src + idx[i - r];
 		avg[0] -= (tv = tvv[0]);
@@ -8625,7 +10961,7 @@ static void kuwahara_row(unsigned char *src, int base, int add, kuwahara_info *i
 		dis[1] -= tv * tv;
 		avg[2] -= (tv = tvv[2]);
 		dis[2] -= tv * tv;
-		i3 = (base + i) * 3;
+		i3 = (base + i - x0) * 3;
 		iavg = info->avg + i3;
 		idis = info->dis + i3;
 		if (add)
@@ -8712,12 +11048,13 @@ static void kuwahara_min(int base, kuwahara_info *info)
 	}
 }
 
+
 /* Replace each pixel in image row by nearest color in 3x3 Kuwahara'ed region */
-static void kuwahara_detailed(unsigned char *buf, unsigned char *mask,
-	unsigned char *dest, int y, int gcor)
+static void kuwahara_detailed(unsigned char *buf, unsigned char *dest, int y,
+	kuwahara_info *info)
 {
-	unsigned char *tmp;
-	int l, w = mem_width * 3;
+	unsigned char *tmp, *mask = info->mask;
+	int l, w = info->w * 3, gcor = info->gcor;
 #define REGION_SIZE 9
 	int steps[REGION_SIZE] = { 3, 3, w, 3, 3, w, 3, 3, w };
 
@@ -8727,9 +11064,13 @@ static void kuwahara_detailed(unsigned char *buf, unsigned char *mask,
 	steps [8 - 3 * l] -= (w + 6) * 3;
 #endif
 
-	row_protected(0, y, mem_width, mask);
-	tmp = mem_img[CHN_IMAGE] + y * w;
-	for (l = 0; l < mem_width; l++ , tmp += 3 , dest += 3)
+	/* Only the band's own pixels */
+	l = (info->bx - info->x0) * 3;
+	buf += l; dest += l;
+
+	row_protected(info->bx, y, info->bw, mask);
+	tmp = mem_img[CHN_IMAGE] + (y * mem_width + info->bx) * 3;
+	for (l = 0; l < info->bw; l++ , tmp += 3 , dest += 3)
 	{
 		unsigned char *tb, *found;
 		int rr, gg, bb, op = *mask++;
@@ -8792,64 +11133,44 @@ static int idx2row(int idx)
 	return (j);
 }
 
-/* RGB only - cannot be generalized without speed loss */
-void mem_kuwahara(int r, int gcor, int detail)
+/* Each thread goes down a band of columns, for vertical running sums to be
+ * the same as if going through the entire row */
+static void kuwahara_band(tcb *thread)
 {
-	kuwahara_info info;
-	unsigned char *mem, *src, *buf, *mask, *tmp, *timg, *tx;
-	int i, j, k, l, ir, len, rl, r1 = r + 1;
-	int w = mem_width * 3, wbuf = w + 3 * 2, ch = mem_channel;
-	double r2i = 1.0 / (double)(r1 * r1);
-
-
-	if (mem_img_bpp != 3) return; // Sanity check
+	kuwahara_info *info = thread->data;
+	unsigned char *src = info->src, *buf, *mask = info->mask, *tmp;
+	unsigned char *timg = info->timg, *tx;
+	int i, l, n, ir, p0, r = info->r, r1 = r + 1, detail = info->detail;
+	int w = mem_width * 3, wbuf, cnt = thread->nsteps;
+	double r2i = info->r2i;
 
-	len = mem_width + r + r + 1;
-	info.l = l = mem_width + r;
-	info.rl = rl = gcor ? l : 0;
-	mem = multialloc(MA_ALIGN_DOUBLE,
-		&info.rs, rl * r1 * 3 * sizeof(double),
-		&info.avg, l * r1 * 3 * sizeof(int),
-		&info.dis, l * r1 * 3 * sizeof(int),
-		&info.idx, len * sizeof(int),
-		&info.min, l * r1,
-		&mask, mem_width,
-		&timg, wbuf * 3,
-		NULL);
-	if (!mem)
-	{
-		memory_errors(1);
-		return;
-	}
-	info.r2i = r2i; info.w = mem_width; info.r = r; info.gcor = gcor;
 
-	progress_init(_("Kuwahara-Nagao Filter"), 1);
-	info.idx += r1;
-	if (mem_width > 1) // All indices remain zero otherwise
-	{
-		k = mem_width + mem_width - 2;
-		for (i = -(r + 1); i < mem_width + r; i++)
-		{
-			j = abs(i) % k;
-			if (j >= mem_width) j = k - j;
-			info.idx[i] = j * 3;
-		}
-	}
+	/* Own columns, and in detail mode, ones next to them */
+	info->bx = info->x0 = thread->step0;
+	info->bw = n = cnt;
+	if (detail && info->x0) info->x0-- , n++;
+	if (detail && (info->bx + cnt < mem_width)) n++;
+	info->w = n;
+	info->l = l = n + r;
+	info->rl = info->gcor ? l : 0;
+	wbuf = (n + 2) * 3;
+	memset(info->avg, 0, l * 3 * sizeof(int));
+	memset(info->dis, 0, l * 3 * sizeof(int));
+	if (info->rl) memset(info->rs, 0, l * 3 * sizeof(double));
+	p0 = thread->progress;
 
-	mem_channel = CHN_IMAGE; // For row_protected()
-	src = mem_undo_previous(CHN_IMAGE);
 	/* Initialize the bottom sum */
 	for (i = -r; i <= 0; i++)
-		kuwahara_row(src + idx2row(i) * w, 0, TRUE, &info);
-	kuwahara_min(0, &info);
+		kuwahara_row(src + idx2row(i) * w, 0, TRUE, info);
+	kuwahara_min(0, info);
 	/* Initialize the rest of sums */
 	for (i = 1; i <= r; i++)
 	{
 		int j = l * i;
-		kuwahara_copy(j, j - l, &info);
-		kuwahara_row(src + idx2row(i - r1) * w, j, FALSE, &info);
-		kuwahara_row(src + idx2row(i) * w, j, TRUE, &info);
-		kuwahara_min(j, &info);
+		kuwahara_copy(j, j - l, info);
+		kuwahara_row(src + idx2row(i - r1) * w, j, FALSE, info);
+		kuwahara_row(src + idx2row(i) * w, j, TRUE, info);
+		kuwahara_min(j, info);
 	}
 	/* Actually process image */
 	ir = i = 0;
@@ -8857,13 +11178,15 @@ void mem_kuwahara(int r, int gcor, int detail)
 	{
 		int j, k, jp;
 
-		if ((i * 10) % mem_height >= mem_height - 10)
-			if (progress_update((float)(i + 1) / mem_height)) break;
+		/* Work is split by columns, so progress is counted in them */
+		thread->progress = k = p0 + ((i + 1) * (long long)cnt) / mem_height;
+		if (((i * 10) % mem_height >= mem_height - 10) &&
+			thread_step(thread, k, mem_width, mem_width)) break;
 
 		/* Process a pixel row */
-		if (!detail) row_protected(0, i, mem_width, mask);
+		if (!detail) row_protected(info->bx, i, cnt, mask);
 		tmp = buf = timg + wbuf * (i % 3);
-		for (j = 0; j < mem_width; j++)
+		for (j = 0; j < n; j++)
 		{
 			double dis;
 			int jj, jk;
@@ -8872,27 +11195,27 @@ void mem_kuwahara(int r, int gcor, int detail)
 			if (!detail && (mask[j] == 255)) continue;
 			/* Select minimum variance square from covered rows */
 			jj = j + l;
-			jk = j + info.min[j];
-			dis = kuwahara_square(jk, &info);
+			jk = j + info->min[j];
+			dis = kuwahara_square(jk, info);
 // !!! Only the all-or-nothing mode for now - weighted mode not implemented yet
 			for (k = 1; k < r1; k++ , jj += l)
 			{
-				int jv = jj + info.min[jj];
-				double dv = kuwahara_square(jv, &info);
+				int jv = jj + info->min[jj];
+				double dv = kuwahara_square(jv, info);
 				if (dv < dis) jk = jv , dis = dv;
 			}
 			/* Calculate & store new RGB */
 			jk *= 3;
-			if (gcor)
+			if (info->gcor)
 			{
-				double *wr = info.rs + jk;
+				double *wr = info->rs + jk;
 				tmp[0] = UNGAMMA256(wr[0] * r2i);
 				tmp[1] = UNGAMMA256(wr[1] * r2i);
 				tmp[2] = UNGAMMA256(wr[2] * r2i);
 			}
 			else
 			{
-				int *ar = info.avg + jk;
+				int *ar = info->avg + jk;
 				tmp[0] = rint(*ar++ * r2i);
 				tmp[1] = rint(*ar++ * r2i);
 				tmp[2] = rint(*ar * r2i);
@@ -8910,17 +11233,18 @@ void mem_kuwahara(int r, int gcor, int detail)
 			{
 				// Overwrite outgoing pixels of outgoing row
 				tx = timg + wbuf * ((i + 1) % 3);
-				kuwahara_detailed(timg, mask, tx, i - 1, gcor);
-				tmp = mem_img[CHN_IMAGE] + (i - 1) * w;
-				process_img(0, 1, mem_width, mask, tmp, tmp, tx,
+				kuwahara_detailed(timg, tx, i - 1, info);
+				tmp = mem_img[CHN_IMAGE] + (i - 1) * w + info->bx * 3;
+				tx += (info->bx - info->x0) * 3;
+				process_img(0, 1, cnt, mask, tmp, tmp, tx,
 					NULL, 3, BLENDF_SET | BLENDF_INVM);
 			}
 		}
 		else
 		{
 			/* Mask-merge current row */
-			tmp = mem_img[CHN_IMAGE] + i * w;
-			process_img(0, 1, mem_width, mask, tmp, tmp, buf + 3,
+			tmp = mem_img[CHN_IMAGE] + i * w + info->bx * 3;
+			process_img(0, 1, cnt, mask, tmp, tmp, buf + 3,
 				NULL, 3, BLENDF_SET | BLENDF_INVM);
 		}
 
@@ -8928,10 +11252,10 @@ void mem_kuwahara(int r, int gcor, int detail)
 		{
 			/* Update sums for a new row */
 			jp = ir * l;
-			kuwahara_copy(jp, ((ir + r) % r1) * l, &info);
-			kuwahara_row(src + idx2row(i - 1) * w, jp, FALSE, &info);
-			kuwahara_row(src + idx2row(i + r) * w, jp, TRUE, &info);
-			kuwahara_min(jp, &info);
+			kuwahara_copy(jp, ((ir + r) % r1) * l, info);
+			kuwahara_row(src + idx2row(i - 1) * w, jp, FALSE, info);
+			kuwahara_row(src + idx2row(i + r) * w, jp, TRUE, info);
+			kuwahara_min(jp, info);
 			ir = (ir + 1) % r1;
 			continue;
 		}
@@ -8941,18 +11265,88 @@ void mem_kuwahara(int r, int gcor, int detail)
 			/* Copy-extend the bottom row */
 			memcpy(timg + wbuf * (i % 3), buf, wbuf);
 			/* Build and mask-merge it */
-			kuwahara_detailed(timg, mask, timg, i - 1, gcor);
-			tmp = mem_img[CHN_IMAGE] + (i - 1) * w;
-			process_img(0, 1, mem_width, mask, tmp, tmp, timg,
+			kuwahara_detailed(timg, timg, i - 1, info);
+			tmp = mem_img[CHN_IMAGE] + (i - 1) * w + info->bx * 3;
+			tx = timg + (info->bx - info->x0) * 3;
+			process_img(0, 1, cnt, mask, tmp, tmp, tx,
 				NULL, 3, BLENDF_SET | BLENDF_INVM);
 		}
 		break;
 	}
+}
+
+/* RGB only - cannot be generalized without speed loss */
+void mem_kuwahara(int r, int gcor, int detail)
+{
+	kuwahara_info info;
+	threaddata *tdata;
+	int i, j, k, l, n, w, len, rl, r1 = r + 1, ch = mem_channel;
+
+
+	if (mem_img_bpp != 3) return; // Sanity check
+
+	/* Bands need be wide enough for the overlap to not matter */
+	n = image_threads(mem_width, mem_height);
+	if (n > mem_width / (r1 * 4)) n = mem_width / (r1 * 4);
+	if (n < 1) n = 1;
+	/* Band gets at most its share of width, plus 2 columns */
+	w = (mem_width + n - 1) / n + 2;
+	l = w + r;
+	rl = gcor ? l : 0;
+	len = mem_width + r + r + 1;
+	memset(&info, 0, sizeof(info));
+	tdata = talloc(MA_ALIGN_DOUBLE, n, &info, sizeof(info),
+		&info.idx, len * sizeof(int),
+		NULL,
+		&info.rs, rl * r1 * 3 * sizeof(double),
+		&info.avg, l * r1 * 3 * sizeof(int),
+		&info.dis, l * r1 * 3 * sizeof(int),
+		&info.min, l * r1,
+		&info.mask, w,
+		&info.timg, (w + 2) * 3 * 3,
+		NULL);
+	if (!tdata)
+	{
+		memory_errors(1);
+		return;
+	}
+	/* Chunks must not be wider than that */
+	tdata->chunks = (n + tdata->count - 1) / tdata->count;
+
+	/* Shared index array */
+	info.idx += r1;
+	if (mem_width > 1) // All indices remain zero otherwise
+	{
+		k = mem_width + mem_width - 2;
+		for (i = -(r + 1); i < mem_width + r; i++)
+		{
+			j = abs(i) % k;
+			if (j >= mem_width) j = k - j;
+			info.idx[i] = j * 3;
+		}
+	}
+	info.r2i = 1.0 / (double)(r1 * r1);
+	info.r = r;
+	info.gcor = gcor;
+	info.detail = detail;
+	info.src = mem_undo_previous(CHN_IMAGE);
+	for (i = 0; i < tdata->count; i++)
+	{
+		kuwahara_info *ti = tdata->threads[i]->data;
+		ti->idx = info.idx;
+		ti->r2i = info.r2i;
+		ti->r = r;
+		ti->gcor = gcor;
+		ti->detail = detail;
+		ti->src = info.src;
+	}
 
+	mem_channel = CHN_IMAGE; // For row_protected()
+	launch_threads(kuwahara_band, tdata, _("Kuwahara-Nagao Filter"),
+		mem_width);
 	mem_channel = ch;
 
-	progress_end();
-	free(mem);
+	free(tdata);
 }
 
 ///	CLIPBOARD MASK
@@ -10084,7 +12478,7 @@ static void skew_fill_util(double *buf, double *filler,
 	memset(buf + k, 0, l * sizeof(double));
 
 	/* Collect pixels */
-	dest = buf + xl * 3;
+	dest = buf + xl;
 	for (j = xl; j < xr; j++)
 	{
 		unsigned char *img;
@@ -10115,60 +12509,31 @@ static void skew_fill_util(double *buf, double *filler,
  * free-rotate if using 6-tap filter, or 1.5 times if using 2-tap one. Which,
  * while still being several times faster than anything else, is rather bad
  * for a high-quality tool like mtPaint. Needs improvement. - WJ */
-static void mem_skew_filt(chanlist old_img, chanlist new_img, int ow, int oh,
-	int nw, int nh, double xskew, double yskew, int mode, int gcor,
-	int dis_a, int silent)
-{
-	void *xmem, *ymem, *tmem;
+typedef struct {
+	unsigned char **old_img, **new_img;
 	double *xfilt, *yfilt, *wbuf, *rbuf;
 	int *dxx, *dyy;
 	double x0, y0, d, Kh, Kv, XX[4], YY[4], filler[7];
-	int i, cc, /*fw2, fh2,*/ xfsz, yfsz, wbsz, rgba, step, ny, nr;
-
-
-	/* Create temp data */
-	step = (rgba = new_img[CHN_ALPHA] && !dis_a) ? 7 : 3;
-	xmem = make_skew_filter(&xfilt, &dxx, &xfsz, oh, (nw - ow) * 0.5, xskew, mode);
-	ymem = make_skew_filter(&yfilt, &dyy, &yfsz, nw, (nh - oh) * 0.5, yskew, mode);
-//	fw2 = xfsz >> 1; fh2 = yfsz >> 1;
-
-	wbsz = nw * step;
-	tmem = multialloc(MA_ALIGN_DOUBLE, &wbuf, wbsz * yfsz * sizeof(double),
-		&rbuf, wbsz * sizeof(double), NULL);
-	if (!xmem || !ymem || !tmem) goto fail;
-	x0 = 0.5 * (nw - 1); y0 = 0.5 * (nh - 1);
-
-	/* Calculate clipping parallelogram's corners */
-	// To avoid corner cases, we add an extra pixel to original dimensions
-	XX[1] = XX[3] = (XX[0] = XX[2] = 0.5 * (nw - ow) - 1) + ow + 1;
-	YY[2] = YY[3] = (YY[0] = YY[1] = 0.5 * (nh - oh) - 1) + oh + 1;
-	for (i = 0; i < 4; i++)
-	{
-		XX[i] += (YY[i] - y0) * xskew;
-		YY[i] += (XX[i] - x0) * yskew;
-	}
-	d = 1.0 + xskew * yskew;
-	Kv = d ? xskew / d : 0.0; // for left & right
-	Kh = yskew ? 1.0 / yskew : 0.0; // for top & bottom
-
-	/* Init filler */
-	memset(filler, 0, sizeof(filler));
-	if (gcor)
-	{
-		filler[0] = gamma256[mem_col_A24.red];
-		filler[1] = gamma256[mem_col_A24.green];
-		filler[2] = gamma256[mem_col_A24.blue];
-	}
-	else
-	{
-		filler[0] = mem_col_A24.red;
-		filler[1] = mem_col_A24.green;
-		filler[2] = mem_col_A24.blue;
-	}
+	double xskew, yskew;
+	int ow, oh, nw, nh, bpp, xfsz, yfsz, wbsz, rgba, step, gcor, progress;
+} skewd;
+
+static void skew_filt_rows(tcb *thread)
+{
+	skewd *sd = thread->data;
+	unsigned char **old_img = sd->old_img, **new_img = sd->new_img;
+	double *xfilt = sd->xfilt, *yfilt = sd->yfilt;
+	double *wbuf = sd->wbuf, *rbuf = sd->rbuf, *filler = sd->filler;
+	double *XX = sd->XX, *YY = sd->YY, Kh = sd->Kh, Kv = sd->Kv;
+	int *dxx = sd->dxx, *dyy = sd->dyy;
+	int ow = sd->ow, oh = sd->oh, nw = sd->nw, xfsz = sd->xfsz;
+	int yfsz = sd->yfsz, wbsz = sd->wbsz, rgba = sd->rgba, step = sd->step;
+	int gcor = sd->gcor, cc, ny, nr, cnt = thread->nsteps;
+	int r0 = thread->step0, r1 = r0 + cnt;
 
 	/* Process image channels */
 	for (nr = cc = 0; cc < NUM_CHANNELS; cc++) nr += !!new_img[cc];
-	nr = (nr - rgba) * (nh + yfsz - 1);
+	nr = (nr - rgba) * (cnt + yfsz - 1);
 	for (ny = cc = 0; cc < NUM_CHANNELS; cc++)
 	{
 		int ring_l[FILT_MAX], ring_r[FILT_MAX];
@@ -10181,14 +12546,17 @@ static void mem_skew_filt(chanlist old_img, chanlist new_img, int ow, int oh,
 		/* Init border rings to all-filled */
 		for (i = 0; i < yfsz; i++) ring_l[i] = 0 , ring_r[i] = nw;
 
-		/* Row loop */
-		for (i = 1 - yfsz , idx = 0; i < nh; i++ , ++idx >= yfsz ? idx = 0 : 0)
+		/* Row loop; the rows before the band are read in to fill the
+		 * buffers, into the same places they'd be when going from the
+		 * top, so that output does not depend on where band starts */
+		for (i = r0 + 1 - yfsz , idx = r0 % yfsz; i < r1;
+			i++ , ++idx >= yfsz ? idx = 0 : 0)
 		{
 			double *filt0, *thatbuf, *thisbuf = wbuf + idx * wbsz;
 			int j, k, y0, xl, xr, len, ofs, lfx = -xfsz;
 
-			if (!silent && ((++ny * 10) % nr >= nr - 10))
-				progress_update((float)ny / nr);
+			if (sd->progress && thread_step(thread, ++ny, nr, 10))
+				goto stop;
 
 			/* Locate source row */
 			y0 = i + yfsz - 1; // Effective Y offset
@@ -10226,7 +12594,7 @@ static void mem_skew_filt(chanlist old_img, chanlist new_img, int ow, int oh,
 			ring_l[idx] = xl;
 			ring_r[idx] = xr;
 
-			if (i < 0) continue; // Initialization phase
+			if (i < r0) continue; // Initialization phase
 
 			/* Clip target row */
 			if (i <= YY[0]) xl = ceil(XX[0] + (i - YY[0]) * Kh);
@@ -10337,37 +12705,94 @@ static void mem_skew_filt(chanlist old_img, chanlist new_img, int ow, int oh,
 		}
 	}
 
-fail:	free(xmem);
-	free(ymem);
-	free(tmem);
+stop:	thread_done(thread);
 }
 
-static void mem_skew_nn(chanlist old_img, chanlist new_img, int ow, int oh,
-	int nw, int nh, int bpp, double xskew, double yskew, int silent)
+static void mem_skew_filt(chanlist old_img, chanlist new_img, int ow, int oh,
+	int nw, int nh, double xskew, double yskew, int mode, int gcor,
+	int dis_a, int silent)
 {
-	double x0, y0, d, Kh, Kv, XX[4], YY[4];
-	int i, ny;
+	skewd sd;
+	threaddata *tdata = NULL;
+	void *xmem, *ymem;
+	double x0, y0, d, *XX = sd.XX, *YY = sd.YY, *filler = sd.filler;
+	int i, /*fw2, fh2,*/ rgba, step;
+
+
+	/* Create temp data */
+	step = (rgba = new_img[CHN_ALPHA] && !dis_a) ? 7 : 3;
+	xmem = make_skew_filter(&sd.xfilt, &sd.dxx, &sd.xfsz, oh, (nw - ow) * 0.5, xskew, mode);
+	ymem = make_skew_filter(&sd.yfilt, &sd.dyy, &sd.yfsz, nw, (nh - oh) * 0.5, yskew, mode);
+//	fw2 = xfsz >> 1; fh2 = yfsz >> 1;
+	if (!xmem || !ymem) goto fail;
 
-	/* Calculate clipping parallelogram's corners */
 	x0 = 0.5 * (nw - 1); y0 = 0.5 * (nh - 1);
-	XX[1] = XX[3] = (XX[0] = XX[2] = 0.5 * (nw - ow - 1)) + ow;
-	YY[2] = YY[3] = (YY[0] = YY[1] = 0.5 * (nh - oh - 1)) + oh;
+
+	/* Calculate clipping parallelogram's corners */
+	// To avoid corner cases, we add an extra pixel to original dimensions
+	XX[1] = XX[3] = (XX[0] = XX[2] = 0.5 * (nw - ow) - 1) + ow + 1;
+	YY[2] = YY[3] = (YY[0] = YY[1] = 0.5 * (nh - oh) - 1) + oh + 1;
 	for (i = 0; i < 4; i++)
 	{
 		XX[i] += (YY[i] - y0) * xskew;
 		YY[i] += (XX[i] - x0) * yskew;
 	}
 	d = 1.0 + xskew * yskew;
-	Kv = d ? xskew / d : 0.0; // for left & right
-	Kh = yskew ? 1.0 / yskew : 0.0; // for top & bottom
+	sd.Kv = d ? xskew / d : 0.0; // for left & right
+	sd.Kh = yskew ? 1.0 / yskew : 0.0; // for top & bottom
 
-	/* Process image row by row */
-	for (ny = 0; ny < nh; ny++)
+	/* Init filler */
+	memset(filler, 0, sizeof(sd.filler));
+	if (gcor)
 	{
-		int cc, xl, xr;
+		filler[0] = gamma256[mem_col_A24.red];
+		filler[1] = gamma256[mem_col_A24.green];
+		filler[2] = gamma256[mem_col_A24.blue];
+	}
+	else
+	{
+		filler[0] = mem_col_A24.red;
+		filler[1] = mem_col_A24.green;
+		filler[2] = mem_col_A24.blue;
+	}
+
+	/* Process image in row bands */
+	sd.old_img = old_img;
+	sd.new_img = new_img;
+	sd.ow = ow;
+	sd.oh = oh;
+	sd.nw = nw;
+	sd.rgba = rgba;
+	sd.step = step;
+	sd.gcor = gcor;
+	sd.progress = !silent;
+	sd.wbsz = nw * step;
+	tdata = talloc(MA_ALIGN_DOUBLE, image_threads(nw, nh), &sd, sizeof(sd),
+		NULL,
+		&sd.wbuf, sd.wbsz * sd.yfsz * sizeof(double),
+		&sd.rbuf, sd.wbsz * sizeof(double),
+		NULL);
+	if (!tdata) goto fail;
+	tdata->silent = silent;
+	launch_threads(skew_filt_rows, tdata, NULL, nh);
+
+fail:	free(xmem);
+	free(ymem);
+	free(tdata);
+}
+
+static void skew_nn_rows(tcb *thread)
+{
+	skewd *sd = thread->data;
+	unsigned char **old_img = sd->old_img, **new_img = sd->new_img;
+	double x0 = sd->x0, y0 = sd->y0, d = sd->d, Kh = sd->Kh, Kv = sd->Kv;
+	double *XX = sd->XX, *YY = sd->YY, xskew = sd->xskew, yskew = sd->yskew;
+	int ow = sd->ow, oh = sd->oh, nw = sd->nw, nh = sd->nh, bpp = sd->bpp;
+	int ny, ii, cnt = thread->nsteps;
 
-		if (!silent && ((ny * 10) % nh >= nh - 10))
-			progress_update((float)ny / nh);
+	for (ny = thread->step0 , ii = 0; ii < cnt; ny++ , ii++)
+	{
+		int cc, xl, xr;
 
 		/* Clip row */
 		if (ny <= YY[0]) xl = ceil(XX[0] + (ny - YY[0]) * Kh);
@@ -10420,7 +12845,52 @@ static void mem_skew_nn(chanlist old_img, chanlist new_img, int ow, int oh,
 				}
 			}
 		}
+		if (sd->progress && thread_step(thread, ii + 1, cnt, 10)) break;
+	}
+	thread_done(thread);
+}
+
+static void mem_skew_nn(chanlist old_img, chanlist new_img, int ow, int oh,
+	int nw, int nh, int bpp, double xskew, double yskew, int silent)
+{
+	skewd sd;
+	threaddata *tdata;
+	double x0, y0, d, *XX = sd.XX, *YY = sd.YY;
+	int i;
+
+	/* Calculate clipping parallelogram's corners */
+	x0 = 0.5 * (nw - 1); y0 = 0.5 * (nh - 1);
+	XX[1] = XX[3] = (XX[0] = XX[2] = 0.5 * (nw - ow - 1)) + ow;
+	YY[2] = YY[3] = (YY[0] = YY[1] = 0.5 * (nh - oh - 1)) + oh;
+	for (i = 0; i < 4; i++)
+	{
+		XX[i] += (YY[i] - y0) * xskew;
+		YY[i] += (XX[i] - x0) * yskew;
 	}
+	d = 1.0 + xskew * yskew;
+	sd.Kv = d ? xskew / d : 0.0; // for left & right
+	sd.Kh = yskew ? 1.0 / yskew : 0.0; // for top & bottom
+
+	/* Process image in row bands */
+	sd.old_img = old_img;
+	sd.new_img = new_img;
+	sd.x0 = x0;
+	sd.y0 = y0;
+	sd.d = d;
+	sd.xskew = xskew;
+	sd.yskew = yskew;
+	sd.ow = ow;
+	sd.oh = oh;
+	sd.nw = nw;
+	sd.nh = nh;
+	sd.bpp = bpp;
+	sd.progress = !silent;
+	tdata = talloc(MA_ALIGN_DEFAULT, image_threads(nw, nh), &sd, sizeof(sd),
+		NULL, NULL);
+	if (!tdata) return;
+	tdata->silent = silent;
+	launch_threads(skew_nn_rows, tdata, NULL, nh);
+	free(tdata);
 }
 
 /* Skew geometry calculation is far nastier than same for rotation, and worse,
@@ -10598,57 +13068,190 @@ static void mem_convert_row(double *dest, unsigned char *src, int l, int cspace)
 
 static int cmp_edge(const void *v1, const void *v2)
 {
-	float f1 = ((seg_edge *)v1)->diff, f2 = ((seg_edge *)v2)->diff;
-	return (f1 < f2 ? -1 : f1 != f2 ? f1 > f2 :
-		((seg_edge *)v1)->which - ((seg_edge *)v2)->which);
+	seg_edge e1 = *(seg_edge *)v1, e2 = *(seg_edge *)v2;
+	return (e1 < e2 ? -1 : e1 > e2);
+}
+
+static inline float seg_diff(seg_edge e)
+{
+	uint32_t v = e >> 32;
+	float f;
+
+	memcpy(&f, &v, sizeof(f));
+	return (f);
 }
 
 static inline int seg_find(seg_pixel *pix, int n)
 {
 	unsigned int i, j;
 
-	for (i = n; i != (j = pix[i].group); i = j);
-	return (pix[n].group = i);
+	for (i = n; !((j = pix[i].group) & SEG_ROOT); i = j);
+	if (i != n) pix[n].group = i;
+	return (i);
 }
 
 static inline int seg_join(seg_pixel *pix, int a, int b)
 {
 	seg_pixel *ca = pix + a, *cb = pix + b;
 
-	if (ca->rank > cb->rank)
+	/* Rank value is logarithmic, so fits in what's left of the field */
+	if (ca->group > cb->group)
 	{
 		ca->cnt += cb->cnt;
 		return (cb->group = a);
 	}
 	cb->cnt += ca->cnt;
-	cb->rank += (ca->rank == cb->rank);
+	cb->group += (ca->group == cb->group);
 	return (ca->group = b);
 }
 
-seg_state *mem_seg_prepare(seg_state *s, unsigned char *img, int w, int h,
-	int flags, int cspace, int dist)
+/* Edges get sorted by the exact float value of difference, as positive
+ * floats order the same as their bit patterns: first spread by top bits
+ * into buckets, keeping the original order, then each bucket is sorted on
+ * its own. Differences are computed in bands of rows on multiple threads,
+ * and stored by edge index in the space of pixel nodes meanwhile */
+
+#define SEG_KEYBITS 16
+#define SEG_BUCKETS (1 << SEG_KEYBITS)
+#define SEG_BANDS_MAX 256
+
+typedef struct {
+	seg_state *s;
+	unsigned char *img;
+	float *diffs;		// Differences by edge index
+	unsigned int *hist;	// Per-band histograms, then write offsets
+	unsigned int *bstart;	// Bucket bounds
+	double *rows;		// Row buffers
+	int cspace, dist, bands, progress;
+} seg_prep_info;
+
+static inline uint32_t seg_bits(float f)
+{
+	uint32_t v;
+
+	memcpy(&v, &f, sizeof(v));
+	return (v);
+}
+
+static inline int seg_key(float f)
+{
+	return (seg_bits(f) >> (32 - SEG_KEYBITS));
+}
+
+static void seg_diffs(tcb *thread)
 {
 	static const unsigned char dist_scales[NUM_CSPACES] = { 1, 255, 1 };
+	seg_prep_info *si = thread->data;
+	distance_func dist = distance_3d[si->dist];
+	double mult, *row0, *row1, *tmp;
+	float *d;
+	unsigned int *hist;
+	int i, n, x, y, y1, w = si->s->w, h = si->s->h, cnt = si->bands;
+	int p0 = thread->progress;
+
+	mult = dist_scales[si->cspace]; // Make all colorspaces use similar scale
+	for (i = 0 , n = thread->nsteps; i < n; i++)
+	{
+		int band = thread->step0 + i;
+
+		hist = si->hist + band * SEG_BUCKETS;
+		y = (band * (long long)h) / cnt;
+		y1 = ((band + 1) * (long long)h) / cnt;
+		row0 = si->rows;
+		row1 = row0 + w * 3;
+		mem_convert_row(row0, si->img + y * w * 3, w, si->cspace);
+		for (; y < y1; y++)
+		{
+			d = si->diffs + y * w * 2;
+			if (y < h - 1) mem_convert_row(row1,
+				si->img + (y + 1) * w * 3, w, si->cspace);
+			for (x = 0; x < w; x++ , d += 2)
+			{
+				/* Right vertex */
+				if (x < w - 1) hist[seg_key(d[0] = mult *
+					dist(row0 + x * 3, row0 + x * 3 + 3))]++;
+				/* Bottom vertex */
+				if (y < h - 1) hist[seg_key(d[1] = mult *
+					dist(row0 + x * 3, row1 + x * 3))]++;
+			}
+			tmp = row0 , row0 = row1 , row1 = tmp;
+		}
+		if (!si->progress) continue;
+		if (!thread_step(thread, p0 + i + 1, thread->tdata->total, 20))
+			continue;
+		thread->stop = TRUE; // Single-threaded build does not set it
+		break;
+	}
+}
+
+static void seg_spread(tcb *thread)
+{
+	seg_prep_info *si = thread->data;
+	seg_edge *edges = si->s->edges;
+	float *d;
+	unsigned int *ofs;
+	int i, x, y, y1, k, w = si->s->w, h = si->s->h, cnt = si->bands;
+
+	for (i = 0; i < thread->nsteps; i++)
+	{
+		int band = thread->step0 + i;
+
+		ofs = si->hist + band * SEG_BUCKETS;
+		y = (band * (long long)h) / cnt;
+		y1 = ((band + 1) * (long long)h) / cnt;
+		for (; y < y1; y++)
+		{
+			k = y * w * 2;
+			d = si->diffs + k;
+			for (x = 0; x < w; x++ , d += 2 , k += 2)
+			{
+				if (x < w - 1) edges[ofs[seg_key(d[0])]++] =
+					((seg_edge)seg_bits(d[0]) << 32) + k;
+				if (y < h - 1) edges[ofs[seg_key(d[1])]++] =
+					((seg_edge)seg_bits(d[1]) << 32) + k + 1;
+			}
+		}
+	}
+}
+
+static void seg_sort_buckets(tcb *thread)
+{
+	seg_prep_info *si = thread->data;
 	seg_edge *e;
-	double mult, *row0, *row1, *rows[2];
-	int i, j, k, l, bsz, sz = w * h;
+	int j, n, b = thread->step0, b1 = b + thread->nsteps;
+
+	for (; b < b1; b++)
+	{
+		e = si->s->edges + si->bstart[b];
+		n = si->bstart[b + 1] - si->bstart[b];
+		/* Already in index order, so only unequal values need sorting */
+		for (j = 1; (j < n) && ((e[j] ^ e[0]) >> 32 == 0); j++);
+		if (j < n) qsort(e, n, sizeof(seg_edge), cmp_edge);
+	}
+}
+
+seg_state *mem_seg_prepare(seg_state *s, unsigned char *img, int w, int h,
+	int flags, int cspace, int dist)
+{
+	seg_prep_info si;
+	threaddata *tdata;
+	seg_state *s0 = s;
+	unsigned int *hist, v;
+	int i, b, n, nt, bands, sz = w * h;
 
 
 	// !!! Will need a longer int type (and twice the memory) otherwise
 	if (sz > (INT_MAX >> 1) + 1) return (NULL);
 
-	/* 3 buffers will be sharing space */
-	bsz = w * 3 * 2 * sizeof(double);
-	l = sz * sizeof(seg_pixel);
-	if (l > bsz) bsz = l;
-
 	if (!s) // Reuse existing allocation if possible
 	{ /* Allocation is HUGE, but no way to make do with smaller one - WJ */
 		void *v[3];
 
 		s = multialloc(MA_ALIGN_DOUBLE,
 			v, sizeof(seg_state), // Dummy pointer (header struct)
-			v + 1, bsz, // Row buffers/pixel nodes
+			// Pixel nodes/differences
+			v + 1, sz * (sizeof(seg_pixel) > sizeof(float) * 2 ?
+				sizeof(seg_pixel) : sizeof(float) * 2),
 			v + 2, sz * 2 * sizeof(seg_edge), // Pixel connections
 			NULL);
 		if (!s) return (NULL);
@@ -10657,49 +13260,81 @@ seg_state *mem_seg_prepare(seg_state *s, unsigned char *img, int w, int h,
 		s->w = w;
 		s->h = h;
 	}
-	rows[0] = (void *)s->pix; // 1st row buffer
-	rows[1] = rows[0] + w * 3; // 2nd row buffer
 	s->phase = 0; // Struct is to be refilled
 
+	/* Bands of rows, enough to keep threads busy, but not so many that
+	 * their histograms would take more memory than pixels */
+	nt = image_threads(w, h);
+	n = helper_threads();
+	if (nt > n) nt = n;
+	if (nt < 1) nt = 1;
+	bands = nt * 4;
+	if (bands < 16) bands = 16;
+	if (bands > SEG_BANDS_MAX) bands = SEG_BANDS_MAX;
+	if (bands > (n = sz >> SEG_KEYBITS)) bands = n;
+	if (bands < nt) bands = nt;
+	if (bands > h) bands = h;
+
+	memset(&si, 0, sizeof(si));
+	si.s = s;
+	si.img = img;
+	si.diffs = (void *)s->pix;
+	si.cspace = cspace;
+	si.dist = dist;
+	si.bands = bands;
+	si.progress = flags & SEG_PROGRESS;
+	tdata = talloc(MA_ALIGN_DOUBLE, nt, &si, sizeof(si),
+		&si.hist, bands * SEG_BUCKETS * sizeof(int),
+		&si.bstart, (SEG_BUCKETS + 1) * sizeof(int),
+		NULL,
+		&si.rows, w * 3 * 2 * sizeof(double),
+		NULL);
+	if (!tdata) /* Fail if new, leave unfilled if not */
+	{
+		if (!s0) free(s);
+		return (s0);
+	}
+
 	if (flags & SEG_PROGRESS) progress_init(_("Segmentation Pass 1"), 1);
 
-	/* Compute color distances, fill connections buffer */
-	l = w * 3;
-	mult = dist_scales[cspace]; // Make all colorspaces use similar scale
-	for (i = 0 , e = s->edges; i < h; i++)
+	/* Compute color distances, count them into buckets */
+	tdata->silent = !(flags & SEG_PROGRESS);
+	tdata->chunks = (bands + tdata->count - 1) / tdata->count;
+	launch_threads(seg_diffs, tdata, NULL, bands);
+	if (tdata->threads[0]->stop) goto quit;
+
+	/* Where each band's part of each bucket goes */
+	hist = si.hist;
+	for (b = n = 0; b < SEG_BUCKETS; b++)
 	{
-		k = i * w;
-		mem_convert_row(row1 = rows[i & 1], img + k * 3, w, cspace);
-		/* Right vertices for this row */
-		for (j = 3 , k *= 2; j < l; j += 3 , k += 2 , e++)
+		si.bstart[b] = n;
+		for (i = 0; i < bands; i++)
 		{
-			e->which = k;
-			e->diff = mult * distance_3d[dist](row1 + j - 3, row1 + j);
+			v = hist[i * SEG_BUCKETS + b];
+			hist[i * SEG_BUCKETS + b] = n;
+			n += v;
 		}
-		if (!i) continue;
-		/* Bottom vertices for previous row */
-		k = (i - 1) * w * 2 + 1;
-		row0 = rows[~i & 1];
-		for (j = 0; j < l; j += 3 , k += 2 , e++)
-		{
-			e->which = k;
-			e->diff = mult * distance_3d[dist](row0 + j, row1 + j);
-		}
-		if ((flags & SEG_PROGRESS) && ((i * 20) % h >= h - 20))
-			if (progress_update((0.9 * i) / h)) goto quit;
 	}
+	si.bstart[b] = s->cnt = n;
 
-	/* Sort connections, smallest distances first */
-	s->cnt = e - s->edges;
-	qsort(s->edges, s->cnt, sizeof(seg_edge), cmp_edge);
+	/* Fill connections buffer, smallest distances first */
+	tdata->silent = TRUE;
+	launch_threads(seg_spread, tdata, NULL, bands);
+	tdata->chunks = 64;
+	launch_threads(seg_sort_buckets, tdata, NULL, SEG_BUCKETS);
 
 	s->phase = 1;
 
 quit:	if (flags & SEG_PROGRESS) progress_end();
+	free(tdata);
 
 	return (s);
 }
 
+#undef SEG_KEYBITS
+#undef SEG_BUCKETS
+#undef SEG_BANDS_MAX
+
 int mem_seg_process_chunk(int start, int cnt, seg_state *s)
 {
 	seg_edge *edge;
@@ -10714,9 +13349,8 @@ int mem_seg_process_chunk(int start, int cnt, seg_state *s)
 	{
 		for (i = 0 , cp = pix; i < sz; i++ , cp++)
 		{
-			cp->group = i;
+			cp->group = SEG_ROOT; // Rank 0
 			cp->cnt = 1;
-			cp->rank = 0;
 			cp->threshold = threshold;
 		}
 	}
@@ -10736,8 +13370,8 @@ int mem_seg_process_chunk(int start, int cnt, seg_state *s)
 			int j, k, idx;
 
 			/* Get the original pixel */
-			dist = edge->diff;
-			idx = edge->which;
+			dist = seg_diff(*edge);
+			idx = (uint32_t)*edge;
 			j = idx >> 1;
 			/* Get the neighboring pixel's index */
 			k = j + w1[idx & 1];
@@ -10750,8 +13384,8 @@ int mem_seg_process_chunk(int start, int cnt, seg_state *s)
 			 * small in pass 2 */
 			if (!pass ? ((dist <= pix[j].threshold) &&
 					(dist <= pix[k].threshold)) :
-				pass == 1 ? ((pix[j].rank < minrank) ||
-					(pix[k].rank < minrank)) :
+				pass == 1 ? (((int)(pix[j].group & ~SEG_ROOT) < minrank) ||
+					((int)(pix[k].group & ~SEG_ROOT) < minrank)) :
 				((pix[j].cnt < minsize) || (pix[k].cnt < minsize)))
 			{
 				seg_pixel *cp = pix + seg_join(pix, j, k);
@@ -10766,8 +13400,9 @@ int mem_seg_process_chunk(int start, int cnt, seg_state *s)
 		pass += pass && (minsize <= (1 << minrank)); // Maybe skip pass 2
 	}
 
-	/* Normalize groups */
+	/* Normalize groups, then make roots refer to themselves */
 	for (i = 0; i < sz; i++) seg_find(pix, i);
+	for (i = 0; i < sz; i++) if (pix[i].group & SEG_ROOT) pix[i].group = i;
 
 	/* All done */
 	s->phase |= 2;
@@ -10795,6 +13430,13 @@ int mem_seg_process(seg_state *s)
 	return (s->phase >= 2);
 }
 
+/* Group of pixel, with roots not yet normalized */
+static inline unsigned int seg_group(const seg_pixel *pix, int n)
+{
+	unsigned int g = pix[n].group;
+	return (g & SEG_ROOT ? n : g);
+}
+
 /* This produces for one row 2 difference bits per pixel: left & up; if called
  * with segmentation still in progress, will show oversegmentation */
 void mem_seg_scan(unsigned char *dest, int y, int x, int w, int zoom,
@@ -10806,10 +13448,10 @@ void mem_seg_scan(unsigned char *dest, int y, int x, int w, int zoom,
 	memset(dest, 0, (w + 3) >> 2);
 	ofs = (y * s->w + x) * zoom;
 	dy = y ? s->w * zoom : 0; // No up neighbors for Y=0
-	j = pix[ofs + (!x - 1) * zoom].group; // No left neighbor for X=0
+	j = seg_group(pix, ofs + (!x - 1) * zoom); // No left neighbor for X=0
 	for (i = 0; i < w; i++ , j = k , ofs += zoom)
 	{
-		k = pix[ofs].group , l = pix[ofs - dy].group;
+		k = seg_group(pix, ofs) , l = seg_group(pix, ofs - dy);
 		dest[i >> 2] |= ((j != k) * 2 + (k != l)) << ((i + i) & 6);
 	}
 }
@@ -10855,8 +13497,8 @@ void mem_seg_render(unsigned char *img, const seg_state *s)
 double mem_seg_threshold(seg_state *s)
 {
 	int k = s->cnt - FRACTAL_THR * pow(s->cnt, 0.5 * FRACTAL_DIM);
-	while (!s->edges[k].diff && (k < s->cnt - 1)) k++;
-	return (s->edges[k].diff ? s->edges[k].diff * THRESHOLD_MULT : 1.0);
+	while (!(s->edges[k] >> 32) && (k < s->cnt - 1)) k++;
+	return (s->edges[k] >> 32 ? seg_diff(s->edges[k]) * THRESHOLD_MULT : 1.0);
 }
 
 #undef FRACTAL_DIM
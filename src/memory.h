@@ -406,6 +406,7 @@ int mem_nudge;				// Nudge pixels per SHIFT+Arrow key during selection/paste
 
 int mem_undo_limit;		// Max MB memory allocation limit
 int mem_undo_common;		// Percent of undo space in common arena
+int mem_undo_spill;		// Max MB disk space for undo
 int mem_undo_opacity;		// Use previous image for opacity calculations?
 
 int mem_undo_fail;		// Undo space shortfall
@@ -653,6 +654,27 @@ int cmask_from(chanlist img);	// Chanlist to cmask
 int mem_count_all_cols();			// Count all colours - Using main image
 int mem_count_all_cols_real(unsigned char *im, int w, int h);	// Count all colours - very memory greedy
 
+#define COL_STATS_TOP 256 /* How many most frequent colours to list */
+
+typedef struct {
+	int rgb, cnt;
+} col_freq;
+
+typedef struct {
+	int cols;		// Distinct colours
+	int rgb[256][3];	// Channel value frequencies
+	int nfreq;		// Colours listed by frequency
+	col_freq freq[COL_STATS_TOP];
+	col_freq *tab;		// All colours by value, with counts; malloc()ed
+} col_stats;
+
+#define CS_FREQ   1 /* Count pixels of each colour too */
+#define CS_CACHED 2 /* Only return what is already there */
+
+int mem_get_col_stats(col_stats *cs, unsigned char *img, int w, int h, int freq);
+			// Collect colour statistics of RGB chunk; caller frees cs->tab
+col_stats *mem_col_stats(int flags);	// Same for main RGB image, reusing the last result
+
 int mem_cols_used(png_color *pal);	// Count and collect colours used in main RGB image
 int mem_cols_used_real(unsigned char *im, int w, int h, png_color *pal);
 			// Count and collect colours used in RGB chunk
@@ -682,8 +704,12 @@ void mem_init();				// Initialise memory
 
 //	Return the number of bytes used in image + undo stuff
 size_t mem_used();
+//	Same, from running total kept by undo code - cheap enough for status bar
+size_t mem_undo_used();
 //	Return the number of bytes used in image + undo in all layers
 size_t mem_used_layers();
+//	Return the number of bytes of undo data moved out to disk, in all layers
+size_t mem_undo_spilled();
 
 #define FX_EDGE       0
 #define FX_EMBOSS     2
@@ -701,6 +727,13 @@ size_t mem_used_layers();
 
 void do_effect( int type, int param );		// 0=edge detect 1=UNUSED 2=emboss
 void mem_bacteria( int val );			// Apply bacteria effect val times the canvas area
+/* Gaussian blur engines */
+#define BLUR_DOUBLE 0	/* Exact, slowest */
+#define BLUR_FLOAT  1
+#define BLUR_FIXED  2	/* 16-bit fixed point */
+
+int blur_engine;		// Which of the above to use
+
 void mem_gauss(double radiusX, double radiusY, int gcor);
 void mem_unsharp(double radius, double amount, int threshold, int gcor);
 void mem_dog(double radiusW, double radiusN, int norm, int gcor);
@@ -734,15 +767,18 @@ void do_convert_rgb(int start, int step, int cnt, unsigned char *dest,
 	unsigned char *src, png_color *pal);	// Convert image to RGB
 int mem_convert_indexed(unsigned char *dest, unsigned char *src, int cnt,
 	int cols, png_color *pal);	// Convert image to Indexed Palette
-//	Quantize image using Max-Min algorithm
+//	Quantize image using Max-Min algorithm; colour table from cs, if any,
+//	gets used instead of scanning the image
 int maxminquan(unsigned char *inbuf, int width, int height, int quant_to,
-	png_color *userpal);
-//	Quantize image using PNN algorithm
+	png_color *userpal, col_stats *cs);
+//	Quantize image using PNN algorithm; same for cs
 int pnnquan(unsigned char *inbuf, int width, int height, int quant_to,
-	png_color *userpal);
+	png_color *userpal, col_stats *cs);
 //	Convert RGB->indexed using error diffusion with variety of options
 int mem_dither(unsigned char *old, int ncols, short *dither, int cspace,
 	int dist, int limit, int selc, int serpent, int rgb8b, double emult);
+//	Time palette search against plain scan, print results to stdout
+int mem_nearest_bench();
 //	Do the same in dumb but fast way
 int mem_dumb_dither(unsigned char *old, unsigned char *new, png_color *pal,
 	int width, int height, int ncols, int dither);
@@ -862,6 +898,8 @@ void mem_rotate_free_real(chanlist old_img, chanlist new_img, int ow, int oh,
 int mem_image_scale(int nw, int nh, int type, int gcor, int sharp, int bound);
 int mem_image_scale_real(chanlist old_img, int ow, int oh, int bpp,
 	chanlist new_img, int nw, int nh, int type, int gcor, int sharp);
+//	Time scaling against reference code, print results to stdout
+int mem_scale_bench();
 int mem_image_resize(int nw, int nh, int ox, int oy, int mode);	// Resize image
 
 int mem_isometrics(int type);
@@ -951,15 +989,16 @@ int average_pixels(unsigned char *rgb, unsigned char *alpha, int iw, int *vxy);
 
 #define SEG_PROGRESS 1
 
-typedef struct {
-	int which; // Pixel index * 2 + (0 if right / 1 if down)
-	float diff;
-} seg_edge;
+/* Edge holds bit pattern of difference in upper half, and pixel index * 2 +
+ * (0 if right / 1 if down) in lower half; differences are never negative, so
+ * edges order by difference then by index as plain integers */
+typedef guint64 seg_edge;
+
+/* Segment root holds its rank in group field, with SEG_ROOT bit set */
+#define SEG_ROOT 0x80000000U
 
 typedef struct {
 	unsigned int group, cnt;
-	unsigned char rank; // Value is logarithmic, so this is more than enough
-//	unsigned char reserved[3];
 	float threshold;
 } seg_pixel;
 
@@ -119,6 +119,7 @@ static int clip_to_layer(int layer)
 	}
 	else
 	{
+		layer_ready(layer); // Not to be unpacked over the new image
 		img = &layer_table[layer].image->image_;
 		state = &layer_table[layer].image->state_;
 		*state = mem_state;
@@ -1907,6 +1908,8 @@ static void click_quantize_ok(quantize_dd *dt, void **wdata)
 	int quantize_cols = dt->cols0, efrac = 0;
 	png_color newpal[256];
 	unsigned char *old_image = mem_img[CHN_IMAGE];
+	/* Colour table, if already collected, replaces scanning the image */
+	col_stats *cs = mem_col_stats(CS_FREQ | CS_CACHED);
 
 	/* Dithering filters */
 	/* Floyd-Steinberg dither */
@@ -1950,13 +1953,16 @@ static void click_quantize_ok(quantize_dd *dt, void **wdata)
 	case QUAN_CURRENT: /* Use current palette */
 		break;
 	case QUAN_PNN: /* PNN quantizer */
-		err = pnnquan(old_image, mem_width, mem_height, new_cols, newpal);
+		err = pnnquan(old_image, mem_width, mem_height, new_cols, newpal,
+			cs);
 		break;
 	case QUAN_WU: /* Wu quantizer */
-		err = wu_quant(old_image, mem_width, mem_height, new_cols, newpal);
+		err = wu_quant(old_image, mem_width, mem_height, new_cols, newpal,
+			cs);
 		break;
 	case QUAN_MAXMIN: /* Max-Min quantizer */
-		err = maxminquan(old_image, mem_width, mem_height, new_cols, newpal);
+		err = maxminquan(old_image, mem_width, mem_height, new_cols,
+			newpal, cs);
 		break;
 	}
 
@@ -2091,9 +2097,12 @@ void pressed_quantize(int palette)
 {
 	char *qnames[sizeof(quan_txt) / sizeof(quan_txt[0])];
 	quantize_dd tdata;
+	col_stats *cs = mem_col_stats(CS_CACHED);
 
 	tdata.pflag = palette;
-	tdata.cols = tdata.cols0 = mem_cols_used(tdata.newpal);
+	/* No need to scan the image again if already known to be too colourful */
+	if (cs && (cs->cols > 256)) tdata.cols = tdata.cols0 = 257;
+	else tdata.cols = tdata.cols0 = mem_cols_used(tdata.newpal);
 	tdata.qtxt = qnames;
 
 	memcpy(qnames, quan_txt, sizeof(qnames));
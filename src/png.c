@@ -21,6 +21,9 @@
 
 #include <stdio.h>
 #include <errno.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
 
 #define PNG_READ_PACK_SUPPORTED
 
@@ -54,6 +57,9 @@
 #define RGBA_FRAMES
 #include <webp/encode.h>
 #include <webp/decode.h>
+#ifdef U_WEBPMUX
+#include <webp/mux.h>
+#endif
 #endif
 #if U_LCMS == 2
 #include <lcms2.h>
@@ -78,6 +84,7 @@
 #include "layer.h"
 #include "spawn.h"
 #include "thread.h"
+#include "wu.h"
 
 /* Make fseek() and ftell() on Win64 have the same limits as on 64-bit Unix */
 #ifdef _WIN64 /* LLP64 */
@@ -95,6 +102,27 @@ typedef long f_long;
 /* Macro for big-endian tags (IFF and BMP) */
 #define TAG4B(A,B,C,D) (((A) << 24) + ((B) << 16) + ((C) << 8) + (D))
 
+/* Exploded frame waiting to be written out */
+typedef struct {
+	ls_settings settings;
+	png_color pal[256];
+	char name[PATHBUF + 32];
+	size_t mem;
+	int res;
+	volatile int state;
+} frame_out;
+
+/* Frame slot states */
+enum {
+	FO_FREE = 0,
+	FO_QUEUED,
+	FO_BUSY,
+	FO_DONE
+};
+
+/* Memory limit for frames waiting to be written out */
+#define FRAMES_OUT_MEM (256 * 1024 * 1024)
+
 /* All-in-one transport container for animation save/load */
 typedef struct {
 	frameset fset;
@@ -105,6 +133,11 @@ typedef struct {
 	int error, miss, cnt;
 	int lastzero;
 	char *destdir;
+	/* Ring of frames queued for writing out in parallel */
+	frame_out *outq;
+	int nout, maxout, ohead;
+	volatile int otake, oend;
+	size_t outmem;
 } ani_settings;
 
 int silence_limit, jpeg_quality, png_compression;
@@ -112,6 +145,7 @@ int tga_RLE, tga_565, tga_defdir, jp2_rate;
 int lzma_preset, zstd_level, tiff_predictor, tiff_rtype, tiff_itype, tiff_btype;
 int webp_preset, webp_quality, webp_compression;
 int lbm_mask, lbm_untrans, lbm_pack, lbm_pbm;
+int gif_small;
 int apply_icc;
 
 fformat file_formats[NUM_FTYPES] = {
@@ -137,7 +171,7 @@ fformat file_formats[NUM_FTYPES] = {
 #else
 	{ "", "", "", 0},
 #endif
-	{ "GIF", "gif", "", FF_256 | FF_ANIM, XF_TRANS },
+	{ "GIF", "gif", "", FF_256 | FF_ANIM | FF_WMEM, XF_TRANS },
 	{ "BMP", "bmp", "", FF_256 | FF_RGB | FF_ALPHAR | FF_MEM },
 	{ "XPM", "xpm", "", FF_256 | FF_RGB, XF_TRANS | XF_SPOT },
 	{ "XBM", "xbm", "", FF_BW, XF_SPOT },
@@ -153,8 +187,8 @@ fformat file_formats[NUM_FTYPES] = {
 	{ "PAL", "pal", "", FF_PALETTE },
 	{ "ACT", "act", "", FF_PALETTE },
 	{ "LAYERS", "txt", "", FF_LAYER },
-/* !!! No 2nd layers format yet */
-	{ "", "", "", 0},
+/* mtPaint's own single-file layers format */
+	{ "MTPL", "mtpl", "", FF_LAYER },
 /* An X pixmap - not a file at all */
 	{ "PIXMAP", "", "", FF_RGB | FF_NOSAVE },
 /* SVG image - import only */
@@ -307,6 +341,8 @@ static int allocate_image(ls_settings *settings, int cmask)
 	else if (mode == FS_CLIPBOARD) cmask &= CMASK_RGBA;
 	else if ((mode == FS_CHANNEL_LOAD) || (mode == FS_PATTERN_LOAD))
 		cmask &= CMASK_IMAGE;
+	/* Reduced decode handles only image and alpha */
+	if (settings->reduce) cmask &= CMASK_RGBA;
 
 	/* Overwriting is allowed */
 	oldmask = cmask_from(settings->img);
@@ -426,13 +462,213 @@ static void delete_alpha(ls_settings *settings, int v)
 		deallocate_image(settings, CMASK_ALPHA);
 }
 
+/* Reduced-resolution decode: a loader reading the image row by row can let
+ * the rows be box-averaged on the fly into an image which fits into lim_w x
+ * lim_h, so that only the reduced image and one source row get stored. Rows
+ * can come in any order, so long as rows of one box come together. Indexed
+ * images get sampled, not averaged; utility channels are not loaded. RGB is
+ * weighted by alpha, same as when scaling; the transparent colour is kept
+ * out of averages, and a box whose first pixel has it gets it */
+
+typedef struct {
+	int w, h, f;	// Source size, reduction factor
+	int y, n;	// Output row being summed, and rows summed into it
+	unsigned char *row[2];	// Source rows: image, alpha
+	unsigned long long *sum; // Sums: RGB, alpha (or transparent colour
+				// flag), alpha-weighted RGB, pixel count
+} ls_reducer;
+
+#define REDUCE_SUMS 8
+#define REDUCE_MAX 4096 /* REDUCE_MAX^2 fits into int */
+
+static int reduce_factor(ls_settings *settings, int w, int h)
+{
+	int l, f = 1;
+
+	if ((l = settings->lim_w) && (w > l)) f = (w + l - 1) / l;
+	if ((l = settings->lim_h) && (h > l) && ((h + l - 1) / l > f))
+		f = (h + l - 1) / l;
+	return (f > REDUCE_MAX ? REDUCE_MAX : f);
+}
+
+/* Replace source size in settings by reduced one, if there is a need */
+static int reduce_setup(ls_settings *settings)
+{
+	ls_reducer *rd;
+	int f, w = settings->width, h = settings->height;
+
+	if ((f = reduce_factor(settings, w, h)) < 2) return (FALSE);
+	free(settings->reduce);
+	settings->reduce = rd = calloc(1, sizeof(ls_reducer) +
+		(w + f - 1) / f * REDUCE_SUMS * sizeof(*rd->sum) + w * 4);
+	if (!rd) return (FALSE); // Load it as is then
+	rd->w = w; rd->h = h; rd->f = f;
+	rd->sum = (void *)(rd + 1);
+	rd->row[0] = (void *)(rd->sum + (w + f - 1) / f * REDUCE_SUMS);
+	rd->row[1] = rd->row[0] + w * 3;
+	settings->width = (w + f - 1) / f;
+	settings->height = (h + f - 1) / f;
+	return (TRUE);
+}
+
+/* Where to put row y of image or alpha channel */
+static unsigned char *ls_row(ls_settings *settings, int chn, int y)
+{
+	ls_reducer *rd = settings->reduce;
+
+	if (!settings->img[chn]) return (NULL);
+	if (rd) return (rd->row[chn != CHN_IMAGE]);
+	return (settings->img[chn] + (size_t)y * settings->width *
+		(chn == CHN_IMAGE ? settings->bpp : 1));
+}
+
+/* Notify that row y is in place */
+static void ls_row_done(ls_settings *settings, int y)
+{
+	ls_reducer *rd = settings->reduce;
+	unsigned char *src, *dest, *alpha;
+	unsigned long long *sum;
+	int i, k, x, n, nw, nh, ow, f, w, tr = -1;
+
+	if (!rd) return;
+	w = rd->w; f = rd->f; ow = settings->width;
+	/* Start new box, dropping the previous one if incomplete */
+	if (!rd->n || (y / f != rd->y))
+	{
+		memset(rd->sum, 0, ow * REDUCE_SUMS * sizeof(*rd->sum));
+		rd->y = y / f; rd->n = 0;
+	}
+	nh = rd->h - rd->y * f;
+	if (nh > f) nh = f;
+	alpha = settings->img[CHN_ALPHA] ? rd->row[1] : NULL;
+	if (!alpha && (settings->bpp == 3)) tr = settings->rgb_trans;
+
+	/* Sample indexed image */
+	if (settings->bpp == 1)
+	{
+		if (!(y % f))
+		{
+			src = rd->row[0];
+			dest = settings->img[CHN_IMAGE] + (size_t)rd->y * ow;
+			for (x = 0; x < ow; x++) dest[x] = src[x * f];
+		}
+	}
+	/* Sum up RGB */
+	else for (src = rd->row[0] , sum = rd->sum , x = 0; x < w; x += f)
+	{
+		for (i = 0 , n = w - x < f ? w - x : f; i < n; i++ , src += 3)
+		{
+			if ((tr >= 0) && (MEM_2_INT(src, 0) == tr))
+			{
+				if (!i && !(y % f)) sum[3] = 1;
+				continue;
+			}
+			sum[0] += src[0];
+			sum[1] += src[1];
+			sum[2] += src[2];
+			sum[7]++;
+			if (!alpha) continue;
+			k = alpha[x + i];
+			sum[4] += src[0] * k;
+			sum[5] += src[1] * k;
+			sum[6] += src[2] * k;
+		}
+		sum += REDUCE_SUMS;
+	}
+	/* Sum up alpha */
+	if (alpha)
+	{
+		for (src = alpha , sum = rd->sum + 3 , x = 0; x < w; x += f)
+		{
+			for (n = w - x < f ? w - x : f; n > 0; n--)
+				*sum += *src++;
+			sum += REDUCE_SUMS;
+		}
+	}
+	if (++rd->n < nh) return;
+
+	/* Box is complete - store averages */
+	for (sum = rd->sum , x = 0; x < ow; x++ , sum += REDUCE_SUMS)
+	{
+		nw = w - x * f;
+		if (nw > f) nw = f;
+		n = nw * nh;
+		if (settings->bpp == 3)
+		{
+			dest = settings->img[CHN_IMAGE] +
+				((size_t)rd->y * ow + x) * 3;
+			/* Transparent colour */
+			if ((tr >= 0) && (sum[3] || !sum[7]))
+			{
+				dest[0] = INT_2_R(tr);
+				dest[1] = INT_2_G(tr);
+				dest[2] = INT_2_B(tr);
+			}
+			/* Weighted by alpha, unless all of it is 0 */
+			else if (alpha && sum[3]) for (i = 0; i < 3; i++)
+				dest[i] = (sum[i + 4] + (sum[3] >> 1)) / sum[3];
+			else for (i = 0; i < 3; i++)
+				dest[i] = (sum[i] + (sum[7] >> 1)) / sum[7];
+		}
+		if (!alpha) continue;
+		k = (sum[3] + (n >> 1)) / n;
+		settings->img[CHN_ALPHA][(size_t)rd->y * ow + x] = k;
+	}
+	rd->n = 0;
+}
+
+/* Reduce image which loader did not reduce while reading it */
+static void reduce_image(ls_settings *settings)
+{
+	chanlist old;
+	ls_reducer *rd;
+	int i, y, w = settings->width, h = settings->height, bpp = settings->bpp;
+
+	if (settings->reduce || !reduce_setup(settings)) return;
+	rd = settings->reduce;
+	memcpy(old, settings->img, sizeof(chanlist));
+	memset(settings->img, 0, sizeof(chanlist));
+	for (i = CHN_IMAGE; i <= CHN_ALPHA; i++)
+	{
+		if (!old[i]) continue;
+		settings->img[i] = malloc((size_t)settings->width *
+			settings->height * (i == CHN_IMAGE ? bpp : 1));
+		if (!settings->img[i]) break;
+	}
+	/* Not enough memory - keep it unreduced */
+	if (i <= CHN_ALPHA)
+	{
+		mem_free_chanlist(settings->img);
+		memcpy(settings->img, old, sizeof(chanlist));
+		settings->width = w;
+		settings->height = h;
+	}
+	else
+	{
+		for (y = 0; y < h; y++)
+		{
+			rd->row[0] = old[CHN_IMAGE] + (size_t)y * w * bpp;
+			if (old[CHN_ALPHA])
+				rd->row[1] = old[CHN_ALPHA] + (size_t)y * w;
+			ls_row_done(settings, y);
+		}
+		mem_free_chanlist(old);
+	}
+	free(rd);
+	settings->reduce = NULL;
+}
+
 typedef struct {
 	FILE *file; // for traditional use
 	memx2 m; // data
 	int top;  // end of data
+	size_t map; // size of file mapping, if any
 } memFILE;
 #define MEMFILE_MAX INT_MAX /* How much it can hold */
 
+/* Files smaller than this aren't worth mapping */
+#define MF_MAP_MIN (1 << 20)
+
 #if MEMFILE_MAX != MEMX2_MAX
 #error "Mismatched max sizes"
 #endif
@@ -458,6 +694,15 @@ static size_t mfwrite(void *ptr, size_t size, size_t nmemb, memFILE *mf)
 	if (mf->file) return (fwrite(ptr, size, nmemb, mf->file));
 
 	if (mf->m.here < 0) return (0);
+	/* Seeked past the end - fill the gap with zeros, as a file would */
+	if (mf->m.here > mf->top)
+	{
+		l = mf->m.here - mf->top;
+		mf->m.here = mf->top;
+		addchars(&mf->m, 0, l);
+		if (mf->m.here - mf->top < l) return (0);
+		mf->top = mf->m.here;
+	}
 	l = getmemx2(&mf->m, size * nmemb);
 	nmemb = l / size;
 	memcpy(mf->m.buf + mf->m.here, ptr, l);
@@ -531,6 +776,111 @@ static int mfputss(memFILE *mf, const char *s, ...)
 	return (m);
 }
 
+/* Big uncompressed files get mapped into memory read-only, so that loaders can
+ * convert pixels straight from there, without read buffers and on multiple
+ * threads */
+
+/* Open file for reading; return FALSE if failed */
+static int mfopen(memFILE *mf, char *file_name)
+{
+#ifndef WIN32
+	struct stat st;
+	void *map;
+#endif
+
+	memset(mf, 0, sizeof(memFILE));
+	if (!(mf->file = fopen(file_name, "rb"))) return (FALSE);
+#ifndef WIN32
+	if (fstat(fileno(mf->file), &st) || !S_ISREG(st.st_mode) ||
+		(st.st_size < MF_MAP_MIN) || (st.st_size > MEMFILE_MAX))
+		return (TRUE); // Read it the regular way
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+		fileno(mf->file), 0);
+	if (map == MAP_FAILED) return (TRUE);
+#ifdef MADV_SEQUENTIAL
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+#endif
+	fclose(mf->file);
+	mf->file = NULL;
+	mf->m.buf = map;
+	mf->m.size = mf->top = mf->map = st.st_size;
+#endif
+	return (TRUE);
+}
+
+static void mfclose(memFILE *mf)
+{
+	if (mf->file) fclose(mf->file);
+#ifndef WIN32
+	else if (mf->map) munmap(mf->m.buf, mf->map);
+#endif
+	mf->file = NULL;
+	mf->map = 0;
+}
+
+/* Get a pointer to the next "len" bytes if they are in memory, and step over
+ * them; return NULL if cannot */
+static unsigned char *mfview(memFILE *mf, size_t len)
+{
+	unsigned char *res;
+
+	if (mf->file || (mf->m.here < 0) || (mf->m.here > mf->top) ||
+		(len > (size_t)(mf->top - mf->m.here))) return (NULL);
+	res = (unsigned char *)mf->m.buf + mf->m.here;
+	mf->m.here += len;
+	return (res);
+}
+
+typedef void (*row_func)(void *data, unsigned char *src, int y,
+	unsigned char *buf);
+
+typedef struct {
+	row_func what;
+	void *data;
+	unsigned char *src, *buf;
+	size_t ll;
+	int progress;
+} rows_job;
+
+static void rows_thread(tcb *thread)
+{
+	rows_job *rj = thread->data;
+	int i, ii, cnt = thread->nsteps;
+
+	for (i = thread->step0 , ii = 0; ii < cnt; i++ , ii++)
+	{
+		rj->what(rj->data, rj->src + rj->ll * i, i, rj->buf);
+		if (rj->progress && thread_step(thread, ii + 1, cnt, 10)) break;
+	}
+	thread_done(thread);
+}
+
+/* Convert h rows of ll bytes in memory, each thread having a buffer of
+ * "bufsize" bytes for the purpose */
+static int convert_rows(row_func what, void *data, unsigned char *src,
+	size_t ll, int h, int bufsize, ls_settings *settings)
+{
+	rows_job rj;
+	threaddata *tdata;
+
+	memset(&rj, 0, sizeof(rj));
+	rj.what = what;
+	rj.data = data;
+	rj.src = src;
+	rj.ll = ll;
+	rj.progress = !settings->silent;
+	tdata = talloc(MA_ALIGN_DEFAULT | MA_SKIP_ZEROSIZE,
+		image_threads(settings->width, h),
+		&rj, sizeof(rj),
+		NULL,
+		&rj.buf, bufsize,
+		NULL);
+	if (!tdata) return (FILE_MEM_ERROR);
+	launch_threads(rows_thread, tdata, NULL, h);
+	free(tdata);
+	return (0);
+}
+
 static void copy_run(unsigned char *dest, unsigned char *src, int len,
 	int dstep, int sstep, int bgr)
 {
@@ -644,7 +994,8 @@ static void ls_init(char *what, int save)
 
 static void ls_progress(ls_settings *settings, int n, int steps)
 {
-	int h = settings->height;
+	ls_reducer *rd = settings->reduce;
+	int h = rd ? rd->h : settings->height;
 
 	if (!settings->silent && ((n * steps) % h >= h - steps))
 		progress_update((float)n / h);
@@ -709,8 +1060,8 @@ static int load_png(char *file_name, ls_settings *settings, memFILE *mf)
 		{1, 2, 0, 2},
 		{0, 1, 1, 2}
 	};
-	static png_bytep *row_pointers;
-	static char *msg;
+	png_bytep *volatile row_pointers;
+	char *volatile msg;
 	png_structp png_ptr;
 	png_infop info_ptr;
 	png_unknown_chunkp uk_p;
@@ -721,6 +1072,7 @@ static int load_png(char *file_name, ls_settings *settings, memFILE *mf)
 	FILE *fp = NULL;
 	int i, j, k, bit_depth, color_type, interlace_type, num_uk, res = -1;
 	int maxpass, x0, dx, y0, dy, n, nx, height, width, itrans = FALSE;
+	int rows = FALSE;
 
 	if (!mf)
 	{
@@ -781,6 +1133,8 @@ static int load_png(char *file_name, ls_settings *settings, memFILE *mf)
 	i = CMASK_IMAGE;
 	if ((color_type == PNG_COLOR_TYPE_RGB_ALPHA) ||
 		(color_type == PNG_COLOR_TYPE_GRAY_ALPHA)) i = CMASK_RGBA;
+	/* Interlaced image cannot be reduced while reading */
+	if (interlace_type == PNG_INTERLACE_NONE) reduce_setup(settings);
 	if ((res = allocate_image(settings, i))) goto fail2;
 	res = FILE_MEM_ERROR;
 
@@ -863,8 +1217,8 @@ static int load_png(char *file_name, ls_settings *settings, memFILE *mf)
 				{
 					png_read_rows(png_ptr, &row_pointers[0], NULL, 1);
 					src = row_pointers[0];
-					dest = settings->img[CHN_IMAGE] + (i * width + x0) * 3;
-					dsta = settings->img[CHN_ALPHA] + i * width;
+					dest = ls_row(settings, CHN_IMAGE, i) + x0 * 3;
+					dsta = ls_row(settings, CHN_ALPHA, i);
 					for (j = x0; j < width; j += dx)
 					{
 						dest[0] = src[0];
@@ -873,6 +1227,7 @@ static int load_png(char *file_name, ls_settings *settings, memFILE *mf)
 						dsta[j] = src[3];
 						src += 4; dest += 3 * dx;
 					}
+					ls_row_done(settings, i);
 					if (msg && ((n * 20) % nx >= nx - 20))
 						progress_update((float)n / nx);
 				}
@@ -881,11 +1236,7 @@ static int load_png(char *file_name, ls_settings *settings, memFILE *mf)
 		else /* RGB */
 		{
 			png_set_strip_alpha(png_ptr);
-			for (i = 0; i < height; i++)
-			{
-				row_pointers[i] = settings->img[CHN_IMAGE] + i * width * 3;
-			}
-			png_read_image(png_ptr, row_pointers);
+			rows = TRUE;
 		}
 	}
 	/* Paletted PNG file */
@@ -907,9 +1258,27 @@ static int load_png(char *file_name, ls_settings *settings, memFILE *mf)
 		png_set_packing(png_ptr);
 		if ((color_type == PNG_COLOR_TYPE_GRAY) && (bit_depth < 8))
 			png_set_gray_1_2_4_to_8(png_ptr);
+		rows = TRUE;
+	}
+
+	/* Read RGB or indexed image in */
+	if (!rows);
+	else if (settings->reduce) /* Row by row */
+	{
+		for (i = 0; i < height; i++)
+		{
+			png_read_row(png_ptr, ls_row(settings, CHN_IMAGE, i), NULL);
+			ls_row_done(settings, i);
+			if (msg && ((i * 20) % height >= height - 20))
+				progress_update((float)i / height);
+		}
+	}
+	else /* All at once */
+	{
 		for (i = 0; i < height; i++)
 		{
-			row_pointers[i] = settings->img[CHN_IMAGE] + i * width;
+			row_pointers[i] = settings->img[CHN_IMAGE] +
+				i * width * settings->bpp;
 		}
 		png_read_image(png_ptr, row_pointers);
 	}
@@ -922,6 +1291,8 @@ static int load_png(char *file_name, ls_settings *settings, memFILE *mf)
 	if (itrans) res = palette_trans(settings, trans);
 
 	num_uk = png_get_unknown_chunks(png_ptr, info_ptr, &uk_p);
+	/* These hold full-size channels, so reduced image goes without them */
+	if (settings->reduce) num_uk = 0;
 	if (num_uk)	/* File contains mtPaint's private chunks */
 	{
 		for (i = 0; i < num_uk; i++)	/* Examine each chunk */
@@ -981,6 +1352,281 @@ fail:	if (fp) fclose(fp);
 #define PNG_AFTER_IDAT 8
 #endif
 
+/* Big images get encoded on multiple threads: PNG as bands of rows deflated
+ * separately and spliced into one zlib stream at sync flush points, TIFF as
+ * strips compressed in memory and then written out in order */
+
+#define ENC_BAND_MIN (1 << 18)
+#define ENC_BAND_MAX (1 << 20)
+
+/* Set to use the serial encoders only, to compare against */
+static int enc_ref;
+
+typedef struct {
+	unsigned char *buf;	// Compressed data
+	size_t len;		// Its length
+	unsigned long adler;	// Checksum of uncompressed data
+	int y0, y1;		// Rows
+} enc_band;
+
+typedef struct {
+	ls_settings *settings;
+	enc_band *bands;
+	int bpp, level, rows;
+	int type, af, bw, pf;	// TIFF parameters
+} enc_job;
+
+/* Pick the number of rows per band */
+static int enc_band_rows(int h, size_t rowbytes)
+{
+	size_t l = (h * rowbytes) / (helper_threads() * 4);
+
+	if (l < ENC_BAND_MIN) l = ENC_BAND_MIN;
+	if (l > ENC_BAND_MAX) l = ENC_BAND_MAX;
+	l /= rowbytes;
+	return (l < 1 ? 1 : l > h ? h : l);
+}
+
+/* Encode bands in batches; "what" gets called with the batch encoded, and
+ * returns nonzero to stop */
+static int enc_bands(thread_func tf, enc_job *job, int h, int rows,
+	int (*what)(enc_job *job, int n, void *data), void *data)
+{
+	threaddata *tdata;
+	enc_band *bands;
+	int i, n, y, nb = helper_threads() * 4, res = 0;
+
+	bands = calloc(nb, sizeof(enc_band));
+	if (!bands) return (-1);
+	job->bands = bands;
+	job->rows = rows;
+	for (y = 0; !res && (y < h); y += n * rows)
+	{
+		for (n = 0; (n < nb) && (y + n * rows < h); n++)
+		{
+			bands[n].y0 = y + n * rows;
+			bands[n].y1 = bands[n].y0 + rows;
+			if (bands[n].y1 > h) bands[n].y1 = h;
+		}
+		tdata = talloc(MA_ALIGN_DEFAULT, n, job, sizeof(enc_job),
+			NULL, NULL);
+		if (!tdata) break;
+		tdata->chunks = (n + tdata->count - 1) / tdata->count;
+		tdata->silent = TRUE;
+		launch_threads(tf, tdata, NULL, n);
+		free(tdata);
+
+		res = what(job, n, data);
+		for (i = 0; i < n; i++)
+		{
+			if (!bands[i].buf) res = -1;
+			free(bands[i].buf);
+			bands[i].buf = NULL;
+		}
+		if (!res && !job->settings->silent)
+			progress_update((float)(y + n * rows) / h);
+	}
+	free(bands);
+	return (res ? res : y < h ? -1 : 0);
+}
+
+#if ZLIB_VERNUM >= 0x1230 /* Need adler32_combine() */
+
+#define PNG_MT
+
+/* Same weighing as in libpng: sum of row bytes taken as signed */
+#define SABS(X) ((X) < 128 ? (X) : 256 - (X))
+
+static inline int paeth(int a, int b, int c)
+{
+	int p = b - c, q = a - c, pa = abs(p), pb = abs(q), pc = abs(p + q);
+	return ((pa <= pb) && (pa <= pc) ? a : pb <= pc ? b : c);
+}
+
+/* Filter a row, choosing the filter the way libpng does by default */
+static void png_filter_row(unsigned char *dest, unsigned char *src,
+	unsigned char *prev, int len, int bpp, int all)
+{
+	int i, f, a, b, c, x, s[5];
+
+	*dest++ = 0;
+	if (!all) /* Palette rows go unfiltered */
+	{
+		memcpy(dest, src, len);
+		return;
+	}
+
+	memset(s, 0, sizeof(s));
+	for (i = 0; i < len; i++)
+	{
+		a = i < bpp ? 0 : src[i - bpp];
+		b = prev[i];
+		c = i < bpp ? 0 : prev[i - bpp];
+		x = src[i];
+		s[0] += SABS(x);
+		s[1] += SABS((x - a) & 255);
+		s[2] += SABS((x - b) & 255);
+		s[3] += SABS((x - ((a + b) >> 1)) & 255);
+		s[4] += SABS((x - paeth(a, b, c)) & 255);
+	}
+	for (f = 0 , i = 1; i < 5; i++) if (s[i] < s[f]) f = i;
+
+	dest[-1] = f;
+	for (i = 0; i < len; i++)
+	{
+		a = i < bpp ? 0 : src[i - bpp];
+		b = prev[i];
+		c = i < bpp ? 0 : prev[i - bpp];
+		x = f == 1 ? a : f == 2 ? b : f == 3 ? (a + b) >> 1 :
+			f == 4 ? paeth(a, b, c) : 0;
+		dest[i] = src[i] - x;
+	}
+}
+
+/* Filter and deflate a band, with preceding 32K of filtered data for
+ * a dictionary, so that the result will be the same as one stream */
+static void png_band(enc_job *job, enc_band *band)
+{
+	z_stream zs;
+	ls_settings *settings = job->settings;
+	unsigned char *rows, *fbuf, *src, *prev, *buf = NULL;
+	size_t rb = settings->width * job->bpp, ulen, dlen, olen;
+	int y, y0, all = job->bpp > 1;
+
+	/* Rows needed for dictionary */
+	y0 = band->y0 - (32768 + rb) / (rb + 1);
+	if (y0 < 0) y0 = 0;
+
+	rows = calloc(3, rb); // Zero row, then two rows to alternate
+	fbuf = malloc((band->y1 - y0) * (rb + 1));
+	if (!rows || !fbuf) goto fail;
+	prev = y0 ? prepare_row(job->bpp < 4 ? NULL :
+		rows + (((y0 - 1) & 1) + 1) * rb, settings, job->bpp, y0 - 1) :
+		rows;
+	for (y = y0; y < band->y1; y++ , prev = src)
+	{
+		src = prepare_row(job->bpp < 4 ? NULL :
+			rows + ((y & 1) + 1) * rb, settings, job->bpp, y);
+		png_filter_row(fbuf + (y - y0) * (rb + 1), src, prev, rb,
+			job->bpp, all);
+	}
+
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, job->level, Z_DEFLATED, -15, 8,
+		all ? Z_FILTERED : Z_DEFAULT_STRATEGY) != Z_OK) goto fail;
+	dlen = (band->y0 - y0) * (rb + 1);
+	src = fbuf + dlen;
+	if (dlen > 32768) dlen = 32768;
+	if (dlen) deflateSetDictionary(&zs, src - dlen, dlen);
+	ulen = (band->y1 - band->y0) * (rb + 1);
+	olen = deflateBound(&zs, ulen) + 16; // Flush marker
+	/* Leave room for zlib header in front, and checksum in the back */
+	if ((buf = malloc(olen + 6)))
+	{
+		zs.next_in = src;
+		zs.avail_in = ulen;
+		zs.next_out = buf + 2;
+		zs.avail_out = olen;
+		y = deflate(&zs, band->y1 < settings->height ? Z_SYNC_FLUSH :
+			Z_FINISH);
+		if ((zs.avail_in || !zs.avail_out) || (y != (band->y1 <
+			settings->height ? Z_OK : Z_STREAM_END)))
+		{
+			free(buf);
+			buf = NULL;
+		}
+		band->len = olen - zs.avail_out;
+		band->adler = adler32(adler32(0L, Z_NULL, 0), src, ulen);
+	}
+	deflateEnd(&zs);
+fail:	band->buf = buf;
+	free(rows);
+	free(fbuf);
+}
+
+static void png_bands(tcb *thread)
+{
+	enc_job *job = thread->data;
+	enc_band *band = job->bands + thread->step0;
+	int i;
+
+	for (i = thread->nsteps; i > 0; i-- , band++) png_band(job, band);
+}
+
+typedef struct {
+	png_structp png_ptr;
+	unsigned long adler;
+	int level;
+} png_mt_state;
+
+/* Write out a batch of bands as IDATs, in order */
+static int png_write_bands(enc_job *job, int n, void *data)
+{
+	png_mt_state *st = data;
+	enc_band *band = job->bands;
+	unsigned char *buf;
+	size_t len;
+	int i, l;
+
+	for (i = 0; i < n; i++ , band++)
+	{
+		if (!(buf = band->buf)) return (-1);
+		len = band->len;
+		if (band->y0) buf += 2;
+		else /* Starting the stream */
+		{
+			l = st->level;
+			buf[0] = 0x78; // Deflate, 32K window
+			buf[1] = (l < 2 ? 0 : l < 6 ? 1 : l == 6 ? 2 : 3) << 6;
+			buf[1] += 31 - (buf[0] * 256 + buf[1]) % 31;
+			len += 2;
+		}
+		st->adler = band->y0 ? adler32_combine(st->adler, band->adler,
+			band->y1 > band->y0 ? (band->y1 - band->y0) *
+			(job->settings->width * job->bpp + 1) : 0) : band->adler;
+		if (band->y1 >= job->settings->height) /* Ending it */
+		{
+			unsigned char *tmp = buf + len;
+			tmp[0] = st->adler >> 24;
+			tmp[1] = st->adler >> 16;
+			tmp[2] = st->adler >> 8;
+			tmp[3] = st->adler;
+			len += 4;
+		}
+		png_write_chunk(st->png_ptr, (png_bytep)"IDAT", buf, len);
+	}
+	return (0);
+}
+
+/* Write image data on threads; return 0 to use the regular path, 1 if done,
+ * -1 if failed halfway */
+static int png_write_mt(png_structp png_ptr, ls_settings *settings, int bpp)
+{
+	png_mt_state st;
+	enc_job job;
+	size_t rb = settings->width * bpp + 1;
+	int rows, h = settings->height;
+
+	if (enc_ref || (helper_threads() < 2) || (h * rb < ENC_BAND_MIN * 2))
+		return (0);
+	rows = enc_band_rows(h, rb);
+	if (rows >= h) return (0);
+
+	memset(&job, 0, sizeof(job));
+	job.settings = settings;
+	job.bpp = bpp;
+	job.level = settings->png_compression;
+	memset(&st, 0, sizeof(st));
+	st.png_ptr = png_ptr;
+	st.level = job.level;
+	if (!enc_bands(png_bands, &job, h, rows, png_write_bands, &st))
+		return (1);
+	/* Nothing written - can go the regular way */
+	return (st.adler ? -1 : 0);
+}
+
+#endif
+
 static int save_png(char *file_name, ls_settings *settings, memFILE *mf)
 {
 	png_unknown_chunk unknown0;
@@ -988,7 +1634,7 @@ static int save_png(char *file_name, ls_settings *settings, memFILE *mf)
 	png_infop info_ptr;
 	FILE *fp = NULL;
 	int h = settings->height, w = settings->width, bpp = settings->bpp;
-	int i, j, res = -1;
+	int i, j, mt = 0, res = -1;
 	long uninit_(dest_len), res_len;
 	char *mess = NULL;
 	unsigned char trans[256], *tmp, *rgba_row = NULL;
@@ -1076,6 +1722,14 @@ static int save_png(char *file_name, ls_settings *settings, memFILE *mf)
 
 	if (mess) ls_init(mess, 1);
 
+#ifdef PNG_MT
+	if ((mt = png_write_mt(png_ptr, settings, bpp)) < 0)
+	{
+		res = -1;
+		goto exit3;
+	}
+	if (!mt)
+#endif
 	for (j = 0; j < h; j++)
 	{
 		tmp = prepare_row(rgba_row, settings, bpp, j);
@@ -1109,6 +1763,13 @@ static int save_png(char *file_name, ls_settings *settings, memFILE *mf)
 		res_len = dest_len;
 		if (compress2(tmp, &res_len, settings->img[i], w,
 			settings->png_compression) != Z_OK) continue;
+		/* Image data went around libpng, so must the rest */
+		if (mt)
+		{
+			png_write_chunk(png_ptr, (png_bytep)chunk_names[i],
+				tmp, res_len);
+			continue;
+		}
 		strncpy(unknown0.name, chunk_names[i], 5);
 		unknown0.data = tmp;
 		unknown0.size = res_len;
@@ -1120,9 +1781,10 @@ static int save_png(char *file_name, ls_settings *settings, memFILE *mf)
 #endif
 	}
 	free(tmp);
-	png_write_end(png_ptr, info_ptr);
+	if (mt) png_write_chunk(png_ptr, (png_bytep)"IEND", NULL, 0);
+	else png_write_end(png_ptr, info_ptr);
 
-	if (mess) progress_end();
+exit3:	if (mess) progress_end();
 
 	/* Tidy up */
 exit2:	png_destroy_write_struct(&png_ptr, &info_ptr);
@@ -1810,15 +2472,21 @@ fail:	free(mem);
 }
 #endif
 
-/* Space enough to hold palette, or longest block + longest decoded sequence */
-#define GIF_BUFSIZE (256 + 4096)
+/* LZW data are prefetched many blocks at once; the buffer must be big enough
+ * to hold palette too */
+#define GIF_BUFSIZE (255 * 64)
 typedef struct {
 	FILE *f;
-	int ptr, end, tail;
+	unsigned char *src, *stop; // Ready data in buffer
+	int eod; // Reached terminator (1) or error (-1)
+	unsigned int w; // Bit shifter
+	int bits; // Ready bits in shifter
 	int lc0, lc, nxc, clear, cmask;
-	int w, bits, prev;
-	short nxcode[4096 + 1];
-	unsigned char buf[GIF_BUFSIZE], cchar[4096 + 1];
+	int prev, ppos, plen, pos; // Previous code & its string, output length
+	/* Strings for codes are referred to where they were output before */
+	int tpos[4096 + 1];
+	unsigned short tlen[4096 + 1];
+	unsigned char buf[GIF_BUFSIZE];
 } gifbuf;
 
 static void resetlzw(gifbuf *gif)
@@ -1837,71 +2505,124 @@ static int initlzw(gifbuf *gif, FILE *fp)
 	gif->lc0 = i = getc(fp); // Min code size
 	/* Enforce hard upper limit but allow wasteful encoding */
 	if ((i == EOF) || (i > 11)) return (FALSE);
-	gif->clear = i = 1 << i; // Clear code
-	/* Initial 1-char codes */
-	while (--i >= 0) gif->nxcode[i] = -1 , gif->cchar[i] = (unsigned char)i;
+	gif->clear = 1 << i; // Clear code
 	resetlzw(gif);
 	gif->w = gif->bits = 0; // Ready bits in shifter
-	gif->ptr = gif->end = gif->tail = 0; // Ready data in buffer
+	gif->src = gif->stop = gif->buf; // Ready data in buffer
+	gif->eod = gif->pos = 0;
 	return (TRUE);
 }
 
-static int getlzw(unsigned char *dest, int cnt, gifbuf *gif)
+/* Refill the buffer with as many blocks as fit, return bytes in it */
+static int fetchlzw(gifbuf *gif)
 {
-	int l, c, cx, w, bits, lc, cmask, prev, nxc, tail = gif->tail;
+	int l, n = gif->stop - gif->src;
 
-	while (TRUE)
+	if (gif->eod) return (n);
+	memmove(gif->buf, gif->src, n);
+	while (n <= GIF_BUFSIZE - 255)
+	{
+		l = getblock(gif->buf + n, gif->f);
+		if (l <= 0)
+		{
+			gif->eod = l ? -1 : 1;
+			break;
+		}
+		n += l;
+	}
+	gif->src = gif->buf;
+	gif->stop = gif->buf + n;
+	return (n);
+}
+
+/* Decode till output is "upto" bytes long, not writing past "total" */
+static int getlzw(unsigned char *dest, int total, int upto, gifbuf *gif)
+{
+	unsigned char *src = gif->src, *stop = gif->stop;
+	unsigned int w = gif->w;
+	int bits = gif->bits, lc = gif->lc, cmask = gif->cmask;
+	int nxc = gif->nxc, prev = gif->prev;
+	int ppos = gif->ppos, plen = gif->plen, pos = gif->pos;
+	int i, l, c, res = FALSE;
+
+	while (pos < upto)
 	{
-		l = tail > cnt ? cnt : tail;
-		cnt -= l;
-		l = tail - l;
-		while (tail > l) *dest++ = gif->buf[GIF_BUFSIZE - tail--];
-		if (cnt <= 0) break; // No tail past this point
-		w = gif->w;
-		bits = gif->bits;
-		lc = gif->lc;
-		while (bits < lc)
-		{
-			if (gif->ptr >= gif->end)
+		/* Fill the shifter */
+		if (bits < lc)
+		{
+			while ((bits <= 24) && (src < stop))
 			{
-				gif->end = getblock(gif->buf, gif->f);
-				if (gif->end <= 0) return (FALSE); // No data
-				gif->ptr = 0;
+				w |= (unsigned int)*src++ << bits;
+				bits += 8;
+			}
+			if (bits < lc)
+			{
+				gif->src = src;
+				if (!fetchlzw(gif)) goto fail; // No data
+				src = gif->src;
+				stop = gif->stop;
+				continue;
 			}
-			w |= gif->buf[gif->ptr++] << bits;
-			bits += 8;
 		}
-		cmask = gif->cmask;
 		c = w & cmask;
-		gif->w = w >> lc;
-		gif->bits = bits - lc;
+		w >>= lc;
+		bits -= lc;
 		if (c == gif->clear)
 		{
+			gif->nxc = nxc;
 			resetlzw(gif);
+			nxc = gif->nxc;
+			lc = gif->lc;
+			cmask = gif->cmask;
+			prev = -1;
 			continue;
 		}
-		if (c == gif->clear + 1) return (FALSE); // Premature EOI
-		/* Update for next code */
-		prev = gif->prev;
-		gif->prev = c;
-		nxc = gif->nxc;
-		gif->nxcode[nxc] = prev;
-		if ((prev >= 0) && (nxc < 4096))
+		if (c == gif->clear + 1) goto fail; // Premature EOI
+		/* Update for next code: previous string + 1st char of this one,
+		 * which will be right after it */
+		if (prev >= 0)
 		{
-			if ((++gif->nxc > cmask) && (cmask < 4096 - 1))
-				gif->cmask = (1 << ++gif->lc) - 1;
+			gif->tpos[nxc] = ppos;
+			gif->tlen[nxc] = plen + 1;
 		}
+		if (c > nxc) goto fail; // Broken code
+		if ((c == nxc) && (prev < 0)) goto fail; // Too early
 		/* Decode this one */
-		if (c > nxc) return (FALSE); // Broken code
-		if ((c == nxc) && (prev < 0)) return (FALSE); // Too early
-		for (cx = c; cx >= 0; cx = gif->nxcode[cx])
-			gif->buf[GIF_BUFSIZE - ++tail] = gif->cchar[cx];
-		gif->cchar[nxc] = gif->buf[GIF_BUFSIZE - tail];
-		/* In case c == nxc, its char was garbage till now, so reread it */
-		gif->buf[GIF_BUFSIZE - 1] = gif->cchar[c];
-	}
-	gif->tail = tail;
-	return (TRUE);
+		if (c < gif->clear) dest[pos] = c , l = 1; // Common case
+		else
+		{
+			l = i = gif->tlen[c];
+			if (i > total - pos) i = total - pos;
+			/* The string overlaps itself when c == nxc */
+			if (c < nxc) memcpy(dest + pos, dest + gif->tpos[c], i);
+			else
+			{
+				unsigned char *s = dest + gif->tpos[c], *d = dest + pos;
+				while (i-- > 0) *d++ = *s++;
+			}
+		}
+		if ((prev >= 0) && (nxc < 4096))
+		{
+			if ((++nxc > cmask) && (cmask < 4096 - 1))
+				cmask = (1 << ++lc) - 1;
+		}
+		ppos = pos;
+		plen = l;
+		prev = c;
+		pos += l;
+	}
+	res = TRUE;
+fail:	gif->src = src;
+	gif->w = w;
+	gif->bits = bits;
+	gif->lc = lc;
+	gif->cmask = cmask;
+	gif->nxc = nxc;
+	gif->prev = prev;
+	gif->ppos = ppos;
+	gif->plen = plen;
+	gif->pos = pos > total ? total : pos;
+	return (res);
 }
 
 static int load_gif_frame(FILE *fp, ls_settings *settings)
@@ -1909,9 +2630,9 @@ static int load_gif_frame(FILE *fp, ls_settings *settings)
 	/* GIF interlace pattern: Y0, DY, ... */
 	static const unsigned char interlace[10] =
 		{ 0, 1, 0, 8, 4, 8, 2, 4, 1, 2 };
-	unsigned char hdr[GIF_IHDRLEN];
+	unsigned char hdr[GIF_IHDRLEN], *dest, *buf = NULL;
 	gifbuf gif;
-	int i, k, kx, n, w, h, dy, res;
+	int i, k, n, w, h, dy, res;
 
 
 	/* Read the header */
@@ -1939,27 +2660,44 @@ static int load_gif_frame(FILE *fp, ls_settings *settings)
 	settings->bpp = 1;
 
 	if ((res = allocate_image(settings, CMASK_IMAGE))) return (res);
+	dest = settings->img[CHN_IMAGE];
+	/* Interlaced rows get decoded in sequence, then put into place */
+	if ((hdr[GIF_IBITS] & GIF_ILFLAG) && !(dest = buf = calloc(w, h)))
+		return (FILE_MEM_ERROR);
 	res = FILE_LIB_ERROR;
 
 	if (!settings->silent) ls_init("GIF", 0);
 
-	if (hdr[GIF_IBITS] & GIF_ILFLAG) k = 2 , kx = 10; /* Interlace */
-	else k = 0 , kx = 2;
-
-	for (n = 0; k < kx; k += 2)
+	/* Decode in 10 parts, for progressbar's sake */
+	dy = (h + 9) / 10;
+	for (n = 0; n < h; )
 	{
-		dy = interlace[k + 1];
-		for (i = interlace[k]; i < h; n++ , i += dy)
-		{
-			if (!getlzw(settings->img[CHN_IMAGE] + i * w, w, &gif))
-				goto fail;
-			ls_progress(settings, n, 10);
-		}
+		n += dy;
+		if (n > h) n = h;
+		if (!getlzw(dest, w * h, n * w, &gif)) goto fail;
+		if (!settings->silent) progress_update((float)n / h);
 	}
 	/* Skip data blocks till 0 */
-	while ((i = getblock(NULL, fp)) > 0);
+	if (gif.eod) i = gif.eod > 0 ? 0 : -1;
+	else while ((i = getblock(NULL, fp)) > 0);
 	if (!i) res = 1;
-fail:	if (!settings->silent) progress_end();
+fail:	if (buf) /* Deinterlace what got decoded */
+	{
+		unsigned char *src = buf;
+
+		n = (gif.pos + w - 1) / w; // Rows with any data
+		for (k = 2; k < 10; k += 2)
+		{
+			dy = interlace[k + 1];
+			for (i = interlace[k]; (i < h) && (n > 0); n-- , i += dy)
+			{
+				memcpy(settings->img[CHN_IMAGE] + i * w, src, w);
+				src += w;
+			}
+		}
+		free(buf);
+	}
+	if (!settings->silent) progress_end();
 	return (res);
 }
 
@@ -2154,123 +2892,183 @@ fail:	fclose(fp);
 	return (res);
 }
 
-/* Space enough to hold palette and all headers, or longest block */
-#define GIF_WBUFSIZE (768 + GIF_HDRLEN + (GIF_GC_LEN + 4) + (GIF_IHDRLEN + 2))
+/* Codestream is buffered this much before being cut into blocks */
+#define GIF_RAWSIZE (255 * 16)
+/* Space enough to hold palette and all headers, or codestream + a word */
+#define GIF_WBUFSIZE (GIF_RAWSIZE + 4)
+#if GIF_WBUFSIZE < 768 + GIF_HDRLEN + (GIF_GC_LEN + 4) + (GIF_IHDRLEN + 2)
+#error "GIF write buffer too small"
+#endif
+
+/* Open-addressed hash of (prefix code, char) to code; with 4x as many slots
+ * as there can be codes, probe chains stay short, and it all fits in L2 */
+#define GIF_HASHBITS 14
+#define GIF_HASHSIZE (1 << GIF_HASHBITS)
+#define GIF_HASH(K) (((K) * 0x9E3779B1U) >> (32 - GIF_HASHBITS))
+
+/* How often to check compression ratio with full table, in output bits */
+#define GIF_CHECKGAP (128 * 12)
 
-/* A cuckoo hash would take 4x less space, but need much more code */
-#define GIF_CODESSIZE ((4096 * 2 * 16) * sizeof(short))
 typedef struct {
-	FILE *f;
-	int cnt, nxmap;
+	memFILE *mf;
+	int cnt; // Bytes in buffer
 	int lc0, lc, nxc, clear, nxc2;
-	int w, bits, prev;
-	short *codes;
+	int bits, prev;
+	unsigned int w; // Bit shifter
+	int small; // Keep using full table while it compresses well enough
+	unsigned int in, out; // Bytes in, bits out since clear
+	unsigned int in0, out0, check; // Same at last check, and next one
+	double ratio; // What was achieved while filling the table
+	/* Slot is 20 bits of key above 12 bits of code, or 0 if empty */
+	unsigned int hash[GIF_HASHSIZE];
 	unsigned char buf[GIF_WBUFSIZE];
 } gifcbuf;
 
+/* Write out full blocks from buffer, or everything */
+static void flushlzw(gifcbuf *gif, int all)
+{
+	unsigned char c, *tmp = gif->buf;
+	int n = gif->cnt;
+
+	while ((n >= 255) || (all && (n > 0)))
+	{
+		c = n > 255 ? 255 : n;
+		mfwrite(&c, 1, 1, gif->mf);
+		mfwrite(tmp, 1, c, gif->mf);
+		tmp += c;
+		n -= c;
+	}
+	memmove(gif->buf, tmp, n);
+	gif->cnt = n;
+}
+
+static void emitlzw(gifcbuf *gif, int c)
+{
+	int bits = gif->bits, lc = gif->lc;
+	unsigned int w = gif->w | ((unsigned)c << bits);
+
+	gif->out += lc;
+	if ((bits += lc) >= 32) /* Store a whole word, keep the rest */
+	{
+		unsigned char *tmp = gif->buf + gif->cnt;
+		PUT32(tmp, w);
+		if ((gif->cnt += 4) >= GIF_RAWSIZE) flushlzw(gif, FALSE);
+		w = (unsigned int)c >> (lc - (bits -= 32));
+	}
+	gif->bits = bits;
+	gif->w = w;
+	/* Extend code size if needed */
+	if ((gif->nxc >= gif->nxc2) && (lc < 12)) gif->nxc2 = 1 << ++gif->lc;
+}
+
 static void resetclzw(gifcbuf *gif)
 {
 	/* Send clear code at current length */
-	gif->w |= gif->clear << gif->bits;
-	gif->bits += gif->lc;
+	emitlzw(gif, gif->clear);
 	/* Reset parameters */
 	gif->nxc = gif->clear + 2; // First usable code
 	gif->lc = gif->lc0 + 1; // Actual code size
 	gif->nxc2 = 1 << gif->lc; // For next code size
-	memset(gif->codes, 0, GIF_CODESSIZE); // Maps
-	gif->nxmap = 1; // First usable intermediate map
+	memset(gif->hash, 0, sizeof(gif->hash));
+	gif->out = gif->check = 0;
 }
 
-static void initclzw(gifcbuf *gif, int lc0, FILE *fp)
+static void initclzw(gifcbuf *gif, int lc0, int small, memFILE *mf)
 {
+	unsigned char c;
+
 	if (lc0 < 2) lc0 = 2; // Minimum allowed
-	gif->f = fp;
-	gif->lc0 = lc0;
-	fputc(lc0, fp);
+	gif->mf = mf;
+	gif->lc0 = c = lc0;
+	mfwrite(&c, 1, 1, mf);
 	gif->clear = 1 << lc0; // Clear code
+	gif->small = small;
 	gif->prev = -1; // No previous code
 	gif->cnt = gif->w = gif->bits = 0; // No data yet
+	gif->in = 0;
 	gif->lc = gif->lc0 + 1; // Actual code size
 	resetclzw(gif); // Initial clear
 }
 
-static void emitlzw(gifcbuf *gif, int c)
+static void putlzw(gifcbuf *gif, unsigned char *src, int cnt)
 {
-	int bits = gif->bits, w = gif->w | (c << bits);
+	unsigned int k, v, *hash = gif->hash;
+	int i, c, prev = gif->prev;
 
-	bits += gif->lc;
-	while (bits >= 8)
+	gif->in += cnt;
+	while (cnt-- > 0)
 	{
-		gif->buf[++gif->cnt] = (unsigned char)w;
-		w >>= 8;
-		bits -= 8;
-		if (gif->cnt >= 255)
+		c = *src++;
+		if (prev < 0) /* Begin */
 		{
-			gif->buf[0] = 255;
-			fwrite(gif->buf, 1, 256, gif->f);
-			gif->cnt = 0;
-		}
-	}
-	gif->bits = bits;
-	gif->w = w;
-	/* Extend code size if needed */
-	if (gif->nxc >= gif->nxc2) gif->nxc2 = 1 << ++gif->lc;
-}
-
-static void putlzw(gifcbuf *gif, unsigned char *src, int cnt)
-{
-	short *codes = gif->codes;
-	int i, j, c, prev = gif->prev;
-
-	while (cnt-- > 0)
-	{
-		c = *src++;
-		if (prev < 0) /* Begin */
-		{
-			prev = c;
-			continue;
+			prev = c;
+			continue;
 		}
 		/* Try compression */
-		i = prev * 16 + (c >> 4) + 4096 * 16;
-		j = codes[i] * 16 + (c & 0xF);
-		j = codes[j];
-		if (j) // Have match
+		k = (prev << 8) + c;
+		i = GIF_HASH(k);
+		while ((v = hash[i]) && (v >> 12 != k))
+			i = (i + 1) & (GIF_HASHSIZE - 1);
+		if (v) // Have match
 		{
-			prev = j - 4096;
+			prev = v & 0xFFF;
 			continue;
 		}
 		/* Emit the code */
 		emitlzw(gif, prev);
 		prev = c;
-		/* Do a clear if needed */
-		if (gif->nxc >= 4096 - 1)
+		/* Add new code if there is space */
+		if (gif->nxc < 4096 - 1 + gif->small)
 		{
-			resetclzw(gif);
+			hash[i] = (k << 12) + gif->nxc++;
 			continue;
 		}
-		/* Add new code */
-		if (!codes[i]) codes[i] = gif->nxmap++;
-		j = codes[i] * 16 + (c & 0xF);
-		codes[j] = gif->nxc++ + 4096;
+		/* Table is full: clear right away, or when it stops paying off */
+		if (!gif->small) resetclzw(gif);
+		else
+		{
+			unsigned int in = gif->in - cnt;
+
+			if (!gif->check) /* Just got full */
+				gif->ratio = (double)in / gif->out;
+			else if (gif->out < gif->check) continue;
+			/* Compressing worse than while filling the table */
+			else if ((double)(in - gif->in0) / (gif->out - gif->out0) <
+				gif->ratio)
+			{
+				resetclzw(gif);
+				gif->in = cnt; // Remaining input is yet to come
+				continue;
+			}
+			gif->in0 = in;
+			gif->out0 = gif->out;
+			gif->check = gif->out + GIF_CHECKGAP;
+		}
 	}
 	gif->prev = prev;
 }
 
 static void donelzw(gifcbuf *gif) /* Flush */
 {
-	emitlzw(gif, gif->prev);
+	unsigned char *tmp;
+
+	if (gif->prev >= 0) emitlzw(gif, gif->prev);
 	emitlzw(gif, gif->clear + 1); // EOD
-	if (gif->bits) gif->buf[++gif->cnt] = gif->w;
-//	gif->w = gif->bits = 0;
-	gif->buf[0] = gif->cnt;
-	gif->buf[gif->cnt + 1] = 0; // Block terminator
-	fwrite(gif->buf, 1, gif->cnt + 2, gif->f);
-//	gif->cnt = 0;
+	for (tmp = gif->buf + gif->cnt; gif->bits > 0; gif->bits -= 8)
+	{
+		*tmp++ = (unsigned char)gif->w;
+		gif->w >>= 8;
+	}
+	gif->cnt = tmp - gif->buf;
+	flushlzw(gif, TRUE);
+	gif->buf[0] = 0; // Block terminator
+	mfwrite(gif->buf, 1, 1, gif->mf);
 }
 
-static int save_gif(char *file_name, ls_settings *settings)
+static int save_gif(char *file_name, ls_settings *settings, memFILE *mf)
 {
 	gifcbuf gif;
+	memFILE fake_mf;
 	unsigned char *tmp;
 	FILE *fp = NULL;
 	int i, nc, ext = FALSE, w = settings->width, h = settings->height;
@@ -2279,13 +3077,11 @@ static int save_gif(char *file_name, ls_settings *settings)
 	/* GIF save must be on indexed image */
 	if (settings->bpp != 1) return WRONG_FORMAT;
 
-	gif.codes = malloc(GIF_CODESSIZE);
-	if (!gif.codes) return (-1);
-
-	if (!(fp = fopen(file_name, "wb")))
+	if (!mf)
 	{
-		free(gif.codes);
-		return (-1);
+		if (!(fp = fopen(file_name, "wb"))) return (-1);
+		memset(mf = &fake_mf, 0, sizeof(fake_mf));
+		fake_mf.file = fp;
 	}
 
 	/* Get colormap size bits */
@@ -2329,26 +3125,426 @@ static int save_gif(char *file_name, ls_settings *settings)
 	if (ext) gif.buf[GIF_VER] = '9'; // If we use extension
 
 	/* Write out all the headers */
-	fwrite(gif.buf, 1, tmp - gif.buf, fp);
+	mfwrite(gif.buf, 1, tmp - gif.buf, mf);
 
 	if (!settings->silent) ls_init("GIF", 1);
 
-	initclzw(&gif, nc + 1, fp); // "Min code size" = palette index bits
+	/* "Min code size" = palette index bits */
+	initclzw(&gif, nc + 1, settings->gif_small, mf);
 	for (i = 0; i < h; i++)
 	{
 		putlzw(&gif, settings->img[CHN_IMAGE] + i * w, w);
 		ls_progress(settings, i, 20);
 	}
 	donelzw(&gif);
-	fputc(';', fp); // Trailer block
-	fclose(fp);
+	mfwrite(";", 1, 1, mf); // Trailer block
+	if (fp) fclose(fp);
 
 	if (!settings->silent) progress_end();
 
-	free(gif.codes);
 	return 0;
 }
 
+/* Animated GIF is written frame by frame, each frame being only the area which
+ * differs from what is already displayed; it is encoded both with unchanged
+ * pixels made transparent and without that, and for images with transparency,
+ * also with previous frame disposed of, and whichever comes out the smallest
+ * is kept. Colours go into the global palette for as long as they fit */
+
+typedef struct {
+	memFILE mf;
+	int rxy[4]; // Area
+	int keep; // Unchanged pixels left transparent
+	int dispose; // Previous frame disposed of
+	int tidx; // Transparent index, or -1
+	int cols; // Local palette size, or 0 if global palette used
+	int gcnt, gtidx; // Global palette after this frame
+	png_color pal[256]; // Local or global palette
+} gifvar;
+
+typedef struct {
+	FILE *fp;
+	int w, h, trans; // Transparent color, or -1
+	int frames, delay, gcflags; // Last frame's
+	f_long gc; // Where last frame's control block is
+	int gcnt, gtidx; // Global palette size & transparent index
+	int ob[4]; // Where opaque pixels are on display
+	png_color gpal[256];
+	unsigned char *disp; // What is now on display
+	unsigned char *rgb, *mask, *idx, *ibuf[2]; // Work buffers
+	gifvar v[2];
+	gifcbuf gif;
+} gifanim;
+
+/* Encode the frame one way, return FALSE if no memory */
+static int gif_anim_var(gifanim *ga, gifvar *v, unsigned char *src,
+	unsigned char *dest, int small)
+{
+	png_color fpal[256];
+	unsigned char buf[GIF_IHDRLEN + 1 + 768], map[256], *tmp;
+	unsigned char *s, *d, *rgb = ga->rgb, *mask = ga->mask;
+	int i, j, k, l, c, n, cols, tneed, nc, gt;
+	int w = ga->w, tr = ga->trans, keep = v->keep;
+	int rw = v->rxy[2] - v->rxy[0], rh = v->rxy[3] - v->rxy[1];
+
+	/* Collect pixels which need a color */
+	for (i = v->rxy[1]; i < v->rxy[3]; i++)
+	{
+		l = (i * w + v->rxy[0]) * 3;
+		s = src + l;
+		d = ga->disp + l;
+		for (j = 0; j < rw; j++ , s += 3 , d += 3)
+		{
+			c = MEM_2_INT(s, 0);
+			if ((*mask++ = (c == tr) || (keep &&
+				(c == MEM_2_INT(d, 0))))) continue;
+			*rgb++ = s[0];
+			*rgb++ = s[1];
+			*rgb++ = s[2];
+		}
+	}
+	n = (rgb - ga->rgb) / 3;
+	tneed = n < rw * rh;
+
+	v->tidx = -1;
+	v->gcnt = ga->gcnt;
+	v->gtidx = gt = ga->gtidx;
+	cols = mem_cols_used_real(ga->rgb, n, 1, fpal);
+	/* Too many colors - quantize into local palette */
+	if (cols > 256 - tneed)
+	{
+		cols = 256 - tneed;
+		if (wu_quant(ga->rgb, n, 1, cols, fpal, NULL)) return (FALSE);
+		/* Transparent color must stay unique */
+		if (tr >= 0) for (i = 0; i < cols; i++)
+			if (PNG_2_INT(fpal[i]) == tr) fpal[i].blue ^= 1;
+		mem_dumb_dither(ga->rgb, ga->idx, fpal, n, 1, cols, FALSE);
+		k = -1;
+	}
+	/* Try adding colors to global palette */
+	else
+	{
+		mem_convert_indexed(ga->idx, ga->rgb, n, cols, fpal);
+		k = ga->gcnt;
+		memcpy(v->pal, ga->gpal, sizeof(v->pal));
+		for (i = 0; i < cols; i++)
+		{
+			c = PNG_2_INT(fpal[i]);
+			for (j = 0; j < k; j++)
+				if ((j != gt) && (PNG_2_INT(v->pal[j]) == c)) break;
+			if (j == k)
+			{
+				if (k >= 256) break;
+				v->pal[k++] = fpal[i];
+			}
+			map[i] = j;
+		}
+		/* Reserve a transparent slot if have none yet */
+		if (tneed && (gt < 0) && (k < 256))
+			memset(v->pal + (gt = k++), 0, sizeof(png_color));
+		if ((i < cols) || (tneed && (gt < 0))) k = -1;
+	}
+
+	/* Use local palette */
+	if (k < 0)
+	{
+		v->cols = cols + tneed;
+		memcpy(v->pal, fpal, sizeof(v->pal));
+		for (i = 0; i < cols; i++) map[i] = i;
+		if (tneed)
+		{
+			v->tidx = cols;
+			v->pal[cols].red = INT_2_R(tr < 0 ? 0 : tr);
+			v->pal[cols].green = INT_2_G(tr < 0 ? 0 : tr);
+			v->pal[cols].blue = INT_2_B(tr < 0 ? 0 : tr);
+		}
+		nc = nlog2(v->cols) - 1;
+		if (nc < 0) nc = 0;
+	}
+	else
+	{
+		v->cols = 0;
+		v->gcnt = k;
+		v->gtidx = gt;
+		if (tneed) v->tidx = gt;
+		nc = 7;
+	}
+
+	/* Map the pixels */
+	for (i = j = 0 , l = rw * rh , mask = ga->mask; i < l; i++)
+		dest[i] = mask[i] ? v->tidx : map[ga->idx[j++]];
+
+	/* Image header and palette */
+	v->mf.m.here = v->mf.top = 0;
+	tmp = buf;
+	*tmp++ = ',';
+	memset(tmp, 0, GIF_IHDRLEN);
+	PUT16(tmp + GIF_IX, v->rxy[0]);
+	PUT16(tmp + GIF_IY, v->rxy[1]);
+	PUT16(tmp + GIF_IWIDTH, rw);
+	PUT16(tmp + GIF_IHEIGHT, rh);
+	if (v->cols) tmp[GIF_IBITS] = GIF_LPFLAG | nc;
+	tmp += GIF_IHDRLEN;
+	if (v->cols)
+	{
+		pal2rgb(tmp, v->pal, v->cols, 2 << nc);
+		tmp += (2 << nc) * 3;
+	}
+	mfwrite(buf, 1, tmp - buf, &v->mf);
+
+	/* Image data */
+	initclzw(&ga->gif, nc + 1, small, &v->mf);
+	putlzw(&ga->gif, dest, l);
+	donelzw(&ga->gif);
+
+	return (TRUE);
+}
+
+static void gif_anim_free(gifanim *ga)
+{
+	free(ga->disp);
+	free(ga->v[0].mf.m.buf);
+	free(ga->v[1].mf.m.buf);
+	free(ga);
+}
+
+static gifanim *gif_anim_start(char *file_name, ls_settings *settings)
+{
+	static const unsigned char loop[] = { '!', 0xFF, GIF_AP_LEN,
+		'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0',
+		3, 1, 0, 0, 0 }; // Loop forever
+	unsigned char buf[GIF_HDRLEN + 768];
+	gifanim *ga;
+	size_t l, wh = (size_t)settings->width * settings->height;
+
+	if (!(ga = calloc(1, sizeof(gifanim)))) return (NULL);
+	/* Display, gathered RGB, mask, and 3 index buffers */
+	if (!(ga->disp = malloc(wh * (3 + 3 + 1 + 1 + 2)))) goto fail;
+	ga->rgb = ga->disp + wh * 3;
+	ga->mask = ga->rgb + wh * 3;
+	ga->idx = ga->mask + wh;
+	ga->ibuf[0] = ga->idx + wh;
+	ga->ibuf[1] = ga->ibuf[0] + wh;
+	/* Encoded frames; 12 bits per pixel at most, plus block lengths and
+	 * clear codes, plus headers with palette */
+	l = wh * 2 + 1024;
+	if (!(ga->v[0].mf.m.buf = malloc(l)) ||
+		!(ga->v[1].mf.m.buf = malloc(l))) goto fail;
+	ga->v[0].mf.m.size = ga->v[1].mf.m.size = l;
+
+	ga->w = ga->ob[0] = settings->width;
+	ga->h = ga->ob[1] = settings->height;
+	ga->gtidx = -1;
+	/* Display starts transparent, so that color gets global index 0 */
+	if ((ga->trans = settings->rgb_trans) >= 0)
+	{
+		ga->gpal[0].red = INT_2_R(ga->trans);
+		ga->gpal[0].green = INT_2_G(ga->trans);
+		ga->gpal[0].blue = INT_2_B(ga->trans);
+		ga->gcnt = 1;
+		ga->gtidx = 0;
+		pal2rgb(ga->disp, ga->gpal, 1, 1);
+		for (l = 3; l < wh * 3; l *= 2)
+			memcpy(ga->disp + l, ga->disp, l * 2 > wh * 3 ?
+				wh * 3 - l : l);
+	}
+
+	if (!(ga->fp = fopen(file_name, "wb"))) goto fail;
+
+	/* Header, with global palette to be filled in when done */
+	memset(buf, 0, sizeof(buf));
+	memcpy(buf, GIF_ID, GIF_IDLEN);
+	buf[GIF_VER] = '9';
+	PUT16(buf + GIF_WIDTH, ga->w);
+	PUT16(buf + GIF_HEIGHT, ga->h);
+	buf[GIF_GPBITS] = GIF_GPFLAG | GIF_8BPC | 7;
+	if ((fwrite(buf, 1, sizeof(buf), ga->fp) == sizeof(buf)) &&
+		(fwrite(loop, 1, sizeof(loop), ga->fp) == sizeof(loop)))
+		return (ga);
+
+	fclose(ga->fp);
+fail:	gif_anim_free(ga);
+	return (NULL);
+}
+
+static int gif_anim_frame(gifanim *ga, ls_settings *settings)
+{
+	unsigned char buf[768], *src = settings->img[CHN_IMAGE];
+	unsigned char *s, *d, *tmp, *uninit_(dest);
+	gifvar *v, *best = NULL;
+	size_t nch = 0, area;
+	int ch[4] = { ga->w, ga->h, 0, 0 }, ob[4] = { ga->w, ga->h, 0, 0 };
+	int i, j, c, k, n, tr = ga->trans, delay = settings->gif_delay;
+	int over = TRUE, first = !ga->frames++;
+
+	/* Find what changed, and where opaque pixels are */
+	for (i = 0 , s = src , d = ga->disp; i < ga->h; i++)
+	{
+		for (j = 0; j < ga->w; j++ , s += 3 , d += 3)
+		{
+			c = MEM_2_INT(s, 0);
+			if (c != tr)
+			{
+				if (j < ob[0]) ob[0] = j;
+				if (j >= ob[2]) ob[2] = j + 1;
+				if (i < ob[1]) ob[1] = i;
+				ob[3] = i + 1;
+			}
+			if (c == MEM_2_INT(d, 0)) continue;
+			nch++;
+			/* Transparent over opaque needs disposal */
+			if (c == tr) over = FALSE;
+			if (j < ch[0]) ch[0] = j;
+			if (j >= ch[2]) ch[2] = j + 1;
+			if (i < ch[1]) ch[1] = i;
+			ch[3] = i + 1;
+		}
+	}
+
+	/* Nothing changed - show the last frame for longer */
+	if (over && !first && (ch[0] >= ch[2]))
+	{
+		if ((ga->delay += delay) > 0xFFFF) ga->delay = 0xFFFF;
+		PUT16(buf, ga->delay);
+		if (fseek(ga->fp, ga->gc + GIF_GC_DELAY, SEEK_SET) ||
+			(fwrite(buf, 1, 2, ga->fp) != 2) ||
+			fseek(ga->fp, 0, SEEK_END)) return (-1);
+		return (0);
+	}
+
+	/* Decide which ways to try */
+	v = ga->v;
+	v[0].dispose = v[1].dispose = FALSE;
+	/* Without transparency, draw the changes over, with and without
+	 * leaving unchanged pixels transparent */
+	if (tr < 0)
+	{
+		if (first) ch[0] = ch[1] = 0 , ch[2] = ga->w , ch[3] = ga->h;
+		copy4(v[0].rxy, ch);
+		copy4(v[1].rxy, ch);
+		v[0].keep = FALSE;
+		v[1].keep = TRUE;
+		n = first ? 1 : 2;
+		/* Only try both if neither way is a clear winner: with most of
+		 * the area changed, transparency gains next to nothing, and
+		 * with most of it unchanged, it gains a lot */
+		if (n > 1)
+		{
+			area = (size_t)(ch[2] - ch[0]) * (ch[3] - ch[1]);
+			if (nch * 8 >= area * 7) n = 1;
+			else if (nch * 2 <= area) v[0].keep = TRUE , n = 1;
+		}
+	}
+	/* With it, keep all opaque pixels inside the area drawn, so that
+	 * disposing of the frame always clears the display; then, either
+	 * draw over, or dispose of the previous frame and draw anew */
+	else
+	{
+		n = 0;
+		if (over)
+		{
+			/* Changed area plus what was opaque */
+			v[0].rxy[0] = ch[0] < ga->ob[0] ? ch[0] : ga->ob[0];
+			v[0].rxy[1] = ch[1] < ga->ob[1] ? ch[1] : ga->ob[1];
+			v[0].rxy[2] = ch[2] > ga->ob[2] ? ch[2] : ga->ob[2];
+			v[0].rxy[3] = ch[3] > ga->ob[3] ? ch[3] : ga->ob[3];
+			v[n++].keep = TRUE;
+		}
+		if (!first)
+		{
+			copy4(v[n].rxy, ob);
+			v[n].keep = FALSE;
+			v[n++].dispose = TRUE;
+		}
+	}
+
+	/* Try them, and keep the smallest */
+	for (i = k = 0; i < n; i++)
+	{
+		/* Frame must have some area, even if all transparent */
+		if ((v[i].rxy[0] >= v[i].rxy[2]) || (v[i].rxy[1] >= v[i].rxy[3]))
+			v[i].rxy[0] = v[i].rxy[1] = 0 , v[i].rxy[2] = v[i].rxy[3] = 1;
+		if (!gif_anim_var(ga, v + i, src, ga->ibuf[k],
+			settings->gif_small)) return (-1);
+		if (best && (best->mf.top <= v[i].mf.top)) continue;
+		best = v + i;
+		dest = ga->ibuf[k];
+		k ^= 1;
+	}
+
+	/* Dispose of previous frame */
+	if (best->dispose)
+	{
+		if (fseek(ga->fp, ga->gc + GIF_GC_FLAGS, SEEK_SET) ||
+			(fputc((ga->gcflags & ~(7 << GIF_GC_DISP)) |
+			(2 << GIF_GC_DISP), ga->fp) == EOF) ||
+			fseek(ga->fp, 0, SEEK_END)) return (-1);
+		for (i = ga->ob[1]; i < ga->ob[3]; i++)
+		{
+			d = ga->disp + (i * ga->w + ga->ob[0]) * 3;
+			for (j = ga->ob[0]; j < ga->ob[2]; j++ , d += 3)
+				d[0] = INT_2_R(tr) , d[1] = INT_2_G(tr) ,
+				d[2] = INT_2_B(tr);
+		}
+	}
+
+	/* Write out control block and the image */
+	tmp = buf;
+	*tmp++ = '!';	// Extension block
+	*tmp++ = 0xF9;	// Graphics control
+	*tmp++ = GIF_GC_LEN;
+	memset(tmp, 0, GIF_GC_LEN + 1); // W/block terminator
+	ga->gcflags = tmp[GIF_GC_FLAGS] = (1 << GIF_GC_DISP) | // Leave as is
+		(best->tidx >= 0 ? GIF_GC_TFLAG : 0);
+	PUT16(tmp + GIF_GC_DELAY, delay);
+	tmp[GIF_GC_TRANS] = best->tidx < 0 ? 0 : best->tidx;
+	tmp += GIF_GC_LEN + 1;
+	ga->gc = ftell(ga->fp) + 3;
+	ga->delay = delay;
+	if ((fwrite(buf, 1, tmp - buf, ga->fp) != tmp - buf) ||
+		(fwrite(best->mf.m.buf, 1, best->mf.top, ga->fp) != best->mf.top))
+		return (-1);
+
+	/* Update palette and display */
+	if (!best->cols)
+	{
+		memcpy(ga->gpal, best->pal, sizeof(ga->gpal));
+		ga->gcnt = best->gcnt;
+		ga->gtidx = best->gtidx;
+	}
+	copy4(ga->ob, ob);
+	for (i = best->rxy[1]; i < best->rxy[3]; i++)
+	{
+		d = ga->disp + (i * ga->w + best->rxy[0]) * 3;
+		for (j = best->rxy[0]; j < best->rxy[2]; j++ , d += 3)
+		{
+			png_color *col = best->pal + (c = *dest++);
+
+			/* Unchanged pixels stay as they were */
+			if ((c == best->tidx) && best->keep) continue;
+			d[0] = col->red;
+			d[1] = col->green;
+			d[2] = col->blue;
+		}
+	}
+
+	return (0);
+}
+
+static int gif_anim_end(gifanim *ga)
+{
+	unsigned char buf[768];
+	int res = -1;
+
+	pal2rgb(buf, ga->gpal, ga->gcnt, 256);
+	if ((fputc(';', ga->fp) != EOF) && // Trailer block
+		!fseek(ga->fp, GIF_HDRLEN, SEEK_SET) &&
+		(fwrite(buf, 1, 768, ga->fp) == 768)) res = 0;
+	if (fclose(ga->fp)) res = -1;
+	gif_anim_free(ga);
+	return (res);
+}
+
 #ifdef NEED_CMYK
 #ifdef U_LCMS
 /* Guard against cmsHTRANSFORM changing into something overlong in the future */
@@ -2430,12 +3626,12 @@ METHODDEF(void) my_error_exit (j_common_ptr cinfo)
 	my_error_ptr myerr = (my_error_ptr) cinfo->err;
 	longjmp(myerr->setjmp_buffer, 1);
 }
-struct my_error_mgr jerr;
 
 static int load_jpeg(char *file_name, ls_settings *settings)
 {
-	static int pr;
+	struct my_error_mgr jerr;
 	struct jpeg_decompress_struct cinfo;
+	volatile int pr;
 	unsigned char *memp, *memx = NULL;
 	FILE *fp;
 	int i, width, height, bpp, res = -1, inv = 0;
@@ -2463,6 +3659,9 @@ static int load_jpeg(char *file_name, ls_settings *settings)
 #endif
 
 	jpeg_read_header(&cinfo, TRUE);
+	/* Let libjpeg do what it can of the reduction, by DCT scaling */
+	i = reduce_factor(settings, cinfo.image_width, cinfo.image_height);
+	cinfo.scale_denom = i >= 8 ? 8 : i >= 4 ? 4 : i >= 2 ? 2 : 1;
 	jpeg_start_decompress(&cinfo);
 
 	bpp = 3;
@@ -2485,6 +3684,7 @@ static int load_jpeg(char *file_name, ls_settings *settings)
 	settings->width = width = cinfo.output_width;
 	settings->height = height = cinfo.output_height;
 	settings->bpp = bpp;
+	reduce_setup(settings);
 	if ((res = allocate_image(settings, CMASK_IMAGE))) goto fail;
 	res = -1;
 	pr = !settings->silent;
@@ -2543,9 +3743,10 @@ static int load_jpeg(char *file_name, ls_settings *settings)
 
 	for (i = 0; i < height; i++)
 	{
-		memp = settings->img[CHN_IMAGE] + width * i * bpp;
+		memp = ls_row(settings, CHN_IMAGE, i);
 		jpeg_read_scanlines(&cinfo, memx ? &memx : &memp, 1);
 		if (memx) cmyk2rgb(memp, memx, width, inv, settings);
+		ls_row_done(settings, i);
 		ls_progress(settings, i, 20);
 	}
 	done_cmyk2rgb(settings);
@@ -2561,6 +3762,7 @@ fail:	if (pr) progress_end();
 
 static int save_jpeg(char *file_name, ls_settings *settings)
 {
+	struct my_error_mgr jerr;
 	struct jpeg_compress_struct cinfo;
 	JSAMPROW row_pointer;
 	FILE *fp;
@@ -2660,12 +3862,19 @@ static int file2mem(char *file_name, unsigned char **where, size_t *len, size_t
  * Decompression speedup happened only for 64-bit builds, but on 32-bit with
  * multiple cores, multithreading still can let it overtake JasPer - WJ */
 
+/* OpenJPEG 2.x reports component size already reduced */
+#if U_JP2 < 2 /* 1.x */
+#define OPJ_CSIZE(C,V) (((C)->V + (1 << (C)->factor) - 1) >> (C)->factor)
+#else /* 2.x */
+#define OPJ_CSIZE(C,V) ((C)->V)
+#endif
+
 static int parse_opj(opj_image_t *image, ls_settings *settings)
 {
 	opj_image_comp_t *comp;
-	unsigned char xtb[256], *dest;
-	int i, j, k, w, h, w0, nc, step, shift;
-	unsigned delta;
+	unsigned char xtb[4][256], *dest;
+	int i, j, k, w, h, w0, nc, step, shift[4];
+	unsigned delta[4];
 	int *src, cmask = CMASK_IMAGE, res;
 
 	if (image->numcomps < 3) /* Guess this is paletted */
@@ -2676,44 +3885,50 @@ static int parse_opj(opj_image_t *image, ls_settings *settings)
 	else settings->bpp = 3;
 	if ((nc = settings->bpp) < image->numcomps) nc++ , cmask = CMASK_RGBA;
 	comp = image->comps;
-	settings->width = w = (comp->w + (1 << comp->factor) - 1) >> comp->factor;
-	settings->height = h = (comp->h + (1 << comp->factor) - 1) >> comp->factor;
+	settings->width = w = OPJ_CSIZE(comp, w);
+	settings->height = h = OPJ_CSIZE(comp, h);
 	for (i = 1; i < nc; i++) /* Check if all components are the same size */
 	{
 		comp++;
-		if ((w != (comp->w + (1 << comp->factor) - 1) >> comp->factor) ||
-			(h != (comp->h + (1 << comp->factor) - 1) >> comp->factor))
+		if ((w != OPJ_CSIZE(comp, w)) || (h != OPJ_CSIZE(comp, h)))
 			return (-1);
 	}
+	reduce_setup(settings);
 	if ((res = allocate_image(settings, cmask))) return (res);
 
-	/* Unpack data */
+	/* Prepare to unpack */
 	for (i = 0 , comp = image->comps; i < nc; i++ , comp++)
 	{
-		if (i < settings->bpp) /* Image */
-		{
-			dest = settings->img[CHN_IMAGE] + i;
-			step = settings->bpp;
-		}
-		else /* Alpha */
-		{
-			dest = settings->img[CHN_ALPHA];
-			if (!dest) break; /* No alpha allocated */
-			step = 1;
-		}
-		w0 = comp->w;
-		delta = comp->sgnd ? 1U << (comp->prec - 1) : 0;
-		shift = comp->prec > 8 ? comp->prec - 8 : 0;
-		set_xlate(xtb, comp->prec - shift);
-		for (j = 0; j < h; j++)
+		delta[i] = comp->sgnd ? 1U << (comp->prec - 1) : 0;
+		shift[i] = comp->prec > 8 ? comp->prec - 8 : 0;
+		set_xlate(xtb[i], comp->prec - shift[i]);
+	}
+
+	/* Unpack data row by row */
+	for (j = 0; j < h; j++)
+	{
+		for (i = 0 , comp = image->comps; i < nc; i++ , comp++)
 		{
+			if (i < settings->bpp) /* Image */
+			{
+				dest = ls_row(settings, CHN_IMAGE, j) + i;
+				step = settings->bpp;
+			}
+			else /* Alpha */
+			{
+				dest = ls_row(settings, CHN_ALPHA, j);
+				if (!dest) break; /* No alpha allocated */
+				step = 1;
+			}
+			w0 = comp->w;
 			src = comp->data + j * w0;
 			for (k = 0; k < w; k++)
 			{
-				*dest = xtb[(src[k] + delta) >> shift];
+				*dest = xtb[i][(src[k] + delta[i]) >> shift[i]];
 				dest += step;
 			}
 		}
+		ls_row_done(settings, j);
 	}
 
 #ifdef U_LCMS
@@ -2913,8 +4128,31 @@ static int load_jpeg2000(char *file_name, ls_settings *settings)
 	opj_codec_set_threads(dinfo, helper_threads());
 #endif
 	if ((pr = !settings->silent)) ls_init("JPEG2000", 0);
-	i = opj_read_header(inp, dinfo, &image) &&
-		opj_decode(dinfo, inp, image) &&
+	i = opj_read_header(inp, dinfo, &image);
+#if OPJ_VERSION_MINOR >= 1 /* 2.1+ */
+	/* Skip decoding resolution levels which reduction would discard */
+	while (i)
+	{
+		opj_codestream_info_v2_t *cs;
+		int j, l, n = 32, k = reduce_factor(settings,
+			image->x1 - image->x0, image->y1 - image->y0);
+
+		if (k < 2) break;
+		cs = opj_get_cstr_info(dinfo);
+		if (!cs) break;
+		for (j = 0; j < cs->nbcomps; j++)
+		{
+			l = cs->m_default_tile_info.tccp_info[j].numresolutions;
+			if (l - 1 < n) n = l - 1;
+		}
+		opj_destroy_cstr_info(&cs);
+		/* Largest power of 2 not above the factor */
+		for (l = 0; (l < n) && (k >> (l + 1)); l++);
+		if (l) opj_set_decoded_resolution_factor(dinfo, l);
+		break;
+	}
+#endif
+	i = i && opj_decode(dinfo, inp, image) &&
 		opj_end_decompress(dinfo, inp);
 	opj_destroy_codec(dinfo);
 	opj_stream_destroy(inp);
@@ -3471,6 +4709,9 @@ static int load_tiff_frame(TIFF *tif, ls_settings *settings)
 	/* !!! No alpha support for RGB mode yet */
 	if (argb) cmask = CMASK_IMAGE;
 
+	/* Can reduce on the fly only what gets read row by row */
+	if (!argb && !tw && !planar && (pmetric != PHOTOMETRIC_SEPARATED))
+		reduce_setup(settings);
 	if ((res = allocate_image(settings, cmask))) return (res);
 	res = -1;
 
@@ -3604,7 +4845,7 @@ static int load_tiff_frame(TIFF *tif, ls_settings *settings)
 		{
 			unsigned char *tmp, *tmpa;
 			uint32 x, y, w, h, l;
-			int i, k, dx, dxa, dy, dys;
+			int i, k, dx, dxa, dy, dya, dys;
 
 			/* Read one piece */
 			if (tw)
@@ -3644,7 +4885,7 @@ static int load_tiff_frame(TIFF *tif, ls_settings *settings)
 			}
 
 			/* Prepare pointers */
-			dx = dxa = 1; dy = width;
+			dx = dxa = 1; dy = dya = width;
 			i = y * width + x;
 			tmp = tmpa = settings->img[CHN_ALPHA] + i;
 			if (plane >= wbpp); // Alpha
@@ -3658,13 +4899,21 @@ static int load_tiff_frame(TIFF *tif, ls_settings *settings)
 				dx = bpp;
 				tmp = settings->img[CHN_IMAGE] + plane + i * bpp;
 			}
+			/* Reduced decode reuses one row */
+			if (settings->reduce)
+			{
+				tmp = ls_row(settings, CHN_IMAGE, y) + x * bpp;
+				if ((tmpa = ls_row(settings, CHN_ALPHA, y))) tmpa += x;
+				dy = dya = 0;
+			}
 			dy *= dx; dys = bpr;
 			src = buf;
 			/* Account for horizontal mirroring */
 			if (mirror & 1)
 			{
 				// Write bytes backward
-				tmp += (w - 1) * dx; tmpa += w - 1;
+				tmp += (w - 1) * dx;
+				if (tmpa) tmpa += w - 1;
 				dx = -dx; dxa = -1;
 			}
 			/* Account for vertical mirroring */
@@ -3692,8 +4941,9 @@ static int load_tiff_frame(TIFF *tif, ls_settings *settings)
 				{
 					stream_MSB(src, tmpa, w, bits1,
 						bit0 + bpsamp * wbpp, db, dxa);
-					tmpa += width;
+					tmpa += dya;
 				}
+				ls_row_done(settings, y + l);
 			}
 
 			/* Convert CMYK to RGB if needed */
@@ -3709,7 +4959,7 @@ static int load_tiff_frame(TIFF *tif, ls_settings *settings)
 		}
 		done_cmyk2rgb(settings);
 
-		j = width * height;
+		j = settings->width * settings->height;
 		tmp = settings->img[CHN_IMAGE];
 		src = settings->img[CHN_ALPHA];
 
@@ -3848,68 +5098,19 @@ static int load_tiff(char *file_name, ls_settings *settings, memFILE *mf)
 	return (res);
 }
 
-static int save_tiff(char *file_name, ls_settings *settings, memFILE *mf)
+/* Set the tags for image or band of given height */
+static void tiff_tags(TIFF *tif, ls_settings *settings, enc_job *job, int h)
 {
-	unsigned char buf[MAX_WIDTH / 8], *src, *row = NULL;
 	uint16 rgb[256 * 3];
-	unsigned int tflags, sflags, xflags;
-	int i, l, type, bw, af, pf, res = 0, pmetric = -1;
-	int w = settings->width, h = settings->height, bpp = settings->bpp;
-	TIFF *tif;
-
-
-	/* Select output mode */
-	sflags = FF_SAVE_MASK_FOR(*settings);
-	type = settings->tiff_type;
-	if (type < 0) type = bpp == 3 ? tiff_rtype : // RGB
-		settings->colors <= 2 ?	tiff_btype : // BW
-		tiff_itype; // Indexed
-	if (settings->mode == FS_CLIPBOARD)
-	{
-		type = 0; // Uncompressed
-		/* RGB for clipboard mask */
-		if (settings->img[CHN_ALPHA]) sflags = FF_RGB , bpp = 3;
-	}
-	tflags = tiff_formats[type].flags;
-	sflags &= tflags;
-	bw = !(sflags & (FF_256 | FF_RGB));
-	if (!sflags) return WRONG_FORMAT; // Paranoia
-
-	af = settings->img[CHN_ALPHA] && (tflags & FF_ALPHA);
-
-	/* Use 1-bit mode where possible */
-	if (!bw && !af && (sflags & FF_BW))
-	{
-		/* No need of palette if the colors are full white and black */
-		i = PNG_2_INT(settings->pal[0]);
-		bw = (!i ? 0xFFFFFF : i == 0xFFFFFF ? 0 : -1) ==
-			PNG_2_INT(settings->pal[1]) ? 1 : -1;
-	}		
-
-	/* !!! When using predictor, libtiff 3.8 modifies row buffer in-place */
-	pf = tiff_predictor && !bw && tiff_formats[type].pflag;
-	if (af || pf || (bpp > settings->bpp))
-	{
-		row = malloc(w * (bpp + af));
-		if (!row) return -1;
-	}
+	unsigned int xflags;
+	int i, l, type = job->type, pmetric = -1;
 
-	TIFFSetErrorHandler(NULL);	// We don't want any echoing to the output
-	TIFFSetWarningHandler(NULL);
-	if (!mf) tif = TIFFOpen(file_name, "w");
-	else tif = TIFFClientOpen("", "w", (void *)mf, mTIFFread, mTIFFwrite,
-		mTIFFlseek, mTIFFclose, mTIFFsize, mTIFFmap, mTIFFunmap);
-	if (!tif)
-	{
-		free(row);
-		return -1;
-	}
 
 	/* Write regular tags */
-	TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, w);
+	TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, settings->width);
 	TIFFSetField(tif, TIFFTAG_IMAGELENGTH, h);
-	TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, bpp + af);
-	TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, bw ? 1 : 8);
+	TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, job->bpp + job->af);
+	TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, job->bw ? 1 : 8);
 	TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
 
 	/* Write compression-specific tags */
@@ -3940,15 +5141,15 @@ static int save_tiff(char *file_name, ls_settings *settings, memFILE *mf)
 		TIFFSetField(tif, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB);
 		pmetric = PHOTOMETRIC_YCBCR;
 	}
-	if (pf) TIFFSetField(tif, TIFFTAG_PREDICTOR, PREDICTOR_HORIZONTAL);
+	if (job->pf) TIFFSetField(tif, TIFFTAG_PREDICTOR, PREDICTOR_HORIZONTAL);
 
-	if (bw > 0) pmetric = get_bw(settings) ? PHOTOMETRIC_MINISWHITE :
+	if (job->bw > 0) pmetric = get_bw(settings) ? PHOTOMETRIC_MINISWHITE :
 		PHOTOMETRIC_MINISBLACK;
-	else if (bpp == 1)
+	else if (job->bpp == 1)
 	{
 		pmetric = PHOTOMETRIC_PALETTE;
 		memset(rgb, 0, sizeof(rgb));
-		l = bw ? 2 : 256;
+		l = job->bw ? 2 : 256;
 		for (i = 0; i < settings->colors; i++)
 		{
 			rgb[i] = settings->pal[i].red * 257;
@@ -3959,59 +5160,219 @@ static int save_tiff(char *file_name, ls_settings *settings, memFILE *mf)
 	}
 	else if (pmetric < 0) pmetric = PHOTOMETRIC_RGB;
 	TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, pmetric);
-	if (af)
+	if (job->af)
 	{
 		rgb[0] = EXTRASAMPLE_UNASSALPHA;
 		TIFFSetField(tif, TIFFTAG_EXTRASAMPLES, 1, rgb);
 	}
+}
 
-	/* Actually write the image */
-	if (!settings->silent) ls_init("TIFF", 1);
-	for (i = 0; i < h; i++)
+/* Get a row in TIFF layout */
+static unsigned char *tiff_row(unsigned char *buf, enc_job *job, int y)
+{
+	ls_settings *settings = job->settings;
+	int w = settings->width;
+	unsigned char *src = settings->img[CHN_IMAGE] + w * y * settings->bpp;
+
+	if (job->bw) /* Pack the bits */
 	{
-		src = settings->img[CHN_IMAGE] + w * i * settings->bpp;
-		if (bw) /* Pack the bits */
-		{
-			pack_MSB(buf, src, w, 1);
-			src = buf;
-		}
-		else if (row) /* Fill the buffer */
-			src = prepare_row(row, settings, bpp + af, i);
-		if (TIFFWriteScanline(tif, src, i, 0) == -1)
-		{
-			res = -1;
-			break;
-		}
-		ls_progress(settings, i, 20);
+		pack_MSB(buf, src, w, 1);
+		return (buf);
 	}
-	TIFFClose(tif);
+	/* Fill the buffer if needed */
+	return (job->pf || job->af || (job->bpp > settings->bpp) ?
+		prepare_row(buf, settings, job->bpp + job->af, y) : src);
+}
 
-	if (!settings->silent) progress_end();
+/* Compress a band into a TIFF in memory, and extract the strip from it */
+static void tiff_band(enc_job *job, enc_band *band)
+{
+	memFILE mf;
+	TIFF *tif;
+	toff_t *offs, *lens, ofs = 0;
+	ls_settings *settings = job->settings;
+	unsigned char *src, *buf;
+	size_t len = 0;
+	int y, h = band->y1 - band->y0, l = job->bw ?
+		(settings->width + 7) >> 3 : settings->width * (job->bpp + job->af);
 
-	free(row);
-	return (res);
+
+	if (!(buf = malloc(h * l))) return;
+	for (y = 0; y < h; y++)
+	{
+		src = tiff_row(buf + y * l, job, band->y0 + y);
+		if (src != buf + y * l) memcpy(buf + y * l, src, l);
+	}
+
+	memset(&mf, 0, sizeof(mf));
+	if (!(mf.m.buf = malloc(mf.m.size = 0x4000 - 64))) goto fail;
+	tif = TIFFClientOpen("", "w", (void *)&mf, mTIFFread, mTIFFwrite,
+		mTIFFlseek, mTIFFclose, mTIFFsize, mTIFFmap, mTIFFunmap);
+	if (!tif) goto fail;
+	tiff_tags(tif, settings, job, h);
+	TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, h);
+	y = (TIFFWriteEncodedStrip(tif, 0, buf, h * l) != -1) &&
+		TIFFGetField(tif, TIFFTAG_STRIPOFFSETS, &offs) &&
+		TIFFGetField(tif, TIFFTAG_STRIPBYTECOUNTS, &lens);
+	if (y) ofs = offs[0] , len = lens[0];
+	TIFFClose(tif);
+	if (y && (ofs + len <= mf.top))
+	{
+		/* Keep the compressed data only */
+		memmove(mf.m.buf, mf.m.buf + ofs, len);
+		band->buf = mf.m.buf;
+		band->len = len;
+		mf.m.buf = NULL;
+	}
+fail:	free(mf.m.buf);
+	free(buf);
 }
-#endif
 
-#ifdef U_WEBP
+static void tiff_bands(tcb *thread)
+{
+	enc_job *job = thread->data;
+	enc_band *band = job->bands + thread->step0;
+	int i;
 
-/* *** PREFACE ***
- * WebP Demux API is exceedingly cumbersome in case you don't feed the entire
- * file to it in one single memory block. Stepping through the RIFF container to
- * pick individual chunks is more manageable. */
+	for (i = thread->nsteps; i > 0; i-- , band++) tiff_band(job, band);
+}
 
-static int analyze_webp_frame(ani_status *stat, ls_settings *settings)
+/* Write out a batch of strips, in order */
+static int tiff_write_bands(enc_job *job, int n, void *data)
 {
-	int same_size, holes, alpha0, alpha1, alpha;
+	enc_band *band = job->bands;
+	int i;
 
-	if (stat->mode <= ANM_RAW) // Raw frame mode
+	for (i = 0; i < n; i++ , band++)
 	{
-		stat->defw = settings->width;
-		stat->defh = settings->height;
-		return (0); // Output matches input
+		if (!band->buf) return (-1);
+		if (TIFFWriteRawStrip((TIFF *)data, band->y0 / job->rows, band->buf,
+			band->len) == -1) return (-1);
 	}
-	else if ((stat->defw > MAX_WIDTH) || (stat->defh > MAX_HEIGHT))
-		return (-1); // Too large
+	return (0);
+}
+
+static int save_tiff(char *file_name, ls_settings *settings, memFILE *mf)
+{
+	enc_job job;
+	unsigned char buf[MAX_WIDTH / 8], *row = NULL;
+	unsigned int tflags, sflags;
+	int i, type, bw, af, pf, rows = 0, res = 0;
+	int w = settings->width, h = settings->height, bpp = settings->bpp;
+	TIFF *tif;
+
+
+	/* Select output mode */
+	sflags = FF_SAVE_MASK_FOR(*settings);
+	type = settings->tiff_type;
+	if (type < 0) type = bpp == 3 ? tiff_rtype : // RGB
+		settings->colors <= 2 ?	tiff_btype : // BW
+		tiff_itype; // Indexed
+	if (settings->mode == FS_CLIPBOARD)
+	{
+		type = 0; // Uncompressed
+		/* RGB for clipboard mask */
+		if (settings->img[CHN_ALPHA]) sflags = FF_RGB , bpp = 3;
+	}
+	tflags = tiff_formats[type].flags;
+	sflags &= tflags;
+	bw = !(sflags & (FF_256 | FF_RGB));
+	if (!sflags) return WRONG_FORMAT; // Paranoia
+
+	af = settings->img[CHN_ALPHA] && (tflags & FF_ALPHA);
+
+	/* Use 1-bit mode where possible */
+	if (!bw && !af && (sflags & FF_BW))
+	{
+		/* No need of palette if the colors are full white and black */
+		i = PNG_2_INT(settings->pal[0]);
+		bw = (!i ? 0xFFFFFF : i == 0xFFFFFF ? 0 : -1) ==
+			PNG_2_INT(settings->pal[1]) ? 1 : -1;
+	}		
+
+	/* !!! When using predictor, libtiff 3.8 modifies row buffer in-place */
+	pf = tiff_predictor && !bw && tiff_formats[type].pflag;
+	if (af || pf || (bpp > settings->bpp))
+	{
+		row = malloc(w * (bpp + af));
+		if (!row) return -1;
+	}
+
+	memset(&job, 0, sizeof(job));
+	job.settings = settings;
+	job.bpp = bpp;
+	job.type = type;
+	job.af = af;
+	job.bw = bw;
+	job.pf = pf;
+
+	/* Compress strips on threads if there is enough work, and the codec
+	 * has no state across strips */
+	if (!enc_ref && (helper_threads() > 1) &&
+		(tiff_formats[type].id != COMPRESSION_NONE) &&
+		!(tiff_formats[type].xflags & XF_COMPJ))
+	{
+		i = bw ? (w + 7) >> 3 : w * (bpp + af);
+		if (h * i >= ENC_BAND_MIN * 2) rows = enc_band_rows(h, i);
+		if (rows >= h) rows = 0;
+	}
+
+	TIFFSetErrorHandler(NULL);	// We don't want any echoing to the output
+	TIFFSetWarningHandler(NULL);
+	if (!mf) tif = TIFFOpen(file_name, "w");
+	else tif = TIFFClientOpen("", "w", (void *)mf, mTIFFread, mTIFFwrite,
+		mTIFFlseek, mTIFFclose, mTIFFsize, mTIFFmap, mTIFFunmap);
+	if (!tif)
+	{
+		free(row);
+		return -1;
+	}
+
+	tiff_tags(tif, settings, &job, h);
+	if (rows) TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, rows);
+
+	/* Actually write the image */
+	if (!settings->silent) ls_init("TIFF", 1);
+	if (rows) res = enc_bands(tiff_bands, &job, h, rows, tiff_write_bands,
+		tif);
+	else for (i = 0; i < h; i++)
+	{
+		if (TIFFWriteScanline(tif, tiff_row(row ? row : buf, &job, i),
+			i, 0) == -1)
+		{
+			res = -1;
+			break;
+		}
+		ls_progress(settings, i, 20);
+	}
+	TIFFClose(tif);
+
+	if (!settings->silent) progress_end();
+
+	free(row);
+	return (res);
+}
+#endif
+
+#ifdef U_WEBP
+
+/* *** PREFACE ***
+ * WebP Demux API is exceedingly cumbersome in case you don't feed the entire
+ * file to it in one single memory block. Stepping through the RIFF container to
+ * pick individual chunks is more manageable. */
+
+static int analyze_webp_frame(ani_status *stat, ls_settings *settings)
+{
+	int same_size, holes, alpha0, alpha1, alpha;
+
+	if (stat->mode <= ANM_RAW) // Raw frame mode
+	{
+		stat->defw = settings->width;
+		stat->defh = settings->height;
+		return (0); // Output matches input
+	}
+	else if ((stat->defw > MAX_WIDTH) || (stat->defh > MAX_HEIGHT))
+		return (-1); // Too large
 	ani_map_frame(stat, settings);
 	same_size = !(settings->x | settings->y |
 		(stat->defw ^ settings->width) | (stat->defh ^ settings->height));
@@ -4421,7 +5782,7 @@ char *webp_presets[] = { _("Lossless"), _("Default"), _("Picture"), _("Photo"),
 
 // !!! Min version 0.5.0
 
-static int save_webp(char *file_name, ls_settings *settings)
+static int webp_config(WebPConfig *conf, ls_settings *settings)
 {
 	static const signed char presets[] = {
 		WEBP_PRESET_DEFAULT, /* Lossless */
@@ -4431,46 +5792,59 @@ static int save_webp(char *file_name, ls_settings *settings)
 		WEBP_PRESET_DRAWING,
 		WEBP_PRESET_ICON,
 		WEBP_PRESET_TEXT };
-	WebPConfig conf;
-	WebPPicture pic;
-	FILE *fp;
-	unsigned char *rgba;
-	int wh, st, res = -1;
 
-	if (settings->bpp == 1) return WRONG_FORMAT;
+	if (!WebPConfigPreset(conf, presets[settings->webp_preset],
+		settings->webp_quality)) return (FALSE); // Lib failure
+	if (!settings->webp_preset)
+		WebPConfigLosslessPreset(conf, settings->webp_compression);
+	conf->exact = TRUE; // Preserve invisible parts
+	return (TRUE);
+}
 
-	if ((fp = fopen(file_name, "wb")) == NULL) return (-1);
+/* Prepare intermediate container */
+static int webp_picture(WebPPicture *pic, ls_settings *settings)
+{
+	unsigned char *rgba;
+	int wh, st;
 
-	if (!WebPConfigPreset(&conf, presets[settings->webp_preset],
-		settings->webp_quality)) goto ffail; // Lib failure
-	if (!settings->webp_preset)
-		WebPConfigLosslessPreset(&conf, settings->webp_compression);
-	conf.exact = TRUE; // Preserve invisible parts
-
-	/* Prepare intermediate container */
-	if (!WebPPictureInit(&pic)) goto ffail; // Lib failure
-	pic.use_argb = TRUE;
-	pic.width = settings->width;
-	pic.height = settings->height;
-	wh = pic.width * pic.height;
-	pic.writer = webp_fwrite;
-	pic.custom_ptr = (void *)fp;
-	if (!settings->silent) pic.progress_hook = webp_progress;
+	if (!WebPPictureInit(pic)) return (FALSE); // Lib failure
+	pic->use_argb = TRUE;
+	pic->width = settings->width;
+	pic->height = settings->height;
+	wh = pic->width * pic->height;
 	if (settings->img[CHN_ALPHA]) /* Need RGBA */
 	{
 		rgba = malloc(wh * 4);
-		if (!rgba) goto ffail;
+		if (!rgba) return (FALSE);
 		copy_bytes(rgba, settings->img[CHN_IMAGE], wh, 4, 3);
 		copy_bytes(rgba + 3, settings->img[CHN_ALPHA], wh, 4, 1);
-		st = WebPPictureImportRGBA(&pic, rgba, pic.width * 4);
+		st = WebPPictureImportRGBA(pic, rgba, pic->width * 4);
 		free(rgba);
 	}
 	/* RGB is enough */
-	else st = WebPPictureImportRGB(&pic, settings->img[CHN_IMAGE], pic.width * 3);
+	else st = WebPPictureImportRGB(pic, settings->img[CHN_IMAGE], pic->width * 3);
+	return (st);
+}
+
+static int save_webp(char *file_name, ls_settings *settings)
+{
+	WebPConfig conf;
+	WebPPicture pic;
+	FILE *fp;
+	int res = -1;
+
+	if (settings->bpp == 1) return WRONG_FORMAT;
+
+	if ((fp = fopen(file_name, "wb")) == NULL) return (-1);
+
+	if (!webp_config(&conf, settings)) goto ffail;
 
 	/* Do encode */
-	if (st)
+	if (webp_picture(&pic, settings))
 	{
+		pic.writer = webp_fwrite;
+		pic.custom_ptr = (void *)fp;
+		if (!settings->silent) pic.progress_hook = webp_progress;
 		if (!settings->silent) ls_init("WebP", 1);
 		if (WebPEncode(&conf, &pic)) res = 0;
 		WebPPictureFree(&pic);
@@ -4480,6 +5854,65 @@ static int save_webp(char *file_name, ls_settings *settings)
 ffail:	fclose(fp);
 	return (res);
 }
+
+#ifdef U_WEBPMUX
+
+/* Animated WebP is put together by libwebp itself, which finds the changed
+ * areas and the best way to blend them in */
+
+typedef struct {
+	FILE *fp;
+	WebPAnimEncoder *enc;
+	WebPConfig conf;
+	int ts; // Timestamp of next frame, in ms
+} webpanim;
+
+static webpanim *webp_anim_start(char *file_name, ls_settings *settings)
+{
+	WebPAnimEncoderOptions opts;
+	webpanim *wa;
+
+	if (!(wa = calloc(1, sizeof(webpanim)))) return (NULL);
+	if (!webp_config(&wa->conf, settings) ||
+		!WebPAnimEncoderOptionsInit(&opts)) goto fail; // Lib failure
+	opts.anim_params.loop_count = 0; // Loop forever
+	wa->enc = WebPAnimEncoderNew(settings->width, settings->height, &opts);
+	if (!wa->enc) goto fail;
+	if ((wa->fp = fopen(file_name, "wb"))) return (wa);
+	WebPAnimEncoderDelete(wa->enc);
+fail:	free(wa);
+	return (NULL);
+}
+
+static int webp_anim_frame(webpanim *wa, ls_settings *settings)
+{
+	WebPPicture pic;
+	int res;
+
+	if (!webp_picture(&pic, settings)) return (-1);
+	res = WebPAnimEncoderAdd(wa->enc, &pic, wa->ts, &wa->conf);
+	WebPPictureFree(&pic);
+	wa->ts += settings->gif_delay * 10;
+	return (res ? 0 : -1);
+}
+
+static int webp_anim_end(webpanim *wa)
+{
+	WebPData data;
+	int res = -1;
+
+	WebPDataInit(&data);
+	/* Last frame's duration gets set by a NULL frame */
+	if (WebPAnimEncoderAdd(wa->enc, NULL, wa->ts, NULL) &&
+		WebPAnimEncoderAssemble(wa->enc, &data) &&
+		(fwrite(data.bytes, 1, data.size, wa->fp) == data.size)) res = 0;
+	WebPDataClear(&data);
+	WebPAnimEncoderDelete(wa->enc);
+	if (fclose(wa->fp)) res = -1;
+	free(wa);
+	return (res);
+}
+#endif
 #endif
 
 /* Version 2 fields */
@@ -4540,25 +5973,49 @@ ffail:	fclose(fp);
 #define BMPCS_LINK  TAG4B('L', 'I', 'N', 'K')
 #define BMPCS_EMBED TAG4B('M', 'B', 'E', 'D')
 
+typedef struct {
+	ls_settings *settings;
+	int w, bpp, y0, step, shifts[4], bpps[4];
+} bmp_rows;
+
+/* Unpack a row of uncompressed data, "y" counting in file order */
+static void bmp_row(void *data, unsigned char *src, int y, unsigned char *buf)
+{
+	bmp_rows *br = data;
+	ls_settings *settings = br->settings;
+	unsigned char *dest;
+	int i, w = br->w, bpp = br->bpp;
+
+	y = br->y0 + y * br->step;
+	dest = ls_row(settings, CHN_IMAGE, y);
+	if (bpp < 16) /* Indexed */
+		stream_MSB(src, dest, w, bpp, 0, bpp, 1);
+	else /* RGB */
+	{
+		for (i = 0; i < 3; i++) stream_LSB(src, dest + i, w,
+			br->bpps[i], br->shifts[i], bpp, 3);
+		if (settings->img[CHN_ALPHA]) stream_LSB(src,
+			ls_row(settings, CHN_ALPHA, y), w, br->bpps[3],
+			br->shifts[3], bpp, 1);
+	}
+	ls_row_done(settings, y);
+}
+
 static int load_bmp(char *file_name, ls_settings *settings, memFILE *mf)
 {
 	guint32 masks[4];
 	unsigned char hdr[BMP5_HSIZE], xlat[256], *dest, *tmp, *buf = NULL;
+	bmp_rows br;
 	memFILE fake_mf;
-	FILE *fp = NULL;
 	unsigned l, ofs;
-	int shifts[4], bpps[4];
+	int *shifts = br.shifts, *bpps = br.bpps;
 	int def_alpha = FALSE, cmask = CMASK_IMAGE, comp = 0, ba = 0, rle = 0, res = -1;
 	int i, j, k, n, ii, w, h, bpp, wbpp;
 	int bl, rl, step, skip, dx, dy;
 
 
-	if (!mf)
-	{
-		if (!(fp = fopen(file_name, "rb"))) return (-1);
-		memset(mf = &fake_mf, 0, sizeof(fake_mf));
-		fake_mf.file = fp;
-	}
+	memset(&fake_mf, 0, sizeof(fake_mf));
+	if (!mf && !mfopen(mf = &fake_mf, file_name)) return (-1);
 
 	/* Read the largest header */
 	k = mfread(hdr, 1, BMP5_HSIZE, mf);
@@ -4731,6 +6188,8 @@ static int load_bmp(char *file_name, ls_settings *settings, memFILE *mf)
 	buf = malloc(bl + 1);
 	res = FILE_MEM_ERROR;
 	if (!buf) goto fail;
+	/* RLE can skip rows, so only uncompressed gets reduced on the fly */
+	if (!rle) reduce_setup(settings);
 	if ((res = allocate_image(settings, cmask))) goto fail2;
 
 #ifdef U_LCMS
@@ -4771,25 +6230,26 @@ static int load_bmp(char *file_name, ls_settings *settings, memFILE *mf)
 
 	if (!rle) /* No RLE */
 	{
-		for (n = 0; (i < h) && (i >= 0); n++ , i += step)
+		br.settings = settings;
+		br.w = w;
+		br.bpp = bpp;
+		br.y0 = i;
+		br.step = step;
+		/* Convert straight from memory if the file is there, unless
+		 * reducing it; bitparser's extra step needs a byte more, so
+		 * the last row goes through the padded buffer */
+		if (!settings->reduce && (tmp = mfview(mf, (size_t)rl * h)))
+		{
+			if ((h > 1) && (res = convert_rows(bmp_row, &br, tmp,
+				rl, h - 1, 0, settings))) goto fail3;
+			memcpy(buf, tmp + (size_t)rl * (h - 1), rl);
+			bmp_row(&br, buf, h - 1, NULL);
+		}
+		else for (n = 0; n < h; n++)
 		{
 			j = mfread(buf, 1, rl, mf);
 			if (j < rl) goto fail3;
-			dest = settings->img[CHN_IMAGE] + w * i * wbpp;
-			if (bpp < 16) /* Indexed */
-				stream_MSB(buf, dest, w, bpp, 0, bpp, 1);
-			else /* RGB */
-			{
-				stream_LSB(buf, dest + 0, w, bpps[0],
-					shifts[0], bpp, 3);
-				stream_LSB(buf, dest + 1, w, bpps[1],
-					shifts[1], bpp, 3);
-				stream_LSB(buf, dest + 2, w, bpps[2],
-					shifts[2], bpp, 3);
-				if (settings->img[CHN_ALPHA])
-					stream_LSB(buf, settings->img[CHN_ALPHA] +
-						w * i, w, bpps[3], shifts[3], bpp, 1);
-			}
+			bmp_row(&br, buf, n, NULL);
 			ls_progress(settings, n, 10);
 		}
 
@@ -4807,7 +6267,7 @@ static int load_bmp(char *file_name, ls_settings *settings, memFILE *mf)
 			}
 			else tmp = settings->img[CHN_IMAGE] + i;
 			set_xlate(xlat, bpps[i] + !bpps[i]); // Let 0-wide fields be
-			n = w * h;
+			n = settings->width * settings->height;
 			for (j = 0; j < n; j++ , tmp += k) *tmp = xlat[*tmp];
 		}
 
@@ -4931,7 +6391,7 @@ static int load_bmp(char *file_name, ls_settings *settings, memFILE *mf)
 
 fail3:	if (!settings->silent) progress_end();
 fail2:	free(buf);
-fail:	if (fp) fclose(fp);
+fail:	mfclose(&fake_mf);
 	return (res);
 }
 
@@ -6277,7 +7737,7 @@ static int load_tga(char *file_name, ls_settings *settings)
 	int rle, real_alpha = FALSE, assoc_alpha = FALSE, wmode = 0, res = -1;
 	int iofs, buflen;
 	int ix, ishift, imask, ax, ashift, amask;
-	int start, xstep, xstepb, ystep, ccnt, rcnt, strl, y;
+	int x0, y0, xstep, xstepb, ystep, ccnt, rcnt, strl, y;
 
 
 	if (!(fp = fopen(file_name, "rb"))) return (-1);
@@ -6473,6 +7933,7 @@ static int load_tga(char *file_name, ls_settings *settings)
 	buf = malloc(buflen + 1); /* One extra byte for bitparser */
 	res = FILE_MEM_ERROR;
 	if (!buf) goto fail;
+	reduce_setup(settings);
 	if ((res = allocate_image(settings, abits ? CMASK_RGBA : CMASK_IMAGE)))
 		goto fail2;
 	/* Don't even try reading alpha if nowhere to store it */
@@ -6483,25 +7944,24 @@ static int load_tga(char *file_name, ls_settings *settings)
 
 	fseek(fp, iofs, SEEK_SET); /* Seek to data */
 	/* Prepare loops */
-	start = 0; xstep = 1; ystep = 0;
+	x0 = y0 = 0; xstep = ystep = 1;
 	if (hdr[TGA_DESC] & TGA_R2L)
 	{
 		/* Right-to-left */
-		start = w - 1;
+		x0 = w - 1;
 		xstep = -1;
-		ystep = 2 * w;
 	}
 	if (!(hdr[TGA_DESC] & TGA_T2B))
 	{
 		/* Bottom-to-top */
-		start += (h - 1) * w;
-		ystep -= 2 * w;
+		y0 = h - 1;
+		ystep = -1;
 	}
 	xstepb = xstep * bpp;
 	res = FILE_LIB_ERROR;
 
-	dest = settings->img[CHN_IMAGE] + start * bpp;
-	dsta = settings->img[CHN_ALPHA] + start;
+	dest = ls_row(settings, CHN_IMAGE, y0) + x0 * bpp;
+	if ((dsta = ls_row(settings, CHN_ALPHA, y0))) dsta += x0;
 	y = ccnt = rcnt = 0;
 	bstart = bstop = buf + buflen;
 	strl = w;
@@ -6605,10 +8065,12 @@ static int load_tga(char *file_name, ls_settings *settings)
 			else ++rcnt; /* Copy block - several reads */
 		}
 		if (strl) continue; /* It was buffer end */
+		ls_row_done(settings, y0 + y * ystep);
 		ls_progress(settings, y, 10);
 		if (++y >= h) break; /* All done */
-		dest += ystep * bpp;
-		if (dsta) dsta += ystep;
+		dest = ls_row(settings, CHN_IMAGE, y0 + y * ystep) + x0 * bpp;
+		if ((dsta = ls_row(settings, CHN_ALPHA, y0 + y * ystep)))
+			dsta += x0;
 		strl = w;
 	}
 
@@ -6620,7 +8082,7 @@ static int load_tga(char *file_name, ls_settings *settings)
 	if (settings->img[CHN_ALPHA] && (wmode == 3) && !assoc_alpha)
 	{
 		unsigned char *timg, *talpha;
-		int i, j = w * h, k = 0, l;
+		int i, j = settings->width * settings->height, k = 0, l;
 
 		timg = settings->img[CHN_IMAGE];
 		talpha = settings->img[CHN_ALPHA];
@@ -6642,13 +8104,14 @@ static int load_tga(char *file_name, ls_settings *settings)
 
 	/* Rescale alpha */
 	if (settings->img[CHN_ALPHA] && (abits < 8))
-		extend_bytes(settings->img[CHN_ALPHA], w * h, (1 << abits) - 1);
+		extend_bytes(settings->img[CHN_ALPHA],
+			settings->width * settings->height, (1 << abits) - 1);
 
 	/* Unassociate alpha */
 	if (settings->img[CHN_ALPHA] && assoc_alpha && (abits > 1))
 	{
-		mem_demultiply(settings->img[CHN_IMAGE],
-			settings->img[CHN_ALPHA], w * h, bpp);
+		mem_demultiply(settings->img[CHN_IMAGE], settings->img[CHN_ALPHA],
+			settings->width * settings->height, bpp);
 	}
 	res = 0;
 
@@ -7816,13 +9279,13 @@ static void copy_bytes(unsigned char *dest, unsigned char *src, int len,
 	}	
 }
 
-static int check_next_pnm(FILE *fp, char id)
+static int check_next_pnm(memFILE *mf, char id)
 {
 	char buf[2];
 
-	if (fread(buf, 2, 1, fp))
+	if (mfread(buf, 2, 1, mf))
 	{
-		fseek(fp, -2, SEEK_CUR);
+		mfseek(mf, -2, SEEK_CUR);
 		if ((buf[0] == 'P') && (buf[1] == id)) return (FILE_HAS_FRAMES);
 	}
 	return (1);
@@ -7892,26 +9355,53 @@ static char *pam_behead(memFILE *mf, int whdm[4])
  * because handling format variations which aren't found in the wild
  * is a waste of code - WJ */
 
-static int load_pam_frame(FILE *fp, ls_settings *settings)
+static const char pam_depths[] = { 1, 2, 1, 2, 3, 4, 4, 5 };
+
+typedef struct {
+	ls_settings *settings;
+	cvt_func cvt_stream;
+	int ftype, bpp, depth, vl, maxval;
+} pam_rows;
+
+static void pam_row(void *data, unsigned char *src, int y, unsigned char *buf)
+{
+	pam_rows *pr = data;
+	ls_settings *settings = pr->settings;
+	unsigned char *dest;
+	int w = settings->width, bpp = pr->bpp, vl = pr->vl;
+
+	if (settings->img[CHN_ALPHA]) // Have alpha - parse it
+	{
+		pr->cvt_stream(settings->img[CHN_ALPHA] + (size_t)w * y,
+			src + pam_depths[pr->ftype] * vl - vl, w, 1, pr->depth,
+			pr->maxval);
+	}
+	dest = settings->img[CHN_IMAGE] + (size_t)w * bpp * y;
+	if (pr->ftype >= 6) // CMYK
+	{
+		pr->cvt_stream(buf, src, w, 4, pr->depth, pr->maxval);
+		if (pr->maxval < 255) extend_bytes(buf, w * 4, pr->maxval);
+		cmyk2rgb(dest, buf, w, FALSE, settings);
+	}
+	else pr->cvt_stream(dest, src, w, bpp, pr->depth, pr->maxval);
+}
+
+static int load_pam_frame(memFILE *mf, ls_settings *settings)
 {
 	static const char *typenames[] = {
 		"BLACKANDWHITE", "BLACKANDWHITE_ALPHA",
 		"GRAYSCALE", "GRAYSCALE_ALPHA",
 		"RGB", "RGB_ALPHA",
 		"CMYK", "CMYK_ALPHA", NULL };
-	static const char depths[] = { 1, 2, 1, 2, 3, 4, 4, 5 };
-	memFILE fake_mf;
-	cvt_func cvt_stream;
+	pam_rows pr;
 	char *t1;
-	unsigned char *dest, *buf = NULL;
+	unsigned char *dest, *src, *buf = NULL;
 	int maxval, w, h, depth, ftype = -1;
 	int i, j, ll, bpp, trans, vl, res, whdm[4];
 
 
 	/* Read header */
-	memset(&fake_mf, 0, sizeof(fake_mf));
-	fake_mf.file = fp;
-	if (!(t1 = pam_behead(&fake_mf, whdm))) return (-1);
+	if (!(t1 = pam_behead(mf, whdm))) return (-1);
 	/* Compare TUPLTYPE to list of known ones */
 	if (*t1) for (i = 0; typenames[i]; i++)
 	{
@@ -7925,7 +9415,7 @@ static int load_pam_frame(FILE *fp, ls_settings *settings)
 	if (ftype < 0) ftype = depth >= 3 ? 4 : 2;
 
 	/* Validate */
-	if ((depth < depths[ftype]) || (depth > 16) || (maxval > 65535))
+	if ((depth < pam_depths[ftype]) || (depth > 16) || (maxval > 65535))
 		return (-1);
 	bpp = ftype < 4 ? 1 : 3;
 	trans = ftype & 1;
@@ -7953,32 +9443,31 @@ static int load_pam_frame(FILE *fp, ls_settings *settings)
 	/* Read the image */
 	if (!settings->silent) ls_init("PAM", 0);
 	res = FILE_LIB_ERROR;
-	cvt_stream = vl > 1 ? convert_16b : (cvt_func)copy_bytes;
-	for (i = 0; i < h; i++)
+	pr.settings = settings;
+	pr.cvt_stream = vl > 1 ? convert_16b : (cvt_func)copy_bytes;
+	pr.ftype = ftype;
+	pr.bpp = bpp;
+	pr.depth = depth;
+	pr.vl = vl;
+	pr.maxval = maxval;
+	/* Convert straight from memory if the file is there */
+	if ((src = mfview(mf, (size_t)ll * h)))
+	{
+		if ((res = convert_rows(pam_row, &pr, src, ll, h,
+			ftype >= 6 ? w * 4 : 0, settings))) goto fail2;
+	}
+	else for (i = 0; i < h; i++)
 	{
 		dest = buf ? buf : settings->img[CHN_IMAGE] + ll * i;
-		j = fread(dest, 1, ll, fp);
+		j = mfread(dest, 1, ll, mf);
 		if (j < ll) goto fail2;
 		ls_progress(settings, i, 10);
 
-		if (!buf) continue; // Nothing else to do here
-		if (settings->img[CHN_ALPHA]) // Have alpha - parse it
-		{
-			cvt_stream(settings->img[CHN_ALPHA] + w * i,
-				buf + depths[ftype] * vl - vl, w, 1, depth, maxval);
-		}
-		dest = settings->img[CHN_IMAGE] + w * bpp * i;
-		if (ftype >= 6) // CMYK
-		{
-			cvt_stream(buf, buf, w, 4, depth, maxval);
-			if (maxval < 255) extend_bytes(buf, w * 4, maxval);
-			cmyk2rgb(dest, buf, w, FALSE, settings);
-		}
-		else cvt_stream(dest, buf, w, bpp, depth, maxval);
+		if (buf) pam_row(&pr, buf, i, buf);
 	}
 
 	/* Check for next frame */
-	res = check_next_pnm(fp, '7');
+	res = check_next_pnm(mf, '7');
 
 fail2:	if (maxval < 255) // Extend what we've read
 	{
@@ -8002,7 +9491,7 @@ fail:	free(buf);
 
 #define PNM_BUFSIZE 4096
 typedef struct {
-	FILE *f;
+	memFILE *mf;
 	int ptr, end, eof, comment;
 	char buf[PNM_BUFSIZE + 2];
 } pnmbuf;
@@ -8050,7 +9539,7 @@ static char *pnm_gets(pnmbuf *pnm, int data)
 		if (pnm->ptr >= pnm->end) pnm->ptr = pnm->end = 0;
 		l = PNM_BUFSIZE - pnm->end;
 		if (l <= 0) return (NULL); // A "token" of 4096 chars means failure
-		pnm->end += k = fread(pnm->buf + pnm->end, 1, l, pnm->f);
+		pnm->end += k = mfread(pnm->buf + pnm->end, 1, l, pnm->mf);
 		pnm->eof = k < l;
 		if (pnm->comment) pnm_skip_comment(pnm);
 	}
@@ -8063,28 +9552,48 @@ static int pnm_endhdr(pnmbuf *pnm, int plain)
 		pnm_skip_comment(pnm);
 		if (!pnm->comment) break;
 		if (pnm->eof) return (FALSE);
-		pnm->end = fread(pnm->buf, 1, PNM_BUFSIZE, pnm->f);
+		pnm->end = mfread(pnm->buf, 1, PNM_BUFSIZE, pnm->mf);
 		pnm->eof = pnm->end < PNM_BUFSIZE;
 	}
 	/* Last whitespace in header already got consumed while parsing */
 
 	/* Buffer will remain in use in plain mode */
 	if (!plain && (pnm->ptr < pnm->end))
-		fseek(pnm->f, pnm->ptr - pnm->end, SEEK_CUR);
+		mfseek(pnm->mf, pnm->ptr - pnm->end, SEEK_CUR);
 	return (TRUE);
 }
 
-static int load_pnm_frame(FILE *fp, ls_settings *settings)
+typedef struct {
+	ls_settings *settings;
+	int mode, maxval;
+} pnm_rows;
+
+/* Convert a row of raw data */
+static void pnm_row(void *data, unsigned char *src, int y, unsigned char *buf)
+{
+	pnm_rows *pr = data;
+	int i, w = pr->settings->width, l = w * pr->settings->bpp;
+	unsigned char *dest = pr->settings->img[CHN_IMAGE] + (size_t)l * y;
+
+	if (!pr->mode) /* Packed bits */
+		for (i = 0; i < w; i++) *dest++ = (src[i >> 3] >> (~i & 7)) & 1;
+	else if (pr->mode == 4) /* Ushorts in MSB order */
+		convert_16b(dest, src, l, 1, 1, pr->maxval);
+	else memcpy(dest, src, l); /* Bytes */
+}
+
+static int load_pnm_frame(memFILE *mf, ls_settings *settings)
 {
+	pnm_rows pr;
 	pnmbuf pnm;
 	char *s, *tail;
-	unsigned char *dest;
+	unsigned char *dest, *src;
 	int i, l, m, w, h, bpp, maxval, plain, mode, fid, res;
 
 
 	/* Identify*/
 	memset(&pnm, 0, sizeof(pnm));
-	pnm.f = fp;
+	pnm.mf = mf;
 	fid = settings->ftype == FT_PBM ? 0 : settings->ftype == FT_PGM ? 1 : 2;
 	if (!(s = pnm_gets(&pnm, FALSE))) return (-1);
 	if ((s[0] != 'P') || ((s[1] != fid + '1') && (s[1] != fid + '4')))
@@ -8127,7 +9636,19 @@ static int load_pnm_frame(FILE *fp, ls_settings *settings)
 	res = FILE_LIB_ERROR;
 	l = w * bpp;
 	m = maxval * 2;
-	for (i = 0; i < h; i++)
+	/* Convert raw data straight from memory if the file is there */
+	pr.settings = settings;
+	pr.mode = mode;
+	pr.maxval = maxval;
+	i = !mode ? (w + 7) >> 3 : mode == 4 ? l * 2 : l;
+	if (!plain && (src = mfview(mf, (size_t)i * h)))
+	{
+		if ((res = convert_rows(pnm_row, &pr, src, i, h, 0, settings)))
+			goto fail2;
+		i = h; // Done
+	}
+	else i = 0;
+	for (; i < h; i++)
 	{
 		dest = settings->img[CHN_IMAGE] + l * i;
 		switch (mode)
@@ -8141,7 +9662,7 @@ static int load_pnm_frame(FILE *fp, ls_settings *settings)
 			unsigned char *tp = pnm.buf;
 
 			k = (w + 7) >> 3;
-			j = fread(tp, 1, k, fp);
+			j = mfread(tp, 1, k, mf);
 			for (i = 0; i < w; i++)
 				*dest++ = (tp[i >> 3] >> (~i & 7)) & 1;
 			if (j < k) goto fail2;
@@ -8149,7 +9670,7 @@ static int load_pnm_frame(FILE *fp, ls_settings *settings)
 		}
 		case 3: /* Raw byte values - extend later */
 		case 5: /* Raw 0..255 values - trivial */
-			if (fread(dest, 1, l, fp) < l) goto fail2;
+			if (mfread(dest, 1, l, mf) < l) goto fail2;
 			break;
 		case 1: /* Chars "0" and "1" */
 		{
@@ -8188,7 +9709,7 @@ static int load_pnm_frame(FILE *fp, ls_settings *settings)
 			for (ll = l * 2; ll > 0; ll -= k)
 			{
 				k = PNM_BUFSIZE < ll ? PNM_BUFSIZE : ll;
-				j = fread(pnm.buf, 1, k, fp);
+				j = mfread(pnm.buf, 1, k, mf);
 				i = j >> 1;
 				convert_16b(dest, pnm.buf, i, 1, 1, maxval);
 				dest += i;
@@ -8202,7 +9723,7 @@ static int load_pnm_frame(FILE *fp, ls_settings *settings)
 	res = 1;
 
 	/* Check for next frame */
-	if (!plain) res = check_next_pnm(fp, fid + '4');
+	if (!plain) res = check_next_pnm(mf, fid + '4');
 
 fail2:	if (mode == 3) // Extend what we've read
 		extend_bytes(settings->img[CHN_IMAGE], l * h, maxval);
@@ -8213,12 +9734,12 @@ fail2:	if (mode == 3) // Extend what we've read
 
 static int load_pnm_frames(char *file_name, ani_settings *ani)
 {
-	FILE *fp;
+	memFILE mf;
 	ls_settings w_set;
 	int res, is_pam = ani->settings.ftype == FT_PAM, next = TRUE;
 
 
-	if (!(fp = fopen(file_name, "rb"))) return (-1);
+	if (!mfopen(&mf, file_name)) return (-1);
 	while (next)
 	{
 		res = FILE_TOO_LONG;
@@ -8226,26 +9747,26 @@ static int load_pnm_frames(char *file_name, ani_settings *ani)
 			goto fail;
 		w_set = ani->settings;
 		w_set.gif_delay = -1; // Multipage
-		res = (is_pam ? load_pam_frame : load_pnm_frame)(fp, &w_set);
+		res = (is_pam ? load_pam_frame : load_pnm_frame)(&mf, &w_set);
 		next = res == FILE_HAS_FRAMES;
 		if ((res != 1) && !next) goto fail;
 		res = process_page_frame(file_name, ani, &w_set);
 		if (res) goto fail;
 	}
 	res = 1;
-fail:	fclose(fp);
+fail:	mfclose(&mf);
 	return (res);
 }
 
 static int load_pnm(char *file_name, ls_settings *settings)
 {
-	FILE *fp;
+	memFILE mf;
 	int res;
 
-	if (!(fp = fopen(file_name, "rb"))) return (-1);
+	if (!mfopen(&mf, file_name)) return (-1);
 	res = (settings->ftype == FT_PAM ? load_pam_frame :
-		load_pnm_frame)(fp, settings);
-	fclose(fp);
+		load_pnm_frame)(&mf, settings);
+	mfclose(&mf);
 	return (res);
 }
 
@@ -8471,15 +9992,35 @@ static void readtags(tagline *tl, ls_settings *settings, int bpp)
 	}
 }
 
+typedef struct {
+	ls_settings *settings;
+	int depth, slots[NUM_CHANNELS];
+} pmm_rows;
+
+/* Distribute a row of data between channels */
+static void pmm_row(void *data, unsigned char *src, int y, unsigned char *buf)
+{
+	pmm_rows *pr = data;
+	ls_settings *settings = pr->settings;
+	int j, w = settings->width;
+
+	copy_bytes(settings->img[CHN_IMAGE] + (size_t)w * settings->bpp * y,
+		src, w, settings->bpp, pr->depth);
+	for (j = CHN_ALPHA; j < NUM_CHANNELS; j++)
+		if (settings->img[j]) copy_bytes(settings->img[j] +
+			(size_t)w * y, src + pr->slots[j], w, 1, pr->depth);
+}
+
 static int load_pmm_frame(memFILE *mf, ls_settings *settings)
 {
 	/* !!! INDEXED is at index 1, RGB at index 3 to use index as BPP */
 	static const char *blocks[] = { "TAGS", "INDEXED", "PALETTE", "RGB", NULL };
+	pmm_rows pr;
 	tagline tl;
-	unsigned char *dest, *buf = NULL;
+	unsigned char *dest, *src, *buf = NULL;
 	char *ttype = NULL;
 	int w, h, depth, rgbpp, cmask = CMASK_IMAGE;
-	int i, j, l, res, whdm[4], slots[NUM_CHANNELS];
+	int i, j, l, res, whdm[4], *slots = pr.slots;
 
 	while (TRUE)
 	{
@@ -8540,7 +10081,7 @@ static int load_pmm_frame(memFILE *mf, ls_settings *settings)
 		// !!! Only slots 1 & 3 fall through to here
 		rgbpp = j;
 		/* Add up extra channels */
-		memset(slots, 0, sizeof(slots));
+		memset(pr.slots, 0, sizeof(pr.slots));
 		while ((i = nexttag(&tl, FALSE)) == 1)
 		{
 			if (!strcmp(tl.tag, "ALPHA")) i = CHN_ALPHA;
@@ -8575,18 +10116,20 @@ static int load_pmm_frame(memFILE *mf, ls_settings *settings)
 		/* Read the image */
 		if (!settings->silent) ls_init("* PMM *", 0);
 		res = FILE_LIB_ERROR;
-		for (i = 0; i < h; i++)
+		pr.settings = settings;
+		pr.depth = depth;
+		/* Convert straight from memory if the data are there */
+		if ((src = mfview(mf, (size_t)l * h)))
+		{
+			if ((res = convert_rows(pmm_row, &pr, src, l, h,
+				0, settings))) goto fail;
+		}
+		else for (i = 0; i < h; i++)
 		{
 			dest = settings->img[CHN_IMAGE] + w * rgbpp * i;
 			if (!mfread(buf ? buf : dest, l, 1, mf)) goto fail;
 			ls_progress(settings, i, 10);
-			if (!buf) continue; // Nothing else to do here
-
-			copy_bytes(dest, buf, w, rgbpp, depth);
-			for (j = CHN_ALPHA; j < NUM_CHANNELS; j++)
-				if (settings->img[j]) copy_bytes(
-					settings->img[j] + w * i,
-					buf + slots[j], w, 1, depth);
+			if (buf) pmm_row(&pr, buf, i, NULL);
 		}
 
 		/* Extend what we've read */
@@ -8620,17 +10163,12 @@ fail:		if (!settings->silent) progress_end();
 static int load_pmm_frames(char *file_name, ani_settings *ani, memFILE *mf)
 {
 	memFILE fake_mf;
-	FILE *fp = NULL;
 	ls_settings w_set, init_set;
 	int res, next;
 
 
-	if (!mf)
-	{
-		if (!(fp = fopen(file_name, "rb"))) return (-1);
-		memset(mf = &fake_mf, 0, sizeof(fake_mf));
-		fake_mf.file = fp;
-	}
+	memset(&fake_mf, 0, sizeof(fake_mf));
+	if (!mf && !mfopen(mf = &fake_mf, file_name)) return (-1);
 	init_set = ani->settings;
 	init_set.gif_delay = -1; // Multipage by default
 	while (TRUE)
@@ -8653,24 +10191,19 @@ static int load_pmm_frames(char *file_name, ani_settings *ani, memFILE *mf)
 		init_set.rgb_trans = w_set.rgb_trans;
 		init_set.gif_delay = w_set.gif_delay;
 	}
-	fclose(fp);
+	mfclose(&fake_mf);
 	return (res);
 }
 
 static int load_pmm(char *file_name, ls_settings *settings, memFILE *mf)
 {
 	memFILE fake_mf;
-	FILE *fp = NULL;
 	int res;
 
-	if (!mf)
-	{
-		if (!(fp = fopen(file_name, "rb"))) return (-1);
-		memset(mf = &fake_mf, 0, sizeof(fake_mf));
-		fake_mf.file = fp;
-	}
+	memset(&fake_mf, 0, sizeof(fake_mf));
+	if (!mf && !mfopen(mf = &fake_mf, file_name)) return (-1);
 	res = load_pmm_frame(mf, settings);
-	if (fp) fclose(fp);
+	mfclose(&fake_mf);
 	return (res);
 }
 
@@ -9163,7 +10696,7 @@ static int save_image_x(char *file_name, ls_settings *settings, memFILE *mf)
 	{
 	default:
 	case FT_PNG: res = save_png(file_name, &setw, mf); break;
-	case FT_GIF: res = save_gif(file_name, &setw); break;
+	case FT_GIF: res = save_gif(file_name, &setw, mf); break;
 #ifdef U_JPEG
 	case FT_JPEG: res = save_jpeg(file_name, &setw); break;
 #endif
@@ -9223,21 +10756,203 @@ int save_mem_image(unsigned char **buf, int *len, ls_settings *settings)
 	return (res);
 }
 
-static void store_image_extras(image_info *image, image_state *state,
-	ls_settings *settings)
+int can_save_anim(int ftype)
 {
-#if U_LCMS
-	/* Apply ICC profile */
-	while (settings->icc_size > 0)
-	{
-		cmsHPROFILE from, to;
-		cmsHTRANSFORM how = NULL;
-		int l = settings->icc_size - sizeof(icHeader);
-		unsigned char *iccdata = settings->icc + sizeof(icHeader);
-
-		/* Do nothing if the profile seems to be the default sRGB one */
-		if ((l == 3016) && (hashf(HASHSEED, iccdata, l) == 0xBA0A8E52UL) &&
-			(hashf(HASH_RND(HASHSEED), iccdata, l) == 0x94C42C77UL)) break;
+	ftype &= FTM_FTYPE;
+	if (ftype == FT_GIF) return (TRUE);
+#ifdef U_WEBPMUX
+	if (ftype == FT_WEBP) return (TRUE);
+#endif
+	return (FALSE);
+}
+
+/* Settings give file type, size, and for GIF, transparent color in rgb_trans;
+ * frames are given as RGB (with alpha for WebP), their delays in gif_delay */
+void *save_anim_start(char *file_name, ls_settings *settings)
+{
+	switch (settings->ftype & FTM_FTYPE)
+	{
+	case FT_GIF: return (gif_anim_start(file_name, settings));
+#ifdef U_WEBPMUX
+	case FT_WEBP: return (webp_anim_start(file_name, settings));
+#endif
+	}
+	return (NULL);
+}
+
+int save_anim_frame(void *anim, ls_settings *settings)
+{
+	switch (settings->ftype & FTM_FTYPE)
+	{
+	case FT_GIF: return (gif_anim_frame(anim, settings));
+#ifdef U_WEBPMUX
+	case FT_WEBP: return (webp_anim_frame(anim, settings));
+#endif
+	}
+	return (-1);
+}
+
+int save_anim_end(void *anim, ls_settings *settings)
+{
+	switch (settings->ftype & FTM_FTYPE)
+	{
+	case FT_GIF: return (gif_anim_end(anim));
+#ifdef U_WEBPMUX
+	case FT_WEBP: return (webp_anim_end(anim));
+#endif
+	}
+	return (-1);
+}
+
+#define SBENCH_W 3840
+#define SBENCH_H 2160
+
+/* Time one save to memory; return size, or 0 if failed */
+static int bench_save(ls_settings *settings, GTimer *timer, double *t)
+{
+	ls_settings w_set = *settings;
+	unsigned char *buf;
+	int len;
+
+	g_timer_start(timer);
+	if (save_mem_image(&buf, &len, &w_set)) return (0);
+	*t = g_timer_elapsed(timer, NULL);
+	free(buf);
+	return (len);
+}
+
+int save_bench()
+{
+	/* File type, TIFF compression, and range of compression levels */
+	static const int tests[][4] = {
+		{ FT_PNG, 0, 0, 9 },
+#ifdef U_TIFF
+		{ FT_TIFF, COMPRESSION_LZW, 0, 0 },
+		{ FT_TIFF, COMPRESSION_ADOBE_DEFLATE, 1, 9 },
+#endif
+		{ FT_NONE } };
+	ls_settings settings;
+	GTimer *timer;
+	char buf[64];
+	unsigned char *mem, *img;
+	double t0, t1;
+	unsigned int seed = 1;
+	int i, j, k, n, l0, l1, sz = SBENCH_W * SBENCH_H;
+
+	if (!(mem = malloc(sz * 4)))
+	{
+		printf("Not enough memory for benchmark\n");
+		return (1);
+	}
+	memset(&settings, 0, sizeof(settings));
+	settings.mode = FS_PNG_SAVE;
+	settings.ftype = FT_PNG;
+	settings.width = SBENCH_W;
+	settings.height = SBENCH_H;
+	settings.bpp = 3;
+	settings.img[CHN_IMAGE] = mem;
+	settings.img[CHN_ALPHA] = mem + sz * 3;
+	settings.xpm_trans = settings.rgb_trans = -1;
+
+	/* Same mix of hard edges, gradients, noise, and alpha as for scaling */
+	img = mem;
+	for (i = 0; i < SBENCH_H; i++)
+	for (j = 0; j < SBENCH_W; j++ , img += 3)
+	{
+		seed = seed * 1103515245 + 12345;
+		n = (seed >> 16) & 0x1F;
+		img[0] = ((i >> 5) ^ (j >> 5)) & 1 ? 0xFF : 0;
+		img[1] = ((i + j) * 0xE0) / (SBENCH_W + SBENCH_H) + n;
+		img[2] = n * 8;
+		settings.img[CHN_ALPHA][i * SBENCH_W + j] =
+			((i / 89 + j / 97) % 3) * 0x7F;
+	}
+
+	printf("Saving %dx%d RGBA image, %d threads\n", SBENCH_W, SBENCH_H,
+		helper_threads());
+	printf("%-28s%10s%10s%8s%12s%12s\n", "Test", "Old, s", "New, s",
+		"Gain", "Old, bytes", "New, bytes");
+	timer = g_timer_new();
+	for (i = 0; tests[i][0]; i++)
+	{
+		settings.ftype = tests[i][0];
+		j = 0;
+#ifdef U_TIFF
+		if (settings.ftype == FT_TIFF)
+		{
+			n = tests[i][1];
+			for (; tiff_formats[j].name &&
+				(tiff_formats[j].id != n); j++);
+			if (!tiff_formats[j].name || !TIFFIsCODECConfigured(n))
+				continue;
+			settings.tiff_type = j;
+		}
+#endif
+		/* Serial save for "old", threaded one for "new" */
+		for (k = tests[i][2]; k <= tests[i][3]; k++)
+		{
+			settings.png_compression = k;
+			if (settings.ftype == FT_PNG)
+				snprintf(buf, sizeof(buf), "PNG level %d", k);
+			else if (!k) snprintf(buf, sizeof(buf), "TIFF %s",
+				tiff_formats[j].name);
+			else snprintf(buf, sizeof(buf), "TIFF %s level %d",
+				tiff_formats[j].name, k);
+			t0 = t1 = 0.0;
+			enc_ref = TRUE;
+			l0 = bench_save(&settings, timer, &t0);
+			enc_ref = FALSE;
+			l1 = bench_save(&settings, timer, &t1);
+			if (!l0 || !l1) printf("%-28s%10s\n", buf, "Failed");
+			else printf("%-28s%10.3f%10.3f%7.2fx%12d%12d\n", buf,
+				t0, t1, t0 / t1, l0, l1);
+		}
+	}
+
+	/* Indexed version: 1:5:2 bits RGB, with ordered dithering */
+	img = mem;
+	for (i = 0; i < SBENCH_H; i++)
+	for (j = 0; j < SBENCH_W; j++ , img += 3)
+	{
+		n = ((i & 3) * 4 + (j & 3)) * 16;
+		mem[i * SBENCH_W + j] = (img[0] & 0x80) +
+			((img[1] * 31 + n) / 255) * 4 + (img[2] * 3 + n) / 255;
+	}
+	settings.ftype = FT_GIF;
+	settings.bpp = 1;
+	settings.colors = 256;
+	settings.pal = mem_pal;
+	settings.img[CHN_ALPHA] = NULL;
+	t0 = t1 = 0.0;
+	settings.gif_small = FALSE;
+	l0 = bench_save(&settings, timer, &t0);
+	settings.gif_small = TRUE;
+	l1 = bench_save(&settings, timer, &t1);
+	/* Here, "old" is the traditional clear-when-full mode */
+	if (!l0 || !l1) printf("%-28s%10s\n", "GIF smaller output", "Failed");
+	else printf("%-28s%10.3f%10.3f%7.2fx%12d%12d\n", "GIF smaller output",
+		t0, t1, t0 / t1, l0, l1);
+	g_timer_destroy(timer);
+
+	free(mem);
+	return (0);
+}
+
+static void store_image_extras(image_info *image, image_state *state,
+	ls_settings *settings)
+{
+#if U_LCMS
+	/* Apply ICC profile */
+	while (settings->icc_size > 0)
+	{
+		cmsHPROFILE from, to;
+		cmsHTRANSFORM how = NULL;
+		int l = settings->icc_size - sizeof(icHeader);
+		unsigned char *iccdata = settings->icc + sizeof(icHeader);
+
+		/* Do nothing if the profile seems to be the default sRGB one */
+		if ((l == 3016) && (hashf(HASHSEED, iccdata, l) == 0xBA0A8E52UL) &&
+			(hashf(HASH_RND(HASHSEED), iccdata, l) == 0x94C42C77UL)) break;
 
 		from = cmsOpenProfileFromMem((void *)settings->icc,
 			settings->icc_size);
@@ -9297,6 +11012,58 @@ static void store_image_extras(image_info *image, image_state *state,
 	image->cols = settings->colors;
 }
 
+/* Call the loader for the format */
+static int load_image_ls(char *file_name, ls_settings *settings, memFILE *mf)
+{
+	int res;
+
+	switch (settings->ftype)
+	{
+	default:
+	case FT_PNG: res = load_png(file_name, settings, mf); break;
+	case FT_GIF: res = load_gif(file_name, settings); break;
+#ifdef U_JPEG
+	case FT_JPEG: res = load_jpeg(file_name, settings); break;
+#endif
+#ifdef HANDLE_JP2
+	case FT_JP2:
+	case FT_J2K: res = load_jpeg2000(file_name, settings); break;
+#endif
+#ifdef U_TIFF
+	case FT_TIFF: res = load_tiff(file_name, settings, mf); break;
+#endif
+#ifdef U_WEBP
+	case FT_WEBP: res = load_webp(file_name, settings); break;
+#endif
+	case FT_BMP: res = load_bmp(file_name, settings, mf); break;
+	case FT_XPM: res = load_xpm(file_name, settings); break;
+	case FT_XBM: res = load_xbm(file_name, settings); break;
+	case FT_LSS: res = load_lss(file_name, settings); break;
+	case FT_TGA: res = load_tga(file_name, settings); break;
+	case FT_PCX: res = load_pcx(file_name, settings); break;
+	case FT_LBM: res = load_lbm(file_name, settings); break;
+	case FT_PBM:
+	case FT_PGM:
+	case FT_PPM:
+	case FT_PAM: res = load_pnm(file_name, settings); break;
+	case FT_PMM: res = load_pmm(file_name, settings, mf); break;
+	case FT_PIXMAP: res = load_pixmap(settings, mf); break;
+	case FT_SVG:
+#ifdef MAY_HANDLE_SVG
+		if (svg_check < 0) svg_check = svg_supported();
+		if (svg_check) res = load_svg(file_name, settings);
+		else
+#endif
+		res = import_svg(file_name, settings); break;
+	/* Palette files */
+	case FT_GPL:
+	case FT_TXT: res = load_txtpal(file_name, settings); break;
+	case FT_PAL:
+	case FT_ACT: res = load_rawpal(file_name, settings); break;
+	}
+	return (res);
+}
+
 static int load_image_x(char *file_name, memFILE *mf, int mode, int ftype,
 	int rw, int rh)
 {
@@ -9326,6 +11093,9 @@ static int load_image_x(char *file_name, memFILE *mf, int mode, int ftype,
 	init_ls_settings(&settings, NULL);
 	settings.req_w = rw;
 	settings.req_h = rh;
+	/* Raster image gets reduced to fit, if it does not */
+	if ((mode != FS_CHANNEL_LOAD) && !(file_formats[ftype].flags & FF_SCALE))
+		settings.lim_w = rw , settings.lim_h = rh;
 	/* Preset delay to -1, to detect animations by its changing */
 	settings.gif_delay = -1;
 #ifdef U_LCMS
@@ -9349,53 +11119,14 @@ static int load_image_x(char *file_name, memFILE *mf, int mode, int ftype,
 	mem_pal_copy(pal, mem_pal_def);
 	settings.colors = mem_pal_def_i;
 
-	switch (ftype)
-	{
-	default:
-	case FT_PNG: res0 = load_png(file_name, &settings, mf); break;
-	case FT_GIF: res0 = load_gif(file_name, &settings); break;
-#ifdef U_JPEG
-	case FT_JPEG: res0 = load_jpeg(file_name, &settings); break;
-#endif
-#ifdef HANDLE_JP2
-	case FT_JP2:
-	case FT_J2K: res0 = load_jpeg2000(file_name, &settings); break;
-#endif
-#ifdef U_TIFF
-	case FT_TIFF: res0 = load_tiff(file_name, &settings, mf); break;
-#endif
-#ifdef U_WEBP
-	case FT_WEBP: res0 = load_webp(file_name, &settings); break;
-#endif
-	case FT_BMP: res0 = load_bmp(file_name, &settings, mf); break;
-	case FT_XPM: res0 = load_xpm(file_name, &settings); break;
-	case FT_XBM: res0 = load_xbm(file_name, &settings); break;
-	case FT_LSS: res0 = load_lss(file_name, &settings); break;
-	case FT_TGA: res0 = load_tga(file_name, &settings); break;
-	case FT_PCX: res0 = load_pcx(file_name, &settings); break;
-	case FT_LBM: res0 = load_lbm(file_name, &settings); break;
-	case FT_PBM:
-	case FT_PGM:
-	case FT_PPM:
-	case FT_PAM: res0 = load_pnm(file_name, &settings); break;
-	case FT_PMM: res0 = load_pmm(file_name, &settings, mf); break;
-	case FT_PIXMAP: res0 = load_pixmap(&settings, mf); break;
-	case FT_SVG:
-#ifdef MAY_HANDLE_SVG
-		if (svg_check < 0) svg_check = svg_supported();
-		if (svg_check) res0 = load_svg(file_name, &settings);
-		else
-#endif
-		res0 = import_svg(file_name, &settings); break;
-	/* Palette files */
-	case FT_GPL:
-	case FT_TXT: res0 = load_txtpal(file_name, &settings); break;
-	case FT_PAL:
-	case FT_ACT: res0 = load_rawpal(file_name, &settings); break;
-	}
+	res0 = load_image_ls(file_name, &settings, mf);
 
 	/* Consider animated GIF a success */
 	res = res0 == FILE_HAS_FRAMES ? 1 : res0;
+	/* Reduce what loader could not */
+	if ((res == 1) && (settings.lim_w || settings.lim_h))
+		reduce_image(&settings);
+	free(settings.reduce);
 	/* Ignore frames beyond first if in-memory (imported clipboard) */
 	if (mf) res0 = res;
 
@@ -9557,6 +11288,339 @@ int load_image_scale(char *file_name, int mode, int ftype, int w, int h)
 	return (load_image_x(file_name, NULL, mode, ftype, w, h));
 }
 
+/* Area-average RGBA image into nw x nh, weighting colour by alpha */
+static unsigned char *scale_rgba(unsigned char *rgba, int w, int h, int nw,
+	int nh)
+{
+	unsigned char *res, *src, *dest;
+	float *tmp, *tp, *acc, lo, hi, k, sx = (float)w / nw, sy = (float)h / nh;
+	int i, j, x, y, l = nw * 4;
+
+	res = malloc((size_t)nh * l);
+	tmp = calloc((size_t)(h + 1) * l, sizeof(float));
+	if (!res || !tmp)
+	{
+		free(res);
+		free(tmp);
+		return (NULL);
+	}
+
+	/* Horizontal pass, into premultiplied floats */
+	for (y = 0; y < h; y++)
+	{
+		src = rgba + (size_t)y * w * 4;
+		tp = tmp + (size_t)y * l;
+		for (x = 0; x < nw; x++ , tp += 4)
+		{
+			lo = x * sx;
+			hi = lo + sx;
+			for (j = lo; (j < hi) && (j < w); j++)
+			{
+				k = ((j + 1 < hi ? j + 1 : hi) - (j > lo ? j : lo)) *
+					src[j * 4 + 3];
+				tp[0] += src[j * 4 + 0] * k;
+				tp[1] += src[j * 4 + 1] * k;
+				tp[2] += src[j * 4 + 2] * k;
+				tp[3] += k;
+			}
+		}
+	}
+
+	/* Vertical pass, and back to bytes */
+	acc = tmp + (size_t)h * l;
+	for (dest = res , y = 0; y < nh; y++)
+	{
+		memset(acc, 0, l * sizeof(float));
+		lo = y * sy;
+		hi = lo + sy;
+		for (j = lo; (j < hi) && (j < h); j++)
+		{
+			k = (j + 1 < hi ? j + 1 : hi) - (j > lo ? j : lo);
+			tp = tmp + (size_t)j * l;
+			for (i = 0; i < l; i++) acc[i] += tp[i] * k;
+		}
+		for (tp = acc , x = 0; x < nw; x++ , tp += 4 , dest += 4)
+		{
+			k = tp[3] > 0 ? 1.0 / tp[3] : 0.0;
+			for (i = 0; i < 3; i++)
+			{
+				j = tp[i] * k + 0.5;
+				dest[i] = j > 255 ? 255 : j;
+			}
+			j = tp[3] / (sx * sy) + 0.5;
+			dest[3] = j > 255 ? 255 : j;
+		}
+	}
+	free(tmp);
+	return (res);
+}
+
+/* Preview of an image file, in RGBA, scaled to fit into size x size; it does
+ * not touch the current image or any other global state, so can be run from a
+ * background thread. Loaders reduce by integer factors only, so the image is
+ * decoded to between 1x and 2x the size, and then resampled to fit exactly,
+ * as other programs reading the thumbnail cache expect */
+unsigned char *load_thumbnail(char *file_name, int ftype, int size, int *w, int *h)
+{
+	png_color pal[256];
+	ls_settings settings;
+	unsigned char *src, *dest, *alpha, *rgba = NULL;
+	int i, k, l, tr, nw, nh, res;
+
+
+	ftype &= FTM_FTYPE;
+	/* Raster images only */
+	if (!(file_formats[ftype].flags & FF_IMAGE) ||
+		(file_formats[ftype].flags & FF_SCALE)) return (NULL);
+#ifdef U_JASPER
+	/* Jasper keeps global state */
+	if ((ftype == FT_JP2) || (ftype == FT_J2K)) return (NULL);
+#endif
+
+	init_ls_settings(&settings, NULL);
+	settings.lim_w = settings.lim_h = size * 2;
+	settings.gif_delay = -1;
+#ifdef U_LCMS
+	settings.icc_size = -1;
+#endif
+	/* Plain malloc()ed channels, same as for exploded frames */
+	settings.mode = FS_EXPLODE_FRAMES;
+	settings.ftype = ftype;
+	settings.pal = pal;
+	settings.hot_x = settings.hot_y = -1;
+	settings.xpm_trans = settings.rgb_trans = -1;
+	settings.silent = TRUE;
+	mem_pal_copy(pal, mem_pal_def);
+	settings.colors = mem_pal_def_i;
+
+	res = load_image_ls(file_name, &settings, NULL);
+	if (res == FILE_HAS_FRAMES) res = 1;
+	if (res == 1) reduce_image(&settings);
+	free(settings.reduce);
+
+	l = settings.width * settings.height;
+	if ((res == 1) && (rgba = malloc(l * 4)))
+	{
+		src = settings.img[CHN_IMAGE];
+		alpha = settings.img[CHN_ALPHA];
+		tr = settings.bpp == 1 ? settings.xpm_trans : settings.rgb_trans;
+		for (dest = rgba , i = 0; i < l; i++ , dest += 4)
+		{
+			if (settings.bpp == 1)
+			{
+				k = src[i];
+				dest[0] = pal[k].red;
+				dest[1] = pal[k].green;
+				dest[2] = pal[k].blue;
+			}
+			else
+			{
+				k = MEM_2_INT(src, i * 3);
+				dest[0] = src[i * 3 + 0];
+				dest[1] = src[i * 3 + 1];
+				dest[2] = src[i * 3 + 2];
+			}
+			dest[3] = alpha ? alpha[i] : k == tr ? 0 : 255;
+		}
+		nw = settings.width;
+		nh = settings.height;
+		if ((nw > size) || (nh > size))
+		{
+			if (nw >= nh) nh = (nh * size + (nw >> 1)) / nw , nw = size;
+			else nw = (nw * size + (nh >> 1)) / nh , nh = size;
+			if (nw < 1) nw = 1;
+			if (nh < 1) nh = 1;
+			src = scale_rgba(rgba, settings.width, settings.height,
+				nw, nh);
+			free(rgba);
+			rgba = src;
+		}
+		*w = nw;
+		*h = nh;
+	}
+	mem_free_chanlist(settings.img);
+	free(settings.icc);
+	return (rgba);
+}
+
+/* Thumbnail files are RGBA PNGs, with text chunks identifying their sources;
+ * "keys" is a NULL-terminated list of key-value pairs which must all match */
+unsigned char *load_thumb_png(char *file_name, char **keys, int *w, int *h)
+{
+	png_structp png_ptr;
+	png_infop info_ptr = NULL;
+	png_textp text;
+	png_bytep *volatile rows = NULL;
+	unsigned char *volatile rgba = NULL;
+	png_uint_32 pw, ph;
+	FILE *fp;
+	int i, j, n, bit_depth, color_type;
+
+
+	if (!(fp = fopen(file_name, "rb"))) return (NULL);
+	png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (!png_ptr) goto fail;
+	info_ptr = png_create_info_struct(png_ptr);
+	if (!info_ptr) goto fail2;
+	if (setjmp(png_jmpbuf(png_ptr)))
+	{
+		free(rgba);
+		rgba = NULL;
+		goto fail2;
+	}
+
+	png_init_io(png_ptr, fp);
+	png_read_info(png_ptr, info_ptr);
+	png_get_IHDR(png_ptr, info_ptr, &pw, &ph, &bit_depth, &color_type,
+		NULL, NULL, NULL);
+	/* Thumbnails are never big */
+	if ((pw > THUMB_MAX) || (ph > THUMB_MAX)) goto fail2;
+
+	/* Convert everything to 8-bit RGBA */
+	png_set_strip_16(png_ptr);
+	png_set_expand(png_ptr);
+	png_set_gray_to_rgb(png_ptr);
+	png_set_filler(png_ptr, 0xFF, PNG_FILLER_AFTER);
+	png_set_interlace_handling(png_ptr);
+	png_read_update_info(png_ptr, info_ptr);
+	if (png_get_rowbytes(png_ptr, info_ptr) != pw * 4) goto fail2;
+
+	rows = malloc(ph * sizeof(png_bytep));
+	rgba = malloc(pw * ph * 4);
+	if (!rows || !rgba)
+	{
+		free(rgba);
+		rgba = NULL;
+		goto fail2;
+	}
+	for (i = 0; i < ph; i++) rows[i] = rgba + i * pw * 4;
+	png_read_image(png_ptr, rows);
+	png_read_end(png_ptr, info_ptr);
+
+	/* Check if the file is what was asked for */
+	n = png_get_text(png_ptr, info_ptr, &text, NULL);
+	for (i = 0; keys[i]; i += 2)
+	{
+		for (j = 0; (j < n) && strcmp(text[j].key, keys[i]); j++);
+		if ((j >= n) || strcmp(text[j].text, keys[i + 1])) break;
+	}
+	if (keys[i])
+	{
+		free(rgba);
+		rgba = NULL;
+	}
+	else *w = pw , *h = ph;
+
+fail2:	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+	free(rows);
+fail:	fclose(fp);
+	return (rgba);
+}
+
+int save_thumb_png(char *file_name, char **keys, unsigned char *rgba, int w, int h)
+{
+	png_text text[THUMB_KEYS];
+	png_structp png_ptr;
+	png_infop info_ptr = NULL;
+	FILE *fp;
+	int i, res = -1;
+
+
+	if (!(fp = fopen(file_name, "wb"))) return (-1);
+	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (!png_ptr) goto fail;
+	info_ptr = png_create_info_struct(png_ptr);
+	if (!info_ptr) goto fail2;
+	if (setjmp(png_jmpbuf(png_ptr))) goto fail2;
+
+	png_init_io(png_ptr, fp);
+	png_set_IHDR(png_ptr, info_ptr, w, h, 8, PNG_COLOR_TYPE_RGB_ALPHA,
+		PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+		PNG_FILTER_TYPE_DEFAULT);
+	memset(text, 0, sizeof(text));
+	for (i = 0; (i < THUMB_KEYS) && keys[i * 2]; i++)
+	{
+		text[i].compression = PNG_TEXT_COMPRESSION_NONE;
+		text[i].key = keys[i * 2];
+		text[i].text = keys[i * 2 + 1];
+	}
+	png_set_text(png_ptr, info_ptr, text, i);
+	png_write_info(png_ptr, info_ptr);
+	for (i = 0; i < h; i++) png_write_row(png_ptr, rgba + i * w * 4);
+	png_write_end(png_ptr, info_ptr);
+	res = 0;
+
+fail2:	png_destroy_write_struct(&png_ptr, &info_ptr);
+fail:	fclose(fp);
+	return (res);
+}
+
+/* Layers in a layers file are stored as PMM, deflated each on its own so that
+ * they can be unpacked in parallel, or when needed. Neither function touches
+ * any global state */
+unsigned char *pack_layer(ls_settings *settings, size_t *len, size_t *ulen)
+{
+	memFILE mf;
+	unsigned char *res = NULL;
+	uLongf dl;
+	size_t l;
+	int i;
+
+	/* Reserve enough for the whole image, to not reallocate */
+	l = (size_t)settings->width * settings->height * settings->bpp + 1024;
+	for (i = CHN_ALPHA; i < NUM_CHANNELS; i++)
+		if (settings->img[i]) l += (size_t)settings->width * settings->height;
+	if (l > MEMFILE_MAX) return (NULL);
+	memset(&mf, 0, sizeof(mf));
+	if (!(mf.m.buf = malloc(mf.m.size = l))) return (NULL);
+
+	settings->ftype = FT_PMM;
+	settings->silent = TRUE;
+	if (!save_image_x(NULL, settings, &mf) &&
+		(res = malloc(dl = compressBound(mf.top))) &&
+		(compress2(res, &dl, (void *)mf.m.buf, mf.top,
+		settings->png_compression) == Z_OK))
+	{
+		unsigned char *tmp = realloc(res, dl);
+		if (tmp) res = tmp;
+		*len = dl;
+		*ulen = mf.top;
+	}
+	else
+	{
+		free(res);
+		res = NULL;
+	}
+	free(mf.m.buf);
+	return (res);
+}
+
+/* Channels get allocated anew, for caller to validate and use */
+int unpack_layer(unsigned char *buf, size_t len, size_t ulen,
+	ls_settings *settings)
+{
+	memFILE mf;
+	uLongf dl = ulen;
+	int res = FILE_LIB_ERROR;
+
+	if (ulen > MEMFILE_MAX) return (-1);
+	memset(&mf, 0, sizeof(mf));
+	if (!(mf.m.buf = malloc(ulen))) return (FILE_MEM_ERROR);
+	if ((uncompress((void *)mf.m.buf, &dl, buf, len) == Z_OK) &&
+		(dl == ulen))
+	{
+		mf.top = mf.m.size = ulen;
+		settings->ftype = FT_PMM;
+		settings->silent = TRUE;
+		res = load_pmm(NULL, settings, &mf);
+		/* Only one frame is expected */
+		if (res == FILE_HAS_FRAMES) res = 1;
+		if (res == 1) map_rgb_trans(settings);
+	}
+	free(mf.m.buf);
+	return (res);
+}
+
 // !!! The only allowed modes for now are FS_LAYER_LOAD and FS_EXPLODE_FRAMES
 // !!! Load from memblock is not supported yet
 static int load_frames_x(ani_settings *ani, int ani_mode, char *file_name,
@@ -9627,26 +11691,146 @@ int load_frameset(frameset *frames, int ani_mode, char *file_name, int mode,
 	return (res);
 }
 
+static void write_out_job(frame_out *fo)
+{
+	fo->res = save_image(fo->name, &fo->settings);
+	mem_free_chanlist(fo->settings.img);
+	memset(fo->settings.img, 0, sizeof(chanlist));
+}
+
+DEF_MUTEX(out_lock);
+
+/* Encoder thread: take queued frames in order, till the queue gets closed */
+static void write_out_worker(ani_settings *ani)
+{
+	frame_out *fo;
+	int end;
+
+	while (TRUE)
+	{
+		LOCK_MUTEX(out_lock);
+		end = ani->oend;
+		fo = ani->outq + ani->otake;
+		if (fo->state != FO_QUEUED) fo = NULL;
+		else
+		{
+			fo->state = FO_BUSY;
+			ani->otake = (ani->otake + 1) % ani->maxout;
+		}
+		UNLOCK_MUTEX(out_lock);
+		if (!fo)
+		{
+			if (end) break;
+			thread_yield();
+			continue;
+		}
+		write_out_job(fo);
+		LOCK_MUTEX(out_lock);
+		fo->state = FO_DONE;
+		UNLOCK_MUTEX(out_lock);
+	}
+}
+
+/* Count written frames in order, freeing their slots; unless "all", only
+ * wait till there is room for one more frame */
+static int collect_out_frames(ani_settings *ani, int all)
+{
+	frame_out *fo;
+	int n;
+
+	while (ani->nout)
+	{
+		fo = ani->outq + ani->ohead;
+		LOCK_MUTEX(out_lock);
+		n = fo->state;
+		UNLOCK_MUTEX(out_lock);
+		if (n != FO_DONE)
+		{
+			if (!all && (ani->nout < ani->maxout) &&
+				(ani->outmem < FRAMES_OUT_MEM)) break;
+			thread_yield();
+			continue;
+		}
+		/* Sequence ends at the first failure */
+		if (!ani->error && !(ani->error = fo->res)) ani->cnt++;
+		ani->outmem -= fo->mem;
+		LOCK_MUTEX(out_lock);
+		fo->state = FO_FREE;
+		UNLOCK_MUTEX(out_lock);
+		ani->ohead = (ani->ohead + 1) % ani->maxout;
+		ani->nout--;
+	}
+	return (ani->error);
+}
+
+/* Put a frame into the queue, copying its channels if not given them */
+static int queue_out_frame(ani_settings *ani, ls_settings *w_set, char *name,
+	int own)
+{
+	frame_out *fo;
+	size_t l, sz = (size_t)w_set->width * w_set->height;
+	int i;
+
+	if (collect_out_frames(ani, FALSE)) /* No use going on */
+	{
+		if (own) mem_free_chanlist(w_set->img);
+		return (ani->error);
+	}
+
+	fo = ani->outq + (ani->ohead + ani->nout) % ani->maxout;
+	fo->settings = *w_set;
+	fo->settings.icc = NULL; // Not for saving
+	if (w_set->pal)
+	{
+		mem_pal_copy(fo->pal, w_set->pal);
+		fo->settings.pal = fo->pal;
+	}
+	strncpy0(fo->name, name, sizeof(fo->name));
+	if (!own) memset(fo->settings.img, 0, sizeof(chanlist));
+	for (fo->mem = 0 , i = 0; i < NUM_CHANNELS; i++)
+	{
+		if (!w_set->img[i]) continue;
+		l = i == CHN_IMAGE ? sz * w_set->bpp : sz;
+		if (!own)
+		{
+			if (!(fo->settings.img[i] = malloc(l)))
+			{
+				mem_free_chanlist(fo->settings.img);
+				memset(fo->settings.img, 0, sizeof(chanlist));
+				return (FILE_MEM_ERROR);
+			}
+			memcpy(fo->settings.img[i], w_set->img[i], l);
+		}
+		fo->mem += l;
+	}
+	ani->outmem += fo->mem;
+	ani->nout++;
+	LOCK_MUTEX(out_lock);
+	fo->state = FO_QUEUED;
+	UNLOCK_MUTEX(out_lock);
+	return (0);
+}
+
 /* Write out the last frame to indexed sequence, and delete it */
 static int write_out_frame(char *file_name, ani_settings *ani, ls_settings *f_set)
 {
 	ls_settings w_set;
 	image_frame *frame = ani->fset.frames + ani->fset.cnt - 1;
 	char new_name[PATHBUF + 32], *tmp;
-	int n, deftype = ani->desttype, res;
+	int n, deftype = ani->desttype, res, cnt = ani->cnt + ani->nout;
 
 
 	/* Show progress, for unknown final count */
-	n = nextpow2(ani->cnt);
+	n = nextpow2(cnt);
 	if (n < 16) n = 16;
-	progress_update((float)ani->cnt / n);
+	progress_update((float)cnt / n);
 
 	tmp = strrchr(file_name, DIR_SEP);
 	if (!tmp) tmp = file_name;
 	else tmp++;
 	file_in_dir(new_name, ani->destdir, tmp, PATHBUF);
 	tmp = new_name + strlen(new_name);
-	sprintf(tmp, ".%03d", ani->cnt);
+	sprintf(tmp, ".%03d", cnt);
 
 	if (f_set) w_set = *f_set;
 	else
@@ -9669,6 +11853,14 @@ static int write_out_frame(char *file_name, ani_settings *ani, ls_settings *f_se
 	}
 	w_set.mode = ani->mode; // Only FS_EXPLODE_FRAMES for now
 
+	if (ani->maxout) /* Leave it to the encoder threads */
+	{
+		res = queue_out_frame(ani, &w_set, new_name, !!f_set);
+		if (f_set) memset(f_set->img, 0, sizeof(chanlist)); // Given away
+		else frame->flags |= FM_NUKE;
+		return (res);
+	}
+
 	res = ani->error = save_image(new_name, &w_set);
 	if (!res) ani->cnt++;
 
@@ -9691,20 +11883,90 @@ static void warn_miss(int miss, int total, int ftype)
 	g_free(txt);
 }
 
+typedef struct {
+	ani_settings *ani;
+	char *file_name;
+	int ani_mode, ftype;
+	int *res;
+} explode_job;
+
+/* Main thread decodes and composites frames, the others write them out */
+static void explode_thread(tcb *thread)
+{
+	explode_job *ej = thread->data;
+	ani_settings *ani = ej->ani;
+	int i, n;
+
+	if (thread->index) write_out_worker(ani);
+	else
+	{
+		/* Helper threads might be busy elsewhere */
+		for (i = 1 , n = 0; i < thread->tdata->count; i++)
+			n += !thread->tdata->threads[i]->stopped;
+		if (!n) ani->maxout = 0; // Write them out here then
+		*ej->res = load_frames_x(ani, ej->ani_mode, ej->file_name,
+			FS_EXPLODE_FRAMES, ej->ftype);
+		/* Close the queue, and write out what is still in it, even
+		 * after a load failure */
+		LOCK_MUTEX(out_lock);
+		ani->oend = TRUE;
+		UNLOCK_MUTEX(out_lock);
+		if (collect_out_frames(ani, TRUE) && (*ej->res == 1))
+			*ej->res = -1;
+	}
+	thread_done(thread);
+}
+
 int explode_frames(char *dest_path, int ani_mode, char *file_name, int ftype,
 	int desttype)
 {
 	ani_settings ani;
-	int res;
+	explode_job ej;
+	threaddata *tdata = NULL;
+	int n, res;
 
 
 	memset(&ani, 0, sizeof(ani_settings));
 	ani.desttype = desttype;
 	ani.destdir = dest_path;
 
+	/* Frames get composited in order, while written out on other cores */
+	n = helper_threads();
+#ifdef U_JASPER
+	/* JasPer is not known to be thread-safe */
+	if (((desttype & FTM_FTYPE) == FT_JP2) ||
+		((desttype & FTM_FTYPE) == FT_J2K)) n = 1;
+#endif
+	if (n > 1)
+	{
+		ej.ani = &ani;
+		ej.file_name = file_name;
+		ej.ani_mode = ani_mode;
+		ej.ftype = ftype;
+		ej.res = &res;
+		tdata = talloc(MA_ALIGN_DEFAULT, n, &ej, sizeof(ej), NULL, NULL);
+	}
+	/* Queue holds 2 frames per encoder thread */
+	if (tdata && ((tdata->count < 2) ||
+		!(ani.outq = calloc((tdata->count - 1) * 2, sizeof(frame_out)))))
+	{
+		free(tdata);
+		tdata = NULL;
+	}
+
 	progress_init(_("Explode frames"), 0);
 	progress_update(0.0);
-	res = load_frames_x(&ani, ani_mode, file_name, FS_EXPLODE_FRAMES, ftype);
+	if (!tdata) res = load_frames_x(&ani, ani_mode, file_name,
+		FS_EXPLODE_FRAMES, ftype);
+	else
+	{
+		ani.maxout = (tdata->count - 1) * 2;
+		tdata->chunks = -1; // Threads run till the queue is closed
+		tdata->silent = TRUE;
+		launch_threads(explode_thread, tdata, NULL, tdata->count);
+		free(tdata);
+	}
+	free(ani.outq);
 	progress_update(1.0);
 	if (res == 1); // Everything went OK
 	else if (res == FILE_MEM_ERROR); // Report memory problem
@@ -9859,8 +12121,7 @@ static int do_detect_format(char *name, FILE *fp)
 		if (!stop || (stop - buf > 32)) return (FT_NONE);
 		i = atoi(++stop);
 		if (i == 1) return (FT_LAYERS1);
-/* !!! Not implemented yet */
-//		if (i == 2) return (FT_LAYERS2);
+		if (i == 2) return (FT_LAYERS2);
 		return (FT_NONE);
 	}
 
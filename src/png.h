@@ -148,6 +148,7 @@ typedef struct {
 	int xpm_trans;
 	int hot_x, hot_y;
 	int req_w, req_h; // Size request for scalable formats
+	int lim_w, lim_h; // Size limit for raster formats (reduced decode)
 	int jpeg_quality;
 	int png_compression;
 	int lzma_preset;
@@ -157,7 +158,7 @@ typedef struct {
 	int jp2_rate;
 	int webp_preset, webp_quality, webp_compression;
 	int lbm_pack, lbm_pbm;
-	int gif_delay;
+	int gif_delay, gif_small;
 	int rgb_trans;
 	int silent;
 	/* Image data */
@@ -168,6 +169,7 @@ typedef struct {
 	/* Extra data */
 	int icc_size;
 	char *icc;
+	void *reduce; // Reduced decode state
 } ls_settings;
 
 int silence_limit, jpeg_quality, png_compression;
@@ -175,6 +177,7 @@ int tga_RLE, tga_565, tga_defdir, jp2_rate;
 int lzma_preset, zstd_level, tiff_predictor, tiff_rtype, tiff_itype, tiff_btype;
 int webp_preset, webp_quality, webp_compression;
 int lbm_mask, lbm_untrans, lbm_pack, lbm_pbm;
+int gif_small;
 int apply_icc;
 
 int file_type_by_ext(char *name, guint32 mask);
@@ -186,13 +189,32 @@ int load_image(char *file_name, int mode, int ftype);
 int load_mem_image(unsigned char *buf, int len, int mode, int ftype);
 int load_image_scale(char *file_name, int mode, int ftype, int w, int h);
 
+/* Previews of image files in RGBA, and thumbnail files to store them in */
+#define THUMB_MAX  1024 /* Biggest thumbnail file to accept */
+#define THUMB_KEYS 8 /* Max text chunks in thumbnail file */
+unsigned char *load_thumbnail(char *file_name, int ftype, int size, int *w, int *h);
+unsigned char *load_thumb_png(char *file_name, char **keys, int *w, int *h);
+int save_thumb_png(char *file_name, char **keys, unsigned char *rgba, int w, int h);
+
+/* Layer images in layers file */
+unsigned char *pack_layer(ls_settings *settings, size_t *len, size_t *ulen);
+int unpack_layer(unsigned char *buf, size_t len, size_t ulen,
+	ls_settings *settings);
+
 // !!! The only allowed mode for now is FS_LAYER_LOAD
 int load_frameset(frameset *frames, int ani_mode, char *file_name, int mode,
 	int ftype);
 int explode_frames(char *dest_path, int ani_mode, char *file_name, int ftype,
 	int desttype);
 
+/* Animated files written in one go, frame by frame */
+int can_save_anim(int ftype);
+void *save_anim_start(char *file_name, ls_settings *settings);
+int save_anim_frame(void *anim, ls_settings *settings);
+int save_anim_end(void *anim, ls_settings *settings);
+
 int export_undo(char *file_name, ls_settings *settings);
+int save_bench();	// Time serial vs threaded PNG and TIFF encoding
 int export_ascii ( char *file_name );
 
 int detect_file_format(char *name, int need_palette);
@@ -142,6 +142,9 @@ static int tablet_preview(pref_dd *dt, void **wdata, int what, void **where,
 
 static char *xchans[NUM_CHANNELS];
 
+static char *blur_engines[] = { _("Double"), _("Float"), _("Fixed-point"),
+	NULL };
+
 ///	V-CODE
 
 #define WBbase pref_dd
@@ -159,19 +162,21 @@ static void *pref_code[] = {
 ///	---- TAB1 - GENERAL
 	PAGE(_("General")), GROUPN,
 #ifdef U_THREADS
-	TABLE2(6),
+	TABLE2(8),
 	TSPINv(_("Max threads (0 to autodetect)"), maxthreads, 0, 256),
 	TSPINv(_("Min kpixels per render thread"), kpix_threads,
 		16, (MAX_WIDTH * MAX_HEIGHT + 1023) / 1024),
 #define XROWS 2
 #else
-	TABLE2(4),
+	TABLE2(6),
 #define XROWS 0
 #endif
 	TSPINv(_("Max memory used for undo (MB)"), mem_undo_limit, 1, 2048),
+	TSPINv(_("Max disk space used for undo (MB)"), mem_undo_spill, 0, 65536),
 	TSPINa(_("Max undo levels"), undo_depth),
 	TSPINv(_("Communal layer undo space (%)"), mem_undo_common, 0, 100),
-	TLHBOXpl(4, 0, 3 + XROWS, 2),
+	TOPTv(_("Gaussian blur precision"), blur_engines, 0, blur_engine),
+	TLHBOXpl(4, 0, 5 + XROWS, 2),
 	MLABEL(_("Bayer master pattern")), XLENTRY(pattern, 48),
 	WDONE,
 	WDONE,
@@ -196,10 +201,11 @@ static void *pref_code[] = {
 #endif
 ///	---- TAB3 - INTERFACE
 	PAGE(_("Interface")),
-	TABLE2(3),
+	TABLE2(4),
 	TSPINv(_("Greyscale backdrop"), mem_background, 0, 255),
 	TSPINv(_("Selection nudge pixels"), mem_nudge, 2, MAX_WIDTH),
 	TSPINv(_("Max Pan Window Size"), max_pan, 64, 256),
+	TSPINv(_("Max memory for layer composites (MB)"), lcache_mb, 0, 2048),
 	WDONE,
 	CHECKv(_("Display clipboard while pasting"), show_paste),
 	CHECKv(_("Mouse cursor = Tool"), cursor_tool),
@@ -231,6 +237,7 @@ static void *pref_code[] = {
 	CHECKv(_("TGA RLE Compression"), tga_RLE),
 	CHECKv(_("Read 16-bit TGAs as 5:6:5 BGR"), tga_565),
 	CHECKv(_("Write TGAs in bottom-up row order"), tga_defdir),
+	CHECKv(_("Smaller GIF files"), gif_small),
 	CHECKv(_("Undoable image loading"), undo_load),
 #ifdef U_LCMS
 	CHECKv(_("Apply colour profile"), apply_icc),
@@ -0,0 +1,1431 @@
+/*	simd.c
+	Copyright (C) 2026 The mtPaint Authors
+
+	This file is part of mtPaint.
+
+	mtPaint is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	mtPaint is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with mtPaint in the file COPYING.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "simd.h"
+
+/* Vector versions of the innermost compositing loops. Each has to produce
+ * exactly the same bytes as the plain C one, which is the reference; which
+ * version gets used is decided at runtime, once */
+
+/* x86 code for everything above baseline is compiled with target attributes,
+ * so that a generic build can use it when the CPU allows */
+#if (defined(__x86_64__) || defined(__i386__)) && \
+	(defined(__clang__) || (defined(__GNUC__) && (__GNUC__ >= 5)))
+#define SIMD_X86
+#include <immintrin.h>
+#define TARGET(X) __attribute__ ((target (X)))
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define SIMD_ARM
+#include <arm_neon.h>
+#endif
+
+typedef void (*blend_func)(unsigned char *dest, unsigned char *src,
+	unsigned char *op, int len);
+typedef void (*overlay_func)(unsigned char *dest, unsigned char **src, int *op,
+	unsigned short (*pat)[48], int n, int len);
+typedef void (*maddf_func)(float *dest, float *src0, float *src1, float k,
+	int len);
+typedef void (*madds_func)(unsigned int *dest, unsigned short *src0,
+	unsigned short *src1, int k, int len);
+typedef void (*boxf_func)(float *dest, float *sum, float *add, float *sub,
+	float mult, int len);
+typedef void (*boxs_func)(unsigned short *dest, int *sum, unsigned short *add,
+	unsigned short *sub, float mult, int len);
+typedef void (*sumf_func)(float *dest, float **src, float *k, int n, int len);
+typedef void (*filterf_func)(float *dest, float *src, fstep *f, int l);
+typedef void (*floatb_func)(float *dest, unsigned char *src, int len);
+typedef void (*expandf_func)(float *dest, float *rgb, unsigned char *alpha,
+	int len);
+typedef void (*storef_func)(unsigned char *dest, unsigned char *alpha,
+	float *src, int len, int l);
+typedef void (*distd_func)(double *dest, double *v, double *xyz, int n,
+	int type);
+
+/* Colour repeated for 16 pixels, so that vector code can load the pattern
+ * for any 8 or 16 bytes at 8-byte aligned offsets from it */
+static void make_pattern(unsigned short (*pat)[48], unsigned char *rgb, int n)
+{
+	int i, j;
+
+	for (i = 0; i < n; i++)
+	for (j = 0; j < 48; j++) pat[i][j] = rgb[i * 3 + j % 3];
+}
+
+/// PLAIN C
+
+static void blend_c(unsigned char *dest, unsigned char *src, unsigned char *op,
+	int len)
+{
+	int i, j;
+
+	for (i = 0; i < len; i++)
+	{
+		j = 255 * dest[i] + op[i] * (src[i] - dest[i]);
+		dest[i] = (j + (j >> 8) + 1) >> 8;
+	}
+}
+
+static void overlay_c(unsigned char *dest, unsigned char **src, int *op,
+	unsigned short (*pat)[48], int n, int len)
+{
+	int i, j, c, t0, t;
+
+	for (i = 0; i < len; i++)
+	{
+		t0 = t = 0;
+		for (c = 0; c < n; c++)
+		{
+			j = op[c] * src[c][i];
+			t0 += j;
+			t += j * pat[c][i % 3];
+		}
+		t += ((256 * 255) - t0) * dest[i];
+		dest[i] = (t + (t >> 8) + 0x100) >> 16;
+	}
+}
+
+/* Do the bytes left over from vector loop, from offset i on */
+static void overlay_tail(unsigned char *dest, unsigned char **src, int *op,
+	unsigned short (*pat)[48], int n, int i, int len)
+{
+	unsigned short tp[3][48];
+	unsigned char *s[3];
+	int c;
+
+	for (c = 0; c < n; c++)
+	{
+		s[c] = src[c] + i;
+		memcpy(tp[c], pat[c] + i % 3, 3 * sizeof(tp[0][0]));
+	}
+	overlay_c(dest + i, s, op, tp, n, len - i);
+}
+
+/* Blur kernels: a symmetric pair of taps, and a running box sum step */
+
+static void madd_floats_c(float *dest, float *src0, float *src1, float k,
+	int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++) dest[i] += (src0[i] + src1[i]) * k;
+}
+
+static void madd_shorts_c(unsigned int *dest, unsigned short *src0,
+	unsigned short *src1, int k, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		dest[i] += src0[i] * (unsigned)k + src1[i] * (unsigned)k;
+}
+
+static void box_floats_c(float *dest, float *sum, float *add, float *sub,
+	float mult, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+	{
+		sum[i] += add[i] - sub[i];
+		dest[i] = sum[i] * mult;
+	}
+}
+
+static void box_shorts_c(unsigned short *dest, int *sum, unsigned short *add,
+	unsigned short *sub, float mult, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+	{
+		sum[i] += add[i] - sub[i];
+		dest[i] = (int)((float)sum[i] * mult + 0.5f);
+	}
+}
+
+/* Resampling kernels: vertical pass across pixels, and horizontal one across
+ * channels of each pixel */
+
+/* Do the values from offset i on */
+static void sum_tail(float *dest, float **src, float *k, int n, int i, int len)
+{
+	float acc;
+	int j;
+
+	for (; i < len; i++)
+	{
+		acc = dest[i];
+		for (j = 0; j < n; j++) acc += src[j][i] * k[j];
+		dest[i] = acc;
+	}
+}
+
+static void sum_floats_c(float *dest, float **src, float *k, int n, int len)
+{
+	sum_tail(dest, src, k, n, 0, len);
+}
+
+/* Odd taps get summed apart from even ones, so that vector code has more
+ * independent additions to do at once */
+static void filter_floats_c(float *dest, float *src, fstep *f, int l)
+{
+	float acc[2][8], *a, *s;
+	int i, j, n;
+
+	if (l == 1) /* Not worth vectorizing */
+	{
+		for (; f[1].k; f++)
+		{
+			acc[0][0] = acc[1][0] = 0.0f;
+			s = src + f->idx;
+			n = f[1].k - f->k;
+			for (j = 0; j < n - 1; j += 2)
+			{
+				acc[0][0] += s[j] * f->k[j];
+				acc[1][0] += s[j + 1] * f->k[j + 1];
+			}
+			if (j < n) acc[0][0] += s[j] * f->k[j];
+			*dest++ = acc[0][0] + acc[1][0];
+		}
+		return;
+	}
+	for (; f[1].k; f++ , dest += l)
+	{
+		for (i = 0; i < l; i++) acc[0][i] = acc[1][i] = 0.0f;
+		s = src + f->idx * l;
+		n = f[1].k - f->k;
+		for (j = 0; j < n; j++ , s += l)
+		{
+			a = acc[j & 1];
+			for (i = 0; i < l; i++) a[i] += s[i] * f->k[j];
+		}
+		for (i = 0; i < l; i++) dest[i] = acc[0][i] + acc[1][i];
+	}
+}
+
+static void float_bytes_c(float *dest, unsigned char *src, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++) dest[i] = src[i];
+}
+
+static void expand_floats_c(float *dest, float *rgb, unsigned char *alpha,
+	int len)
+{
+	float a;
+	int i;
+
+	for (i = 0; i < len; i++ , rgb += 3)
+	{
+		dest[0] = rgb[0];
+		dest[1] = rgb[1];
+		dest[2] = rgb[2];
+		dest[3] = 0.0f;
+		dest += 4;
+		if (!alpha) continue;
+		a = alpha[i];
+		dest[0] = rgb[0] * a;
+		dest[1] = rgb[1] * a;
+		dest[2] = rgb[2] * a;
+		dest[3] = a;
+		dest += 4;
+	}
+}
+
+static void store_floats_c(unsigned char *dest, unsigned char *alpha,
+	float *src, int len, int l)
+{
+	float *sp, m;
+	int i, j, k, n = l == 1 ? 1 : 3;
+
+	for (i = 0; i < len; i++ , src += l)
+	{
+		sp = src;
+		m = 1.0f;
+		if (l == 8)
+		{
+			j = (int)rintf(src[7]);
+			alpha[i] = j = j < 0 ? 0 : j > 0xFF ? 0xFF : j;
+			if (j) sp = src + 4 , m = 1.0f / src[7];
+		}
+		for (k = 0; k < n; k++)
+		{
+			j = (int)rintf(sp[k] * m);
+			*dest++ = j < 0 ? 0 : j > 0xFF ? 0xFF : j;
+		}
+	}
+}
+
+/* Same calculations in same order as distance functions in memory.c */
+static void distance_xyz(double *dest, double *v, double *x, double *y,
+	double *z, int n, int type)
+{
+	double dx, dy, dz;
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		dx = fabs(v[0] - x[i]);
+		dy = fabs(v[1] - y[i]);
+		dz = fabs(v[2] - z[i]);
+		if (type == 2) dx = sqrt(dx * dx + dy * dy + dz * dz);
+		else if (type == 1) dx = dx + dy + dz;
+		else
+		{
+			if (dx < dy) dx = dy;
+			if (dx < dz) dx = dz;
+		}
+		dest[i] = dx;
+	}
+}
+
+static void distance_doubles_c(double *dest, double *v, double *xyz, int n,
+	int type)
+{
+	distance_xyz(dest, v, xyz, xyz + n, xyz + n * 2, n, type);
+}
+
+#ifdef SIMD_X86
+
+/// SSE2
+
+static TARGET("sse2") __m128i blend8_sse2(__m128i d, __m128i s, __m128i o)
+{
+	__m128i j;
+
+	/* 255 * d + o * (s - d) == d * (255 - o) + s * o, which fits in 16 bits */
+	j = _mm_add_epi16(_mm_mullo_epi16(d, _mm_sub_epi16(
+		_mm_set1_epi16(255), o)), _mm_mullo_epi16(s, o));
+	j = _mm_add_epi16(_mm_add_epi16(j, _mm_srli_epi16(j, 8)),
+		_mm_set1_epi16(1));
+	return (_mm_srli_epi16(j, 8));
+}
+
+static TARGET("sse2") void blend_sse2(unsigned char *dest, unsigned char *src,
+	unsigned char *op, int len)
+{
+	__m128i d, s, o, z = _mm_setzero_si128();
+	int i;
+
+	for (i = 0; i <= len - 16; i += 16)
+	{
+		d = _mm_loadu_si128((void *)(dest + i));
+		s = _mm_loadu_si128((void *)(src + i));
+		o = _mm_loadu_si128((void *)(op + i));
+		d = _mm_packus_epi16(
+			blend8_sse2(_mm_unpacklo_epi8(d, z),
+				_mm_unpacklo_epi8(s, z), _mm_unpacklo_epi8(o, z)),
+			blend8_sse2(_mm_unpackhi_epi8(d, z),
+				_mm_unpackhi_epi8(s, z), _mm_unpackhi_epi8(o, z)));
+		_mm_storeu_si128((void *)(dest + i), d);
+	}
+	blend_c(dest + i, src + i, op + i, len - i);
+}
+
+/* Do 8 bytes at offset i */
+static TARGET("sse2") __m128i overlay8_sse2(__m128i d, unsigned char **src,
+	int *op, unsigned short (*pat)[48], int n, int i, __m128i z)
+{
+	__m128i v, w, p, l, h, t0 = z, tl = z, th = z;
+	int c;
+
+	for (c = 0; c < n; c++)
+	{
+		v = _mm_unpacklo_epi8(_mm_loadl_epi64((void *)(src[c] + i)), z);
+		w = _mm_mullo_epi16(v, _mm_set1_epi16(op[c]));
+		t0 = _mm_add_epi16(t0, w);
+		p = _mm_loadu_si128((void *)(pat[c] + i % 48));
+		l = _mm_mullo_epi16(w, p);
+		h = _mm_mulhi_epu16(w, p);
+		tl = _mm_add_epi32(tl, _mm_unpacklo_epi16(l, h));
+		th = _mm_add_epi32(th, _mm_unpackhi_epi16(l, h));
+	}
+	w = _mm_sub_epi16(_mm_set1_epi16(256 * 255), t0);
+	l = _mm_mullo_epi16(w, d);
+	h = _mm_mulhi_epu16(w, d);
+	tl = _mm_add_epi32(tl, _mm_unpacklo_epi16(l, h));
+	th = _mm_add_epi32(th, _mm_unpackhi_epi16(l, h));
+	v = _mm_set1_epi32(0x100);
+	tl = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(tl,
+		_mm_srli_epi32(tl, 8)), v), 16);
+	th = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(th,
+		_mm_srli_epi32(th, 8)), v), 16);
+	return (_mm_packs_epi32(tl, th));
+}
+
+static TARGET("sse2") void overlay_sse2(unsigned char *dest, unsigned char **src,
+	int *op, unsigned short (*pat)[48], int n, int len)
+{
+	__m128i d, z = _mm_setzero_si128();
+	int i;
+
+	for (i = 0; i <= len - 16; i += 16)
+	{
+		d = _mm_loadu_si128((void *)(dest + i));
+		d = _mm_packus_epi16(
+			overlay8_sse2(_mm_unpacklo_epi8(d, z), src, op, pat, n, i, z),
+			overlay8_sse2(_mm_unpackhi_epi8(d, z), src, op, pat, n, i + 8, z));
+		_mm_storeu_si128((void *)(dest + i), d);
+	}
+	overlay_tail(dest, src, op, pat, n, i, len);
+}
+
+static TARGET("sse2") void madd_floats_sse2(float *dest, float *src0,
+	float *src1, float k, int len)
+{
+	__m128 kk = _mm_set1_ps(k);
+	int i;
+
+	for (i = 0; i <= len - 4; i += 4)
+		_mm_storeu_ps(dest + i, _mm_add_ps(_mm_loadu_ps(dest + i),
+			_mm_mul_ps(_mm_add_ps(_mm_loadu_ps(src0 + i),
+			_mm_loadu_ps(src1 + i)), kk)));
+	madd_floats_c(dest + i, src0 + i, src1 + i, k, len - i);
+}
+
+/* Add 16x16 bit products of 8 values to 8 sums */
+static TARGET("sse2") void madd8_sse2(unsigned int *dest, __m128i v, __m128i k)
+{
+	__m128i l = _mm_mullo_epi16(v, k), h = _mm_mulhi_epu16(v, k);
+
+	_mm_storeu_si128((void *)dest, _mm_add_epi32(_mm_loadu_si128(
+		(void *)dest), _mm_unpacklo_epi16(l, h)));
+	_mm_storeu_si128((void *)(dest + 4), _mm_add_epi32(_mm_loadu_si128(
+		(void *)(dest + 4)), _mm_unpackhi_epi16(l, h)));
+}
+
+static TARGET("sse2") void madd_shorts_sse2(unsigned int *dest,
+	unsigned short *src0, unsigned short *src1, int k, int len)
+{
+	__m128i kk = _mm_set1_epi16(k);
+	int i;
+
+	for (i = 0; i <= len - 8; i += 8)
+	{
+		madd8_sse2(dest + i, _mm_loadu_si128((void *)(src0 + i)), kk);
+		madd8_sse2(dest + i, _mm_loadu_si128((void *)(src1 + i)), kk);
+	}
+	madd_shorts_c(dest + i, src0 + i, src1 + i, k, len - i);
+}
+
+static TARGET("sse2") void box_floats_sse2(float *dest, float *sum, float *add,
+	float *sub, float mult, int len)
+{
+	__m128 s, m = _mm_set1_ps(mult);
+	int i;
+
+	for (i = 0; i <= len - 4; i += 4)
+	{
+		s = _mm_add_ps(_mm_loadu_ps(sum + i), _mm_sub_ps(
+			_mm_loadu_ps(add + i), _mm_loadu_ps(sub + i)));
+		_mm_storeu_ps(sum + i, s);
+		_mm_storeu_ps(dest + i, _mm_mul_ps(s, m));
+	}
+	box_floats_c(dest + i, sum + i, add + i, sub + i, mult, len - i);
+}
+
+/* Step 4 sums, and return them scaled and biased by -32768 */
+static TARGET("sse2") __m128i box4_sse2(int *sum, __m128i a, __m128i b,
+	__m128 m)
+{
+	__m128i s;
+
+	s = _mm_add_epi32(_mm_loadu_si128((void *)sum), _mm_sub_epi32(a, b));
+	_mm_storeu_si128((void *)sum, s);
+	s = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(s), m),
+		_mm_set1_ps(0.5f)));
+	return (_mm_sub_epi32(s, _mm_set1_epi32(32768)));
+}
+
+static TARGET("sse2") void box_shorts_sse2(unsigned short *dest, int *sum,
+	unsigned short *add, unsigned short *sub, float mult, int len)
+{
+	__m128i a, b, z = _mm_setzero_si128();
+	__m128 m = _mm_set1_ps(mult);
+	int i;
+
+	/* No unsigned 32-bit pack in SSE2, so pack signed with a bias */
+	for (i = 0; i <= len - 8; i += 8)
+	{
+		a = _mm_loadu_si128((void *)(add + i));
+		b = _mm_loadu_si128((void *)(sub + i));
+		a = _mm_packs_epi32(
+			box4_sse2(sum + i, _mm_unpacklo_epi16(a, z),
+				_mm_unpacklo_epi16(b, z), m),
+			box4_sse2(sum + i + 4, _mm_unpackhi_epi16(a, z),
+				_mm_unpackhi_epi16(b, z), m));
+		_mm_storeu_si128((void *)(dest + i),
+			_mm_xor_si128(a, _mm_set1_epi16(-32768)));
+	}
+	box_shorts_c(dest + i, sum + i, add + i, sub + i, mult, len - i);
+}
+
+static TARGET("sse2") void sum_floats_sse2(float *dest, float **src, float *k,
+	int n, int len)
+{
+	__m128 a0, a1, kk;
+	int i, j;
+
+	for (i = 0; i <= len - 8; i += 8)
+	{
+		a0 = _mm_loadu_ps(dest + i);
+		a1 = _mm_loadu_ps(dest + i + 4);
+		for (j = 0; j < n; j++)
+		{
+			kk = _mm_set1_ps(k[j]);
+			a0 = _mm_add_ps(a0, _mm_mul_ps(_mm_loadu_ps(src[j] + i), kk));
+			a1 = _mm_add_ps(a1, _mm_mul_ps(_mm_loadu_ps(src[j] + i + 4),
+				kk));
+		}
+		_mm_storeu_ps(dest + i, a0);
+		_mm_storeu_ps(dest + i + 4, a1);
+	}
+	sum_tail(dest, src, k, n, i, len);
+}
+
+/* Two pixels at once, when their steps have the same length */
+static TARGET("sse2") void filter_floats_sse2(float *dest, float *src,
+	fstep *f, int l)
+{
+	__m128 a[8], k0, k1, k2, k3;
+	float *s, *t, *tp, *tq;
+	int i, j, n, m, pair;
+
+	if (l == 1)
+	{
+		filter_floats_c(dest, src, f, l);
+		return;
+	}
+	m = l * 2;
+	for (; f[1].k; f++)
+	{
+		for (i = 0; i < 8; i++) a[i] = _mm_setzero_ps();
+		s = src + f->idx * l;
+		t = src + f[1].idx * l;
+		tp = f->k;
+		tq = f[1].k;
+		n = f[1].k - f->k;
+		pair = f[2].k && (f[2].k - f[1].k == n);
+		for (j = 0; j < n - 1; j += 2 , s += m , t += m)
+		{
+			k0 = _mm_set1_ps(tp[j]);
+			k1 = _mm_set1_ps(tp[j + 1]);
+			a[0] = _mm_add_ps(a[0], _mm_mul_ps(_mm_loadu_ps(s), k0));
+			a[1] = _mm_add_ps(a[1], _mm_mul_ps(_mm_loadu_ps(s + l), k1));
+			if (l == 8)
+			{
+				a[2] = _mm_add_ps(a[2], _mm_mul_ps(_mm_loadu_ps(s + 4),
+					k0));
+				a[3] = _mm_add_ps(a[3], _mm_mul_ps(_mm_loadu_ps(s + 12),
+					k1));
+			}
+			if (!pair) continue;
+			k2 = _mm_set1_ps(tq[j]);
+			k3 = _mm_set1_ps(tq[j + 1]);
+			a[4] = _mm_add_ps(a[4], _mm_mul_ps(_mm_loadu_ps(t), k2));
+			a[5] = _mm_add_ps(a[5], _mm_mul_ps(_mm_loadu_ps(t + l), k3));
+			if (l == 4) continue;
+			a[6] = _mm_add_ps(a[6], _mm_mul_ps(_mm_loadu_ps(t + 4), k2));
+			a[7] = _mm_add_ps(a[7], _mm_mul_ps(_mm_loadu_ps(t + 12), k3));
+		}
+		if (j < n)
+		{
+			k0 = _mm_set1_ps(tp[j]);
+			a[0] = _mm_add_ps(a[0], _mm_mul_ps(_mm_loadu_ps(s), k0));
+			if (l == 8) a[2] = _mm_add_ps(a[2],
+				_mm_mul_ps(_mm_loadu_ps(s + 4), k0));
+			if (pair)
+			{
+				k2 = _mm_set1_ps(tq[j]);
+				a[4] = _mm_add_ps(a[4], _mm_mul_ps(_mm_loadu_ps(t), k2));
+				if (l == 8) a[6] = _mm_add_ps(a[6],
+					_mm_mul_ps(_mm_loadu_ps(t + 4), k2));
+			}
+		}
+		_mm_storeu_ps(dest, _mm_add_ps(a[0], a[1]));
+		if (l == 8) _mm_storeu_ps(dest + 4, _mm_add_ps(a[2], a[3]));
+		dest += l;
+		if (!pair) continue;
+		f++;
+		_mm_storeu_ps(dest, _mm_add_ps(a[4], a[5]));
+		if (l == 8) _mm_storeu_ps(dest + 4, _mm_add_ps(a[6], a[7]));
+		dest += l;
+	}
+}
+
+static TARGET("sse2") void float_bytes_sse2(float *dest, unsigned char *src,
+	int len)
+{
+	__m128i v, l, z = _mm_setzero_si128();
+	int i;
+
+	for (i = 0; i <= len - 16; i += 16)
+	{
+		v = _mm_loadu_si128((void *)(src + i));
+		l = _mm_unpacklo_epi8(v, z);
+		_mm_storeu_ps(dest + i, _mm_cvtepi32_ps(_mm_unpacklo_epi16(l, z)));
+		_mm_storeu_ps(dest + i + 4, _mm_cvtepi32_ps(_mm_unpackhi_epi16(l, z)));
+		l = _mm_unpackhi_epi8(v, z);
+		_mm_storeu_ps(dest + i + 8, _mm_cvtepi32_ps(_mm_unpacklo_epi16(l, z)));
+		_mm_storeu_ps(dest + i + 12, _mm_cvtepi32_ps(_mm_unpackhi_epi16(l, z)));
+	}
+	float_bytes_c(dest + i, src + i, len - i);
+}
+
+static TARGET("sse2") void expand_floats_sse2(float *dest, float *rgb,
+	unsigned char *alpha, int len)
+{
+	__m128 v, m = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1)),
+		one = _mm_set_ps(1.0f, 0.0f, 0.0f, 0.0f);
+	int i;
+
+	for (i = 0; i < len; i++ , rgb += 3)
+	{
+		v = _mm_and_ps(_mm_loadu_ps(rgb), m);
+		_mm_storeu_ps(dest, v);
+		dest += 4;
+		if (!alpha) continue;
+		_mm_storeu_ps(dest, _mm_mul_ps(_mm_or_ps(v, one),
+			_mm_set1_ps(alpha[i])));
+		dest += 4;
+	}
+}
+
+/* Rounding mode is the same as rintf()'s, and saturation does the clipping */
+static TARGET("sse2") void store_floats_sse2(unsigned char *dest,
+	unsigned char *alpha, float *src, int len, int l)
+{
+	__m128 v;
+	__m128i w;
+	int i, j;
+
+	if (l == 1)
+	{
+		for (i = 0; i < len - 3; i += 4)
+		{
+			w = _mm_cvtps_epi32(_mm_loadu_ps(src + i));
+			w = _mm_packus_epi16(_mm_packs_epi32(w, w), w);
+			j = _mm_cvtsi128_si32(w);
+			memcpy(dest + i, &j, 4);
+		}
+		store_floats_c(dest + i, NULL, src + i, len - i, l);
+		return;
+	}
+	for (i = 0; i < len; i++ , src += l , dest += 3)
+	{
+		v = _mm_loadu_ps(src);
+		if (l == 8)
+		{
+			j = _mm_cvtss_si32(_mm_load_ss(src + 7));
+			alpha[i] = j = j < 0 ? 0 : j > 0xFF ? 0xFF : j;
+			if (j) v = _mm_mul_ps(_mm_loadu_ps(src + 4),
+				_mm_set1_ps(1.0f / src[7]));
+		}
+		w = _mm_cvtps_epi32(v);
+		w = _mm_packus_epi16(_mm_packs_epi32(w, w), w);
+		j = _mm_cvtsi128_si32(w);
+		dest[0] = j;
+		dest[1] = j >> 8;
+		dest[2] = j >> 16;
+	}
+}
+
+static TARGET("sse2") void distance_doubles_sse2(double *dest, double *v,
+	double *xyz, int n, int type)
+{
+	__m128d dx, dy, dz, m = _mm_castsi128_pd(_mm_set1_epi64x(~(1ULL << 63)));
+	__m128d vx = _mm_set1_pd(v[0]), vy = _mm_set1_pd(v[1]),
+		vz = _mm_set1_pd(v[2]);
+	double *y = xyz + n, *z = y + n;
+	int i;
+
+	for (i = 0; i <= n - 2; i += 2)
+	{
+		dx = _mm_and_pd(_mm_sub_pd(vx, _mm_loadu_pd(xyz + i)), m);
+		dy = _mm_and_pd(_mm_sub_pd(vy, _mm_loadu_pd(y + i)), m);
+		dz = _mm_and_pd(_mm_sub_pd(vz, _mm_loadu_pd(z + i)), m);
+		if (type == 2) dx = _mm_sqrt_pd(_mm_add_pd(_mm_add_pd(
+			_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy)),
+			_mm_mul_pd(dz, dz)));
+		else if (type == 1) dx = _mm_add_pd(_mm_add_pd(dx, dy), dz);
+		else dx = _mm_max_pd(_mm_max_pd(dx, dy), dz);
+		_mm_storeu_pd(dest + i, dx);
+	}
+	distance_xyz(dest + i, v, xyz + i, y + i, z + i, n - i, type);
+}
+
+/// AVX2
+
+static TARGET("avx2") __m256i blend16_avx2(__m256i d, __m256i s, __m256i o)
+{
+	__m256i j;
+
+	j = _mm256_add_epi16(_mm256_mullo_epi16(d, _mm256_sub_epi16(
+		_mm256_set1_epi16(255), o)), _mm256_mullo_epi16(s, o));
+	j = _mm256_add_epi16(_mm256_add_epi16(j, _mm256_srli_epi16(j, 8)),
+		_mm256_set1_epi16(1));
+	return (_mm256_srli_epi16(j, 8));
+}
+
+static TARGET("avx2") void blend_avx2(unsigned char *dest, unsigned char *src,
+	unsigned char *op, int len)
+{
+	__m256i d, s, o, z = _mm256_setzero_si256();
+	int i;
+
+	/* Unpacking and packing both work within 128-bit lanes, so byte order
+	 * ends up the same as it was */
+	for (i = 0; i <= len - 32; i += 32)
+	{
+		d = _mm256_loadu_si256((void *)(dest + i));
+		s = _mm256_loadu_si256((void *)(src + i));
+		o = _mm256_loadu_si256((void *)(op + i));
+		d = _mm256_packus_epi16(
+			blend16_avx2(_mm256_unpacklo_epi8(d, z),
+				_mm256_unpacklo_epi8(s, z), _mm256_unpacklo_epi8(o, z)),
+			blend16_avx2(_mm256_unpackhi_epi8(d, z),
+				_mm256_unpackhi_epi8(s, z), _mm256_unpackhi_epi8(o, z)));
+		_mm256_storeu_si256((void *)(dest + i), d);
+	}
+	blend_sse2(dest + i, src + i, op + i, len - i);
+}
+
+static TARGET("avx2") void overlay_avx2(unsigned char *dest, unsigned char **src,
+	int *op, unsigned short (*pat)[48], int n, int len)
+{
+	__m256i d, v, w, p, l, h, t0, tl, th, z = _mm256_setzero_si256();
+	int i, c;
+
+	/* 16 bytes at a time, widened in order; unpacking to 32 bits and
+	 * packing back are both per lane, so order is preserved */
+	for (i = 0; i <= len - 16; i += 16)
+	{
+		d = _mm256_cvtepu8_epi16(_mm_loadu_si128((void *)(dest + i)));
+		t0 = tl = th = z;
+		for (c = 0; c < n; c++)
+		{
+			v = _mm256_cvtepu8_epi16(_mm_loadu_si128((void *)(src[c] + i)));
+			w = _mm256_mullo_epi16(v, _mm256_set1_epi16(op[c]));
+			t0 = _mm256_add_epi16(t0, w);
+			p = _mm256_loadu_si256((void *)(pat[c] + i % 48));
+			l = _mm256_mullo_epi16(w, p);
+			h = _mm256_mulhi_epu16(w, p);
+			tl = _mm256_add_epi32(tl, _mm256_unpacklo_epi16(l, h));
+			th = _mm256_add_epi32(th, _mm256_unpackhi_epi16(l, h));
+		}
+		w = _mm256_sub_epi16(_mm256_set1_epi16(256 * 255), t0);
+		l = _mm256_mullo_epi16(w, d);
+		h = _mm256_mulhi_epu16(w, d);
+		tl = _mm256_add_epi32(tl, _mm256_unpacklo_epi16(l, h));
+		th = _mm256_add_epi32(th, _mm256_unpackhi_epi16(l, h));
+		v = _mm256_set1_epi32(0x100);
+		tl = _mm256_srli_epi32(_mm256_add_epi32(_mm256_add_epi32(tl,
+			_mm256_srli_epi32(tl, 8)), v), 16);
+		th = _mm256_srli_epi32(_mm256_add_epi32(_mm256_add_epi32(th,
+			_mm256_srli_epi32(th, 8)), v), 16);
+		d = _mm256_packs_epi32(tl, th);
+		_mm_storeu_si128((void *)(dest + i), _mm_packus_epi16(
+			_mm256_castsi256_si128(d), _mm256_extracti128_si256(d, 1)));
+	}
+	overlay_tail(dest, src, op, pat, n, i, len);
+}
+
+static TARGET("avx2") void madd_floats_avx2(float *dest, float *src0,
+	float *src1, float k, int len)
+{
+	__m256 kk = _mm256_set1_ps(k);
+	int i;
+
+	for (i = 0; i <= len - 8; i += 8)
+		_mm256_storeu_ps(dest + i, _mm256_add_ps(_mm256_loadu_ps(dest + i),
+			_mm256_mul_ps(_mm256_add_ps(_mm256_loadu_ps(src0 + i),
+			_mm256_loadu_ps(src1 + i)), kk)));
+	madd_floats_sse2(dest + i, src0 + i, src1 + i, k, len - i);
+}
+
+static TARGET("avx2") void madd_shorts_avx2(unsigned int *dest,
+	unsigned short *src0, unsigned short *src1, int k, int len)
+{
+	__m256i d, kk = _mm256_set1_epi32(k);
+	int i;
+
+	for (i = 0; i <= len - 8; i += 8)
+	{
+		d = _mm256_add_epi32(_mm256_loadu_si256((void *)(dest + i)),
+			_mm256_mullo_epi32(_mm256_cvtepu16_epi32(
+			_mm_loadu_si128((void *)(src0 + i))), kk));
+		d = _mm256_add_epi32(d, _mm256_mullo_epi32(_mm256_cvtepu16_epi32(
+			_mm_loadu_si128((void *)(src1 + i))), kk));
+		_mm256_storeu_si256((void *)(dest + i), d);
+	}
+	madd_shorts_c(dest + i, src0 + i, src1 + i, k, len - i);
+}
+
+static TARGET("avx2") void box_floats_avx2(float *dest, float *sum, float *add,
+	float *sub, float mult, int len)
+{
+	__m256 s, m = _mm256_set1_ps(mult);
+	int i;
+
+	for (i = 0; i <= len - 8; i += 8)
+	{
+		s = _mm256_add_ps(_mm256_loadu_ps(sum + i), _mm256_sub_ps(
+			_mm256_loadu_ps(add + i), _mm256_loadu_ps(sub + i)));
+		_mm256_storeu_ps(sum + i, s);
+		_mm256_storeu_ps(dest + i, _mm256_mul_ps(s, m));
+	}
+	box_floats_sse2(dest + i, sum + i, add + i, sub + i, mult, len - i);
+}
+
+static TARGET("avx2") void box_shorts_avx2(unsigned short *dest, int *sum,
+	unsigned short *add, unsigned short *sub, float mult, int len)
+{
+	__m256i s;
+	__m256 m = _mm256_set1_ps(mult);
+	int i;
+
+	for (i = 0; i <= len - 8; i += 8)
+	{
+		s = _mm256_add_epi32(_mm256_loadu_si256((void *)(sum + i)),
+			_mm256_sub_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128(
+			(void *)(add + i))), _mm256_cvtepu16_epi32(
+			_mm_loadu_si128((void *)(sub + i)))));
+		_mm256_storeu_si256((void *)(sum + i), s);
+		s = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(
+			_mm256_cvtepi32_ps(s), m), _mm256_set1_ps(0.5f)));
+		_mm_storeu_si128((void *)(dest + i), _mm_packus_epi32(
+			_mm256_castsi256_si128(s), _mm256_extracti128_si256(s, 1)));
+	}
+	box_shorts_c(dest + i, sum + i, add + i, sub + i, mult, len - i);
+}
+
+static TARGET("avx2") void sum_floats_avx2(float *dest, float **src, float *k,
+	int n, int len)
+{
+	__m256 a0, a1, kk;
+	int i, j;
+
+	for (i = 0; i <= len - 16; i += 16)
+	{
+		a0 = _mm256_loadu_ps(dest + i);
+		a1 = _mm256_loadu_ps(dest + i + 8);
+		for (j = 0; j < n; j++)
+		{
+			kk = _mm256_set1_ps(k[j]);
+			a0 = _mm256_add_ps(a0, _mm256_mul_ps(
+				_mm256_loadu_ps(src[j] + i), kk));
+			a1 = _mm256_add_ps(a1, _mm256_mul_ps(
+				_mm256_loadu_ps(src[j] + i + 8), kk));
+		}
+		_mm256_storeu_ps(dest + i, a0);
+		_mm256_storeu_ps(dest + i + 8, a1);
+	}
+	sum_tail(dest, src, k, n, i, len);
+}
+
+static TARGET("avx2") void filter_floats_avx2(float *dest, float *src,
+	fstep *f, int l)
+{
+	__m256 a0, a1, b0, b1;
+	float *s, *t, *tp, *tq;
+	int j, n, pair;
+
+	if (l != 8)
+	{
+		filter_floats_sse2(dest, src, f, l);
+		return;
+	}
+	for (; f[1].k; f++ , dest += 8)
+	{
+		a0 = a1 = b0 = b1 = _mm256_setzero_ps();
+		s = src + f->idx * 8;
+		t = src + f[1].idx * 8;
+		tp = f->k;
+		tq = f[1].k;
+		n = f[1].k - f->k;
+		pair = f[2].k && (f[2].k - f[1].k == n);
+		for (j = 0; j < n - 1; j += 2 , s += 16 , t += 16)
+		{
+			a0 = _mm256_add_ps(a0, _mm256_mul_ps(_mm256_loadu_ps(s),
+				_mm256_set1_ps(tp[j])));
+			a1 = _mm256_add_ps(a1, _mm256_mul_ps(_mm256_loadu_ps(s + 8),
+				_mm256_set1_ps(tp[j + 1])));
+			if (!pair) continue;
+			b0 = _mm256_add_ps(b0, _mm256_mul_ps(_mm256_loadu_ps(t),
+				_mm256_set1_ps(tq[j])));
+			b1 = _mm256_add_ps(b1, _mm256_mul_ps(_mm256_loadu_ps(t + 8),
+				_mm256_set1_ps(tq[j + 1])));
+		}
+		if (j < n)
+		{
+			a0 = _mm256_add_ps(a0, _mm256_mul_ps(_mm256_loadu_ps(s),
+				_mm256_set1_ps(tp[j])));
+			if (pair) b0 = _mm256_add_ps(b0, _mm256_mul_ps(
+				_mm256_loadu_ps(t), _mm256_set1_ps(tq[j])));
+		}
+		_mm256_storeu_ps(dest, _mm256_add_ps(a0, a1));
+		if (!pair) continue;
+		f++;
+		dest += 8;
+		_mm256_storeu_ps(dest, _mm256_add_ps(b0, b1));
+	}
+}
+
+static TARGET("avx2") void distance_doubles_avx2(double *dest, double *v,
+	double *xyz, int n, int type)
+{
+	__m256d dx, dy, dz,
+		m = _mm256_castsi256_pd(_mm256_set1_epi64x(~(1ULL << 63)));
+	__m256d vx = _mm256_set1_pd(v[0]), vy = _mm256_set1_pd(v[1]),
+		vz = _mm256_set1_pd(v[2]);
+	double *y = xyz + n, *z = y + n;
+	int i;
+
+	for (i = 0; i <= n - 4; i += 4)
+	{
+		dx = _mm256_and_pd(_mm256_sub_pd(vx, _mm256_loadu_pd(xyz + i)), m);
+		dy = _mm256_and_pd(_mm256_sub_pd(vy, _mm256_loadu_pd(y + i)), m);
+		dz = _mm256_and_pd(_mm256_sub_pd(vz, _mm256_loadu_pd(z + i)), m);
+		if (type == 2) dx = _mm256_sqrt_pd(_mm256_add_pd(_mm256_add_pd(
+			_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy)),
+			_mm256_mul_pd(dz, dz)));
+		else if (type == 1) dx = _mm256_add_pd(_mm256_add_pd(dx, dy), dz);
+		else dx = _mm256_max_pd(_mm256_max_pd(dx, dy), dz);
+		_mm256_storeu_pd(dest + i, dx);
+	}
+	distance_xyz(dest + i, v, xyz + i, y + i, z + i, n - i, type);
+}
+
+static TARGET("avx2") void float_bytes_avx2(float *dest, unsigned char *src,
+	int len)
+{
+	int i;
+
+	for (i = 0; i <= len - 8; i += 8)
+		_mm256_storeu_ps(dest + i, _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(
+			_mm_loadl_epi64((void *)(src + i)))));
+	float_bytes_c(dest + i, src + i, len - i);
+}
+
+#endif /* SIMD_X86 */
+
+#ifdef SIMD_ARM
+
+/// NEON
+
+static uint8x8_t blend8_neon(uint8x8_t d, uint8x8_t s, uint8x8_t o)
+{
+	uint16x8_t j;
+
+	j = vmlal_u8(vmull_u8(d, vsub_u8(vdup_n_u8(255), o)), s, o);
+	j = vaddq_u16(vaddq_u16(j, vshrq_n_u16(j, 8)), vdupq_n_u16(1));
+	return (vshrn_n_u16(j, 8));
+}
+
+static void blend_neon(unsigned char *dest, unsigned char *src,
+	unsigned char *op, int len)
+{
+	uint8x16_t d, s, o;
+	int i;
+
+	for (i = 0; i <= len - 16; i += 16)
+	{
+		d = vld1q_u8(dest + i);
+		s = vld1q_u8(src + i);
+		o = vld1q_u8(op + i);
+		vst1q_u8(dest + i, vcombine_u8(
+			blend8_neon(vget_low_u8(d), vget_low_u8(s), vget_low_u8(o)),
+			blend8_neon(vget_high_u8(d), vget_high_u8(s), vget_high_u8(o))));
+	}
+	blend_c(dest + i, src + i, op + i, len - i);
+}
+
+static void overlay_neon(unsigned char *dest, unsigned char **src, int *op,
+	unsigned short (*pat)[48], int n, int len)
+{
+	uint16x8_t d, w, p, t0;
+	uint32x4_t tl, th, r = vdupq_n_u32(0x100);
+	int i, c;
+
+	for (i = 0; i <= len - 8; i += 8)
+	{
+		d = vmovl_u8(vld1_u8(dest + i));
+		t0 = vdupq_n_u16(0);
+		tl = th = vdupq_n_u32(0);
+		for (c = 0; c < n; c++)
+		{
+			w = vmulq_n_u16(vmovl_u8(vld1_u8(src[c] + i)), op[c]);
+			t0 = vaddq_u16(t0, w);
+			p = vld1q_u16(pat[c] + i % 48);
+			tl = vmlal_u16(tl, vget_low_u16(w), vget_low_u16(p));
+			th = vmlal_u16(th, vget_high_u16(w), vget_high_u16(p));
+		}
+		w = vsubq_u16(vdupq_n_u16(256 * 255), t0);
+		tl = vmlal_u16(tl, vget_low_u16(w), vget_low_u16(d));
+		th = vmlal_u16(th, vget_high_u16(w), vget_high_u16(d));
+		tl = vshrq_n_u32(vaddq_u32(vaddq_u32(tl, vshrq_n_u32(tl, 8)), r), 16);
+		th = vshrq_n_u32(vaddq_u32(vaddq_u32(th, vshrq_n_u32(th, 8)), r), 16);
+		vst1_u8(dest + i, vmovn_u16(vcombine_u16(vmovn_u32(tl),
+			vmovn_u32(th))));
+	}
+	overlay_tail(dest, src, op, pat, n, i, len);
+}
+
+static void madd_floats_neon(float *dest, float *src0, float *src1, float k,
+	int len)
+{
+	int i;
+
+	for (i = 0; i <= len - 4; i += 4)
+		vst1q_f32(dest + i, vaddq_f32(vld1q_f32(dest + i), vmulq_n_f32(
+			vaddq_f32(vld1q_f32(src0 + i), vld1q_f32(src1 + i)), k)));
+	madd_floats_c(dest + i, src0 + i, src1 + i, k, len - i);
+}
+
+static void madd_shorts_neon(unsigned int *dest, unsigned short *src0,
+	unsigned short *src1, int k, int len)
+{
+	uint16x4_t kk = vdup_n_u16(k);
+	uint16x8_t a, b;
+	uint32x4_t l, h;
+	int i;
+
+	for (i = 0; i <= len - 8; i += 8)
+	{
+		a = vld1q_u16(src0 + i);
+		b = vld1q_u16(src1 + i);
+		l = vmlal_u16(vld1q_u32(dest + i), vget_low_u16(a), kk);
+		h = vmlal_u16(vld1q_u32(dest + i + 4), vget_high_u16(a), kk);
+		vst1q_u32(dest + i, vmlal_u16(l, vget_low_u16(b), kk));
+		vst1q_u32(dest + i + 4, vmlal_u16(h, vget_high_u16(b), kk));
+	}
+	madd_shorts_c(dest + i, src0 + i, src1 + i, k, len - i);
+}
+
+static void box_floats_neon(float *dest, float *sum, float *add, float *sub,
+	float mult, int len)
+{
+	float32x4_t s;
+	int i;
+
+	for (i = 0; i <= len - 4; i += 4)
+	{
+		s = vaddq_f32(vld1q_f32(sum + i), vsubq_f32(vld1q_f32(add + i),
+			vld1q_f32(sub + i)));
+		vst1q_f32(sum + i, s);
+		vst1q_f32(dest + i, vmulq_n_f32(s, mult));
+	}
+	box_floats_c(dest + i, sum + i, add + i, sub + i, mult, len - i);
+}
+
+static void box_shorts_neon(unsigned short *dest, int *sum,
+	unsigned short *add, unsigned short *sub, float mult, int len)
+{
+	float32x4_t r = vdupq_n_f32(0.5f);
+	int32x4_t s;
+	int i;
+
+	for (i = 0; i <= len - 4; i += 4)
+	{
+		s = vaddq_s32(vld1q_s32(sum + i), vreinterpretq_s32_u32(vsubl_u16(
+			vld1_u16(add + i), vld1_u16(sub + i))));
+		vst1q_s32(sum + i, s);
+		vst1_u16(dest + i, vqmovun_s32(vcvtq_s32_f32(vaddq_f32(
+			vmulq_n_f32(vcvtq_f32_s32(s), mult), r))));
+	}
+	box_shorts_c(dest + i, sum + i, add + i, sub + i, mult, len - i);
+}
+
+static void sum_floats_neon(float *dest, float **src, float *k, int n, int len)
+{
+	float32x4_t a0, a1;
+	int i, j;
+
+	for (i = 0; i <= len - 8; i += 8)
+	{
+		a0 = vld1q_f32(dest + i);
+		a1 = vld1q_f32(dest + i + 4);
+		for (j = 0; j < n; j++)
+		{
+			a0 = vaddq_f32(a0, vmulq_n_f32(vld1q_f32(src[j] + i), k[j]));
+			a1 = vaddq_f32(a1, vmulq_n_f32(vld1q_f32(src[j] + i + 4),
+				k[j]));
+		}
+		vst1q_f32(dest + i, a0);
+		vst1q_f32(dest + i + 4, a1);
+	}
+	sum_tail(dest, src, k, n, i, len);
+}
+
+static void filter_floats_neon(float *dest, float *src, fstep *f, int l)
+{
+	float32x4_t a[8];
+	float *s, *t, *tp, *tq;
+	int i, j, n, m, pair;
+
+	if (l == 1)
+	{
+		filter_floats_c(dest, src, f, l);
+		return;
+	}
+	m = l * 2;
+	for (; f[1].k; f++)
+	{
+		for (i = 0; i < 8; i++) a[i] = vdupq_n_f32(0.0f);
+		s = src + f->idx * l;
+		t = src + f[1].idx * l;
+		tp = f->k;
+		tq = f[1].k;
+		n = f[1].k - f->k;
+		pair = f[2].k && (f[2].k - f[1].k == n);
+		for (j = 0; j < n - 1; j += 2 , s += m , t += m)
+		{
+			a[0] = vaddq_f32(a[0], vmulq_n_f32(vld1q_f32(s), tp[j]));
+			a[1] = vaddq_f32(a[1], vmulq_n_f32(vld1q_f32(s + l),
+				tp[j + 1]));
+			if (l == 8)
+			{
+				a[2] = vaddq_f32(a[2], vmulq_n_f32(vld1q_f32(s + 4),
+					tp[j]));
+				a[3] = vaddq_f32(a[3], vmulq_n_f32(vld1q_f32(s + 12),
+					tp[j + 1]));
+			}
+			if (!pair) continue;
+			a[4] = vaddq_f32(a[4], vmulq_n_f32(vld1q_f32(t), tq[j]));
+			a[5] = vaddq_f32(a[5], vmulq_n_f32(vld1q_f32(t + l),
+				tq[j + 1]));
+			if (l == 4) continue;
+			a[6] = vaddq_f32(a[6], vmulq_n_f32(vld1q_f32(t + 4), tq[j]));
+			a[7] = vaddq_f32(a[7], vmulq_n_f32(vld1q_f32(t + 12),
+				tq[j + 1]));
+		}
+		if (j < n)
+		{
+			a[0] = vaddq_f32(a[0], vmulq_n_f32(vld1q_f32(s), tp[j]));
+			if (l == 8) a[2] = vaddq_f32(a[2],
+				vmulq_n_f32(vld1q_f32(s + 4), tp[j]));
+			if (pair)
+			{
+				a[4] = vaddq_f32(a[4], vmulq_n_f32(vld1q_f32(t),
+					tq[j]));
+				if (l == 8) a[6] = vaddq_f32(a[6],
+					vmulq_n_f32(vld1q_f32(t + 4), tq[j]));
+			}
+		}
+		vst1q_f32(dest, vaddq_f32(a[0], a[1]));
+		if (l == 8) vst1q_f32(dest + 4, vaddq_f32(a[2], a[3]));
+		dest += l;
+		if (!pair) continue;
+		f++;
+		vst1q_f32(dest, vaddq_f32(a[4], a[5]));
+		if (l == 8) vst1q_f32(dest + 4, vaddq_f32(a[6], a[7]));
+		dest += l;
+	}
+}
+
+static void float_bytes_neon(float *dest, unsigned char *src, int len)
+{
+	uint16x8_t v;
+	int i;
+
+	for (i = 0; i <= len - 8; i += 8)
+	{
+		v = vmovl_u8(vld1_u8(src + i));
+		vst1q_f32(dest + i, vcvtq_f32_u32(vmovl_u16(vget_low_u16(v))));
+		vst1q_f32(dest + i + 4, vcvtq_f32_u32(vmovl_u16(vget_high_u16(v))));
+	}
+	float_bytes_c(dest + i, src + i, len - i);
+}
+
+static void expand_floats_neon(float *dest, float *rgb, unsigned char *alpha,
+	int len)
+{
+	float32x4_t v;
+	int i;
+
+	for (i = 0; i < len; i++ , rgb += 3)
+	{
+		v = vsetq_lane_f32(0.0f, vld1q_f32(rgb), 3);
+		vst1q_f32(dest, v);
+		dest += 4;
+		if (!alpha) continue;
+		vst1q_f32(dest, vmulq_n_f32(vsetq_lane_f32(1.0f, v, 3),
+			alpha[i]));
+		dest += 4;
+	}
+}
+
+#endif /* SIMD_ARM */
+
+/// DISPATCH
+
+static int simd_found = -1;
+static blend_func blend_v = blend_c;
+static overlay_func overlay_v = overlay_c;
+static maddf_func maddf_v = madd_floats_c;
+static madds_func madds_v = madd_shorts_c;
+static boxf_func boxf_v = box_floats_c;
+static boxs_func boxs_v = box_shorts_c;
+static sumf_func sumf_v = sum_floats_c;
+static filterf_func filterf_v = filter_floats_c;
+static floatb_func floatb_v = float_bytes_c;
+static expandf_func expandf_v = expand_floats_c;
+static storef_func storef_v = store_floats_c;
+static distd_func distd_v = distance_doubles_c;
+
+/* Racing threads would all arrive at the same result, and plain C code
+ * meanwhile produces the same output, so no locking */
+int simd_level()
+{
+	int l = SIMD_NONE;
+
+	if (simd_found >= 0) return (simd_found);
+
+	/* Allow disabling vector code, to compare results */
+	if (!getenv("MTPAINT_NOSIMD"))
+	{
+#ifdef SIMD_X86
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2")) l = SIMD_AVX2;
+		else if (__builtin_cpu_supports("sse2")) l = SIMD_SSE2;
+		if (l == SIMD_AVX2) blend_v = blend_avx2 , overlay_v = overlay_avx2 ,
+			maddf_v = madd_floats_avx2 , madds_v = madd_shorts_avx2 ,
+			boxf_v = box_floats_avx2 , boxs_v = box_shorts_avx2 ,
+			sumf_v = sum_floats_avx2 , filterf_v = filter_floats_avx2 ,
+			floatb_v = float_bytes_avx2 , expandf_v = expand_floats_sse2 ,
+			storef_v = store_floats_sse2 , distd_v = distance_doubles_avx2;
+		if (l == SIMD_SSE2) blend_v = blend_sse2 , overlay_v = overlay_sse2 ,
+			maddf_v = madd_floats_sse2 , madds_v = madd_shorts_sse2 ,
+			boxf_v = box_floats_sse2 , boxs_v = box_shorts_sse2 ,
+			sumf_v = sum_floats_sse2 , filterf_v = filter_floats_sse2 ,
+			floatb_v = float_bytes_sse2 , expandf_v = expand_floats_sse2 ,
+			storef_v = store_floats_sse2 , distd_v = distance_doubles_sse2;
+#endif
+#ifdef SIMD_ARM
+		l = SIMD_NEON;
+		blend_v = blend_neon;
+		overlay_v = overlay_neon;
+		maddf_v = madd_floats_neon;
+		madds_v = madd_shorts_neon;
+		boxf_v = box_floats_neon;
+		boxs_v = box_shorts_neon;
+		sumf_v = sum_floats_neon;
+		filterf_v = filter_floats_neon;
+		floatb_v = float_bytes_neon;
+		expandf_v = expand_floats_neon;
+#endif
+	}
+	return (simd_found = l);
+}
+
+void blend_bytes(unsigned char *dest, unsigned char *src, unsigned char *op,
+	int len)
+{
+	if (simd_found < 0) simd_level();
+	blend_v(dest, src, op, len);
+}
+
+void overlay_bytes(unsigned char *dest, unsigned char **src, int *op,
+	unsigned char *rgb, int n, int len)
+{
+	unsigned short pat[3][48];
+
+	if (simd_found < 0) simd_level();
+	make_pattern(pat, rgb, n);
+	overlay_v(dest, src, op, pat, n, len);
+}
+
+void madd_floats(float *dest, float *src0, float *src1, float k, int len)
+{
+	if (simd_found < 0) simd_level();
+	maddf_v(dest, src0, src1, k, len);
+}
+
+void madd_shorts(unsigned int *dest, unsigned short *src0,
+	unsigned short *src1, int k, int len)
+{
+	if (simd_found < 0) simd_level();
+	madds_v(dest, src0, src1, k, len);
+}
+
+void box_floats(float *dest, float *sum, float *add, float *sub, float mult,
+	int len)
+{
+	if (simd_found < 0) simd_level();
+	boxf_v(dest, sum, add, sub, mult, len);
+}
+
+void box_shorts(unsigned short *dest, int *sum, unsigned short *add,
+	unsigned short *sub, float mult, int len)
+{
+	if (simd_found < 0) simd_level();
+	boxs_v(dest, sum, add, sub, mult, len);
+}
+
+void sum_floats(float *dest, float **src, float *k, int n, int len)
+{
+	if (simd_found < 0) simd_level();
+	sumf_v(dest, src, k, n, len);
+}
+
+void filter_floats(float *dest, float *src, fstep *f, int l)
+{
+	if (simd_found < 0) simd_level();
+	filterf_v(dest, src, f, l);
+}
+
+void float_bytes(float *dest, unsigned char *src, int len)
+{
+	if (simd_found < 0) simd_level();
+	floatb_v(dest, src, len);
+}
+
+void expand_floats(float *dest, float *rgb, unsigned char *alpha, int len)
+{
+	if (simd_found < 0) simd_level();
+	expandf_v(dest, rgb, alpha, len);
+}
+
+void store_floats(unsigned char *dest, unsigned char *alpha, float *src,
+	int len, int l)
+{
+	if (simd_found < 0) simd_level();
+	storef_v(dest, alpha, src, len, l);
+}
+
+void distance_doubles(double *dest, double *v, double *xyz, int n, int type)
+{
+	if (simd_found < 0) simd_level();
+	distd_v(dest, v, xyz, n, type);
+}
+
+/* Run every compositing variant this CPU can on the same random data, check
+ * its output against plain C byte for byte, and time it; buffers are offset
+ * by 1 byte and odd-sized, to exercise unaligned loads and tail code */
+
+#define BENCH_PIXELS (1024 * 1024)
+#define BENCH_PASSES 16
+
+typedef struct {
+	char *name;
+	blend_func blend;
+	overlay_func overlay;
+} bench_variant;
+
+int simd_bench()
+{
+	bench_variant vars[4], *bv;
+	unsigned short pat[3][48];
+	unsigned char *mem, *dest0, *dest, *ref[2], *src[3], *op, rgb[9];
+	unsigned int seed = 1;
+	double t, tc[2] = { 0.0, 0.0 };
+	int i, j, n, nv = 0, len = BENCH_PIXELS * 3 - 7, res = 0, ops[3][3];
+
+
+	vars[nv].name = "C";
+	vars[nv].blend = blend_c;
+	vars[nv++].overlay = overlay_c;
+#ifdef SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+	{
+		vars[nv].name = "SSE2";
+		vars[nv].blend = blend_sse2;
+		vars[nv++].overlay = overlay_sse2;
+	}
+	if (__builtin_cpu_supports("avx2"))
+	{
+		vars[nv].name = "AVX2";
+		vars[nv].blend = blend_avx2;
+		vars[nv++].overlay = overlay_avx2;
+	}
+#endif
+#ifdef SIMD_ARM
+	vars[nv].name = "NEON";
+	vars[nv].blend = blend_neon;
+	vars[nv++].overlay = overlay_neon;
+#endif
+
+	if (!(mem = malloc((size_t)(len + 1) * 8)))
+	{
+		printf("Not enough memory for benchmark\n");
+		return (1);
+	}
+	dest0 = mem + 1;
+	dest = dest0 + len + 1;
+	ref[0] = dest + len + 1;
+	ref[1] = ref[0] + len + 1;
+	src[0] = ref[1] + len + 1;
+	src[1] = src[0] + len + 1;
+	src[2] = src[1] + len + 1;
+	op = src[2] + len + 1;
+	for (i = 0; i < (len + 1) * 8; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		mem[i] = seed >> 16;
+	}
+	for (i = 0; i < 9; i++) rgb[i] = src[0][i * 7];
+	make_pattern(pat, rgb, 3);
+	/* Overlay weights: full, and split 2 and 3 ways */
+	ops[0][0] = 256;
+	ops[1][0] = 100 , ops[1][1] = 156;
+	ops[2][0] = 30 , ops[2][1] = 200 , ops[2][2] = 17;
+
+	printf("Compositing %d pixels, %d passes\n", BENCH_PIXELS, BENCH_PASSES);
+	printf("%-28s%12s%8s%10s\n", "Test", "MP/s", "Gain", "Differ");
+	for (bv = vars; bv - vars < nv; bv++)
+	{
+		clock_t c0;
+
+		/* Blend repeatedly in place, so errors would accumulate */
+		memcpy(dest, dest0, len);
+		c0 = clock();
+		for (i = 0; i < BENCH_PASSES; i++) bv->blend(dest, src[0], op, len);
+		t = (double)(clock() - c0) / CLOCKS_PER_SEC;
+		if (bv == vars) memcpy(ref[0], dest, len) , tc[0] = t;
+		for (i = j = 0; i < len; i++) j += dest[i] != ref[0][i];
+		res |= !!j;
+		printf("blend %-22s%12.1f%7.2fx%10d\n", bv->name,
+			BENCH_PASSES * (len / 3) / (t * 1000000.0), tc[0] / t, j);
+
+		/* Overlay 1 to 3 channels, timing the last */
+		memcpy(dest, dest0, len);
+		for (n = 1; n <= 3; n++)
+		{
+			c0 = clock();
+			for (i = 0; i < BENCH_PASSES; i++)
+				bv->overlay(dest, src, ops[n - 1], pat, n, len);
+			t = (double)(clock() - c0) / CLOCKS_PER_SEC;
+		}
+		if (bv == vars) memcpy(ref[1], dest, len) , tc[1] = t;
+		for (i = j = 0; i < len; i++) j += dest[i] != ref[1][i];
+		res |= !!j;
+		printf("overlay %-20s%12.1f%7.2fx%10d\n", bv->name,
+			BENCH_PASSES * (len / 3) / (t * 1000000.0), tc[1] / t, j);
+	}
+	free(mem);
+	return (res);
+}
@@ -0,0 +1,74 @@
+/*	simd.h
+	Copyright (C) 2026 The mtPaint Authors
+
+	This file is part of mtPaint.
+
+	mtPaint is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	mtPaint is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with mtPaint in the file COPYING.
+*/
+
+/* Filter step for resampling: weights from k up to next step's k get applied
+ * to source pixels starting from idx; list ends with a step having NULL k */
+typedef struct {
+	float *k;
+	int idx;
+} fstep;
+
+/* Vector instruction sets usable at runtime */
+#define SIMD_NONE 0
+#define SIMD_SSE2 1
+#define SIMD_AVX2 2
+#define SIMD_NEON 3
+
+//	Best vector instruction set this CPU has; 0 if none
+int simd_level();
+
+//	Blend src bytes into dest ones, with per-byte opacity 0..255
+void blend_bytes(unsigned char *dest, unsigned char *src, unsigned char *op,
+	int len);
+
+//	Add up to 3 weighted overlay colours to RGB bytes; src[] are channel
+//	values expanded to bytes, op[] weights 0..256 summing to no more than 256
+void overlay_bytes(unsigned char *dest, unsigned char **src, int *op,
+	unsigned char *rgb, int n, int len);
+
+//	Add weighted sum of two rows: dest += (src0 + src1) * k
+void madd_floats(float *dest, float *src0, float *src1, float k, int len);
+//	Same for 16-bit values and 32-bit sums; k must be 0..65535
+void madd_shorts(unsigned int *dest, unsigned short *src0,
+	unsigned short *src1, int k, int len);
+//	Step running box sums: sum += add - sub, then dest = sum * mult
+void box_floats(float *dest, float *sum, float *add, float *sub, float mult,
+	int len);
+//	Same for 16-bit values, with dest rounded to nearest
+void box_shorts(unsigned short *dest, int *sum, unsigned short *add,
+	unsigned short *sub, float mult, int len);
+//	Add weighted sum of rows: dest += src[0] * k[0] + ... + src[n-1] * k[n-1]
+void sum_floats(float *dest, float **src, float *k, int n, int len);
+//	Apply filter steps to a row of pixels, 1, 4 or 8 floats each
+void filter_floats(float *dest, float *src, fstep *f, int l);
+//	Convert bytes to floats
+void float_bytes(float *dest, unsigned char *src, int len);
+//	Expand RGB floats into 4 per pixel: RGB and 0; with alpha bytes, into 8:
+//	then RGB multiplied by alpha, and alpha; rgb must have 1 float to spare
+void expand_floats(float *dest, float *rgb, unsigned char *alpha, int len);
+//	Round floats to bytes, from pixels of 1, 4 or 8 floats; the latter are
+//	unpacked into RGB and alpha, as expand_floats() packed them
+void store_floats(unsigned char *dest, unsigned char *alpha, float *src,
+	int len, int l);
+//	Measure distances from point v to n points, stored as n X coords, then
+//	n Y, then n Z; by L-inf, L1 or L2 measure for type 0, 1 or 2
+void distance_doubles(double *dest, double *v, double *xyz, int n, int type);
+//	Check vector compositing code against plain C, and time it; return 1 if
+//	results differ
+int simd_bench();
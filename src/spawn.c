@@ -30,9 +30,16 @@
 #include "png.h"
 #include "canvas.h"
 #include "mainwindow.h"
+#include "thread.h"
 #include "spawn.h"
 
 static char *mt_temp_dir;
+static char *scratch_name;
+static int scratch_fd = -1, scratch_failed;
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
 
 static char *get_tempdir()
 {
@@ -130,9 +137,34 @@ void spawn_quit()
 	tempfile *tmp;
 
 	for (tmp = tempchain; tmp; tmp = tmp->next) unlink(tmp->name);
+	if (scratch_fd >= 0) close(scratch_fd);
+	if (scratch_name) unlink(scratch_name);
 	if (mt_temp_dir) rmdir(mt_temp_dir);
 }
 
+/* Open scratch file for undo data, creating it on first use */
+int get_scratch_fd()
+{
+	char buf[PATHBUF];
+	int i;
+
+	if ((scratch_fd >= 0) || scratch_failed) return (scratch_fd);
+
+	/* Prepare temp directory */
+	if (!mt_temp_dir) mt_temp_dir = new_temp_dir();
+	if (mt_temp_dir) for (i = 0; i < 256; i++)
+	{
+		snprintf(buf, PATHBUF, "%s" DIR_SEP_STR "undo%d.tmp",
+			mt_temp_dir, i);
+		scratch_fd = open(buf, O_RDWR | O_CREAT | O_EXCL | O_BINARY, 0600);
+		if (scratch_fd < 0) continue;
+		scratch_name = strdup(buf);
+		return (scratch_fd);
+	}
+	scratch_failed = TRUE; // Do not try again
+	return (-1);
+}
+
 int get_tempname(char *buf, char *f, int type)
 {
 	char nstub[NAMEBUF], ids[32], *c;
@@ -1079,3 +1111,175 @@ int show_html(char *browser, char *docs)
 		_("There was a problem running the HTML browser.  You need to set the correct program name in the Preferences window."), NULL);
 	return (i);
 }
+
+/* Batch processing: each file gets loaded, run through the script, and saved
+ * under a name made from the pattern. Work on a file is done in a separate
+ * process, forked off for it, so that state of one file cannot affect the
+ * next, and up to "jobs" files get processed at once; on Windows, files get
+ * processed in turn, in this same process */
+
+enum {
+	BATCH_OK = 0,
+	BATCH_LOAD,
+	BATCH_SCRIPT,
+	BATCH_NAME,
+	BATCH_SAVE,
+	BATCH_FAIL
+};
+
+static char *batch_errors[] = { "OK", "Could not load", "Script failed",
+	"Output name too long", "Could not save", "Worker failed" };
+
+/* Pattern variables: %n = name without extension, %e = extension, %d =
+ * directory, %i = index of file in list, %% = percent sign */
+static int batch_name(char *buf, char *pattern, char *name, int idx)
+{
+	char tmp[32], *v, *nm, *ext;
+	int l, d = 0;
+
+	nm = strrchr(name, DIR_SEP);
+	nm = nm ? nm + 1 : name;
+	ext = strrchr(nm, '.');
+	if (!ext || (ext == nm)) ext = nm + strlen(nm);
+
+	for (; *pattern; pattern++)
+	{
+		v = tmp;
+		tmp[0] = *pattern;
+		l = 1;
+		if ((*pattern == '%') && pattern[1]) switch (*++pattern)
+		{
+		case 'n': v = nm; l = ext - nm; break;
+		case 'e': v = ext + !!*ext; l = strlen(v); break;
+		case 'd':
+			if (nm == name) v = ".";
+			else v = name , l = nm - name - 1;
+			break;
+		case 'i': l = sprintf(tmp, "%d", idx); break;
+		case '%': break;
+		default: tmp[1] = *pattern; l = 2; break; // Leave as is
+		}
+		if (d + l >= PATHBUF) return (FALSE);
+		memcpy(buf + d, v, l);
+		d += l;
+	}
+	buf[d] = '\0';
+	return (TRUE);
+}
+
+static int batch_file(char **script, char *name, char *pattern, int idx)
+{
+	ls_settings settings;
+	char buf[PATHBUF];
+
+	script_cmds = script; // Loading must not ask questions
+	if (do_a_load(name, FALSE)) return (BATCH_LOAD);
+	if (run_script(script) != 1) return (BATCH_SCRIPT);
+	if (!pattern) return (BATCH_OK); // Script saved what it wanted
+	if (!batch_name(buf, pattern, name, idx)) return (BATCH_NAME);
+
+	init_ls_settings(&settings, NULL);
+	settings.ftype = file_type_by_ext(buf, FF_IMAGE);
+	settings.mode = FS_PNG_SAVE;
+	if (settings.ftype == FT_NONE) return (BATCH_SAVE);
+	return (gui_save(buf, &settings) < 0 ? BATCH_SAVE : BATCH_OK);
+}
+
+static void batch_report(char *name, int res, double t)
+{
+	printf("%s: %s, %.3f s\n", name, batch_errors[res], t);
+}
+
+int spawn_batch(char **script, char **files, int nfiles, int jobs,
+	char *pattern)
+{
+	GTimer *timer = g_timer_new();
+	double t, tsum = 0.0;
+	int i, res, fails = 0;
+#ifndef WIN32
+	double *start;
+	pid_t pid, *pids;
+	int j, n, status, *idx, running = 0;
+
+	if (jobs < 1) jobs = helper_threads();
+	if (jobs > nfiles) jobs = nfiles > 1 ? nfiles : 1;
+	/* Let workers share the cores, not fight over them */
+	n = helper_threads() / jobs;
+	maxthreads = n < 1 ? 1 : n;
+
+	pids = calloc(jobs, sizeof(*pids));
+	idx = calloc(jobs, sizeof(*idx));
+	start = calloc(jobs, sizeof(*start));
+	if (!pids || !idx || !start) /* Not even the bookkeeping fits */
+	{
+		free(pids);
+		free(idx);
+		free(start);
+		g_timer_destroy(timer);
+		fprintf(stderr, "Not enough memory for %d workers\n", jobs);
+		return (1);
+	}
+
+	for (i = 0; (i < nfiles) || running; )
+	{
+		/* Start next file, if a worker slot is free */
+		if ((i < nfiles) && (running < jobs))
+		{
+			for (j = 0; pids[j]; j++);
+			fflush(NULL); // Don't let children repeat buffered output
+			pid = fork();
+			if (!pid) /* Worker */
+			{
+				res = batch_file(script, files[i], pattern, i + 1);
+				fflush(NULL);
+				_exit(res);
+			}
+			if (pid < 0) /* Fork failed */
+			{
+				batch_report(files[i++], BATCH_FAIL, 0.0);
+				fails++;
+				continue;
+			}
+			pids[j] = pid;
+			idx[j] = i++;
+			start[j] = g_timer_elapsed(timer, NULL);
+			running++;
+			continue;
+		}
+		/* Wait for a worker to finish */
+		pid = waitpid(-1, &status, 0);
+		if (pid < 0) break; // No children, somehow
+		for (j = 0; (j < jobs) && (pids[j] != pid); j++);
+		if (j >= jobs) continue; // Not a worker
+		pids[j] = 0;
+		running--;
+		res = WIFEXITED(status) ? WEXITSTATUS(status) : BATCH_FAIL;
+		if (res > BATCH_FAIL) res = BATCH_FAIL;
+		t = g_timer_elapsed(timer, NULL) - start[j];
+		batch_report(files[idx[j]], res, t);
+		tsum += t;
+		fails += res != BATCH_OK;
+	}
+	free(pids);
+	free(idx);
+	free(start);
+#else
+	jobs = 1;
+	for (i = 0; i < nfiles; i++)
+	{
+		t = g_timer_elapsed(timer, NULL);
+		res = batch_file(script, files[i], pattern, i + 1);
+		t = g_timer_elapsed(timer, NULL) - t;
+		batch_report(files[i], res, t);
+		tsum += t;
+		fails += res != BATCH_OK;
+	}
+#endif
+	t = g_timer_elapsed(timer, NULL);
+	g_timer_destroy(timer);
+
+	printf("%d files, %d failed, %d workers: %.3f s total, "
+		"%.3f s per file, %.2f files/s\n", nfiles, fails, jobs, t,
+		nfiles ? tsum / nfiles : 0.0, t > 0.0 ? nfiles / t : 0.0);
+	return (!!fails);
+}
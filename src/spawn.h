@@ -34,6 +34,11 @@ void init_factions();					// Initialize file action menu
 
 int get_tempname(char *buf, char *f, int type);		// Create tempfile for name
 void spawn_quit();	// Delete temp files
+int get_scratch_fd();	// Open scratch file for undo data
+
+//	Run script on each of files, up to "jobs" at once, and save results
+int spawn_batch(char **script, char **files, int nfiles, int jobs,
+	char *pattern);
 
 // Default action codes
 enum {
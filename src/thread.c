@@ -241,21 +241,133 @@ int thread_progress(tcb *thread)
 	return (TRUE);
 }
 
-static void thread_chunk(tcb *thread)
+/* Helper threads are kept around between jobs, sleeping; each job wakes them
+ * up, and each of them runs the tcb with its own index */
+
+typedef struct {
+	int index, epoch, gen;
+} pool_slot;
+
+static struct {
+	volatile int busy;	// Job is in progress
+	int gen;		// Job number
+	int epoch;		// Pool number, changes if threads got stuck
+	int workers;		// Threads in pool
+	int nw;			// Threads used by current job
+	threaddata *job;	// Current job
+	thread_func func;	// Function to run for it
+} pool;
+
+#if GTK_MAJOR_VERSION == 1
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+#define POOL_LOCK pthread_mutex_lock(&pool_lock)
+#define POOL_UNLOCK pthread_mutex_unlock(&pool_lock)
+#define POOL_WAIT pthread_cond_wait(&pool_cond, &pool_lock)
+#define POOL_WAKE pthread_cond_broadcast(&pool_cond)
+#else
+static GMutex *pool_lock;
+static GCond *pool_cond;
+#define POOL_LOCK g_mutex_lock(pool_lock)
+#define POOL_UNLOCK g_mutex_unlock(pool_lock)
+#define POOL_WAIT g_cond_wait(pool_cond, pool_lock)
+#define POOL_WAKE g_cond_broadcast(pool_cond)
+#endif
+
+static void *pool_worker(void *data)
 {
-	threaddata *tdata = thread->tdata;
-	thread_func tf = tdata->what;
-	int nx, step = thread->nsteps;
+	pool_slot slot = *(pool_slot *)data;
+	threaddata *job;
+	thread_func func;
+	int nw;
 
+	free(data);
 	while (TRUE)
 	{
-		tf(thread);
-		if (thread->stop || thread->stopped) break;
-		nx = thread_xadd(&tdata->done, step);
-		if (nx >= tdata->total) break;
-		thread->step0 = nx;
-		thread->nsteps = step > tdata->total - nx ? tdata->total - nx : step;
+		POOL_LOCK;
+		while ((pool.gen == slot.gen) && (pool.epoch == slot.epoch))
+			POOL_WAIT;
+		slot.gen = pool.gen;
+		nw = pool.epoch == slot.epoch ? pool.nw : -1;
+		job = pool.job;
+		func = pool.func;
+		POOL_UNLOCK;
+		if (nw < 0) break; // Pool was abandoned
+		/* Job is not to be touched after its tcb is marked done */
+		if (slot.index <= nw) func(job->threads[slot.index]);
+	}
+	return (NULL);
+}
+
+/* Have pool hold enough threads, if possible; return how many it holds */
+static int pool_grow(int n)
+{
+	pool_slot *slot;
+
+#if GTK_MAJOR_VERSION > 1
+	if (!pool_lock)
+	{
+		pool_lock = g_mutex_new();
+		pool_cond = g_cond_new();
+	}
+#endif
+	while (pool.workers < n)
+	{
+		if (!(slot = malloc(sizeof(pool_slot)))) break;
+		slot->index = pool.workers + 1;
+		slot->epoch = pool.epoch;
+		slot->gen = pool.gen;
+		if (!launch_bg_thread(pool_worker, slot))
+		{
+			free(slot);
+			break;
+		}
+		pool.workers++;
 	}
+	return (n < pool.workers ? n : pool.workers);
+}
+
+/* Chunked work is kept in a per-thread range; the owner takes chunks from
+ * its front, and a thread which ran out of its own steals the back half of
+ * the biggest range left */
+
+DEF_MUTEX(steal_lock);
+
+static int thread_take(tcb *thread)
+{
+	threaddata *tdata = thread->tdata;
+	tcb *tp, *victim = thread;
+	int i, n, step = tdata->step;
+
+	LOCK_BG_MUTEX(steal_lock);
+	if (thread->wlo >= thread->whi) /* Own work done - steal */
+	{
+		for (i = n = 0; i < tdata->count; i++)
+		{
+			tp = tdata->threads[i];
+			if (tp->whi - tp->wlo <= n) continue;
+			n = tp->whi - tp->wlo;
+			victim = tp;
+		}
+		if (n > step) n = (n + 1) >> 1;
+		thread->whi = victim->whi;
+		thread->wlo = victim->whi -= n;
+	}
+	n = thread->whi - thread->wlo;
+	if (n > step) n = step;
+	thread->step0 = thread->wlo;
+	thread->nsteps = n;
+	thread->wlo += n;
+	UNLOCK_BG_MUTEX(steal_lock);
+	return (n);
+}
+
+static void thread_chunk(tcb *thread)
+{
+	thread_func tf = thread->tdata->what;
+
+	while (!thread->stop && !thread->stopped && thread_take(thread))
+		tf(thread);
 	thread_done(thread);
 }
 
@@ -265,59 +377,57 @@ int launch_threads(thread_func thread, threaddata *tdata, char *title, int total
 {
 	tcb *tp;
 	clock_t uninit_(before), now;
-	int i, j, n0, n1, flag = FALSE;
-#if GTK_MAJOR_VERSION == 1
-	pthread_t tid;
-	pthread_attr_t attr;
-	int attr_failed;
-
-	attr_failed = pthread_attr_init(&attr) ||
-#ifdef PTHREAD_SCOPE_SYSTEM
-		pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM) ||
-#endif
-		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-#endif
+	int i, j, n0, n1, nw = 0, held = FALSE, flag = FALSE;
 
 	/* Prepare chunking */
 	tdata->threads[0]->tsteps = tdata->total = total;
-	i = tdata->count;
-	j = tdata->chunks;
-	if ((i > 1) && (j > 1))	j *= i , total = ((total + j - 1) / j) * i;
-	tdata->done = n1 = total;
-
-	/* Launch aux threads */
 	tdata->what = thread;
-	if (tdata->chunks >= 0) thread = thread_chunk;
-	threads_running = TRUE;
-	for (i -= 1; i > 0; i--)
+	if (tdata->chunks >= 0)
+	{
+		j = tdata->chunks * tdata->count;
+		if (j < 1) j = 1;
+		tdata->step = (total + j - 1) / j;
+		if (tdata->step < 1) tdata->step = 1;
+		thread = thread_chunk;
+	}
+
+	/* Get helper threads, unless they are busy with another job - then,
+	 * as when they cannot be created, main thread does it all */
+	if ((tdata->count > 1) && !(held = !thread_xadd(&pool.busy, 1)))
+		thread_xadd(&pool.busy, -1);
+	if (held) nw = pool_grow(tdata->count - 1);
+
+	/* Allocate work to threads */
+	n1 = total;
+	for (i = tdata->count - 1; i >= 0; i--)
 	{
 		tp = tdata->threads[i];
 		/* Reinit thread state */
-		tp->stop = FALSE; tp->stopped = FALSE;
+		tp->stop = FALSE;
+		tp->stopped = i > nw; // No thread to run it
 		tp->progress = 0;
-		/* Allocate work to thread */
-		tp->step0 = n0 = (n1 * i) / (i + 1);
+		tp->step0 = n0 = i > nw ? n1 : (total * (long long)i) / (nw + 1);
 		tp->nsteps = n1 - n0;
-#if GTK_MAJOR_VERSION == 1
-		if (attr_failed || pthread_create(&tid, &attr,
-			(void *(*)(void *))thread, tp))
-#else 
-		if (!g_thread_create((GThreadFunc)thread, tp, FALSE, NULL))
-#endif
-			tp->stop = TRUE , tp->stopped = TRUE; // Failed to launch
-		else n1 = n0 , flag = TRUE; // Success - work is now being done
+		tp->wlo = n0;
+		tp->whi = n1;
+		n1 = n0;
+	}
+
+	/* Wake up helper threads */
+	if (nw)
+	{
+		threads_running = TRUE;
+		POOL_LOCK;
+		pool.job = tdata;
+		pool.func = thread;
+		pool.nw = nw;
+		pool.gen++;
+		POOL_WAKE;
+		POOL_UNLOCK;
 	}
-	threads_running = flag;
-#if GTK_MAJOR_VERSION == 1
-	pthread_attr_destroy(&attr);
-#endif
 
 	/* Put main thread to work */
 	tp = tdata->threads[0];
-	tp->stop = FALSE; tp->stopped = FALSE;
-	tp->progress = 0;
-	tp->step0 = 0;
-	tp->nsteps = n1;
 	if (title) progress_init(title, 1); /* Let init/end be done outside */
 	thread(tp);
 
@@ -345,13 +455,19 @@ int launch_threads(thread_func thread, threaddata *tdata, char *title, int total
 		}
 		if (!tdata->silent) thread_progress(tdata->threads[0]);
 		/* Let 'em run */
-#if GTK_MAJOR_VERSION == 1
-		sched_yield();
-#else
-		g_thread_yield();
-#endif
+		thread_yield();
 	}
-	threads_running = FALSE;
+	/* A nested job runs in the calling thread, while outer one still runs */
+	if (nw) threads_running = FALSE;
+	if (flag > 1) /* Abandon the pool, to not reuse a hung thread */
+	{
+		POOL_LOCK;
+		pool.epoch++;
+		pool.workers = 0;
+		POOL_WAKE;
+		POOL_UNLOCK;
+	}
+	if (held) thread_xadd(&pool.busy, -1);
 	if (title) progress_end();
 
 /* !!! Even with OS threading, killing a thread is not supported on some systems,
@@ -362,6 +478,32 @@ int launch_threads(thread_func thread, threaddata *tdata, char *title, int total
 	return (-1);
 }
 
+void thread_yield()
+{
+#if GTK_MAJOR_VERSION == 1
+	sched_yield();
+#else
+	g_thread_yield();
+#endif
+}
+
+int launch_bg_thread(bg_thread_func func, void *data)
+{
+#if GTK_MAJOR_VERSION == 1
+	pthread_t tid;
+	pthread_attr_t attr;
+	int res;
+
+	if (pthread_attr_init(&attr)) return (FALSE);
+	res = !pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) &&
+		!pthread_create(&tid, &attr, func, data);
+	pthread_attr_destroy(&attr);
+	return (res);
+#else
+	return (!!g_thread_create((GThreadFunc)func, data, FALSE, NULL));
+#endif
+}
+
 #if !defined(__G_ATOMIC_H__) && !defined(HAVE__SFA)
 
 int thread_xadd(volatile int *var, int n)
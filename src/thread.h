@@ -32,6 +32,7 @@ struct tcb {
 	int count;		// Number of threads
 	int step0, nsteps;	// Work allocated to this thread
 	int tsteps;		// Total amount of work - set only for thread 0
+	int wlo, whi;		// Chunked work not yet taken, open to stealing
 	threaddata *tdata;	// Pointer to array header
 	void *data;		// Parameters & buffers structure for function
 };
@@ -42,6 +43,7 @@ struct threaddata {
 	int total;		// Total amount of work
 	int count;		// Number of threads
 	int chunks;		// Number of chunks per thread
+	int step;		// Chunk size
 	int silent;		// No progressbar & error window
 	thread_func what;	// Function to run
 	tcb *threads[1];	// Threads' TCBs
@@ -55,6 +57,9 @@ threaddata *talloc(int flags, int tmax, void *data, int dsize, ...);
 //	Launch threads and wait for their exiting
 int launch_threads(thread_func thread, threaddata *tdata, char *title, int total);
 
+//	Background thread function type
+typedef void *(*bg_thread_func)(void *data);
+
 #ifdef U_THREADS
 
 //	Show threading status
@@ -82,6 +87,11 @@ static inline void thread_done(tcb *thread)
 	thread->stopped = TRUE;
 }
 
+//	Launch a detached thread for background work, without waiting for it
+int launch_bg_thread(bg_thread_func func, void *data);
+//	Let other threads run
+void thread_yield();
+
 //	Define a static mutex
 #define	DEF_MUTEX(name) static GStaticMutex name = G_STATIC_MUTEX_INIT
 //	Lock a static mutex
@@ -90,6 +100,10 @@ static inline void thread_done(tcb *thread)
 //	Unlock a static mutex
 #define UNLOCK_MUTEX(name) \
 	if (threads_running) g_static_mutex_unlock(&name)
+//	Lock a static mutex shared with a background thread
+#define LOCK_BG_MUTEX(name) g_static_mutex_lock(&name)
+//	Unlock a static mutex shared with a background thread
+#define UNLOCK_BG_MUTEX(name) g_static_mutex_unlock(&name)
 
 #ifdef __G_ATOMIC_H__
 #define thread_xadd(A,B) g_atomic_int_exchange_and_add((A), (B))
@@ -112,9 +126,15 @@ static inline int thread_step(tcb *thread, int i, int tlim, int steps)
 
 #define thread_done(thread)
 
+/* No background threads - caller must do the work itself */
+#define launch_bg_thread(func,data) FALSE
+#define thread_yield()
+
 #define	DEF_MUTEX(name)
 #define LOCK_MUTEX(name)
 #define UNLOCK_MUTEX(name)
+#define LOCK_BG_MUTEX(name)
+#define UNLOCK_BG_MUTEX(name)
 
 static inline int thread_xadd(int *var, int n)
 {
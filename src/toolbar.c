@@ -275,6 +275,7 @@ static int set_blend(blend_dd *dt, void **wdata)
 	blend_mode = i | (dt->reverse ? BLEND_REVERSE : 0) | 
 		(dt->xform ? BLEND_XFORM : 0) | (j << BLEND_RGBSHIFT);
 	blend_src = dt->src;
+	if (blend_src >= SRC_LAYER) layer_ready(blend_src - SRC_LAYER);
 
 	return (TRUE);
 }
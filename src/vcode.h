@@ -659,6 +659,7 @@ enum {
 #define VBOXBS VBOXbp(5, 5, 0)
 #define VBOXPBS VBOXbp(5, 5, 5)
 #define XVBOX WBh_x(VBOX, 0)
+#define XVBOXr WBrh_x(VBOX, 0)
 #define XVBOXbp(S,B,P) WBh_x(VBOX, 1), WBpbs(P, B, S)
 #define XVBOXP XVBOXbp(0, 0, 5)
 #define XVBOXB XVBOXbp(0, 5, 0)
@@ -373,34 +373,38 @@ static void **vw_scrolledwindow;
 void **vw_drawing;
 int vw_focus_on;
 
-size_t render_layers(unsigned char *rgb, int cxy[4], int pw, int zoom, int scale,
-	int lr0, int lr1, int view)
+/* Layer table can be passed in explicitly, for rendering animation frames */
+static size_t render_layers_x(unsigned char *rgb, int cxy[4], int pw, int zoom,
+	int scale, int lr0, int lr1, int view, layer_node *lt)
 {
 	renderstate rs;
 	int rxy[4], txy[4] = { cxy[2], cxy[3], cxy[0], cxy[1] };
 	image_info *image;
+	chanlist mimg;
 	unsigned char *tmp, **img;
 	int i, j, ii, jj, ll, wx0, wy0, wx1, wy1, xpm, opac;
-	int dx, dy, ddx, ddy, mx, mw, my, mh;
+	int dx, dy, ddx, ddy, mx, mw, my, mh, mz, iw, lev;
 	int px = cxy[0], py = cxy[1];
 	size_t npix = 0, nrow = 0;
 
+	if (!lt) lt = view ? layer_table : layer_table_p;
+
 	/* Align view on background, canvas on image */
-	dx = layer_table[0].x;
-	dy = layer_table[0].y;
+	dx = lt[0].x;
+	dy = lt[0].y;
 	if (!view)
 	{
-		dx = layer_table_p[layer_selected].x;
-		dy = layer_table_p[layer_selected].y;
+		dx = lt[layer_selected].x;
+		dy = lt[layer_selected].y;
 	}
 
 	/* Clip to background if needed */
 	if (view && ani_state)
 	{
-		image = layer_selected ? &layer_table[0].image->image_ : &mem_image;
+		image = layer_selected ? &lt[0].image->image_ : &mem_image;
 
-		ddx = (layer_table[0].x - dx) * scale - 1;
-		ddy = (layer_table[0].y - dy) * scale - 1;
+		ddx = (lt[0].x - dx) * scale - 1;
+		ddy = (lt[0].y - dy) * scale - 1;
 
 		if (!clip(cxy, floor_div(ddx + zoom, zoom),
 			floor_div(ddy + zoom, zoom),
@@ -417,7 +421,7 @@ size_t render_layers(unsigned char *rgb, int cxy[4], int pw, int zoom, int scale
 
 	for (ll = lr0; ll <= lr1; ll++)
 	{
-		layer_node *t = (view ? layer_table : layer_table_p) + ll;
+		layer_node *t = lt + ll;
 
 		image = ll == layer_selected ? &mem_image : &t->image->image_;
 		/* !!! When sizing canvas, do not skip selected layer */
@@ -450,7 +454,11 @@ size_t render_layers(unsigned char *rgb, int cxy[4], int pw, int zoom, int scale
 		xpm = ll ? image->trans : -1; // above background
 		opac = (t->opacity * 255 + 50) / 100;
 		mw = rxy[2] - (mx = rxy[0]);
-		setup_row(&rs, mx, mw, zoom, scale, image->width, xpm, opac,
+		img = image->img;
+		mz = zoom;
+		iw = image->width;
+		if ((lev = mip_get(image, xpm, &mz, &iw, mimg))) img = mimg;
+		setup_row(&rs, mx, mw, mz, scale, iw, xpm, opac,
 			image->bpp, image->pal);
 		mh = rxy[3] - (my = rxy[1]);
 		tmp = rgb + (my - py) * pw + (mx - px) * 3;
@@ -460,7 +468,6 @@ size_t render_layers(unsigned char *rgb, int cxy[4], int pw, int zoom, int scale
 		i = my % scale;
 		if (i < 0) i += scale;
 		mh = mh * zoom + i;
-		img = image->img;
 		for (j = -1; i < mh; i += zoom , tmp += pw)
 		{
 			if ((i / scale == j) && !async_bk)
@@ -469,7 +476,7 @@ size_t render_layers(unsigned char *rgb, int cxy[4], int pw, int zoom, int scale
 				continue;
 			}
 			j = i / scale;
-			render_row(&rs, tmp, img, ddx, ddy + j, NULL);
+			render_row(&rs, tmp, img, ddx >> lev, (ddy + j) >> lev, NULL);
 		}
 	}
 
@@ -485,10 +492,17 @@ size_t render_layers(unsigned char *rgb, int cxy[4], int pw, int zoom, int scale
 	return (npix);
 }
 
+size_t render_layers(unsigned char *rgb, int cxy[4], int pw, int zoom, int scale,
+	int lr0, int lr1, int view)
+{
+	return (render_layers_x(rgb, cxy, pw, zoom, scale, lr0, lr1, view, NULL));
+}
+
 typedef struct {
 	unsigned char *rgb;
 	int cxy[4];
 	int pw, zoom, scale;
+	int lr0, lr1, view;
 	threaddata *tdata; // For simplicity
 } lr_render_state;
 
@@ -507,42 +521,31 @@ static void do_layers_render(tcb *thread)
 	else h -= d;
 	if (y0 + h < rxy[3]) rxy[3] = y0 + h;
 
-	/* Always align on background layer */
 	render_layers(ls->rgb + ofs * ls->pw, rxy, ls->pw, ls->zoom, scale,
-		0, layers_total, TRUE);
+		ls->lr0, ls->lr1, ls->view);
 }
 
 #endif
 
-void view_render_rgb( unsigned char *rgb, int px, int py, int pw, int ph, double czoom )
+void render_layers_mt(unsigned char *rgb, int cxy[4], int pw, int zoom,
+	int scale, int lr0, int lr1, int view)
 {
-	lr_render_state ls = { rgb, { px, py, px + pw, py + ph }, pw * 3, 1, 1 };
-	int tmp = overlay_alpha;
+	lr_render_state ls = { rgb, { cxy[0], cxy[1], cxy[2], cxy[3] },
+		pw, zoom, scale, lr0, lr1, view };
 #ifdef U_THREADS
 	int wh, nt, nt2;
 	size_t vpix;
-#endif
-
-	if (!rgb) return; /* Paranoia */
-	/* Control transparency separately */
-	overlay_alpha = opaque_view;
-
-	/* !!! This uses the fact that zoom factor is either N or 1/N !!! */
-	if (czoom < 1.0) ls.zoom = rint(1.0 / czoom);
-	else ls.scale = rint(czoom);
 
-#ifdef U_THREADS
 	/* Calculate amount of work for threads */
-	vpix = render_layers(NULL, ls.cxy, 0, ls.zoom, ls.scale,
-		0, layers_total, TRUE);
+	vpix = render_layers(NULL, ls.cxy, 0, zoom, scale, lr0, lr1, view);
 
-	wh = xy_span(ls.cxy, ls.scale, 1);
-	nt = image_threads(xy_span(ls.cxy, ls.scale, 0), wh);
+	wh = xy_span(ls.cxy, scale, 1);
+	nt = image_threads(xy_span(ls.cxy, scale, 0), wh);
 	// !!! Heuristic weight; maybe 1/8 would be better?
 	nt2 = ceil_div(vpix, kpix_threads * 1024 * 4);
 	if (nt2 > nt) nt2 = nt;
 
-	ls.rgb += ((ls.cxy[1] - py) * pw + ls.cxy[0] - px) * 3;
+	ls.rgb += (ls.cxy[1] - cxy[1]) * pw + (ls.cxy[0] - cxy[0]) * 3;
 
 	ls.tdata = talloc(MA_SKIP_ZEROSIZE | MA_FLAG_NONE, nt2,
 		&ls, sizeof(ls), NULL, NULL);
@@ -558,14 +561,40 @@ void view_render_rgb( unsigned char *rgb, int px, int py, int pw, int ph, double
 	}
 	else if (vpix) // No alloc, single thread, something to draw
 #endif
-	{
-		/* Always align on background layer */
-		render_layers(ls.rgb, ls.cxy, ls.pw, ls.zoom, ls.scale,
-			0, layers_total, TRUE);
-	}
+		render_layers(ls.rgb, ls.cxy, pw, zoom, scale, lr0, lr1, view);
+}
+
+void view_render_rgb( unsigned char *rgb, int px, int py, int pw, int ph, double czoom )
+{
+	int cxy[4] = { px, py, px + pw, py + ph };
+	int zoom = 1, scale = 1, tmp = overlay_alpha;
+
+	if (!rgb) return; /* Paranoia */
+	/* Control transparency separately */
+	overlay_alpha = opaque_view;
+
+	/* !!! This uses the fact that zoom factor is either N or 1/N !!! */
+	if (czoom < 1.0) zoom = rint(1.0 / czoom);
+	else scale = rint(czoom);
+
+	/* Update mipmaps before render threads need them */
+	if (zoom > 1) mip_prepare(zoom, 0, layers_total, TRUE);
+
+	/* Always align on background layer */
+	render_layers_mt(rgb, cxy, pw * 3, zoom, scale, 0, layers_total, TRUE);
 	overlay_alpha = tmp;
 }
 
+/* Render w x h image from layers at positions in "lt", in this thread only,
+ * so that multiple frames can be rendered at once; caller must set up
+ * overlay_alpha and have visible layers unpacked */
+void render_frame_rgb(unsigned char *rgb, int w, int h, layer_node *lt)
+{
+	int cxy[4] = { 0, 0, w, h };
+
+	render_layers_x(rgb, cxy, w * 3, 1, 1, 0, layers_total, TRUE, lt);
+}
+
 ////	COMPOSITE ALPHA
 
 int comp_need_alpha(int ftype)
@@ -583,7 +612,7 @@ int comp_need_alpha(int ftype)
 		(alpha && !is_filled(alpha, 255, image->width * image->height)))));
 }
 
-void collect_alpha(unsigned char *alpha, int pw, int ph)
+void collect_frame_alpha(unsigned char *alpha, int pw, int ph, layer_node *lt)
 {
 	int rxy[4], cxy[4] = { 0, 0, pw, ph };
 	unsigned char buf[MAX_WIDTH];
@@ -593,13 +622,13 @@ void collect_alpha(unsigned char *alpha, int pw, int ph)
 	int dx, dy, ddx, ddy, mx, mw, my, mh, loc;
 
 	/* Align on background */
-	dx = layer_table[0].x;
-	dy = layer_table[0].y;
+	dx = lt[0].x;
+	dy = lt[0].y;
 
 	memset(alpha, 0, pw * ph);
 	for (ll = 0; ll <= layers_total; ll++)
 	{
-		layer_node *t = layer_table + ll;
+		layer_node *t = lt + ll;
 
 		if (!t->visible) continue;
 		i = t->x - dx;
@@ -608,7 +637,7 @@ void collect_alpha(unsigned char *alpha, int pw, int ph)
 		if (!clip(rxy, i, j, i + image->width, j + image->height, cxy))
 			continue;
 
-		xpm = t != layer_table ? image->trans : -1; // above background
+		xpm = ll ? image->trans : -1; // above background
 		if ((xpm > -1) && (image->bpp == 3))
 			xpm = PNG_2_INT(image->pal[xpm]);
 		opac = opaque_view ? 255 : (t->opacity * 255 + 50) / 100;
@@ -658,6 +687,11 @@ void collect_alpha(unsigned char *alpha, int pw, int ph)
 	}
 }
 
+void collect_alpha(unsigned char *alpha, int pw, int ph)
+{
+	collect_frame_alpha(alpha, pw, ph, layer_table);
+}
+
 static guint idle_focus;
 
 void vw_focus_view()						// Focus view window to main window
@@ -819,6 +853,16 @@ void lr_update_area(int lr, int x, int y, int w, int h)	// Update x,y,w,h area o
 {
 	int mx, my, zoom, scale, rxy[4];
 
+	/* Mipmap needs updating too */
+	if (lr < LR_ANIM) mip_dirty(lr == layer_selected ? &mem_image :
+		&layer_table[lr].image->image_, x, y, w, h);
+
+	/* And so do composites of layers around the current one */
+	if ((lr < LR_ANIM) && (lr != layer_selected))
+		lcache_dirty(x + layer_table_p[lr].x - layer_table_p[layer_selected].x,
+			y + layer_table_p[lr].y - layer_table_p[layer_selected].y,
+			w, h);
+
 	if ((lr < LR_ANIM) && (show_layers_main || (lr == layer_selected)))
 	{
 		mx = x + layer_table_p[lr].x - layer_table_p[layer_selected].x;
@@ -835,13 +879,12 @@ void lr_update_area(int lr, int x, int y, int w, int h)	// Update x,y,w,h area o
 	if (vw_zoom < 1.0)
 	{
 		zoom = rint(1.0 / vw_zoom);
-		w += x;
-		h += y;
-		x = floor_div(x + zoom - 1, zoom);
-		y = floor_div(y + zoom - 1, zoom);
-		w = (w - x * zoom + zoom - 1) / zoom;
-		h = (h - y * zoom + zoom - 1) / zoom;
-		if ((w <= 0) || (h <= 0)) return;
+		/* With mipmaps, any pixel can be visible, not only every Nth */
+		w = floor_div(x + w - 1, zoom) + 1;
+		h = floor_div(y + h - 1, zoom) + 1;
+		x = floor_div(x, zoom);
+		y = floor_div(y, zoom);
+		if (((w -= x) <= 0) || ((h -= y) <= 0)) return;
 	}
 	else
 	{
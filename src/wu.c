@@ -20,6 +20,7 @@
 
 #include "mygtk.h"
 #include "memory.h"
+#include "thread.h"
 
 /*
 Having received many constructive comments and bug reports about my previous
@@ -69,17 +70,31 @@ static int	*wt, *mr, *mg, *mb;
 static int	size; // image size
 static int	K;    // color look-up table size
 
-static void Hist3d(inbuf, vwt, vmr, vmg, vmb) 	// build 3-D color histogram of counts, r/g/b, c^2
-unsigned char *inbuf;
-int *vwt, *vmr, *vmg, *vmb;
+/* Each thread builds its own partial histogram, and these get summed up in
+ * thread order afterwards; all the sums are of integers (m2's too, even if
+ * kept in a double), so the result does not depend on the number of threads */
+
+typedef struct {
+	unsigned char *inbuf;
+	double *m2;
+	int *wt, *mr, *mg, *mb;
+	int width;
+} wu_info;
+
+static void Hist3d(thread)	// build 3-D color histogram of counts, r/g/b, c^2
+tcb *thread;
 {
+	wu_info *wi = thread->data;
+	unsigned char *inbuf = wi->inbuf + thread->step0 * wi->width * 3;
+	double *vm2 = wi->m2;
+	int *vwt = wi->wt, *vmr = wi->mr, *vmg = wi->mg, *vmb = wi->mb;
 	register int ind, r, g, b;
 	int	     inr, ing, inb, table[256];
-	register long int i;
+	register long int i, n = thread->nsteps * wi->width;
 		
 	for(i=0; i<256; ++i) table[i]=i*i;
 
-	for(i=0; i<size; ++i)
+	for(i=0; i<n; ++i)
 	{
 		r = inbuf[0];
 		g = inbuf[1];
@@ -94,10 +109,89 @@ int *vwt, *vmr, *vmg, *vmb;
 		vmr[ind] += r;
 		vmg[ind] += g;
 		vmb[ind] += b;
-		m2[ind] += table[r]+table[g]+table[b];
+		vm2[ind] += table[r]+table[g]+table[b];
 	}
+	thread_done(thread);
+}
 
-	if (!quan_sqrt) return;
+static void Hist3d_tab(cs, vwt, vmr, vmg, vmb)	// same from colour table
+col_stats *cs;
+int *vwt, *vmr, *vmg, *vmb;
+{
+	register int ind, r, g, b, n;
+	int	     inr, ing, inb, i, c;
+
+	for(i=0; i<cs->cols; ++i)
+	{
+		c = cs->tab[i].rgb;
+		n = cs->tab[i].cnt;
+		r = INT_2_R(c);
+		g = INT_2_G(c);
+		b = INT_2_B(c);
+		inr=(r>>3)+1;
+		ing=(g>>3)+1;
+		inb=(b>>3)+1;
+		ind=(inr<<10)+(inr<<6)+inr+(ing<<5)+ing+inb;
+		// [inr][ing][inb]
+		vwt[ind] += n;
+		vmr[ind] += r*n;
+		vmg[ind] += g*n;
+		vmb[ind] += b*n;
+		m2[ind] += (double)(r*r+g*g+b*b)*n;
+	}
+}
+
+static int Hist3d_all(inbuf, width, height, cs, vwt, vmr, vmg, vmb)	// merge per-thread histograms
+unsigned char *inbuf;
+int width, height;
+col_stats *cs;
+int *vwt, *vmr, *vmg, *vmb;
+{
+	threaddata *tdata;
+	wu_info wi, *ti;
+	register long int i;
+	int k;
+
+	if (cs && cs->tab) // Colour table is quicker to go through
+	{
+		Hist3d_tab(cs, vwt, vmr, vmg, vmb);
+		goto weight;
+	}
+
+	memset(&wi, 0, sizeof(wi));
+	tdata = talloc(MA_ALIGN_DOUBLE, image_threads(width, height), &wi,
+		sizeof(wi), NULL,
+		&wi.m2, 33*33*33 * sizeof(double),
+		&wi.wt, 33*33*33 * sizeof(int),
+		&wi.mr, 33*33*33 * sizeof(int),
+		&wi.mg, 33*33*33 * sizeof(int),
+		&wi.mb, 33*33*33 * sizeof(int), NULL);
+	if (!tdata) return (FALSE);
+	for (k = 0; k < tdata->count; k++)
+	{
+		ti = tdata->threads[k]->data;
+		ti->inbuf = inbuf;
+		ti->width = width;
+	}
+	tdata->silent = TRUE;
+	launch_threads(Hist3d, tdata, NULL, height);
+
+	for (k = 0; k < tdata->count; k++)
+	{
+		ti = tdata->threads[k]->data;
+		for (i = 0; i < 33 * 33 * 33; i++)
+		{
+			if (!ti->wt[i]) continue;
+			vwt[i] += ti->wt[i];
+			vmr[i] += ti->mr[i];
+			vmg[i] += ti->mg[i];
+			vmb[i] += ti->mb[i];
+			m2[i] += ti->m2[i];
+		}
+	}
+	free(tdata);
+
+weight:	if (!quan_sqrt) return (TRUE);
 	// "Diameter weighting" in action
 	for (i = 0; i < 33 * 33 * 33; i++)
 	{
@@ -110,6 +204,7 @@ int *vwt, *vmr, *vmg, *vmb;
 		vmb[i] *= d;
 		m2[i] *= d;
 	}
+	return (TRUE);
 }
 
 /* At conclusion of the histogram step, we can interpret
@@ -394,7 +489,8 @@ static void Mark(struct box *cube, int label, unsigned char *tag)
 				tag[(r<<10) + (r<<6) + r + (g<<5) + g + b] = label;
 }
 
-int wu_quant(unsigned char *inbuf, int width, int height, int quant_to, png_color *pal)
+static int do_wu_quant(unsigned char *inbuf, int width, int height,
+	int quant_to, png_color *pal, col_stats *cs)
 {
 	void *mem;
 	struct box	cube[MAXCOLOR];
@@ -415,7 +511,11 @@ int wu_quant(unsigned char *inbuf, int width, int height, int quant_to, png_colo
 		&tag, 33*33*33, NULL);
 	if (!mem) return (-1);
 
-	Hist3d(inbuf, wt, mr, mg, mb);
+	if (!Hist3d_all(inbuf, width, height, cs, wt, mr, mg, mb))
+	{
+		free(mem);
+		return (-1);
+	}
 	M3d(wt, mr, mg, mb);
 
 	cube[0].r0 = cube[0].g0 = cube[0].b0 = 0;
@@ -465,3 +565,16 @@ int wu_quant(unsigned char *inbuf, int width, int height, int quant_to, png_colo
 	free(mem);
 	return (0);
 }
+
+/* The state is static, so only one image at a time can be processed */
+int wu_quant(unsigned char *inbuf, int width, int height, int quant_to, png_color *pal,
+	col_stats *cs)
+{
+	DEF_MUTEX(wu_lock);
+	int res;
+
+	LOCK_MUTEX(wu_lock);
+	res = do_wu_quant(inbuf, width, height, quant_to, pal, cs);
+	UNLOCK_MUTEX(wu_lock);
+	return (res);
+}
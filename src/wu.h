@@ -1,4 +1,5 @@
 // wu.h
 // See wu.c for details
 
-int wu_quant(unsigned char *inbuf, int width, int height, int quant_to, png_color *pal);
+int wu_quant(unsigned char *inbuf, int width, int height, int quant_to, png_color *pal,
+	col_stats *cs);